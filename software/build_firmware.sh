@@ -51,6 +51,12 @@ if [[ ! -d "$SKETCH" ]]; then
     exit 1
 fi
 
+# Check the generated protocol headers match protocol/protocol.def
+if ! python3 protocol/gen_protocol.py --check; then
+    echo "Error: Protocol headers are out of date, run 'python3 protocol/gen_protocol.py'."
+    exit 1
+fi
+
 # Ensure the build directory exists
 if ! mkdir -p "$ARDUINO_BUILD_DIR"; then
     echo "Error: Failed to create build directory '$ARDUINO_BUILD_DIR'."
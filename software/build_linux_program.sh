@@ -37,6 +37,12 @@ fi
 
 echo "Cross-compiler '$CROSS_COMPILER' found."
 
+# Check the generated protocol headers match protocol/protocol.def
+if ! python3 "$(dirname "$0")/protocol/gen_protocol.py" --check; then
+    echo "Error: Protocol headers are out of date, run 'python3 protocol/gen_protocol.py'."
+    exit 1
+fi
+
 echo "=================================="
 echo " Building Linux Program "
 echo "=================================="
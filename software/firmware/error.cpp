@@ -11,27 +11,25 @@ void init_error_system(Led* l, SystemStateManager* ssm) {
     led = l;
     system_state_manager = ssm;
 
-    Serial.println("Error handler initialized.");
+    serial_log.println("Error handler initialized.");
     blinkAnim = BlinkLedAnimation(led, 0); 
 }
 
-void throw_error(uint8_t code, const char* message) {
+void throw_error(uint8_t code) {
     if (!led) {
-        Serial.println("ERROR: LED not initialized!");
+        serial_log.println("ERROR: LED not initialized!");
         return;
     }
 
     if (!system_state_manager) {
-        Serial.println("ERROR: Power management not initialized!");
+        serial_log.println("ERROR: Power management not initialized!");
         return;
     }
 
     if (lastErrorCode == code) return;  /* Prevent redundant updates */
 
-    Serial.print("[ERROR] ");
-    Serial.print(code);
-    Serial.print(": ");
-    Serial.println(message);
+    serial_log.print("[ERROR] ");
+    serial_log.println(code);
     
     lastErrorCode = code;
 
@@ -44,12 +42,12 @@ void throw_error(uint8_t code, const char* message) {
 
 void reset_error() {
     if (!led) {
-        Serial.println("ERROR: LED not initialized!");
+        serial_log.println("ERROR: LED not initialized!");
         return;
     }
 
     if (!system_state_manager) {
-        Serial.println("ERROR: Power management not initialized!");
+        serial_log.println("ERROR: Power management not initialized!");
         return;  
     }
 
@@ -63,7 +61,7 @@ void reset_error() {
     /* TODO: determine if the rpi is  */
     system_state_manager->transitionTo(LOW_POWER_STATE);
 
-    Serial.println("Error Reset");
+    serial_log.println("Error Reset");
 }
 
 uint8_t get_current_error() {
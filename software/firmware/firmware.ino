@@ -20,7 +20,6 @@
 
 #define DEBOUNCE_DELAY 50       /* Button debounce delay (ms) */
 #define LONG_PRESS_TIME 1000    /* Long press threshold (ms) */
-#define STATUS_INTERVAL_MS 500  /* Interval between status messages */ 
 
 #define BATTERY_SAMPLES 3                   /* ADC re-samples */
 #define BATTERY_MIN_UV  6000000
@@ -32,6 +31,8 @@
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+#define BOOTLOADER_START FW_APP_SIZE   /* Optiboot, byte address */
+
 struct voltage_lookup_entry {
     uint32_t voltage_uv;
     uint8_t percent;
@@ -60,9 +61,28 @@ uint8_t charger_fault_edge_index = 0;
 bool charger_fault = false;
 volatile bool charger_stat_last_state = HIGH;
 
+/* Status reporting thresholds, set by Linux, see COMMAND_STATUS_SET_* */
+struct status_config {
+    uint32_t volt_delta_uv;
+    uint8_t lvl_delta;
+    uint8_t events;
+    uint32_t keepalive_ms;
+    uint32_t min_interval_ms;
+};
+struct status_config status_cfg = {
+    STATUS_DEFAULT_VOLT_DELTA_UV,
+    STATUS_DEFAULT_LVL_DELTA,
+    STATUS_DEFAULT_EVENTS,
+    STATUS_DEFAULT_KEEPALIVE_MS,
+    STATUS_DEFAULT_MIN_INTERVAL_MS
+};
+bool status_requested = true;   /* Send the next status regardless of thresholds */
+
 volatile unsigned long button_press_start = 0;    /* Stores when the button was pressed */ 
 volatile unsigned long button_press_duration = 0; /* Stores how long it was held */
+volatile unsigned long button_release_us = 0;     /* micros() when it was released */
 volatile bool button_pressed = false;
+uint64_t button_released_at = 0;                  /* comms_clock_us() of the last press handled */
 
 
 
@@ -164,19 +184,22 @@ void button_isr(void)
     {
         // Button just released (rising edge)
         button_press_duration = millis() - button_press_start;
+        button_release_us = micros(); // comms_clock_us() is not for interrupts
         button_pressed = true; // Mark press as handled
     }
 }
 
 /*
  * Handle button press
- * @return Button press duration in milliseconds
+ * @return Button press duration in milliseconds, the release time is left in button_released_at
  */
 unsigned long handle_button_press(void)
 {
     if (button_pressed)
     {               
         button_pressed = false;       
+        uint64_t now = comms_clock_us(); /* micros() in its low 32 bits */
+        button_released_at = now - (uint32_t)((uint32_t)now - button_release_us);
         return button_press_duration; /* return duration in millis */
     }
     return 0;
@@ -257,27 +280,182 @@ uint32_t read_battery_voltage(void)
 
 
 
+/*
+ * status_changed - Whether a status differs enough from the last one sent to report it.
+ */
+bool status_changed(const struct StatusBody *now, const struct StatusBody *last)
+{
+    uint32_t volt_diff = (now->bat_volt_uv > last->bat_volt_uv) ?
+                         now->bat_volt_uv - last->bat_volt_uv : last->bat_volt_uv - now->bat_volt_uv;
+    uint8_t lvl_diff = (now->bat_lvl > last->bat_lvl) ?
+                       now->bat_lvl - last->bat_lvl : last->bat_lvl - now->bat_lvl;
+
+    if (status_cfg.volt_delta_uv && volt_diff >= status_cfg.volt_delta_uv)
+        return true;
+    if (status_cfg.lvl_delta && lvl_diff >= status_cfg.lvl_delta)
+        return true;
+    if ((status_cfg.events & STATUS_EVENT_CHARGING) && now->charging != last->charging)
+        return true;
+    if ((status_cfg.events & STATUS_EVENT_STATE) && now->state != last->state)
+        return true;
+    if ((status_cfg.events & STATUS_EVENT_ERROR) && now->error_code != last->error_code)
+        return true;
+
+    return false;
+}
+
 /* 
- * transmit_status_message - Periodically send a status to linux system via comms.
+ * transmit_status_message - Send a status to linux system via comms when it changed.
+ * A change is sent once status_cfg.min_interval_ms has passed since the last status,
+ * and a status is sent every status_cfg.keepalive_ms regardless.
  */
 void transmit_status_message(uint32_t voltage_uV)
 {
+    static struct StatusBody last_status;
     static unsigned long last_status_time = 0;
-    unsigned long now = millis();
+    unsigned long elapsed = millis() - last_status_time;
+
+    struct StatusBody status = {
+        .bat_volt_uv = voltage_uV,
+        .bat_lvl = voltage_to_percent(voltage_uV),
+        .state = system_state.currentState(),
+        .charging = charging, 
+        .error_code = get_current_error()
+    };
+
+    if ((status_cfg.keepalive_ms && elapsed >= status_cfg.keepalive_ms) ||
+        ((status_requested || status_changed(&status, &last_status)) &&
+         elapsed >= status_cfg.min_interval_ms)) {
+        last_status_time = millis();
+        last_status = status;
+        status_requested = false;
+
+        comms_send_status(&status);
+    }
+}
 
-    if (now - last_status_time >= STATUS_INTERVAL_MS) {
-        last_status_time = now;
+/*
+ * status_set_threshold - Apply a status reporting threshold sent by Linux.
+ * @return REPLY_OK, or REPLY_E_* if the threshold or its value is not supported
+ */
+uint8_t status_set_threshold(uint16_t param, uint64_t val)
+{
+    switch (param) {
+    case COMMAND_STATUS_SET_VOLT_DELTA:
+        if (val > UINT32_MAX) return REPLY_E_INVALID;
+        status_cfg.volt_delta_uv = val;
+        break;
+    case COMMAND_STATUS_SET_LVL_DELTA:
+        if (val > 100) return REPLY_E_INVALID;
+        status_cfg.lvl_delta = val;
+        break;
+    case COMMAND_STATUS_SET_EVENTS:
+        if (val & ~(uint64_t)STATUS_DEFAULT_EVENTS) return REPLY_E_INVALID;
+        status_cfg.events = val;
+        break;
+    case COMMAND_STATUS_SET_KEEPALIVE:
+        if (val > UINT32_MAX) return REPLY_E_INVALID;
+        status_cfg.keepalive_ms = val;
+        break;
+    case COMMAND_STATUS_SET_MIN_INTERVAL:
+        if (val > UINT32_MAX) return REPLY_E_INVALID;
+        status_cfg.min_interval_ms = val;
+        break;
+    default:
+        return REPLY_E_UNKNOWN;
+    }
+    return REPLY_OK;
+}
 
-        struct StatusBody status = {
-            .bat_volt_uv = voltage_uV,
-            .bat_lvl = voltage_to_percent(voltage_uV),
-            .state = system_state.currentState(),
-            .charging = charging, 
-            .error_code = get_current_error()
-        };
+/*
+ * set_param - Apply a parameter sent by Linux.
+ * @return REPLY_OK, or REPLY_E_* if the parameter or its value is not supported
+ */
+uint8_t set_param(uint16_t param, uint64_t val)
+{
+    if (param == COMMAND_LED_SET_BRIGHTNESS) {
+        if (val > 255) return REPLY_E_INVALID;
+        led_strip.setBrightness(val);
+        led_strip.show();
+        return REPLY_OK;
+    }
 
-        comms_send_status(&status);
+    return status_set_threshold(param, val);
+}
+
+/*
+ * handle_status_message - Apply a status request, or a parameter sent without a request.
+ */
+void handle_status_message(const struct Message *msg)
+{
+    if (msg->header.message_type == MESSAGE_TYPE_COMMAND &&
+        msg->body.payload_command.command == COMMAND_STATUS_REQ) {
+        status_requested = true;
+        return;
+    }
+
+    if (msg->header.message_type == MESSAGE_TYPE_RESPONSE)
+        set_param(msg->body.payload_response.param, msg->body.payload_response.val);
+}
+
+/*
+ * enter_bootloader - Hand the UART to Optiboot for a firmware update, never returns.
+ * @note Optiboot (6.2 on) only stays in the bootloader when it is started with MCUSR clear,
+ * which no reset leaves it, so jumping there is how the application asks for an update.
+ * Optiboot starts the new firmware, or this one again if Linux never talks to it, through
+ * a watchdog reset.
+ */
+void enter_bootloader(void)
+{
+    /* Let the reply out first */
+    while (comms_tx_flush() > 0)
+        ;
+    serial_flush();
+
+    cli();
+    wdt_disable();
+    MCUSR = 0;
+    UCSR0B = 0;  /* Optiboot sets the UART up itself */
+
+    ((void (*)(void))(BOOTLOADER_START / 2))();  /* Word address */
+}
+
+/*
+ * handle_request - Carry out a request from Linux and reply with the outcome.
+ * Anything this firmware does not know is answered with REPLY_E_UNKNOWN, so the
+ * requester fails straight away instead of waiting for its timeout.
+ */
+void handle_request(const struct Message *msg)
+{
+    if (msg->header.message_type != MESSAGE_TYPE_REQUEST)
+        return;
+
+    const struct RequestBody *req = &msg->body.payload_request;
+    uint8_t result;
+
+    switch (req->command) {
+    case COMMAND_STATUS_REQ:
+        status_requested = true;
+        result = REPLY_OK;
+        break;
+    case COMMAND_FW_UPDATE:
+        if (req->val != FW_UPDATE_KEY)
+            result = REPLY_E_INVALID;
+        else if (system_state.currentState() == SHUTDOWN_STATE)
+            result = REPLY_E_BUSY;
+        else
+            result = REPLY_OK;
+
+        comms_send_reply(req->tid, result, req->val);
+        if (result == REPLY_OK)
+            enter_bootloader();
+        return;
+    default:
+        result = set_param(req->command, req->val);
+        break;
     }
+
+    comms_send_reply(req->tid, result, req->val);
 }
 
 void setup(void)
@@ -304,7 +482,7 @@ void setup(void)
 
     /* init led strip */
     led_strip.begin();
-    led_strip.setBrightness(8);
+    led_strip.setBrightness(LED_DEFAULT_BRIGHTNESS);
     led.setVal(0); // turn off LED
     led_strip.show();
 
@@ -328,6 +506,8 @@ void loop(void)
     struct Message msg = {0};
     int err = comms_receive_message(&msg);
     if(err < 0) WARN("Error receiving message: ");
+    if(err > 0) handle_status_message(&msg);
+    if(err > 0) handle_request(&msg);
     
     /* Get button press duration */
     unsigned long button_press_duration = handle_button_press();
@@ -347,10 +527,13 @@ void loop(void)
         */
         uint32_t batt_lvl = read_battery_voltage();
 
-        if (batt_lvl < BATTERY_MIN_UV) ERROR(ERR_LOW_BATTERY);
-        if (batt_lvl > BATTERY_MAX_UV) ERROR(ERR_BATTERY_OV);
+        if (batt_lvl < BATTERY_MIN_UV) ERROR_CONTEXT(ERR_LOW_BATTERY, batt_lvl / 1000);  /* mV */
+        if (batt_lvl > BATTERY_MAX_UV) ERROR_CONTEXT(ERR_BATTERY_OV, batt_lvl / 1000);
             
-        /* TODO: transmit button press duration */
+        /* Linux starts or stops recording on a short press, and times it from the release */
+        if (button_press_duration > 0)
+            comms_send_event(button_press_duration >= LONG_PRESS_TIME ? COMMAND_BTN_LONG : COMMAND_BTN_SHORT,
+                             button_released_at);
 
         transmit_status_message(batt_lvl);
     }
@@ -0,0 +1 @@
+../shared/protocol_codec.h
\ No newline at end of file
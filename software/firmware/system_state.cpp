@@ -24,7 +24,7 @@ void SystemStateManager::processStateTransition(unsigned long button_press_durat
             ERROR(ERR_NO_COMM_RPI);
 
         if (msg && msg->header.message_type == MESSAGE_TYPE_COMMAND &&
-            msg->body.payload_command.command == OAC_COMMAND_WD_KICK)
+            msg->body.payload_command.command == COMMAND_WD_KICK)
             transitionTo(READY_STATE);
         break;
 
@@ -63,7 +63,8 @@ void SystemStateManager::transitionTo(SystemState new_state) {
             break;
 
         case STARTUP_STATE:
-            Serial.begin(9600);
+            comms_set_baud(0);                              /* Linux starts every boot at 9600 ... */
+            comms_set_protocol_version(PROTOCOL_VERSION_1); /* ... and renegotiates */
             digitalWrite(power_control_pin, HIGH);
             startup_start_time = millis();
             led->setAnimation(&rainbow);
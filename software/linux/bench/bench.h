@@ -0,0 +1,178 @@
+/*
+ * bench.h - Traffic, damage, timing and reporting shared by the host benchmarks
+ *
+ * Every benchmark prints one line of key=value pairs per run, so results from
+ * two trees can be compared with bench/bench_compare.py.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_SEED        0x2545F491u
+#define BENCH_ROUNDS      5       /* Timed rounds per run, the fastest is reported */
+#define BENCH_MESSAGES    4096    /* Distinct messages in a traffic mix */
+#define BENCH_PASSES      16      /* Passes over the mix per round */
+
+static uint32_t rng_state;
+static volatile uint32_t bench_sink;  /* Keeps results the compiler would otherwise discard */
+
+static inline void bench_seed(uint32_t seed)
+{
+    rng_state = seed;
+}
+
+static inline uint32_t bench_rand(void)
+{
+    /* xorshift32, deterministic across runs */
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+/*
+ * Message kinds in the order they are seen on the link while recording:
+ * mostly commands and statuses, requests for parameters and their replies,
+ * acknowledgements and the odd error.
+ */
+enum bench_kind {
+    BENCH_COMMAND,
+    BENCH_STATUS,
+    BENCH_REQUEST,
+    BENCH_REPLY,
+    BENCH_ACK,
+    BENCH_ERROR,
+};
+
+static inline enum bench_kind bench_kind(uint32_t idx)
+{
+    static const uint8_t mix[20] = {
+        BENCH_COMMAND, BENCH_STATUS, BENCH_COMMAND, BENCH_ACK, BENCH_STATUS,
+        BENCH_COMMAND, BENCH_STATUS, BENCH_REQUEST, BENCH_REPLY, BENCH_COMMAND,
+        BENCH_STATUS, BENCH_ACK, BENCH_COMMAND, BENCH_STATUS, BENCH_COMMAND,
+        BENCH_STATUS, BENCH_REQUEST, BENCH_REPLY, BENCH_ACK, BENCH_ERROR,
+    };
+
+    return (enum bench_kind)mix[idx % 20];
+}
+
+/*
+ * What happens to the stream between the serializer and the parser:
+ *   clean     : nothing
+ *   corrupted : bits flipped, about one frame in twenty is hit
+ *   desynced  : bytes lost and noise inserted, so frames run into each other
+ */
+enum bench_mix {
+    BENCH_MIX_CLEAN,
+    BENCH_MIX_CORRUPTED,
+    BENCH_MIX_DESYNCED,
+    BENCH_MIX_COUNT,
+};
+
+static const char *const bench_mix_names[BENCH_MIX_COUNT] = { "clean", "corrupted", "desynced" };
+
+/*
+ * bench_damage - Apply a mix to a stream in place
+ * @len: length of the stream, updated
+ * @size: size of the buffer, inserted bytes stop when it is full
+ */
+static inline void bench_damage(uint8_t *stream, size_t *len, size_t size, enum bench_mix mix)
+{
+    static uint8_t copy[1 << 20];
+    size_t in_len = *len, out = 0;
+
+    if (mix == BENCH_MIX_CLEAN || in_len > sizeof(copy))
+        return;
+
+    memcpy(copy, stream, in_len);
+    for (size_t i = 0; i < in_len; i++) {
+        uint32_t r = bench_rand();
+
+        if (mix == BENCH_MIX_CORRUPTED) {
+            stream[out++] = (r % 200 == 0) ? copy[i] ^ (1 << ((r >> 24) % 8)) : copy[i];
+            continue;
+        }
+
+        if (r % 256 == 0)
+            continue;                           /* Lost */
+        if (r % 512 == 1 && out < size)
+            stream[out++] = r >> 24;            /* Line noise */
+        if (out < size)
+            stream[out++] = copy[i];
+    }
+    *len = out;
+}
+
+struct bench_slice {
+    size_t pos;
+    size_t len;
+};
+
+/*
+ * bench_split - Cut a stream into frames where a receiver would
+ * @start: v1 start byte
+ * @delimiter: v2 delimiter
+ *
+ * A v1 frame begins at a start byte and is as long as its length field says,
+ * a v2 frame ends at a delimiter. Returns the number of frames.
+ */
+static inline size_t bench_split(const uint8_t *stream, size_t len, unsigned int version,
+                                 uint8_t start, uint8_t delimiter,
+                                 struct bench_slice *slices, size_t max)
+{
+    size_t count = 0, pos = 0, stop;
+
+    while (pos < len && count < max) {
+        if (version == 1) {
+            while (pos < len && stream[pos] != start)
+                pos++;
+            if (pos + 4 > len)
+                break;
+            stop = pos + 6 + stream[pos + 3];
+        } else {
+            stop = pos;
+            while (stop < len && stream[stop] != delimiter)
+                stop++;
+            stop++;
+        }
+        if (stop > len)
+            stop = len;
+
+        slices[count].pos = pos;
+        slices[count].len = stop - pos;
+        count++;
+        pos = stop;
+    }
+    return count;
+}
+
+static inline uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/*
+ * bench_report - Print the result of a timed run
+ * @bench: benchmark, the program
+ * @path: code path under test
+ * @frames: frames processed per round
+ * @ok: frames the path accepted per round
+ * @ns: duration of the fastest round
+ */
+static inline void bench_report(const char *bench, const char *path, unsigned int version,
+                                enum bench_mix mix, unsigned long frames, unsigned long ok,
+                                uint64_t ns)
+{
+    printf("bench=%s path=%s version=%u mix=%s frames=%lu ok=%lu ns_per_frame=%.1f frames_per_s=%.0f\n",
+           bench, path, version, bench_mix_names[mix], frames, ok,
+           (double)ns / frames, frames * 1e9 / (ns ? ns : 1));
+}
+
+#endif /* BENCH_H */
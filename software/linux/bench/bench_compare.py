@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+"""
+bench_compare.py - Compare two benchmark result files and flag regressions
+
+    make bench > before.txt
+    ... change the protocol ...
+    make bench > after.txt
+    bench/bench_compare.py before.txt after.txt
+
+Runs are matched on bench, path, version, mix and mode. A run fails if its
+metric got worse by more than the threshold, or if it accepted a different
+number of frames, which means the change altered behaviour rather than speed.
+The metric is ns_per_frame, goodput_Bps or p99_us, whichever the line has.
+Lines with none of them, such as those of resync_bench, are compared for
+equality of every value.
+
+Exits 1 if any run regressed or went missing.
+"""
+import argparse
+import sys
+
+KEYS = ('bench', 'path', 'version', 'mix', 'mode')
+
+# Metric, unit, and whether a larger value is worse
+METRICS = (
+    ('ns_per_frame', 'ns/frame', True),
+    ('goodput_Bps', 'B/s', False),
+    ('p99_us', 'us p99', True),
+)
+
+
+def metric(fields):
+    for m in METRICS:
+        if m[0] in fields:
+            return m
+    return None
+
+
+def load(path):
+    runs = {}
+    with open(path) as f:
+        for line in f:
+            fields = dict(p.split('=', 1) for p in line.split() if '=' in p)
+            if not fields:
+                continue
+            if metric(fields):
+                key = tuple(fields.get(k, '') for k in KEYS)
+            else:
+                key = tuple(sorted((k, v) for k, v in fields.items()
+                                   if k in ('version', 'drop_rate')))
+            runs[key] = fields
+    return runs
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Compare two benchmark result files')
+    parser.add_argument('before')
+    parser.add_argument('after')
+    parser.add_argument('--threshold', type=float, default=10.0,
+                        help='slowdown in percent that counts as a regression (default 10)')
+    args = parser.parse_args()
+
+    before, after = load(args.before), load(args.after)
+    failed = False
+
+    for key, old in before.items():
+        name = ' '.join(str(k) if isinstance(k, str) else '%s=%s' % k for k in key)
+        new = after.get(key)
+        if new is None:
+            print('MISSING  %s' % name)
+            failed = True
+            continue
+
+        m = metric(old)
+        if m is None:
+            if old != new:
+                print('CHANGED  %s' % name)
+                failed = True
+            continue
+
+        field, unit, larger_worse = m
+        old_val, new_val = float(old[field]), float(new.get(field, 0))
+        change = (new_val - old_val) * 100 / old_val if old_val else 0
+        status = 'ok'
+        if old.get('ok') != new.get('ok'):
+            status = 'CHANGED'
+            failed = True
+        elif (change if larger_worse else -change) > args.threshold:
+            status = 'SLOWER'
+            failed = True
+        print('%-8s %s %.1f -> %.1f %s (%+.1f%%)' % (status, name, old_val, new_val, unit, change))
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,286 @@
+/*
+ * bulk_bench.c - Bulk transfer goodput, and what it does to command latency
+ *
+ * Two copies of comms.c, a sender and a receiver process, talk through a relay
+ * that passes bytes on at BENCH_BAUD in each direction, as a UART would. The
+ * relay reads no faster than the line, so unread bytes pile up in the sender's
+ * socket as they do in its tty buffer. The sender sends one object and, every
+ * BENCH_PROBE_MS, a REQUEST carrying the time it was sent. The receiver reports:
+ *   path=transfer : bytes, ms from OPEN to the last chunk, goodput_Bps, efficiency
+ *                   (goodput as a share of the line rate), ok (object intact)
+ *   path=probe    : how long the REQUESTs took, with the transfer running (mode=bulk)
+ *                   and with the link otherwise idle (mode=idle)
+ * On the corrupted mix the relay flips one bit in every BENCH_FLIP_BYTES in both
+ * directions, so chunks, credits and probes get lost.
+ *
+ * NOTE: comms.c is compiled into this file so its static functions can be used
+ * directly, as in resync_bench.c.
+ */
+
+#include "comms.c"
+#include "bench.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define BENCH_BAUD        1000000
+#define BENCH_OBJECT_SIZE (64 * 1024)
+#define BENCH_WINDOW      2048          /* Receiver window, as oac_dev's */
+#define BENCH_PROBE_MS    10
+#define BENCH_PROBES      50            /* Probes sent with the link otherwise idle */
+#define BENCH_PROBE_END   0xFF          /* tid of the REQUEST that ends a run */
+#define BENCH_FLIP_BYTES  20000
+#define BENCH_TICK_US     100           /* Relay granularity */
+
+static uint8_t object[BENCH_OBJECT_SIZE];
+static uint8_t received[BENCH_OBJECT_SIZE];
+static uint64_t open_ns, close_ns;
+static uint8_t close_result = 0xFF;
+static uint64_t probe_ns[1024];
+static unsigned int probes;
+
+static void bench_fill_object(void)
+{
+    bench_seed(BENCH_SEED);
+    for (size_t i = 0; i < sizeof(object); i++)
+        object[i] = bench_rand() >> 24;
+}
+
+static int bench_read(uint32_t offset, uint8_t *buf, uint8_t len)
+{
+    memcpy(buf, &object[offset], len);
+    return 0;
+}
+
+static int32_t bench_open(uint8_t obj, uint32_t size)
+{
+    if (size > sizeof(received))
+        return -BULK_E_TOO_LARGE;
+    open_ns = bench_now_ns();
+    return 0;
+}
+
+static int bench_write(uint32_t offset, const uint8_t *data, uint8_t len)
+{
+    memcpy(&received[offset], data, len);
+    return 0;
+}
+
+static void bench_close(uint8_t result)
+{
+    close_ns = bench_now_ns();
+    close_result = result;
+}
+
+static const struct BulkSink bench_bulk_sink = {
+    .open = bench_open,
+    .write = bench_write,
+    .close = bench_close,
+    .window = BENCH_WINDOW,
+};
+
+static void bench_send_probe(uint8_t tid)
+{
+    struct Message msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.header.recipient = MESSAGE_RECIPIENT_FIRMWARE;
+    msg.header.message_type = MESSAGE_TYPE_REQUEST;
+    msg.body.payload_request.tid = tid;
+    msg.body.payload_request.command = COMMAND_STATUS_REQ;
+    msg.body.payload_request.val = bench_now_ns();
+    comms_send_message(&msg);
+    comms_tx_flush();  /* Out now, not at the end of the batch window */
+}
+
+/* Sender: one object, or BENCH_PROBES probes alone, then the end marker */
+static void bench_sender(int fd, uint8_t version, bool bulk)
+{
+    struct Message msgs[8];
+    uint64_t next_probe = bench_now_ns();
+    unsigned int sent = 0;
+
+    serial_fd = fd;
+    comms_set_protocol_version(version);
+    if (bulk)
+        comms_bulk_send(BULK_OBJECT_CALIBRATION, sizeof(object), bench_read);
+
+    while (bulk ? comms_bulk_send_status(NULL) > 0 : sent < BENCH_PROBES) {
+        if (bench_now_ns() >= next_probe) {
+            bench_send_probe(sent++ % 0x80);
+            next_probe += BENCH_PROBE_MS * 1000000ull;
+        }
+        comms_receive_messages(msgs, 8);
+        comms_tx_flush();
+        usleep(50);  /* As main.c, the three processes may share one CPU */
+    }
+
+    /* The marker may be lost on the corrupted mix, repeat it until the relay stops */
+    for (;;) {
+        bench_send_probe(BENCH_PROBE_END);
+        usleep(20000);
+        comms_receive_messages(msgs, 8);
+    }
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Receiver: sinks the object and times the probes until the end marker */
+static void bench_receiver(int fd, uint8_t version, enum bench_mix mix, bool bulk)
+{
+    struct Message msgs[8];
+
+    serial_fd = fd;
+    comms_set_protocol_version(version);
+    comms_bulk_set_sink(&bench_bulk_sink);
+
+    for (;;) {
+        int count = comms_receive_messages(msgs, 8);
+
+        for (int i = 0; i < count; i++) {
+            const struct RequestBody *req = &msgs[i].body.payload_request;
+
+            if (msgs[i].header.message_type != MESSAGE_TYPE_REQUEST)
+                continue;
+            if (req->tid == BENCH_PROBE_END && (!bulk || close_result != 0xFF))
+                goto done;
+            if (req->tid != BENCH_PROBE_END && probes < sizeof(probe_ns) / sizeof(probe_ns[0]))
+                probe_ns[probes++] = bench_now_ns() - req->val;
+        }
+        comms_tx_flush();
+        usleep(50);
+    }
+
+done:
+    if (bulk) {
+        uint64_t ns = close_ns - open_ns;
+        double goodput = sizeof(object) * 1e9 / (ns ? ns : 1);
+
+        printf("bench=bulk path=transfer version=%u mix=%s baud=%u bytes=%zu ms=%.1f "
+               "goodput_Bps=%.0f efficiency=%.1f%% ok=%d\n",
+               version, bench_mix_names[mix], BENCH_BAUD, sizeof(object), ns / 1e6,
+               goodput, goodput * 100 / (BENCH_BAUD / 10),
+               close_result == 0 && memcmp(object, received, sizeof(object)) == 0);
+    }
+
+    qsort(probe_ns, probes, sizeof(probe_ns[0]), compare_ns);
+    printf("bench=bulk path=probe version=%u mix=%s mode=%s probes=%u p50_us=%.0f p99_us=%.0f max_us=%.0f\n",
+           version, bench_mix_names[mix], bulk ? "bulk" : "idle", probes,
+           probes ? probe_ns[probes / 2] / 1e3 : 0.0,
+           probes ? probe_ns[probes * 99 / 100] / 1e3 : 0.0,
+           probes ? probe_ns[probes - 1] / 1e3 : 0.0);
+    fflush(stdout);
+    exit(0);
+}
+
+/*
+ * bench_relay - Pass bytes between the two ends at BENCH_BAUD until the receiver exits
+ * @fds: relay side of the sender's and of the receiver's socket
+ */
+static void bench_relay(const int fds[2], pid_t receiver, enum bench_mix mix)
+{
+    uint8_t buf[4096];
+    double tokens[2] = { 0, 0 };
+    uint64_t last = bench_now_ns();
+
+    bench_seed(BENCH_SEED);
+    while (waitpid(receiver, NULL, WNOHANG) == 0) {
+        uint64_t now = bench_now_ns();
+
+        for (int dir = 0; dir < 2; dir++) {
+            int src = fds[dir], dst = fds[!dir];
+            size_t room;
+            ssize_t n;
+
+            /* Never bank more than a FIFO's worth of line time */
+            tokens[dir] += (now - last) * (BENCH_BAUD / 10) / 1e9;
+            if (tokens[dir] > 64)
+                tokens[dir] = 64;
+            room = (size_t)tokens[dir];
+            if (room == 0)
+                continue;
+
+            n = read(src, buf, room);
+            if (n <= 0)
+                continue;
+            tokens[dir] -= n;
+
+            if (mix == BENCH_MIX_CORRUPTED) {
+                for (ssize_t i = 0; i < n; i++)
+                    if (bench_rand() % BENCH_FLIP_BYTES == 0)
+                        buf[i] ^= 1 << (bench_rand() % 8);
+            }
+            if (write(dst, buf, n) != n) {
+                perror("relay write");
+                exit(1);
+            }
+        }
+        last = now;
+        usleep(BENCH_TICK_US);
+    }
+}
+
+static void bench_run(uint8_t version, enum bench_mix mix, bool bulk)
+{
+    int sender_sp[2], receiver_sp[2], relay_fds[2];
+    pid_t sender, receiver;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sender_sp) < 0 ||
+        socketpair(AF_UNIX, SOCK_STREAM, 0, receiver_sp) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(sender_sp[i], F_SETFL, O_NONBLOCK);
+        fcntl(receiver_sp[i], F_SETFL, O_NONBLOCK);
+    }
+
+    fflush(stdout);
+    receiver = fork();
+    if (receiver == 0) {
+        close(sender_sp[0]);
+        close(sender_sp[1]);
+        close(receiver_sp[1]);
+        bench_receiver(receiver_sp[0], version, mix, bulk);
+    }
+    sender = fork();
+    if (sender == 0) {
+        close(receiver_sp[0]);
+        close(receiver_sp[1]);
+        close(sender_sp[1]);
+        bench_sender(sender_sp[0], version, bulk);
+    }
+    close(sender_sp[0]);
+    close(receiver_sp[0]);
+
+    relay_fds[0] = sender_sp[1];
+    relay_fds[1] = receiver_sp[1];
+    bench_relay(relay_fds, receiver, mix);
+
+    kill(sender, SIGKILL);
+    waitpid(sender, NULL, 0);
+    close(sender_sp[1]);
+    close(receiver_sp[1]);
+}
+
+int main(void)
+{
+    bench_fill_object();
+
+    for (uint8_t version = PROTOCOL_VERSION_1; version <= PROTOCOL_VERSION_2; version++) {
+        for (int mix = BENCH_MIX_CLEAN; mix <= BENCH_MIX_CORRUPTED; mix++) {
+            bench_run(version, mix, false);
+            bench_run(version, mix, true);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,247 @@
+/*
+ * codec_bench.c - Throughput of the userspace serializer, deserializer and RX parser
+ *
+ * Runs a realistic traffic mix (see bench.h) through each code path, for both
+ * framings, and through each stream mix for the paths that receive:
+ *   serialize   : comms_serialize_message(), payload encoding and framing
+ *   deserialize : one frame at a time, comms_deserialize_message() in v1 and
+ *                 COBS decoding plus comms_decode_frame() in v2. The stream is
+ *                 cut into frames where the parser would, see bench_split()
+ *   receive     : comms_receive_messages(), the byte parser, sequence tracking and
+ *                 batch unpacking, fed from a socketpair in UART sized chunks
+ *
+ * Output is one line of key=value pairs per run, see bench_report():
+ *   bench        : codec
+ *   path         : code path under test
+ *   version      : framing (1 = START/END, 2 = COBS)
+ *   mix          : clean, corrupted or desynced
+ *   frames       : frames offered per round
+ *   ok           : frames the path accepted per round. In v2 the receive path
+ *                  consumes ACKs itself and does not count them
+ *   ns_per_frame : fastest round, per frame offered
+ *   frames_per_s : the same, as a rate
+ *
+ * NOTE: comms.c is compiled into this file so its static functions can be used
+ * directly, as in resync_bench.c.
+ */
+
+#include "comms.c"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+
+#define BENCH_CHUNK 256
+
+static uint8_t stream[BENCH_MESSAGES * BUFFER_SIZE];
+static struct bench_slice slices[2 * BENCH_MESSAGES];
+
+static void bench_build_message(uint32_t idx, struct Message *msg)
+{
+    memset(msg, 0, sizeof(*msg));
+    msg->header.recipient = MESSAGE_RECIPIENT_LINUX;
+    msg->header.seq = (uint8_t)idx;
+
+    switch (bench_kind(idx)) {
+    case BENCH_COMMAND:
+        msg->header.message_type = MESSAGE_TYPE_COMMAND;
+        msg->body.payload_command.command = COMMAND_WD_KICK;
+        break;
+    case BENCH_STATUS:
+        msg->header.message_type = MESSAGE_TYPE_STATUS;
+        msg->body.payload_status.bat_volt_uv = 7400000 + idx % 50000;
+        msg->body.payload_status.bat_lvl = 80;
+        msg->body.payload_status.state = 2;
+        msg->body.payload_status.charging = idx & 1;
+        break;
+    case BENCH_REQUEST:
+        msg->header.message_type = MESSAGE_TYPE_REQUEST;
+        msg->body.payload_request.tid = (uint8_t)idx;
+        msg->body.payload_request.command = COMMAND_STATUS_SET_KEEPALIVE;
+        msg->body.payload_request.val = STATUS_DEFAULT_KEEPALIVE_MS + idx % 1000;
+        break;
+    case BENCH_REPLY:
+        msg->header.message_type = MESSAGE_TYPE_REPLY;
+        msg->body.payload_reply.tid = (uint8_t)idx;
+        msg->body.payload_reply.result = REPLY_OK;
+        msg->body.payload_reply.val = STATUS_DEFAULT_KEEPALIVE_MS + idx % 1000;
+        break;
+    case BENCH_ACK:
+        msg->header.message_type = MESSAGE_TYPE_ACK;
+        msg->body.payload_ack.seq = (uint8_t)idx;
+        break;
+    case BENCH_ERROR:
+        msg->header.message_type = MESSAGE_TYPE_ERROR;
+        msg->body.payload_error.error_code = 2;
+        snprintf(msg->body.payload_error.error_message,
+                 sizeof(msg->body.payload_error.error_message), "Low Battery %" PRIu32, idx);
+        break;
+    }
+}
+
+/* Serialize the mix into stream[] and damage it, returns its length */
+static size_t bench_build_stream(uint8_t version, enum bench_mix mix)
+{
+    struct Message msg;
+    size_t len = 0;
+
+    comms_set_protocol_version(version);
+    bench_seed(BENCH_SEED);
+
+    for (uint32_t i = 0; i < BENCH_MESSAGES; i++) {
+        bench_build_message(i, &msg);
+        len += comms_serialize_message(&msg, &stream[len]);
+    }
+
+    bench_damage(stream, &len, sizeof(stream), mix);
+    return len;
+}
+
+static void bench_serialize(uint8_t version)
+{
+    static struct Message msgs[BENCH_MESSAGES];
+    uint8_t frame[BUFFER_SIZE];
+    uint64_t best = UINT64_MAX;
+    unsigned long ok = 0;
+
+    comms_set_protocol_version(version);
+    for (uint32_t i = 0; i < BENCH_MESSAGES; i++)
+        bench_build_message(i, &msgs[i]);
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        uint64_t start = bench_now_ns();
+
+        ok = 0;
+        for (int pass = 0; pass < BENCH_PASSES; pass++) {
+            for (uint32_t i = 0; i < BENCH_MESSAGES; i++) {
+                int len = comms_serialize_message(&msgs[i], frame);
+                if (len > 0) {
+                    bench_sink += frame[len - 1];
+                    ok++;
+                }
+            }
+        }
+
+        uint64_t ns = bench_now_ns() - start;
+        if (ns < best)
+            best = ns;
+    }
+
+    bench_report("codec", "serialize", version, BENCH_MIX_CLEAN,
+                 BENCH_MESSAGES * BENCH_PASSES, ok, best);
+}
+
+static int bench_deserialize_frame(uint8_t version, const uint8_t *frame, size_t len,
+                                   struct Message *msg)
+{
+    uint8_t decoded[BUFFER_SIZE];
+    int n;
+
+    if (version == PROTOCOL_VERSION_1)
+        return comms_deserialize_message(frame, len, msg);
+
+    /* As comms_parse_cobs_byte(), less the delimiter */
+    if (len < 1)
+        return -1;
+    n = comms_cobs_decode(frame, len - 1, decoded);
+    if (n < 0)
+        return n;
+    return comms_decode_frame(decoded, n, PROTOCOL_VERSION_2, msg);
+}
+
+static void bench_deserialize(uint8_t version, enum bench_mix mix)
+{
+    size_t len = bench_build_stream(version, mix);
+    size_t count = bench_split(stream, len, version, MESSAGE_START, MESSAGE_DELIMITER,
+                               slices, sizeof(slices) / sizeof(slices[0]));
+    uint64_t best = UINT64_MAX;
+    unsigned long ok = 0;
+    struct Message msg;
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        uint64_t start = bench_now_ns();
+
+        ok = 0;
+        for (int pass = 0; pass < BENCH_PASSES; pass++) {
+            for (size_t i = 0; i < count; i++) {
+                if (bench_deserialize_frame(version, &stream[slices[i].pos], slices[i].len, &msg) == 0) {
+                    bench_sink += msg.header.message_type;
+                    ok++;
+                }
+            }
+        }
+
+        uint64_t ns = bench_now_ns() - start;
+        if (ns < best)
+            best = ns;
+    }
+
+    bench_report("codec", "deserialize", version, mix, count * BENCH_PASSES, ok, best);
+}
+
+static void bench_receive(uint8_t version, enum bench_mix mix)
+{
+    static uint8_t replies[1024];
+    size_t len = bench_build_stream(version, mix);
+    uint64_t best = UINT64_MAX;
+    unsigned long ok = 0;
+    struct Message msgs[16];
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        int sockfd[2];
+        size_t pos = 0;
+        int count;
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockfd) < 0) {
+            perror("socketpair");
+            exit(1);
+        }
+        fcntl(sockfd[0], F_SETFL, O_NONBLOCK);
+        fcntl(sockfd[1], F_SETFL, O_NONBLOCK);
+        serial_fd = sockfd[0];
+        comms_set_protocol_version(version);
+
+        uint64_t start = bench_now_ns();
+
+        ok = 0;
+        while (pos < len) {
+            size_t chunk = (len - pos < BENCH_CHUNK) ? len - pos : BENCH_CHUNK;
+
+            if (write(sockfd[1], &stream[pos], chunk) != (ssize_t)chunk) {
+                perror("write");
+                exit(1);
+            }
+            pos += chunk;
+
+            while ((count = comms_receive_messages(msgs, 16)) > 0)
+                ok += count;
+
+            /* Discard the link layer's replies */
+            while (read(sockfd[1], replies, sizeof(replies)) > 0)
+                ;
+        }
+
+        uint64_t ns = bench_now_ns() - start;
+        if (ns < best)
+            best = ns;
+
+        comms_close();
+        close(sockfd[1]);
+    }
+
+    bench_report("codec", "receive", version, mix, BENCH_MESSAGES, ok, best);
+}
+
+int main(void)
+{
+    for (uint8_t version = PROTOCOL_VERSION_1; version <= PROTOCOL_VERSION_2; version++) {
+        bench_serialize(version);
+        for (int mix = 0; mix < BENCH_MIX_COUNT; mix++)
+            bench_deserialize(version, mix);
+        for (int mix = 0; mix < BENCH_MIX_COUNT; mix++)
+            bench_receive(version, mix);
+    }
+
+    return 0;
+}
@@ -0,0 +1,309 @@
+/*
+ * kcodec_bench.c - Throughput of the kernel driver's serializer and deserializer
+ *
+ * The same traffic and stream mixes as codec_bench.c, through oac_comms.c built
+ * for the host against the small kernel API shim in bench/kshim:
+ *   serialize   : oac_serialize_message()
+ *   deserialize : one frame at a time, oac_deserialize_message() in v1 and
+ *                 oac_cobs_decode() plus oac_decode_frame() in v2, as oac_dev
+ *                 does for each delimited frame, see bench_split()
+ *   receive     : the stream as oac_dev_receive() gets it from serdev, in
+ *                 reads of BENCH_RX_READ bytes, mode=fast through
+ *                 oac_rx_next() and mode=bytewise through the byte at a time
+ *                 accumulator it replaced, kept here for comparison
+ *
+ * Output is as codec_bench.c, with bench=kcodec. Receive lines add the mode
+ * and bytes_per_ns, the stream bytes parsed per nanosecond.
+ */
+
+#include "oac_comms.c"
+#include "bench.h"
+
+#include <inttypes.h>
+
+#define BENCH_RX_READ	64	/* Bytes per read, a typical tty flip buffer fill at speed */
+
+static u8 stream[BENCH_MESSAGES * OAC_MAX_FRAME_SIZE];
+static struct bench_slice slices[2 * BENCH_MESSAGES];
+
+static void bench_build_message(uint32_t idx, struct Message *msg)
+{
+	memset(msg, 0, sizeof(*msg));
+	msg->header.recipient = OAC_COMMS_RECIPIENT_FIRMWARE;
+	msg->header.seq = (u8)idx;
+
+	switch (bench_kind(idx)) {
+	case BENCH_COMMAND:
+		msg->header.message_type = OAC_MESSAGE_TYPE_COMMAND;
+		msg->body.payload_command.command = OAC_COMMAND_WD_KICK;
+		break;
+	case BENCH_STATUS:
+		msg->header.message_type = OAC_MESSAGE_TYPE_STATUS;
+		msg->body.payload_status.bat_volt_uv = 7400000 + idx % 50000;
+		msg->body.payload_status.bat_lvl = 80;
+		msg->body.payload_status.state = 2;
+		msg->body.payload_status.charging = idx & 1;
+		break;
+	case BENCH_REQUEST:
+		msg->header.message_type = OAC_MESSAGE_TYPE_REQUEST;
+		msg->body.payload_request.tid = (u8)idx;
+		msg->body.payload_request.command = OAC_COMMAND_STATUS_SET_KEEPALIVE;
+		msg->body.payload_request.val = OAC_STATUS_DEFAULT_KEEPALIVE_MS + idx % 1000;
+		break;
+	case BENCH_REPLY:
+		msg->header.message_type = OAC_MESSAGE_TYPE_REPLY;
+		msg->body.payload_reply.tid = (u8)idx;
+		msg->body.payload_reply.result = OAC_REPLY_OK;
+		msg->body.payload_reply.val = OAC_STATUS_DEFAULT_KEEPALIVE_MS + idx % 1000;
+		break;
+	case BENCH_ACK:
+		msg->header.message_type = OAC_MESSAGE_TYPE_ACK;
+		msg->body.payload_ack.seq = (u8)idx;
+		break;
+	case BENCH_ERROR:
+		msg->header.message_type = OAC_MESSAGE_TYPE_ERROR;
+		msg->body.payload_error.error_code = 2;
+		snprintf(msg->body.payload_error.error_message,
+			 sizeof(msg->body.payload_error.error_message), "Low Battery %" PRIu32, idx);
+		break;
+	}
+}
+
+/* Serialize the mix into stream[] and damage it, returns its length */
+static size_t bench_build_stream(u8 version, enum bench_mix mix)
+{
+	struct Message msg;
+	size_t len = 0;
+	uint32_t i;
+
+	bench_seed(BENCH_SEED);
+
+	for (i = 0; i < BENCH_MESSAGES; i++) {
+		bench_build_message(i, &msg);
+		len += oac_serialize_message(&msg, version, &stream[len], OAC_MAX_FRAME_SIZE);
+	}
+
+	bench_damage(stream, &len, sizeof(stream), mix);
+	return len;
+}
+
+static void bench_serialize(u8 version)
+{
+	static struct Message msgs[BENCH_MESSAGES];
+	u8 frame[OAC_MAX_FRAME_SIZE];
+	uint64_t best = UINT64_MAX;
+	unsigned long ok = 0;
+	uint32_t i;
+	int round, pass;
+
+	for (i = 0; i < BENCH_MESSAGES; i++)
+		bench_build_message(i, &msgs[i]);
+
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		uint64_t start = bench_now_ns(), ns;
+
+		ok = 0;
+		for (pass = 0; pass < BENCH_PASSES; pass++) {
+			for (i = 0; i < BENCH_MESSAGES; i++) {
+				int len = oac_serialize_message(&msgs[i], version, frame, sizeof(frame));
+
+				if (len > 0) {
+					bench_sink += frame[len - 1];
+					ok++;
+				}
+			}
+		}
+
+		ns = bench_now_ns() - start;
+		if (ns < best)
+			best = ns;
+	}
+
+	bench_report("kcodec", "serialize", version, BENCH_MIX_CLEAN,
+		     BENCH_MESSAGES * BENCH_PASSES, ok, best);
+}
+
+static int bench_deserialize_frame(u8 version, const u8 *frame, size_t len, struct Message *msg)
+{
+	u8 decoded[OAC_MAX_FRAME_SIZE];
+	int n;
+
+	if (version == OAC_PROTOCOL_V1)
+		return oac_deserialize_message(frame, len, msg);
+
+	if (len < 1)
+		return -EBADMSG;
+	n = oac_cobs_decode(frame, len - 1, decoded);
+	if (n < 0)
+		return n;
+	return oac_decode_frame(decoded, n, OAC_PROTOCOL_V2, msg);
+}
+
+static void bench_deserialize(u8 version, enum bench_mix mix)
+{
+	size_t len = bench_build_stream(version, mix);
+	size_t count = bench_split(stream, len, version, OAC_MESSAGE_START, OAC_MESSAGE_DELIMITER,
+				   slices, ARRAY_SIZE(slices));
+	uint64_t best = UINT64_MAX;
+	unsigned long ok = 0;
+	struct Message msg;
+	size_t i;
+	int round, pass;
+
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		uint64_t start = bench_now_ns(), ns;
+
+		ok = 0;
+		for (pass = 0; pass < BENCH_PASSES; pass++) {
+			for (i = 0; i < count; i++) {
+				if (bench_deserialize_frame(version, &stream[slices[i].pos],
+							    slices[i].len, &msg) == 0) {
+					bench_sink += msg.header.message_type;
+					ok++;
+				}
+			}
+		}
+
+		ns = bench_now_ns() - start;
+		if (ns < best)
+			best = ns;
+	}
+
+	bench_report("kcodec", "deserialize", version, mix, count * BENCH_PASSES, ok, best);
+}
+
+/*
+ * The receive path before oac_rx_next(): every byte is copied into rx->buf
+ * and branched on, and a v1 frame decoded from there.
+ */
+static int bench_bytewise_byte(struct oac_rx *rx, bool *receiving, u8 byte, bool v2,
+			       struct oac_rx_frame *frame)
+{
+	int len;
+
+	if (!*receiving) {
+		if (byte == OAC_MESSAGE_START)
+			rx->framing = OAC_PROTOCOL_V1;
+		else if (v2 && byte != OAC_MESSAGE_DELIMITER)
+			rx->framing = OAC_PROTOCOL_V2;
+		else
+			return 0;
+
+		*receiving = true;
+		rx->pos = 0;
+		rx->expected_len = 0;
+		rx->buf[rx->pos++] = byte;
+		return 0;
+	}
+
+	if (rx->framing == OAC_PROTOCOL_V2) {
+		if (byte != OAC_MESSAGE_DELIMITER) {
+			if (rx->pos >= sizeof(rx->buf)) {
+				*receiving = false;
+				return -EMSGSIZE;
+			}
+			rx->buf[rx->pos++] = byte;
+			return 0;
+		}
+
+		*receiving = false;
+		len = oac_cobs_decode(rx->buf, rx->pos, rx->buf);
+		if (len < 0)
+			return len;
+		frame->data = rx->buf;
+		frame->len = len;
+		frame->framing = OAC_PROTOCOL_V2;
+		return 1;
+	}
+
+	rx->buf[rx->pos++] = byte;
+	if (rx->pos == 4) {
+		rx->expected_len = 6 + rx->buf[3];
+		if (rx->expected_len > sizeof(rx->buf)) {
+			*receiving = false;
+			return -EMSGSIZE;
+		}
+	}
+	if (rx->pos < 6 || rx->pos < rx->expected_len)
+		return 0;
+
+	*receiving = false;
+	if (rx->buf[rx->expected_len - 1] != OAC_MESSAGE_END)
+		return -EBADMSG;
+	frame->data = &rx->buf[1];
+	frame->len = rx->expected_len - 2;
+	frame->framing = OAC_PROTOCOL_V1;
+	return 1;
+}
+
+static void bench_receive(u8 version, enum bench_mix mix, bool bytewise)
+{
+	size_t len = bench_build_stream(version, mix);
+	static struct oac_rx rx;
+	struct oac_rx_frame frame;
+	uint64_t best = UINT64_MAX;
+	unsigned long frames = 0, ok = 0;
+	bool v2 = version == OAC_PROTOCOL_V2;
+	bool receiving;
+	struct Message msg;
+	size_t off, n, pos;
+	int round, pass, ret;
+
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		uint64_t start = bench_now_ns(), ns;
+
+		frames = ok = 0;
+		oac_rx_reset(&rx);
+		receiving = false;
+		for (pass = 0; pass < BENCH_PASSES; pass++) {
+			for (off = 0; off < len; off += n) {
+				n = min_t(size_t, BENCH_RX_READ, len - off);
+				for (pos = 0; ; ) {
+					if (bytewise)
+						ret = pos < n ? bench_bytewise_byte(&rx, &receiving,
+										    stream[off + pos++], v2, &frame) : 0;
+					else
+						ret = oac_rx_next(&rx, &stream[off], n, &pos, v2, &frame);
+					if (ret == 0 && pos >= n)
+						break;
+					if (ret == 0)
+						continue;
+
+					frames++;
+					if (ret > 0 && oac_decode_frame(frame.data, frame.len, frame.framing,
+									&msg) == 0) {
+						bench_sink += msg.header.message_type;
+						ok++;
+					}
+				}
+			}
+		}
+
+		ns = bench_now_ns() - start;
+		if (ns < best)
+			best = ns;
+	}
+
+	printf("bench=kcodec path=receive version=%u mix=%s mode=%s bytes=%zu frames=%lu ok=%lu "
+	       "ns_per_frame=%.1f bytes_per_ns=%.3f\n",
+	       version, bench_mix_names[mix], bytewise ? "bytewise" : "fast", len * BENCH_PASSES,
+	       frames, ok, (double)best / (frames ? frames : 1),
+	       (double)len * BENCH_PASSES / (best ? best : 1));
+}
+
+int main(void)
+{
+	u8 version;
+	int mix;
+
+	for (version = OAC_PROTOCOL_V1; version <= OAC_PROTOCOL_V2; version++) {
+		bench_serialize(version);
+		for (mix = 0; mix < BENCH_MIX_COUNT; mix++) {
+			bench_deserialize(version, mix);
+			bench_receive(version, mix, true);
+			bench_receive(version, mix, false);
+		}
+	}
+
+	return 0;
+}
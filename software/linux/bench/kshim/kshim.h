@@ -0,0 +1,84 @@
+/*
+ * kshim.h - Just enough of the kernel API to build oac_comms.c on the host
+ *
+ * The headers under linux/ and asm/ all include this one.
+ */
+#ifndef BENCH_KSHIM_H
+#define BENCH_KSHIM_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define U8_MAX  UINT8_MAX
+#define U16_MAX UINT16_MAX
+#define U32_MAX UINT32_MAX
+#define U64_MAX UINT64_MAX
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define min_t(type, a, b) ((type)(a) < (type)(b) ? (type)(a) : (type)(b))
+#define max_t(type, a, b) ((type)(a) > (type)(b) ? (type)(a) : (type)(b))
+
+/* Logging is compiled out, it would only measure the terminal */
+#define pr_err(fmt, ...)  do { } while (0)
+#define pr_warn(fmt, ...) do { } while (0)
+#define pr_info(fmt, ...) do { } while (0)
+#define pr_debug(fmt, ...) do { } while (0)
+
+#ifndef static_assert
+#define static_assert(cond, msg) _Static_assert(cond, msg)
+#endif
+
+static inline u16 get_unaligned_le16(const void *p)
+{
+    const u8 *b = p;
+
+    return b[0] | (u16)b[1] << 8;
+}
+
+static inline u32 get_unaligned_le32(const void *p)
+{
+    const u8 *b = p;
+
+    return get_unaligned_le16(b) | (u32)get_unaligned_le16(b + 2) << 16;
+}
+
+static inline u64 get_unaligned_le64(const void *p)
+{
+    const u8 *b = p;
+
+    return get_unaligned_le32(b) | (u64)get_unaligned_le32(b + 4) << 32;
+}
+
+static inline void put_unaligned_le16(u16 val, void *p)
+{
+    u8 *b = p;
+
+    b[0] = val;
+    b[1] = val >> 8;
+}
+
+static inline void put_unaligned_le32(u32 val, void *p)
+{
+    u8 *b = p;
+
+    put_unaligned_le16(val, b);
+    put_unaligned_le16(val >> 16, b + 2);
+}
+
+static inline void put_unaligned_le64(u64 val, void *p)
+{
+    u8 *b = p;
+
+    put_unaligned_le32(val, b);
+    put_unaligned_le32(val >> 32, b + 4);
+}
+
+#endif /* BENCH_KSHIM_H */
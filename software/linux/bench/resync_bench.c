@@ -0,0 +1,219 @@
+/*
+ * resync_bench.c - Frame loss and resync time under injected byte drops
+ *
+ * Serializes a realistic mix of command, status and error frames, drops random
+ * bytes from the stream, and feeds what is left through the comms RX path via a
+ * socketpair. Run for both framings to compare how quickly each recovers.
+ *
+ * Output is one line of key=value pairs per (framing, drop rate) run:
+ *   version      : framing under test (1 = START/END, 2 = COBS)
+ *   drop_rate    : probability of any single byte being lost
+ *   frames       : frames transmitted
+ *   received     : frames received intact
+ *   hit          : frames that lost at least one of their own bytes
+ *   collateral   : intact frames that were still lost, i.e. lost to desync
+ *   corrupted    : frames accepted by the parser that do not match what was sent
+ *   resync_bytes : mean bytes from a drop to the start of the next frame received
+ *   resync_ms    : resync_bytes on the wire at 9600 baud, 8N1
+ *
+ * NOTE: comms.c is compiled into this file so its static serializer can be used
+ * directly; the serial fd is pointed at one end of a socketpair. In v2 the parser
+ * answers with ACK/NAK frames, which are read back and discarded.
+ */
+
+#include "comms.c"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+
+#define BENCH_FRAMES      20000
+#define BENCH_CHUNK       256
+#define BENCH_BAUD        9600
+
+static const double drop_rates[] = { 0.0001, 0.001, 0.01 };
+
+struct bench_frame {
+    size_t offset;              /* Offset of the first byte in the clean stream */
+    uint8_t len;
+    uint8_t bytes[BUFFER_SIZE];
+    bool hit;                   /* One of this frame's bytes was dropped */
+    bool received;
+};
+
+static struct bench_frame frames[BENCH_FRAMES];
+
+/*
+ * bench_build_message - Traffic mix seen on the link while recording:
+ * mostly heartbeats/commands, status every few frames and the odd error.
+ * Every message carries its index so the receiver can identify it.
+ */
+static void bench_build_message(uint32_t idx, struct Message *msg)
+{
+    uint32_t kind = idx % 10;
+
+    memset(msg, 0, sizeof(*msg));
+    msg->header.recipient = MESSAGE_RECIPIENT_LINUX;
+    msg->header.seq = (uint8_t)idx;
+
+    if (kind < 6) {
+        msg->header.message_type = MESSAGE_TYPE_COMMAND;
+        msg->header.payload_length = sizeof(struct CommandBody);
+        msg->body.payload_command.command = (uint16_t)idx;
+    } else if (kind < 9) {
+        msg->header.message_type = MESSAGE_TYPE_STATUS;
+        msg->header.payload_length = sizeof(struct StatusBody);
+        msg->body.payload_status.bat_volt_uv = idx;
+        msg->body.payload_status.bat_lvl = 80;
+        msg->body.payload_status.state = 2;
+        msg->body.payload_status.charging = false;
+    } else {
+        msg->header.message_type = MESSAGE_TYPE_ERROR;
+        msg->body.payload_error.error_code = 2;
+        snprintf(msg->body.payload_error.error_message,
+                 sizeof(msg->body.payload_error.error_message), "Low Battery %" PRIu32, idx);
+        msg->header.payload_length = 1 + strlen(msg->body.payload_error.error_message);
+    }
+}
+
+static long bench_message_index(const struct Message *msg)
+{
+    switch (msg->header.message_type) {
+    case MESSAGE_TYPE_COMMAND:
+        return msg->body.payload_command.command;
+    case MESSAGE_TYPE_STATUS:
+        return msg->body.payload_status.bat_volt_uv;
+    case MESSAGE_TYPE_ERROR: {
+        const char *num = strrchr(msg->body.payload_error.error_message, ' ');
+        return num ? strtol(num + 1, NULL, 10) : -1;
+    }
+    default:
+        return -1;
+    }
+}
+
+static void bench_run(uint8_t version, double drop_rate)
+{
+    static uint8_t stream[BENCH_FRAMES * BUFFER_SIZE];
+    static size_t drops[BENCH_FRAMES * BUFFER_SIZE];
+    struct Message msgs[16];
+    static uint8_t check_replies[1024];
+    size_t clean_len = 0, sent_len = 0, n_drops = 0, pos = 0;
+    uint32_t threshold = (uint32_t)(drop_rate * UINT32_MAX);
+    unsigned long received = 0, hit = 0, corrupted = 0;
+    long next_expected = 0;
+    int sockfd[2];
+
+    comms_set_protocol_version(version);
+    bench_seed(BENCH_SEED);
+
+    /* Serialize the clean stream */
+    for (uint32_t i = 0; i < BENCH_FRAMES; i++) {
+        struct Message msg;
+
+        bench_build_message(i, &msg);
+        frames[i].offset = clean_len;
+        frames[i].len = comms_serialize_message(&msg, frames[i].bytes);
+        frames[i].hit = false;
+        frames[i].received = false;
+        memcpy(&stream[clean_len], frames[i].bytes, frames[i].len);
+        clean_len += frames[i].len;
+    }
+
+    /* Drop bytes in place, remembering where each drop happened */
+    for (uint32_t i = 0, f = 0; i < clean_len; i++) {
+        while (f + 1 < BENCH_FRAMES && frames[f + 1].offset <= i)
+            f++;
+
+        if (bench_rand() < threshold) {
+            drops[n_drops++] = i;
+            frames[f].hit = true;
+            continue;
+        }
+        stream[sent_len++] = stream[i];
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockfd) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    fcntl(sockfd[0], F_SETFL, O_NONBLOCK);
+    fcntl(sockfd[1], F_SETFL, O_NONBLOCK);
+    serial_fd = sockfd[0];
+
+    /* Feed the damaged stream in UART sized chunks, draining after each */
+    while (pos < sent_len) {
+        size_t chunk = (sent_len - pos < BENCH_CHUNK) ? sent_len - pos : BENCH_CHUNK;
+        int count;
+
+        if (write(sockfd[1], &stream[pos], chunk) != (ssize_t)chunk) {
+            perror("write");
+            exit(1);
+        }
+        pos += chunk;
+
+        while ((count = comms_receive_messages(msgs, 16)) > 0) {
+            for (int i = 0; i < count; i++) {
+                uint8_t check[BUFFER_SIZE];
+                long idx = bench_message_index(&msgs[i]);
+
+                if (idx < next_expected || idx >= BENCH_FRAMES) {
+                    corrupted++;
+                    continue;
+                }
+
+                /* A frame is only intact if it re-serializes to exactly what was sent */
+                int len = comms_serialize_message(&msgs[i], check);
+                if (len != frames[idx].len || memcmp(check, frames[idx].bytes, len) != 0) {
+                    corrupted++;
+                    continue;
+                }
+
+                frames[idx].received = true;
+                next_expected = idx + 1;
+                received++;
+            }
+        }
+
+        /* Discard the link layer's replies */
+        while (read(sockfd[1], check_replies, sizeof(check_replies)) > 0)
+            ;
+    }
+
+    comms_close();
+    close(sockfd[1]);
+
+    /* Resync distance: from each drop to the start of the next frame that got through */
+    double resync_total = 0;
+    unsigned long resync_count = 0;
+    for (size_t d = 0, f = 0; d < n_drops; d++) {
+        while (f < BENCH_FRAMES && (frames[f].offset <= drops[d] || !frames[f].received))
+            f++;
+        if (f == BENCH_FRAMES)
+            break;
+        resync_total += frames[f].offset - drops[d];
+        resync_count++;
+    }
+
+    for (uint32_t i = 0; i < BENCH_FRAMES; i++)
+        hit += frames[i].hit;
+
+    double resync_bytes = resync_count ? resync_total / resync_count : 0;
+
+    printf("version=%u drop_rate=%.4f frames=%d received=%lu hit=%lu collateral=%lu "
+           "corrupted=%lu resync_bytes=%.1f resync_ms=%.1f\n",
+           version, drop_rate, BENCH_FRAMES, received, hit,
+           BENCH_FRAMES - received - hit, corrupted,
+           resync_bytes, resync_bytes * 10 * 1000 / BENCH_BAUD);
+}
+
+int main(void)
+{
+    for (size_t r = 0; r < sizeof(drop_rates) / sizeof(drop_rates[0]); r++) {
+        bench_run(PROTOCOL_VERSION_1, drop_rates[r]);
+        bench_run(PROTOCOL_VERSION_2, drop_rates[r]);
+    }
+
+    return 0;
+}
@@ -0,0 +1 @@
+../shared/comms_trace.h
\ No newline at end of file
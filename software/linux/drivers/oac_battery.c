@@ -15,6 +15,7 @@ struct oac_battery {
 	struct power_supply *psy;
 	struct power_supply_desc desc;
 	struct oac_dev *core;
+	struct device *dev;
 
 	bool charging;
 	int voltage_uv;
@@ -22,7 +23,6 @@ struct oac_battery {
 	int error_code;
 };
 
-static struct oac_battery *bat;
 static atomic_t shutdown_triggered = ATOMIC_INIT(0);
 
 static int oac_battery_get_property(struct power_supply *psy,
@@ -85,40 +85,100 @@ static enum power_supply_property oac_battery_props[] = {
  * oac_battery_message_cb - Callback invoked when a status message is received.
  * @dev: Pointer to oac_dev structure
  * @msg: Pointer to received Message
+ * @context: The oac_battery
  *
- * Note: Triggers shutdown if battery voltage is critically low.
+ * Note: Triggers shutdown if battery voltage is critically low. The MCU only
+ * reports changes and a slow keepalive, a keepalive that changes nothing
+ * does not notify userspace.
  */
-static void oac_battery_message_cb(struct oac_dev *dev, const struct Message *msg)
+static void oac_battery_message_cb(struct oac_dev *dev, const struct Message *msg, void *context)
 {
-	struct platform_device *pdev = to_platform_device(dev->serdev->dev.parent);
-	bool shutdown_not_triggered = atomic_cmpxchg(&shutdown_triggered, 0, 1) == 0;
-
-	if (!msg || msg->header.message_type != OAC_MESSAGE_TYPE_STATUS || !bat)
-		return;
-
+	struct oac_battery *bat = context;
 	const struct StatusBody *status = &msg->body.payload_status;
+	bool changed = bat->voltage_uv != status->bat_volt_uv ||
+		       bat->bat_lvl != status->bat_lvl ||
+		       bat->charging != status->charging;
+
 	bat->voltage_uv = status->bat_volt_uv;
 	bat->bat_lvl = status->bat_lvl;
 	bat->charging = status->charging;
 	bat->error_code = status->error_code;
 
-	power_supply_changed(bat->psy);
+	if (changed)
+		power_supply_changed(bat->psy);
 
 	/* If battery is critically low, trigger a shutdown */
-	if (bat->voltage_uv <= BATTERY_CRITICAL_UV && shutdown_not_triggered) {
-		dev_emerg(&pdev->dev, "Battery critically low (%d%%), shutting down\n", bat->bat_lvl);
-		if (orderly_poweroff(true)) {
-			dev_emerg(&pdev->dev, "orderly_poweroff() failed — forcing kernel_power_off()\n");
-			kernel_power_off();
-		}
+	if (bat->voltage_uv <= BATTERY_CRITICAL_UV &&
+	    atomic_cmpxchg(&shutdown_triggered, 0, 1) == 0) {
+		dev_emerg(bat->dev, "Battery critically low (%d%%), shutting down\n", bat->bat_lvl);
+		/* Only queues the power off, forced if userspace does not manage it */
+		orderly_poweroff(true);
 	}
 
 }
 
+/* Status reporting thresholds, in sysfs as status_* on the platform device */
+static ssize_t oac_battery_threshold_show(struct device *dev,
+					  struct device_attribute *attr, char *buf)
+{
+	struct oac_battery *bat = dev_get_drvdata(dev);
+	struct dev_ext_attribute *ea = container_of(attr, struct dev_ext_attribute, attr);
+	u64 val;
+	int ret;
+
+	ret = oac_dev_param_get(bat->core, (uintptr_t)ea->var, &val);
+	if (ret)
+		return ret;
+
+	return sysfs_emit(buf, "%llu\n", val);
+}
+
+/* Send a threshold to the MCU, it applies from the next status on. Fails if the MCU rejects it */
+static ssize_t oac_battery_threshold_store(struct device *dev,
+					   struct device_attribute *attr,
+					   const char *buf, size_t count)
+{
+	struct oac_battery *bat = dev_get_drvdata(dev);
+	struct dev_ext_attribute *ea = container_of(attr, struct dev_ext_attribute, attr);
+	u64 val;
+	int ret;
+
+	ret = kstrtou64(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	ret = oac_dev_param_set(bat->core, (uintptr_t)ea->var, val);
+	return ret ? ret : count;
+}
+
+#define OAC_BATTERY_THRESHOLD_ATTR(_name, _idx)					\
+	static struct dev_ext_attribute dev_attr_##_name = {			\
+		__ATTR(_name, 0644, oac_battery_threshold_show,			\
+		       oac_battery_threshold_store),				\
+		(void *)(_idx)							\
+	}
+
+OAC_BATTERY_THRESHOLD_ATTR(status_volt_delta_uv, OAC_PARAM_STATUS_VOLT_DELTA);
+OAC_BATTERY_THRESHOLD_ATTR(status_lvl_delta, OAC_PARAM_STATUS_LVL_DELTA);
+OAC_BATTERY_THRESHOLD_ATTR(status_events, OAC_PARAM_STATUS_EVENTS);
+OAC_BATTERY_THRESHOLD_ATTR(status_keepalive_ms, OAC_PARAM_STATUS_KEEPALIVE);
+OAC_BATTERY_THRESHOLD_ATTR(status_min_interval_ms, OAC_PARAM_STATUS_MIN_INTERVAL);
+
+static struct attribute *oac_battery_attrs[] = {
+	&dev_attr_status_volt_delta_uv.attr.attr,
+	&dev_attr_status_lvl_delta.attr.attr,
+	&dev_attr_status_events.attr.attr,
+	&dev_attr_status_keepalive_ms.attr.attr,
+	&dev_attr_status_min_interval_ms.attr.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(oac_battery);
+
 static int oac_battery_probe(struct platform_device *pdev)
 {
 	struct oac_dev *core = dev_get_drvdata(pdev->dev.parent);
 	struct power_supply_config psy_cfg = {};
+	struct oac_battery *bat;
 
 	bat = devm_kzalloc(&pdev->dev, sizeof(*bat), GFP_KERNEL);
 	if (!bat)
@@ -128,6 +188,7 @@ static int oac_battery_probe(struct platform_device *pdev)
 	psy_cfg.of_node = pdev->dev.of_node;
 
 	bat->core = core;
+	bat->dev = &pdev->dev;
 	bat->desc.name = "oac-battery";
 	bat->desc.type = POWER_SUPPLY_TYPE_BATTERY;
 	bat->desc.properties = oac_battery_props;
@@ -140,9 +201,20 @@ static int oac_battery_probe(struct platform_device *pdev)
 
 	platform_set_drvdata(pdev, bat);
 
-	if (oac_dev_register_callback(core, oac_battery_message_cb) < 0)
+	if (oac_dev_subscribe(core, OAC_MESSAGE_TYPE_STATUS, 0, U16_MAX, oac_battery_message_cb, bat) < 0)
 		return dev_err_probe(&pdev->dev, -ENODEV, "Failed to register message callback\n");
 
+	/* The MCU only reports changes, ask for the current status */
+	struct Message req = {
+		.header = {
+			.message_type = OAC_MESSAGE_TYPE_COMMAND,
+			.recipient = OAC_COMMS_RECIPIENT_FIRMWARE,
+		},
+		.body.payload_command.command = OAC_COMMAND_STATUS_REQ,
+	};
+	if (oac_dev_send_message(core, &req) < 0)
+		dev_warn(&pdev->dev, "Failed to request status\n");
+
 	dev_info(&pdev->dev, "Open Action Cam - battery driver initialized\n");
 	return 0;
 }
@@ -150,7 +222,7 @@ static int oac_battery_probe(struct platform_device *pdev)
 static int oac_battery_remove(struct platform_device *pdev)
 {
 	struct oac_battery *bat = platform_get_drvdata(pdev);
-	oac_dev_unregister_callback(bat->core, oac_battery_message_cb);
+	oac_dev_unsubscribe(bat->core, oac_battery_message_cb, bat);
 	return 0;
 }
 
@@ -166,6 +238,7 @@ static struct platform_driver oac_battery_driver = {
 	.driver = {
 		.name = "oac_battery",
 		.of_match_table = oac_battery_of_match,
+		.dev_groups = oac_battery_groups,
 	},
 };
 module_platform_driver(oac_battery_driver);
@@ -0,0 +1,530 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Bulk transfers over DATA messages
+ *
+ * One object is sent and one received at a time, in chunks that carry their
+ * offset. The receiver credits what has arrived and how far past it the
+ * sender may go, and asks for a resend from there when a chunk goes missing.
+ * The sender goes back to the last credit when no credit arrives within
+ * OAC_BULK_RETRY_MS. The messages are described with BULK_OP_* in
+ * oac_protocol.h, shared/comms.c runs the same protocol on the MCU.
+ *
+ * serdev does not say how much of what was written is still queued, so the
+ * line time of every chunk is added up. Chunks are only written while less
+ * than one frame plus two ticks of them are queued, which is what any other
+ * message has to wait behind.
+ */
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <asm/unaligned.h>
+#include "oac_comms.h"
+#include "oac_dev.h"
+
+static int oac_bulk_errno(u8 result)
+{
+	switch (result) {
+	case 0:
+		return 0;
+	case OAC_BULK_E_NO_SINK:
+		return -ENOENT;
+	case OAC_BULK_E_TOO_LARGE:
+		return -EFBIG;
+	case OAC_BULK_E_IO:
+		return -EIO;
+	case OAC_BULK_E_TIMEOUT:
+		return -ETIMEDOUT;
+	default:
+		return -ECANCELED;
+	}
+}
+
+/* Send a bulk transfer message, payload is OP XFER and the operation's fields */
+static int oac_bulk_send_op(struct oac_dev *odev, const u8 *payload, u8 len)
+{
+	struct Message msg = {
+		.header = {
+			.recipient = OAC_COMMS_RECIPIENT_FIRMWARE,
+			.message_type = OAC_MESSAGE_TYPE_DATA,
+			.payload_length = len,
+		},
+	};
+
+	memcpy(msg.body.payload_raw, payload, len);
+	return oac_dev_send_message(odev, &msg);
+}
+
+/* Time the UART takes to send a frame of len bytes, 10 bits each */
+static u64 oac_bulk_line_ns(struct oac_dev *odev, size_t len)
+{
+	return div_u64((u64)len * 10 * NSEC_PER_SEC, oac_dev_baud(odev));
+}
+
+static void oac_bulk_send_open(struct oac_dev *odev)
+{
+	struct oac_bulk_tx *tx = &odev->bulk_tx;
+	u8 payload[7] = { OAC_BULK_OP_OPEN, tx->xfer, tx->object };
+
+	put_unaligned_le32(tx->size, &payload[3]);
+	oac_bulk_send_op(odev, payload, sizeof(payload));
+}
+
+/*
+ * oac_bulk_tx_end - End the transfer being sent, bulk_lock held
+ * @result: 0 if the MCU has the whole object, otherwise a BULK_E_*
+ * @notify: tell the MCU the sender gave up
+ */
+static void oac_bulk_tx_end(struct oac_dev *odev, u8 result, bool notify)
+{
+	struct oac_bulk_tx *tx = &odev->bulk_tx;
+
+	if (notify) {
+		u8 payload[3] = { OAC_BULK_OP_CANCEL, tx->xfer, result };
+
+		oac_bulk_send_op(odev, payload, sizeof(payload));
+	}
+
+	tx->state = OAC_BULK_IDLE;
+	tx->data = NULL;
+	if (tx->done)
+		tx->done(odev, oac_bulk_errno(result), tx->context);
+}
+
+/*
+ * oac_bulk_pump - Write chunks within the credit while the UART has room, and
+ * go back to the last credit when the MCU has gone quiet. bulk_lock held.
+ */
+static void oac_bulk_pump(struct oac_dev *odev)
+{
+	struct oac_bulk_tx *tx = &odev->bulk_tx;
+	unsigned long retry = msecs_to_jiffies(OAC_BULK_RETRY_MS);
+	unsigned long delay;
+	u8 payload[OAC_MAX_PAYLOAD_SIZE];
+	u64 ahead, now;
+
+	if (tx->state == OAC_BULK_IDLE)
+		return;
+
+	if (time_after(jiffies, tx->time + retry)) {
+		if (++tx->retries > OAC_BULK_MAX_RETRIES) {
+			dev_warn(&odev->serdev->dev, "Bulk transfer of object %u timed out at %u/%u\n",
+				 tx->object, tx->acked, tx->size);
+			oac_bulk_tx_end(odev, OAC_BULK_E_TIMEOUT, true);
+			return;
+		}
+		tx->time = jiffies;
+
+		if (tx->state == OAC_BULK_OPENING)
+			oac_bulk_send_open(odev);
+		else
+			tx->next = tx->acked;
+	}
+
+	ahead = oac_bulk_line_ns(odev, OAC_FRAME_LEN_V2(OAC_MAX_PAYLOAD_SIZE)) + jiffies_to_nsecs(2);
+	now = ktime_get_ns();
+
+	while (tx->state == OAC_BULK_SENDING && tx->next < tx->limit && tx->busy_until < now + ahead) {
+		u8 len = min_t(u32, tx->limit - tx->next, OAC_BULK_CHUNK_MAX);
+
+		payload[0] = OAC_BULK_OP_CHUNK;
+		payload[1] = tx->xfer;
+		put_unaligned_le32(tx->next, &payload[2]);
+		memcpy(&payload[OAC_BULK_CHUNK_HEADER_LEN], tx->data + tx->next, len);
+		if (oac_bulk_send_op(odev, payload, OAC_BULK_CHUNK_HEADER_LEN + len) < 0)
+			break;	/* the retry goes back to the last credit */
+
+		tx->busy_until = max(tx->busy_until, now) +
+			oac_bulk_line_ns(odev, OAC_FRAME_LEN_V2(OAC_BULK_CHUNK_HEADER_LEN + len));
+		tx->next += len;
+		now = ktime_get_ns();
+	}
+
+	/* Come back for the retry, or as soon as the UART has room for more */
+	delay = time_after(tx->time + retry, jiffies) ? tx->time + retry - jiffies + 1 : 1;
+	if (tx->state == OAC_BULK_SENDING && tx->next < tx->limit)
+		delay = clamp(nsecs_to_jiffies(tx->busy_until - min(tx->busy_until, now + ahead)),
+			      1UL, delay);
+	mod_delayed_work(system_wq, &odev->bulk_work, delay);
+}
+
+static void oac_bulk_work(struct work_struct *work)
+{
+	struct oac_dev *odev = container_of(to_delayed_work(work),
+					    struct oac_dev, bulk_work);
+
+	mutex_lock(&odev->bulk_lock);
+	oac_bulk_pump(odev);
+	mutex_unlock(&odev->bulk_lock);
+}
+
+/**
+ * oac_bulk_send - Start sending an object to the MCU
+ * @dev: oac_dev instance
+ * @object: BULK_OBJECT_*
+ * @data: the object, read until @done has been called
+ * @size: size of the object in bytes
+ * @done: called once with 0 when the MCU has the object, otherwise an error.
+ *        Called with the bulk lock held, it must not call oac_bulk_*().
+ * @context: passed to @done
+ *
+ * Return: 0 on success, -EBUSY if an object is being sent.
+ */
+int oac_bulk_send(struct oac_dev *dev, u8 object, const void *data, size_t size,
+		  oac_bulk_done_t done, void *context)
+{
+	struct oac_bulk_tx *tx = &dev->bulk_tx;
+
+	if (size > U32_MAX)
+		return -EFBIG;
+
+	mutex_lock(&dev->bulk_lock);
+
+	if (tx->state != OAC_BULK_IDLE) {
+		mutex_unlock(&dev->bulk_lock);
+		return -EBUSY;
+	}
+
+	/* Start from the clock, the MCU must not take this for the transfer before a reload */
+	tx->xfer = tx->xfer ? tx->xfer + 1 : (u8)jiffies;
+	if (!tx->xfer)
+		tx->xfer = 1;
+
+	tx->data = data;
+	tx->size = size;
+	tx->object = object;
+	tx->acked = tx->next = tx->limit = 0;
+	tx->retries = 0;
+	tx->time = jiffies;
+	tx->done = done;
+	tx->context = context;
+	tx->state = OAC_BULK_OPENING;
+
+	oac_bulk_send_open(dev);
+	oac_bulk_pump(dev);
+
+	mutex_unlock(&dev->bulk_lock);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(oac_bulk_send);
+
+/**
+ * oac_bulk_cancel - Give up on the object being sent, its @done gets -ECANCELED
+ * @dev: oac_dev instance
+ */
+void oac_bulk_cancel(struct oac_dev *dev)
+{
+	mutex_lock(&dev->bulk_lock);
+	if (dev->bulk_tx.state != OAC_BULK_IDLE)
+		oac_bulk_tx_end(dev, OAC_BULK_E_CANCELLED, true);
+	mutex_unlock(&dev->bulk_lock);
+}
+EXPORT_SYMBOL_GPL(oac_bulk_cancel);
+
+/* Tell the MCU what has arrived and how much more may follow, bulk_lock held */
+static void oac_bulk_credit(struct oac_dev *odev, u8 op)
+{
+	struct oac_bulk_rx *rx = &odev->bulk_rx;
+	u8 payload[8] = { op, rx->xfer };
+
+	put_unaligned_le32(rx->offset, &payload[2]);
+	put_unaligned_le16(rx->state == OAC_BULK_DONE ? 0 : OAC_BULK_RX_WINDOW, &payload[6]);
+	rx->credited = rx->offset;
+	oac_bulk_send_op(odev, payload, sizeof(payload));
+}
+
+static void oac_bulk_refuse(struct oac_dev *odev, u8 xfer, u8 reason)
+{
+	u8 payload[3] = { OAC_BULK_OP_ABORT, xfer, reason };
+
+	oac_bulk_send_op(odev, payload, sizeof(payload));
+}
+
+static struct oac_bulk_sink *oac_bulk_find_sink(struct oac_dev *odev, u8 object)
+{
+	int i;
+
+	for (i = 0; i < OAC_BULK_MAX_SINKS; i++) {
+		if (odev->bulk_sinks[i].cb && odev->bulk_sinks[i].object == object)
+			return &odev->bulk_sinks[i];
+	}
+	return NULL;
+}
+
+/* The object is complete, hand it to its sink. bulk_lock held */
+static void oac_bulk_rx_complete(struct oac_dev *odev)
+{
+	struct oac_bulk_rx *rx = &odev->bulk_rx;
+	struct oac_bulk_sink *sink = oac_bulk_find_sink(odev, rx->object);
+
+	rx->state = OAC_BULK_DONE;
+	if (sink)
+		sink->cb(odev, rx->object, rx->buf, rx->size, sink->context);
+
+	kvfree(rx->buf);
+	rx->buf = NULL;
+}
+
+/*
+ * oac_bulk_receive_open - Handle an offered object, bulk_lock held
+ *
+ * An OPEN for the transfer already open or done was resent because the
+ * credit answering it was lost. Any other OPEN replaces the transfer being
+ * received, and resumes it if it is for the same object and size.
+ */
+static void oac_bulk_receive_open(struct oac_dev *odev, const u8 *payload, u8 len)
+{
+	struct oac_bulk_rx *rx = &odev->bulk_rx;
+	struct oac_bulk_sink *sink;
+	u8 xfer = payload[1];
+	u8 object;
+	u32 size;
+
+	if (len < 7)
+		return;
+
+	if (rx->state != OAC_BULK_IDLE && xfer == rx->xfer) {
+		oac_bulk_credit(odev, OAC_BULK_OP_CREDIT);
+		return;
+	}
+
+	object = payload[2];
+	size = get_unaligned_le32(&payload[3]);
+	rx->state = OAC_BULK_IDLE;
+	rx->xfer = xfer;
+
+	sink = oac_bulk_find_sink(odev, object);
+	if (!sink) {
+		oac_bulk_refuse(odev, xfer, OAC_BULK_E_NO_SINK);
+		return;
+	}
+	if (size > sink->max_size) {
+		oac_bulk_refuse(odev, xfer, OAC_BULK_E_TOO_LARGE);
+		return;
+	}
+
+	if (!rx->buf || rx->object != object || rx->size != size) {
+		kvfree(rx->buf);
+		rx->buf = kvmalloc(max_t(size_t, size, 1), GFP_KERNEL);
+		if (!rx->buf) {
+			oac_bulk_refuse(odev, xfer, OAC_BULK_E_IO);
+			return;
+		}
+		rx->object = object;
+		rx->size = size;
+		rx->offset = 0;
+	} else {
+		dev_info(&odev->serdev->dev, "Resuming bulk object %u at %u/%u\n",
+			 object, rx->offset, size);
+	}
+
+	rx->resent = false;
+	rx->state = OAC_BULK_SENDING;
+
+	if (rx->offset == rx->size)
+		oac_bulk_rx_complete(odev);
+	oac_bulk_credit(odev, OAC_BULK_OP_CREDIT);
+}
+
+/*
+ * oac_bulk_receive_chunk - Store a chunk that follows on from what has arrived,
+ * bulk_lock held
+ *
+ * Anything else means a chunk was lost, and the MCU is asked to resume from
+ * what has arrived. Once, as the rest of its window is on the way, and again
+ * only if it keeps going after half a retry interval. After the last chunk
+ * the final credit is repeated instead.
+ */
+static void oac_bulk_receive_chunk(struct oac_dev *odev, const u8 *payload, u8 len)
+{
+	struct oac_bulk_rx *rx = &odev->bulk_rx;
+	u32 offset;
+	u8 count;
+
+	if (len < OAC_BULK_CHUNK_HEADER_LEN || payload[1] != rx->xfer || rx->state == OAC_BULK_IDLE)
+		return;
+
+	offset = get_unaligned_le32(&payload[2]);
+	count = len - OAC_BULK_CHUNK_HEADER_LEN;
+
+	if (rx->state == OAC_BULK_DONE || offset != rx->offset || count > rx->size - rx->offset) {
+		unsigned long again = rx->resend_time + msecs_to_jiffies(OAC_BULK_RETRY_MS / 2);
+
+		if (!rx->resent || time_after_eq(jiffies, again)) {
+			rx->resent = true;
+			rx->resend_time = jiffies;
+			oac_bulk_credit(odev, rx->state == OAC_BULK_DONE ?
+					OAC_BULK_OP_CREDIT : OAC_BULK_OP_RESEND);
+		}
+		return;
+	}
+
+	memcpy(rx->buf + offset, &payload[OAC_BULK_CHUNK_HEADER_LEN], count);
+	rx->offset += count;
+	rx->resent = false;
+
+	if (rx->offset == rx->size) {
+		oac_bulk_rx_complete(odev);
+		oac_bulk_credit(odev, OAC_BULK_OP_CREDIT);
+	} else if (rx->offset - rx->credited >= OAC_BULK_RX_WINDOW / 2) {
+		oac_bulk_credit(odev, OAC_BULK_OP_CREDIT);
+	}
+}
+
+/* Move the window on, or back to the offset for a RESEND. bulk_lock held */
+static void oac_bulk_receive_credit(struct oac_dev *odev, const u8 *payload, u8 len, bool resend)
+{
+	struct oac_bulk_tx *tx = &odev->bulk_tx;
+	u32 offset, limit;
+
+	if (len < 8 || payload[1] != tx->xfer || tx->state == OAC_BULK_IDLE)
+		return;
+
+	offset = get_unaligned_le32(&payload[2]);
+	if (offset > tx->size)
+		return;
+	limit = min_t(u64, (u64)offset + get_unaligned_le16(&payload[6]), tx->size);
+
+	if (offset > tx->acked || tx->state == OAC_BULK_OPENING) {
+		tx->acked = offset;
+		tx->retries = 0;
+		tx->time = jiffies;
+		tx->state = OAC_BULK_SENDING;
+	}
+
+	if (tx->next < tx->acked || (resend && offset == tx->acked))
+		tx->next = tx->acked;
+	tx->limit = limit;
+
+	if (tx->acked == tx->size)
+		oac_bulk_tx_end(odev, 0, false);
+	else
+		oac_bulk_pump(odev);
+}
+
+/* Run the bulk transfer protocol for a DATA message from the MCU */
+void oac_bulk_handle(struct oac_dev *odev, const struct Message *msg)
+{
+	const u8 *payload = msg->body.payload_raw;
+	u8 len = msg->header.payload_length;
+
+	if (len < 3)
+		return;
+
+	mutex_lock(&odev->bulk_lock);
+
+	switch (payload[0]) {
+	case OAC_BULK_OP_OPEN:
+		oac_bulk_receive_open(odev, payload, len);
+		break;
+	case OAC_BULK_OP_CHUNK:
+		oac_bulk_receive_chunk(odev, payload, len);
+		break;
+	case OAC_BULK_OP_CANCEL:
+		if (payload[1] == odev->bulk_rx.xfer && odev->bulk_rx.state == OAC_BULK_SENDING)
+			odev->bulk_rx.state = OAC_BULK_IDLE;	/* kept for a resume */
+		break;
+	case OAC_BULK_OP_CREDIT:
+	case OAC_BULK_OP_RESEND:
+		oac_bulk_receive_credit(odev, payload, len, payload[0] == OAC_BULK_OP_RESEND);
+		break;
+	case OAC_BULK_OP_ABORT:
+		if (payload[1] == odev->bulk_tx.xfer && odev->bulk_tx.state != OAC_BULK_IDLE)
+			oac_bulk_tx_end(odev, payload[2] ? payload[2] : OAC_BULK_E_CANCELLED, false);
+		break;
+	}
+
+	mutex_unlock(&odev->bulk_lock);
+}
+
+/**
+ * oac_bulk_register_sink - Receive objects of a kind from the MCU
+ * @dev: oac_dev instance
+ * @object: BULK_OBJECT_*
+ * @max_size: larger objects are refused
+ * @cb: called with each complete object, which is freed when it returns.
+ *      Called with the bulk lock held, it must not call oac_bulk_*().
+ * @context: passed to @cb
+ *
+ * Return: 0 on success, -EEXIST if the object has a sink, -ENOSPC if there
+ * is no room for another.
+ */
+int oac_bulk_register_sink(struct oac_dev *dev, u8 object, size_t max_size,
+			   oac_bulk_sink_t cb, void *context)
+{
+	int i, ret = -ENOSPC;
+
+	mutex_lock(&dev->bulk_lock);
+
+	if (oac_bulk_find_sink(dev, object)) {
+		ret = -EEXIST;
+		goto out;
+	}
+
+	for (i = 0; i < OAC_BULK_MAX_SINKS; i++) {
+		if (!dev->bulk_sinks[i].cb) {
+			dev->bulk_sinks[i] = (struct oac_bulk_sink) {
+				.object = object,
+				.max_size = max_size,
+				.cb = cb,
+				.context = context,
+			};
+			ret = 0;
+			break;
+		}
+	}
+
+out:
+	mutex_unlock(&dev->bulk_lock);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(oac_bulk_register_sink);
+
+/**
+ * oac_bulk_unregister_sink - Stop receiving objects of a kind, one being
+ * received is given up on
+ * @dev: oac_dev instance
+ * @object: BULK_OBJECT_*
+ */
+void oac_bulk_unregister_sink(struct oac_dev *dev, u8 object)
+{
+	struct oac_bulk_rx *rx = &dev->bulk_rx;
+	struct oac_bulk_sink *sink;
+
+	mutex_lock(&dev->bulk_lock);
+
+	sink = oac_bulk_find_sink(dev, object);
+	if (sink)
+		sink->cb = NULL;
+
+	if (rx->buf && rx->object == object) {
+		if (rx->state == OAC_BULK_SENDING)
+			oac_bulk_refuse(dev, rx->xfer, OAC_BULK_E_CANCELLED);
+		rx->state = OAC_BULK_IDLE;
+		kvfree(rx->buf);
+		rx->buf = NULL;
+	}
+
+	mutex_unlock(&dev->bulk_lock);
+}
+EXPORT_SYMBOL_GPL(oac_bulk_unregister_sink);
+
+void oac_bulk_init(struct oac_dev *dev)
+{
+	mutex_init(&dev->bulk_lock);
+	INIT_DELAYED_WORK(&dev->bulk_work, oac_bulk_work);
+}
+
+/* The link is closed, fail the object being sent and drop the one being received */
+void oac_bulk_exit(struct oac_dev *dev)
+{
+	cancel_delayed_work_sync(&dev->bulk_work);
+
+	mutex_lock(&dev->bulk_lock);
+	if (dev->bulk_tx.state != OAC_BULK_IDLE)
+		oac_bulk_tx_end(dev, OAC_BULK_E_CANCELLED, false);
+	kvfree(dev->bulk_rx.buf);
+	dev->bulk_rx.buf = NULL;
+	dev->bulk_rx.state = OAC_BULK_IDLE;
+	mutex_unlock(&dev->bulk_lock);
+}
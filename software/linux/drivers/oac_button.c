@@ -11,12 +11,9 @@ struct oac_button {
 	struct oac_dev *core;
 };
 
-static void oac_button_on_message(struct oac_dev *core, const struct Message *msg)
+static void oac_button_on_message(struct oac_dev *core, const struct Message *msg, void *context)
 {
-	struct oac_button *btn = dev_get_drvdata(&core->serdev->dev);
-
-	if (!btn || !btn->input || msg->header.message_type != OAC_MESSAGE_TYPE_COMMAND)
-		return;
+	struct oac_button *btn = context;
 
 	switch (msg->body.payload_command.command) {
 	case OAC_COMMAND_BTN_SHORT:
@@ -66,8 +63,9 @@ static int oac_button_probe(struct platform_device *pdev)
 
 	dev_set_drvdata(&pdev->dev, btn);
 
-	/* Register with oac_dev core */ 
-	err = oac_dev_register_callback(core, oac_button_on_message);
+	/* Subscribe to the button commands */
+	err = oac_dev_subscribe(core, OAC_MESSAGE_TYPE_COMMAND, OAC_COMMAND_BTN_SHORT,
+				OAC_COMMAND_BTN_LONG, oac_button_on_message, btn);
 	if (err)
 		return dev_err_probe(&pdev->dev, err, "Failed to register callback\n");
 
@@ -80,7 +78,7 @@ static int oac_button_remove(struct platform_device *pdev)
 	struct oac_button *btn = dev_get_drvdata(&pdev->dev);
 
 	if (btn && btn->core)
-		oac_dev_unregister_callback(btn->core, oac_button_on_message);
+		oac_dev_unsubscribe(btn->core, oac_button_on_message, btn);
 
 	dev_info(&pdev->dev, "OAC button driver removed\n");
 	return 0;
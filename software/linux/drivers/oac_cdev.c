@@ -0,0 +1,338 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * /dev/oacN, see oac_cdev.h for the interface, one for each bound device
+ *
+ * Each open file subscribes to every message type and has its own ring in
+ * vmalloc_user() memory, which read() drains and mmap() maps. The callback
+ * fills it from rx_work, the only producer, so head needs no lock. The ring
+ * is shared with userspace, so the driver keeps its own copy of head and
+ * only ever indexes the ring modulo its size.
+ *
+ * struct oac_cdev outlives the serdev device for files still open. Once
+ * oac_cdev_exit() has cleared odev they get ENODEV and EPOLLHUP.
+ */
+#include <linux/fs.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/serdev.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include "oac_cdev.h"
+#include "oac_comms.h"
+#include "oac_dev.h"
+
+static DEFINE_IDA(oac_cdev_ida);
+
+struct oac_cdev {
+	struct miscdevice misc;
+	int id;				/* N of /dev/oacN */
+	char name[16];
+	struct kref ref;		/* the device and each open file */
+	struct mutex lock;		/* protects odev and clients */
+	struct oac_dev *odev;		/* NULL once the device is gone */
+	struct list_head clients;
+};
+
+struct oac_cdev_client {
+	struct list_head node;
+	struct oac_cdev *cdev;
+	struct oac_cdev_ring *ring;
+	u32 head;			/* the driver's copy of ring->head */
+	bool gone;
+	struct mutex read_lock;		/* serializes readers */
+	wait_queue_head_t wait;
+};
+
+static void oac_cdev_free(struct kref *ref)
+{
+	kfree(container_of(ref, struct oac_cdev, ref));
+}
+
+/* rx_work, under RCU */
+static void oac_cdev_message(struct oac_dev *odev, const struct Message *msg, void *context)
+{
+	struct oac_cdev_client *client = context;
+	struct oac_cdev_ring *ring = client->ring;
+	struct oac_cdev_msg *slot;
+	u32 head = client->head;
+
+	if (head - smp_load_acquire(&ring->tail) >= OAC_CDEV_RING_SIZE) {
+		WRITE_ONCE(ring->dropped, ring->dropped + 1);
+		return;
+	}
+
+	slot = &ring->msgs[head % OAC_CDEV_RING_SIZE];
+	slot->time_ns = ktime_get_ns();
+	slot->msg = *msg;
+
+	smp_store_release(&client->head, head + 1);
+	smp_store_release(&ring->head, head + 1);
+	wake_up_interruptible_poll(&client->wait, EPOLLIN | EPOLLRDNORM);
+}
+
+static bool oac_cdev_readable(struct oac_cdev_client *client)
+{
+	return smp_load_acquire(&client->head) != READ_ONCE(client->ring->tail) ||
+	       READ_ONCE(client->gone);
+}
+
+/* cdev->lock held */
+static int oac_cdev_subscribe(struct oac_cdev_client *client)
+{
+	struct oac_dev *odev = client->cdev->odev;
+	int type, ret;
+
+	for (type = 0; type < OAC_DEV_SUB_TYPES; type++) {
+		ret = oac_dev_subscribe(odev, type, 0, U16_MAX, oac_cdev_message, client);
+		if (ret) {
+			oac_dev_unsubscribe(odev, oac_cdev_message, client);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static int oac_cdev_open(struct inode *inode, struct file *file)
+{
+	struct oac_cdev *cdev = container_of(file->private_data, struct oac_cdev, misc);
+	struct oac_cdev_client *client;
+	int ret;
+
+	client = kzalloc(sizeof(*client), GFP_KERNEL);
+	if (!client)
+		return -ENOMEM;
+
+	client->ring = vmalloc_user(OAC_CDEV_MMAP_SIZE);
+	if (!client->ring) {
+		kfree(client);
+		return -ENOMEM;
+	}
+	client->ring->size = OAC_CDEV_RING_SIZE;
+	client->cdev = cdev;
+	mutex_init(&client->read_lock);
+	init_waitqueue_head(&client->wait);
+
+	mutex_lock(&cdev->lock);
+	ret = cdev->odev ? oac_cdev_subscribe(client) : -ENODEV;
+	if (!ret)
+		list_add(&client->node, &cdev->clients);
+	mutex_unlock(&cdev->lock);
+
+	if (ret) {
+		vfree(client->ring);
+		kfree(client);
+		return ret;
+	}
+
+	kref_get(&cdev->ref);
+	file->private_data = client;
+	return nonseekable_open(inode, file);
+}
+
+static int oac_cdev_release(struct inode *inode, struct file *file)
+{
+	struct oac_cdev_client *client = file->private_data;
+	struct oac_cdev *cdev = client->cdev;
+
+	mutex_lock(&cdev->lock);
+	if (!client->gone) {
+		oac_dev_unsubscribe(cdev->odev, oac_cdev_message, client);
+		list_del(&client->node);
+	}
+	mutex_unlock(&cdev->lock);
+
+	/* A mapping holds the file open, none is left by now */
+	vfree(client->ring);
+	kfree(client);
+	kref_put(&cdev->ref, oac_cdev_free);
+	return 0;
+}
+
+static ssize_t oac_cdev_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct oac_cdev_client *client = file->private_data;
+	struct oac_cdev_ring *ring = client->ring;
+	size_t done = 0;
+	u32 head, tail;
+	int ret;
+
+	if (count < sizeof(struct oac_cdev_msg))
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&client->read_lock))
+		return -ERESTARTSYS;
+
+	while (!oac_cdev_readable(client)) {
+		if (file->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto out;
+		}
+		ret = wait_event_interruptible(client->wait, oac_cdev_readable(client));
+		if (ret)
+			goto out;
+	}
+
+	head = smp_load_acquire(&client->head);
+	tail = READ_ONCE(ring->tail);
+	if (head - tail > OAC_CDEV_RING_SIZE)
+		tail = head - OAC_CDEV_RING_SIZE;	/* scribbled on through the mapping */
+
+	while (tail != head && done + sizeof(struct oac_cdev_msg) <= count) {
+		if (copy_to_user(buf + done, &ring->msgs[tail % OAC_CDEV_RING_SIZE],
+				 sizeof(struct oac_cdev_msg))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		done += sizeof(struct oac_cdev_msg);
+		tail++;
+	}
+	smp_store_release(&ring->tail, tail);
+
+	ret = done ? done : -ENODEV;
+out:
+	mutex_unlock(&client->read_lock);
+	return ret;
+}
+
+/* Types and commands the driver runs the link with, userspace must not send them */
+static bool oac_cdev_may_send(const struct Message *msg)
+{
+	switch (msg->header.message_type) {
+	case OAC_MESSAGE_TYPE_COMMAND:
+		return !OAC_COMMAND_IS_LINK(msg->body.payload_command.command);
+	case OAC_MESSAGE_TYPE_DATA:
+	case OAC_MESSAGE_TYPE_ACK:
+	case OAC_MESSAGE_TYPE_NAK:
+	case OAC_MESSAGE_TYPE_BATCH:
+	case OAC_MESSAGE_TYPE_REQUEST:
+		return false;
+	default:
+		return true;
+	}
+}
+
+static ssize_t oac_cdev_write(struct file *file, const char __user *buf, size_t count,
+			      loff_t *ppos)
+{
+	struct oac_cdev_client *client = file->private_data;
+	struct oac_cdev *cdev = client->cdev;
+	struct Message msg;
+	int ret;
+
+	if (count != sizeof(msg))
+		return -EINVAL;
+	if (copy_from_user(&msg, buf, sizeof(msg)))
+		return -EFAULT;
+	if (!oac_cdev_may_send(&msg))
+		return -EINVAL;
+
+	msg.header.recipient = OAC_COMMS_RECIPIENT_FIRMWARE;
+
+	mutex_lock(&cdev->lock);
+	ret = cdev->odev ? oac_dev_send_message(cdev->odev, &msg) : -ENODEV;
+	mutex_unlock(&cdev->lock);
+
+	return ret < 0 ? ret : count;
+}
+
+static __poll_t oac_cdev_poll(struct file *file, poll_table *wait)
+{
+	struct oac_cdev_client *client = file->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(file, &client->wait, wait);
+
+	if (smp_load_acquire(&client->head) != READ_ONCE(client->ring->tail))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (READ_ONCE(client->gone))
+		return mask | EPOLLHUP;
+	return mask | EPOLLOUT | EPOLLWRNORM;
+}
+
+static int oac_cdev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct oac_cdev_client *client = file->private_data;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_ALIGN(OAC_CDEV_MMAP_SIZE))
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, client->ring, 0);
+}
+
+static const struct file_operations oac_cdev_fops = {
+	.owner = THIS_MODULE,
+	.open = oac_cdev_open,
+	.release = oac_cdev_release,
+	.read = oac_cdev_read,
+	.write = oac_cdev_write,
+	.poll = oac_cdev_poll,
+	.mmap = oac_cdev_mmap,
+};
+
+int oac_cdev_init(struct oac_dev *odev)
+{
+	struct oac_cdev *cdev;
+	int ret;
+
+	cdev = kzalloc(sizeof(*cdev), GFP_KERNEL);
+	if (!cdev)
+		return -ENOMEM;
+
+	cdev->id = ida_alloc(&oac_cdev_ida, GFP_KERNEL);
+	if (cdev->id < 0) {
+		ret = cdev->id;
+		kfree(cdev);
+		return ret;
+	}
+	snprintf(cdev->name, sizeof(cdev->name), "oac%d", cdev->id);
+
+	kref_init(&cdev->ref);
+	mutex_init(&cdev->lock);
+	INIT_LIST_HEAD(&cdev->clients);
+	cdev->odev = odev;
+	cdev->misc.minor = MISC_DYNAMIC_MINOR;
+	cdev->misc.name = cdev->name;
+	cdev->misc.fops = &oac_cdev_fops;
+	cdev->misc.parent = &odev->serdev->dev;
+	cdev->misc.mode = 0660;
+
+	ret = misc_register(&cdev->misc);
+	if (ret) {
+		ida_free(&oac_cdev_ida, cdev->id);
+		kfree(cdev);
+		return ret;
+	}
+
+	odev->cdev = cdev;
+	return 0;
+}
+
+/* Cut open files off from the device, which is about to go */
+void oac_cdev_exit(struct oac_dev *odev)
+{
+	struct oac_cdev *cdev = odev->cdev;
+	struct oac_cdev_client *client, *tmp;
+
+	if (!cdev)
+		return;
+
+	misc_deregister(&cdev->misc);
+	ida_free(&oac_cdev_ida, cdev->id);
+
+	mutex_lock(&cdev->lock);
+	list_for_each_entry_safe(client, tmp, &cdev->clients, node) {
+		oac_dev_unsubscribe(odev, oac_cdev_message, client);
+		list_del(&client->node);
+		WRITE_ONCE(client->gone, true);
+		wake_up_interruptible_poll(&client->wait, EPOLLHUP);
+	}
+	cdev->odev = NULL;
+	mutex_unlock(&cdev->lock);
+
+	odev->cdev = NULL;
+	kref_put(&cdev->ref, oac_cdev_free);
+}
@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * /dev/oacN - messages to and from the MCU for userspace, alongside the
+ * subdrivers. N counts the bound devices from 0, /dev/oac0 for the first.
+ *
+ * Every open file gets every message the subdrivers could subscribe to,
+ * events as the COMMAND they carry, in a ring of its own:
+ *
+ *   read()   returns as many whole struct oac_cdev_msg as fit, blocking
+ *            until there is one unless the file is O_NONBLOCK
+ *   poll()   EPOLLIN while the ring holds messages, EPOLLHUP once the
+ *            device is gone
+ *   write()  takes one struct Message and sends it as the subdrivers do,
+ *            the driver numbers, batches and frames it. Types and commands
+ *            the driver runs the link with are refused with EINVAL
+ *   mmap()   maps the ring, OAC_CDEV_MMAP_SIZE bytes at offset 0, to drain
+ *            it without a system call per message: take msgs[tail % size]
+ *            while tail != head, then store tail. Load head with acquire
+ *            and store tail with release ordering, both run freely and
+ *            wrap at 2^32. Use either read() or the mapping, not both.
+ *
+ * Messages arriving while the ring is full are counted in dropped.
+ */
+#ifndef _OAC_CDEV_H
+#define _OAC_CDEV_H
+
+#include <linux/types.h>
+#ifdef __KERNEL__
+#include "oac_protocol.h"
+#else
+#include "protocol.h"
+#endif
+
+#define OAC_CDEV_RING_SIZE	64	/* Messages, a power of two */
+
+struct oac_cdev_msg {
+	__u64 time_ns;		/* CLOCK_MONOTONIC it was queued at */
+	struct Message msg;
+};
+
+struct oac_cdev_ring {
+	/* Written by the driver */
+	__u32 head;		/* next slot filled */
+	__u32 size;		/* OAC_CDEV_RING_SIZE */
+	__u32 dropped;
+	__u32 reserved[13];
+
+	/* Written by the reader, on a cache line of its own */
+	__u32 tail;		/* next slot taken */
+	__u32 reserved2[15];
+
+	struct oac_cdev_msg msgs[OAC_CDEV_RING_SIZE];
+};
+
+/* Length to mmap() */
+#define OAC_CDEV_MMAP_SIZE	sizeof(struct oac_cdev_ring)
+
+#endif /* _OAC_CDEV_H */
@@ -0,0 +1,278 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * MCU clock synchronisation
+ *
+ * The MCU timestamps with its own clock, microseconds since it started, which
+ * has no relation to CLOCK_MONOTONIC and runs off by up to a fraction of a
+ * percent. It is pinged every OAC_CLOCK_SYNC_MS and answers with its clock
+ * straight away. Each answer is taken to be the MCU clock at the midpoint of
+ * the round trip, once the time both frames spent on the line is taken out,
+ * and a line is fitted through the answers by least squares, giving the offset
+ * and drift between the clocks. Only pings that came back within twice the
+ * quickest delay are used, the others waited in a queue on the way.
+ *
+ * The estimate is in the clock attribute of the serdev device, as
+ * "fw_us=F mono_ns=M drift_ppb=D error_ns=E samples=N", so userspace converts
+ * an MCU timestamp t with M + (t - F) * (1000 + D / 1e6).
+ */
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/serdev.h>
+#include <linux/sysfs.h>
+#include "oac_comms.h"
+#include "oac_dev.h"
+
+#define OAC_CLOCK_MAX_DRIFT_PPB	20000000	/* 2%, far beyond any ceramic resonator */
+
+/* Time a message takes on the line at the current rate, 10 bits a byte */
+static s64 oac_clock_line_ns(struct oac_dev *odev, const struct Message *msg)
+{
+	u8 frame[OAC_MAX_FRAME_SIZE];
+	int len;
+
+	len = oac_serialize_message(msg, READ_ONCE(odev->proto_version), frame, sizeof(frame));
+	if (len < 0)
+		return 0;
+	return div_u64((u64)len * 10 * NSEC_PER_SEC, oac_dev_baud(odev));
+}
+
+static struct oac_clock_sample *oac_clock_newest(struct oac_dev *odev)
+{
+	return &odev->clock_samples[(odev->clock_next + OAC_CLOCK_SAMPLES - 1) % OAC_CLOCK_SAMPLES];
+}
+
+/*
+ * oac_clock_fit - Fit the MCU clock against CLOCK_MONOTONIC, clock_lock held
+ *
+ * Uses the samples taken within OAC_CLOCK_WINDOW_S of the newest, with at most
+ * twice the smallest delay among them. x is in us and y in ns beyond x * 1000,
+ * both relative to the newest sample, which keeps the sums well inside 64 bits.
+ */
+static void oac_clock_fit(struct oac_dev *odev)
+{
+	const struct oac_clock_sample *last = oac_clock_newest(odev);
+	s64 xs[OAC_CLOCK_SAMPLES], ys[OAC_CLOCK_SAMPLES];
+	s64 min_delay = S64_MAX, sum_x = 0, sum_y = 0, sxx = 0, sxy = 0;
+	s64 mean_x, mean_y, drift = 0;
+	unsigned int i, n = 0;
+
+	for (i = 0; i < odev->clock_count; i++) {
+		const struct oac_clock_sample *sample = &odev->clock_samples[i];
+
+		if (last->fw_us - sample->fw_us <= OAC_CLOCK_WINDOW_S * USEC_PER_SEC)
+			min_delay = min(min_delay, sample->delay_ns);
+	}
+
+	for (i = 0; i < odev->clock_count; i++) {
+		const struct oac_clock_sample *sample = &odev->clock_samples[i];
+
+		if (last->fw_us - sample->fw_us > OAC_CLOCK_WINDOW_S * USEC_PER_SEC ||
+		    sample->delay_ns > 2 * min_delay)
+			continue;
+
+		xs[n] = -(s64)(last->fw_us - sample->fw_us);
+		ys[n] = sample->mono_ns - last->mono_ns - xs[n] * NSEC_PER_USEC;
+		sum_x += xs[n];
+		sum_y += ys[n];
+		n++;
+	}
+
+	mean_x = div_s64(sum_x, n);
+	mean_y = div_s64(sum_y, n);
+	for (i = 0; i < n; i++) {
+		sxx += (xs[i] - mean_x) * (xs[i] - mean_x);
+		sxy += (xs[i] - mean_x) * (ys[i] - mean_y);
+	}
+
+	/* The line goes through the mean, a second of samples at least gives it a slope */
+	if (sxx >= 1000000)
+		drift = clamp_t(s64, div64_s64(sxy, div_s64(sxx, 1000000)),
+				-OAC_CLOCK_MAX_DRIFT_PPB, OAC_CLOCK_MAX_DRIFT_PPB);
+
+	odev->clock_fit.fw_us = last->fw_us + mean_x;
+	odev->clock_fit.mono_ns = last->mono_ns + mean_x * NSEC_PER_USEC + mean_y;
+	odev->clock_fit.drift_ppb = drift;
+	odev->clock_fit.error_ns = min_t(s64, min_delay / 2, U32_MAX);
+	odev->clock_fit.samples = n;
+}
+
+/* Add the MCU's answer to a ping to the estimate, called for every RESPONSE to a link command */
+void oac_clock_handle(struct oac_dev *odev, const struct Message *msg)
+{
+	const struct ResponseBody *pong = &msg->body.payload_response;
+	u64 now = ktime_get_ns();
+	s64 line_ns = oac_clock_line_ns(odev, msg);
+	struct oac_clock_sample *sample;
+	unsigned long flags;
+	s64 delay_ns;
+
+	if ((pong->param & ~OAC_COMMAND_TIME_ID_MASK) != OAC_COMMAND_TIME_PING)
+		return;
+
+	spin_lock_irqsave(&odev->clock_lock, flags);
+
+	if (!odev->clock_ping_pending ||
+	    (pong->param & OAC_COMMAND_TIME_ID_MASK) != odev->clock_ping_id)
+		goto out;	/* Answer to an earlier ping, given up on */
+	odev->clock_ping_pending = false;
+	odev->clock_missed = 0;
+
+	/* The MCU restarted, and its clock with it */
+	if (odev->clock_count && pong->val < oac_clock_newest(odev)->fw_us)
+		odev->clock_count = 0;
+
+	delay_ns = max_t(s64, now - odev->clock_ping_ns - odev->clock_ping_line_ns - line_ns, 0);
+
+	sample = &odev->clock_samples[odev->clock_next];
+	sample->fw_us = pong->val;
+	sample->mono_ns = odev->clock_ping_ns + odev->clock_ping_line_ns + delay_ns / 2;
+	sample->delay_ns = delay_ns;
+	odev->clock_next = (odev->clock_next + 1) % OAC_CLOCK_SAMPLES;
+	if (odev->clock_count < OAC_CLOCK_SAMPLES)
+		odev->clock_count++;
+
+	oac_clock_fit(odev);
+out:
+	spin_unlock_irqrestore(&odev->clock_lock, flags);
+}
+
+/*
+ * oac_clock_work - Ping the MCU
+ *
+ * Every OAC_CLOCK_FAST_MS until OAC_CLOCK_MIN_SAMPLES pings were answered, then
+ * every OAC_CLOCK_SYNC_MS. A ping not answered by the time the next is due is
+ * given up on, and after OAC_CLOCK_FAST_TRIES of those in a row, firmware that
+ * never answers, the slower interval is used until one is. None are sent while the link speed is being negotiated.
+ */
+static void oac_clock_work(struct work_struct *work)
+{
+	struct oac_dev *odev = container_of(to_delayed_work(work), struct oac_dev, clock_work);
+	struct Message ping = {
+		.header = {
+			.recipient = OAC_COMMS_RECIPIENT_FIRMWARE,
+			.message_type = OAC_MESSAGE_TYPE_COMMAND,
+		},
+	};
+	unsigned int interval;
+	unsigned long flags;
+	s64 line_ns;
+	u8 id;
+
+	spin_lock_irqsave(&odev->clock_lock, flags);
+	if (odev->clock_ping_pending && odev->clock_missed < U8_MAX)
+		odev->clock_missed++;
+	interval = odev->clock_count < OAC_CLOCK_MIN_SAMPLES &&
+		   odev->clock_missed < OAC_CLOCK_FAST_TRIES ? OAC_CLOCK_FAST_MS : OAC_CLOCK_SYNC_MS;
+	id = (odev->clock_ping_id + 1) & OAC_COMMAND_TIME_ID_MASK;
+	odev->clock_ping_pending = false;
+	spin_unlock_irqrestore(&odev->clock_lock, flags);
+
+	if (READ_ONCE(odev->baud_state) == OAC_BAUD_IDLE && !READ_ONCE(odev->fw_active)) {
+		ping.body.payload_command.command = OAC_COMMAND_TIME_PING | id;
+		line_ns = oac_clock_line_ns(odev, &ping);
+
+		/* Set before sending, the answer may be handled before oac_dev_send_message() returns */
+		spin_lock_irqsave(&odev->clock_lock, flags);
+		odev->clock_ping_id = id;
+		odev->clock_ping_line_ns = line_ns;
+		odev->clock_ping_ns = ktime_get_ns();
+		odev->clock_ping_pending = true;
+		spin_unlock_irqrestore(&odev->clock_lock, flags);
+
+		if (oac_dev_send_message(odev, &ping) < 0) {
+			spin_lock_irqsave(&odev->clock_lock, flags);
+			odev->clock_ping_pending = false;
+			spin_unlock_irqrestore(&odev->clock_lock, flags);
+		}
+	}
+
+	schedule_delayed_work(&odev->clock_work, msecs_to_jiffies(interval));
+}
+
+/**
+ * oac_clock_get - Current estimate of the MCU clock
+ * @dev: Pointer to oac_dev structure
+ * @fit: Set to the estimate
+ *
+ * Returns 0, or -EAGAIN until OAC_CLOCK_MIN_SAMPLES pings were answered.
+ */
+int oac_clock_get(struct oac_dev *dev, struct oac_clock_fit *fit)
+{
+	unsigned long flags;
+	int ret = -EAGAIN;
+
+	spin_lock_irqsave(&dev->clock_lock, flags);
+	if (dev->clock_count >= OAC_CLOCK_MIN_SAMPLES) {
+		*fit = dev->clock_fit;
+		ret = 0;
+	}
+	spin_unlock_irqrestore(&dev->clock_lock, flags);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(oac_clock_get);
+
+/**
+ * oac_clock_to_ktime - Convert an MCU timestamp to CLOCK_MONOTONIC
+ * @dev: Pointer to oac_dev structure
+ * @fw_us: MCU clock, microseconds since it started (comms_clock_us() in the firmware)
+ * @mono: Set to the same moment on CLOCK_MONOTONIC
+ *
+ * Does not sleep. Returns the error bound in nanoseconds, or -EAGAIN until
+ * OAC_CLOCK_MIN_SAMPLES pings were answered.
+ */
+int oac_clock_to_ktime(struct oac_dev *dev, u64 fw_us, ktime_t *mono)
+{
+	struct oac_clock_fit fit;
+	s64 d, whole;
+	s32 part;
+	int ret;
+
+	ret = oac_clock_get(dev, &fit);
+	if (ret)
+		return ret;
+
+	/* Split so d * drift cannot overflow, however far fw_us is from the estimate */
+	d = fw_us - fit.fw_us;
+	whole = div_s64_rem(d, 1000000, &part);
+	*mono = ns_to_ktime(fit.mono_ns + d * NSEC_PER_USEC + whole * fit.drift_ppb +
+			    div_s64((s64)part * fit.drift_ppb, 1000000));
+
+	return min_t(u32, fit.error_ns, INT_MAX);
+}
+EXPORT_SYMBOL_GPL(oac_clock_to_ktime);
+
+static ssize_t clock_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct oac_dev *odev = dev_get_drvdata(dev);
+	struct oac_clock_fit fit;
+
+	if (oac_clock_get(odev, &fit))
+		return sysfs_emit(buf, "unsynchronised\n");
+
+	return sysfs_emit(buf, "fw_us=%llu mono_ns=%lld drift_ppb=%d error_ns=%u samples=%u\n",
+			  fit.fw_us, fit.mono_ns, fit.drift_ppb, fit.error_ns, fit.samples);
+}
+static DEVICE_ATTR_RO(clock);
+
+static struct attribute *oac_clock_attrs[] = {
+	&dev_attr_clock.attr,
+	NULL,
+};
+
+const struct attribute_group oac_clock_group = {
+	.attrs = oac_clock_attrs,
+};
+
+void oac_clock_init(struct oac_dev *odev)
+{
+	spin_lock_init(&odev->clock_lock);
+	INIT_DELAYED_WORK(&odev->clock_work, oac_clock_work);
+	schedule_delayed_work(&odev->clock_work, msecs_to_jiffies(OAC_CLOCK_FAST_MS));
+}
+
+void oac_clock_exit(struct oac_dev *odev)
+{
+	cancel_delayed_work_sync(&odev->clock_work);
+}
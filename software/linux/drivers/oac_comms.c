@@ -47,9 +47,44 @@
  *
  * This framing format is used in both directions (Linux <-> MCU).
  *
+ * Protocol v2 (COBS framing):
+ *
+ *   +--------------------------------------------------+-----------+
+ *   | COBS( RECIPIENT TYPE LEN SEQ PAYLOAD CRC )       | 0x00      |
+ *   +--------------------------------------------------+-----------+
+ *
+ *   The frame is Consistent Overhead Byte Stuffed so that 0x00 never appears
+ *   inside it and can delimit it. A lost or corrupted byte therefore costs
+ *   only the frame it belongs to, where v1 may misread LEN and swallow the
+ *   following frames as well. A v2 frame is 7 + LEN bytes.
+ *
+ *   SEQ        : Sender's sequence number, incremented for every frame
+ *   CRC        : CRC-8 (polynomial 0x07, init 0) of RECIPIENT..PAYLOAD, which
+ *                catches the bursts and swapped bytes an XOR misses
+ *
+ *   Command frames are acknowledged with an ACK frame carrying their SEQ and
+ *   resent until they are, see oac_dev.c. A receiver that sees SEQ jump asks
+ *   for the missing frames with a NAK frame.
+ *
+ *   Messages sent in quick succession may share a BATCH frame, whose payload
+ *   is TYPE LEN PAYLOAD for each of them. Its SEQ is that of the first
+ *   message, the others follow on consecutively, so they are acknowledged as
+ *   if they had been sent in frames of their own.
+ *
+ *   v2 is negotiated by Linux with OAC_COMMAND_PROTO_REQ_V2, answered by
+ *   OAC_COMMAND_PROTO_ACK_V2, both sent with v1 framing. A v2 receiver still
+ *   accepts v1 frames: a COBS frame never starts with START, as its first
+ *   byte is at most LEN + 6.
+ *
+ * Payload encoding:
+ *
+ *   Payload fields are written one at a time, little-endian, so neither the
+ *   host's byte order nor its struct padding reaches the wire. v1 keeps the
+ *   unpadded AVR struct layout older firmware memcpy()s, v2 packs it further.
+ *   The layouts are described in protocol/protocol.def, the encoder and
+ *   decoder of each are generated into oac_protocol_codec.h.
+ *
  * Notes:
- *   - All multi-byte payload fields (e.g. 16-bit values) are transmitted
- *     in little-endian order (LSB first).
  *   - Deserialization functions must validate START, END, and CHECKSUM
  *     before processing the payload.
  *   - Any frame with invalid structure must be discarded without action.
@@ -60,6 +95,7 @@
 #include <linux/string.h>
 #include <linux/types.h>
 #include "oac_comms.h"
+#include "oac_protocol_codec.h"	/* oac_encode_payload(), oac_decode_payload() */
 
 static u8 oac_calculate_checksum(const u8 *data, u8 len)
 {
@@ -73,51 +109,121 @@ static u8 oac_calculate_checksum(const u8 *data, u8 len)
 /* 
  * oac_validate_checksum
  *
- * Validates by performing XOR checksum on the message, excluding start and end chars,
- * but including the checksum field, such that an XOR on the aforementioned chars will yield 0
+ * Validates by performing XOR checksum on the header and payload, including the
+ * checksum field, such that an XOR on the aforementioned chars will yield 0
  * when the message is intact. 
- * @param data: the raw data of the entire message, including the start and end chars.
- * @param len:  the length of the message
+ * @param data: the header and payload of the message, without any framing bytes.
+ * @param len:  the length of the header and payload
  * @returns false if the message is corrupt.
  *          true if the message is valid.		
  */
 static bool oac_validate_checksum(const u8 *data, size_t len)
 {
     uint8_t result = 0;
-    for (size_t i = 1; i < len - 1; i++)
+    for (size_t i = 0; i < len; i++)
         result ^= data[i];
 
     return result == 0;
 }
 
-int oac_serialize_message(const struct Message *msg, u8 *out_buf, size_t out_len)
+/* CRC-8, polynomial 0x07 (x^8 + x^2 + x + 1) */
+static const u8 oac_crc8_table[256] = {
+	0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15,
+	0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D,
+	0x70, 0x77, 0x7E, 0x79, 0x6C, 0x6B, 0x62, 0x65,
+	0x48, 0x4F, 0x46, 0x41, 0x54, 0x53, 0x5A, 0x5D,
+	0xE0, 0xE7, 0xEE, 0xE9, 0xFC, 0xFB, 0xF2, 0xF5,
+	0xD8, 0xDF, 0xD6, 0xD1, 0xC4, 0xC3, 0xCA, 0xCD,
+	0x90, 0x97, 0x9E, 0x99, 0x8C, 0x8B, 0x82, 0x85,
+	0xA8, 0xAF, 0xA6, 0xA1, 0xB4, 0xB3, 0xBA, 0xBD,
+	0xC7, 0xC0, 0xC9, 0xCE, 0xDB, 0xDC, 0xD5, 0xD2,
+	0xFF, 0xF8, 0xF1, 0xF6, 0xE3, 0xE4, 0xED, 0xEA,
+	0xB7, 0xB0, 0xB9, 0xBE, 0xAB, 0xAC, 0xA5, 0xA2,
+	0x8F, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9D, 0x9A,
+	0x27, 0x20, 0x29, 0x2E, 0x3B, 0x3C, 0x35, 0x32,
+	0x1F, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0D, 0x0A,
+	0x57, 0x50, 0x59, 0x5E, 0x4B, 0x4C, 0x45, 0x42,
+	0x6F, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7D, 0x7A,
+	0x89, 0x8E, 0x87, 0x80, 0x95, 0x92, 0x9B, 0x9C,
+	0xB1, 0xB6, 0xBF, 0xB8, 0xAD, 0xAA, 0xA3, 0xA4,
+	0xF9, 0xFE, 0xF7, 0xF0, 0xE5, 0xE2, 0xEB, 0xEC,
+	0xC1, 0xC6, 0xCF, 0xC8, 0xDD, 0xDA, 0xD3, 0xD4,
+	0x69, 0x6E, 0x67, 0x60, 0x75, 0x72, 0x7B, 0x7C,
+	0x51, 0x56, 0x5F, 0x58, 0x4D, 0x4A, 0x43, 0x44,
+	0x19, 0x1E, 0x17, 0x10, 0x05, 0x02, 0x0B, 0x0C,
+	0x21, 0x26, 0x2F, 0x28, 0x3D, 0x3A, 0x33, 0x34,
+	0x4E, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5C, 0x5B,
+	0x76, 0x71, 0x78, 0x7F, 0x6A, 0x6D, 0x64, 0x63,
+	0x3E, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2C, 0x2B,
+	0x06, 0x01, 0x08, 0x0F, 0x1A, 0x1D, 0x14, 0x13,
+	0xAE, 0xA9, 0xA0, 0xA7, 0xB2, 0xB5, 0xBC, 0xBB,
+	0x96, 0x91, 0x98, 0x9F, 0x8A, 0x8D, 0x84, 0x83,
+	0xDE, 0xD9, 0xD0, 0xD7, 0xC2, 0xC5, 0xCC, 0xCB,
+	0xE6, 0xE1, 0xE8, 0xEF, 0xFA, 0xFD, 0xF4, 0xF3,
+};
+
+/*
+ * oac_crc8 - Table driven CRC-8 used by protocol v2
+ *
+ * Run over data followed by its CRC, the result is 0.
+ */
+u8 oac_crc8(const u8 *data, size_t len)
+{
+	u8 crc = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		crc = oac_crc8_table[crc ^ data[i]];
+	return crc;
+}
+
+/*
+ * oac_frame_v2 - COBS frame an encoded payload
+ *
+ * Returns the frame length, 7 + @payload_len bytes.
+ */
+static int oac_frame_v2(u8 recipient, u8 type, u8 seq, const u8 *payload,
+			size_t payload_len, u8 *out_buf, size_t out_len)
 {
-	size_t payload_size = 0;
-	const u8 *payload_ptr = NULL;
+	u8 frame[OAC_MAX_FRAME_SIZE];
+	size_t enc_len;
+
+	if (payload_len > OAC_MAX_PAYLOAD_SIZE || out_len < 7 + payload_len)
+		return -EMSGSIZE;
+
+	frame[0] = recipient;
+	frame[1] = type;
+	frame[2] = payload_len;
+	frame[3] = seq;
+	memcpy(&frame[4], payload, payload_len);
+	frame[4 + payload_len] = oac_crc8(frame, 4 + payload_len);
+
+	enc_len = oac_cobs_encode(frame, 5 + payload_len, out_buf);
+	out_buf[enc_len] = OAC_MESSAGE_DELIMITER;
+	return enc_len + 1;
+}
+
+/*
+ * oac_serialize_message - Frame @msg for the wire
+ * @version: OAC_PROTOCOL_V1 for START/END framing, OAC_PROTOCOL_V2 for COBS
+ *
+ * Returns the frame length, 6 + LEN bytes in v1 and 7 + LEN bytes in v2.
+ */
+int oac_serialize_message(const struct Message *msg, u8 version, u8 *out_buf, size_t out_len)
+{
+	u8 payload[OAC_MAX_PAYLOAD_SIZE];
+	int payload_size;
 
 	if (!msg || !out_buf)
 		return -EINVAL;
 
-	switch (msg->header.message_type) {
-	case OAC_MESSAGE_TYPE_COMMAND:
-		payload_ptr = (const u8 *)&msg->body.payload_command;
-		payload_size = sizeof(struct CommandBody);
-		break;
-	case OAC_MESSAGE_TYPE_RESPONSE:
-		payload_ptr = (const u8 *)&msg->body.payload_response;
-		payload_size = sizeof(struct ResponseBody);
-		break;
-	case OAC_MESSAGE_TYPE_STATUS:
-		payload_ptr = (const u8 *)&msg->body.payload_status;
-		payload_size = sizeof(struct StatusBody);
-		break;
-	case OAC_MESSAGE_TYPE_ERROR:
-		payload_ptr = (const u8 *)&msg->body.payload_error;
-		payload_size = sizeof(struct ErrorBody);
-		break;
-	default:
-		return -EINVAL;
-	}
+	payload_size = oac_encode_payload(msg, version, payload);
+	if (payload_size < 0)
+		return payload_size;
+
+	if (version == OAC_PROTOCOL_V2)
+		return oac_frame_v2(msg->header.recipient, msg->header.message_type,
+				    msg->header.seq, payload, payload_size, out_buf, out_len);
 
 	/* Validate buffer size: start(1) + header(4) + payload + end(1) */
 	if (out_len < 6 + payload_size)
@@ -129,7 +235,7 @@ int oac_serialize_message(const struct Message *msg, u8 *out_buf, size_t out_len
 	out_buf[3] = payload_size;
 	out_buf[4] = 0; /* Set to 0 for initial checksum calculation */
 
-	memcpy(&out_buf[5], payload_ptr, payload_size);
+	memcpy(&out_buf[5], payload, payload_size);
 
 	/* Compute checksum for message */
 	out_buf[4] = oac_calculate_checksum(&out_buf[1], 4 + payload_size);
@@ -139,6 +245,78 @@ int oac_serialize_message(const struct Message *msg, u8 *out_buf, size_t out_len
 	return 6 + payload_size;
 }
 
+/*
+ * oac_batch_add - Append @msg to a batch payload
+ * @batch: the batch payload
+ * @len:   its current length
+ * @size:  size of @batch
+ *
+ * Returns the new length of the batch, or -EMSGSIZE if @msg does not fit.
+ */
+int oac_batch_add(u8 *batch, size_t len, size_t size, const struct Message *msg)
+{
+	u8 payload[OAC_MAX_PAYLOAD_SIZE];
+	int payload_size;
+
+	payload_size = oac_encode_payload(msg, OAC_PROTOCOL_V2, payload);
+	if (payload_size < 0)
+		return payload_size;
+
+	if (len + 2 + payload_size > size)
+		return -EMSGSIZE;
+
+	batch[len] = msg->header.message_type;
+	batch[len + 1] = payload_size;
+	memcpy(&batch[len + 2], payload, payload_size);
+
+	return len + 2 + payload_size;
+}
+
+/*
+ * oac_serialize_batch - Frame the @count messages of a batch payload
+ * @seq: sequence number of the first message
+ *
+ * A lone message is framed on its own, without the batch overhead.
+ * Returns the frame length.
+ */
+int oac_serialize_batch(const u8 *batch, size_t len, u8 count, u8 recipient, u8 seq,
+			u8 *out_buf, size_t out_len)
+{
+	if (count == 1)
+		return oac_frame_v2(recipient, batch[0], seq, &batch[2], batch[1],
+				    out_buf, out_len);
+
+	return oac_frame_v2(recipient, OAC_MESSAGE_TYPE_BATCH, seq, batch, len,
+			    out_buf, out_len);
+}
+
+/*
+ * oac_batch_next - Unpack the message at @pos of a received batch
+ * @batch: a decoded OAC_MESSAGE_TYPE_BATCH message
+ * @pos:   offset into its payload, start at 0
+ *
+ * The caller assigns the sequence number, that of @batch plus the index.
+ * Returns 1 if @msg was filled, 0 at the end of the batch, or a negative
+ * error if the message at @pos is malformed, in which case it is skipped.
+ */
+int oac_batch_next(const struct Message *batch, size_t *pos, struct Message *msg)
+{
+	const u8 *sub = &batch->body.payload_raw[*pos];
+
+	if (*pos >= batch->header.payload_length)
+		return 0;
+
+	*pos += 2 + sub[1];
+
+	msg->header.recipient = batch->header.recipient;
+	msg->header.message_type = sub[0];
+	msg->header.payload_length = sub[1];
+	msg->header.checksum = 0;
+	msg->header.seq = batch->header.seq;
+
+	return oac_decode_payload(&sub[2], sub[1], OAC_PROTOCOL_V2, msg) ?: 1;
+}
+
 int oac_deserialize_message(const u8 *buf, size_t len, struct Message *msg)
 {
 
@@ -148,39 +326,310 @@ int oac_deserialize_message(const u8 *buf, size_t len, struct Message *msg)
 	if (buf[0] != OAC_MESSAGE_START || buf[len - 1] != OAC_MESSAGE_END)
 		return -EINVAL;
 
-	msg->header.recipient = buf[1];
-	msg->header.message_type = buf[2];
-	msg->header.payload_length = buf[3];
-	msg->header.checksum = buf[4];
+	return oac_decode_frame(&buf[1], len - 2, OAC_PROTOCOL_V1, msg);
+}
+
+/*
+ * oac_decode_frame - Decode the header and payload of a message, common to all framings
+ * @frame:   v1: RECIPIENT TYPE LEN CHECKSUM PAYLOAD
+ *           v2: RECIPIENT TYPE LEN SEQ PAYLOAD CRC
+ * @len:     length of the header, payload and CRC
+ * @version: protocol version the frame was received with
+ * @msg:     message to fill
+ *
+ * Returns 0, -EILSEQ if the checksum (v1) or CRC (v2) does not match, or
+ * another negative error if the frame is malformed.
+ */
+int oac_decode_frame(const u8 *frame, size_t len, u8 version, struct Message *msg)
+{
+	size_t overhead = (version == OAC_PROTOCOL_V2) ? 5 : 4;
+
+	if (!frame || !msg || len < overhead)
+		return -EINVAL;
+
+	msg->header.recipient = frame[0];
+	msg->header.message_type = frame[1];
+	msg->header.payload_length = frame[2];
 
 	/* Check length matches expectation */
-	if (len != 6 + msg->header.payload_length)
+	if (len != overhead + msg->header.payload_length)
 		return -EMSGSIZE;
 
-	/* Validate checksum */
-	if(!oac_validate_checksum(buf,6 + msg->header.payload_length)){
-		pr_err("invalid checksum");
+	if (version == OAC_PROTOCOL_V2) {
+		msg->header.seq = frame[3];
+		msg->header.checksum = frame[len - 1];
+		if (oac_crc8(frame, len) != 0)
+			return -EILSEQ;
+	} else {
+		msg->header.seq = 0;
+		msg->header.checksum = frame[3];
+		/* Validate checksum */
+		if (!oac_validate_checksum(frame, len))
+			return -EILSEQ;
+	}
+
+	return oac_decode_payload(&frame[4], msg->header.payload_length, version, msg);
+}
+
+/*
+ * oac_cobs_encode - Consistent Overhead Byte Stuffing
+ * @in:  data to encode, may contain 0x00
+ * @len: length of the data
+ * @out: output buffer, len + 1 bytes for frames shorter than 254 bytes.
+ *       May alias in - 1, as every output byte is written at or behind the input.
+ *
+ * Returns the length of the encoded data, which contains no 0x00 bytes.
+ */
+size_t oac_cobs_encode(const u8 *in, size_t len, u8 *out)
+{
+	size_t code_idx = 0;
+	size_t out_idx = 1;
+	u8 code = 1;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (in[i] == 0) {
+			out[code_idx] = code;
+			code_idx = out_idx++;
+			code = 1;
+			continue;
+		}
+
+		out[out_idx++] = in[i];
+		if (++code == 0xFF) {
+			out[code_idx] = code;
+			code_idx = out_idx++;
+			code = 1;
+		}
+	}
+	out[code_idx] = code;
+
+	return out_idx;
+}
+
+/*
+ * oac_cobs_decode - Reverse oac_cobs_encode
+ * @in:  encoded data, without the delimiter
+ * @len: length of the encoded data
+ * @out: output buffer, may alias in since the output never overtakes the input
+ *
+ * Returns the length of the decoded data, or -EBADMSG if the encoding is invalid.
+ */
+int oac_cobs_decode(const u8 *in, size_t len, u8 *out)
+{
+	size_t in_idx = 0;
+	size_t out_idx = 0;
+	u8 code, i;
+
+	while (in_idx < len) {
+		code = in[in_idx++];
+
+		if (code == 0 || in_idx + code - 1 > len)
+			return -EBADMSG;
+
+		for (i = 1; i < code; i++)
+			out[out_idx++] = in[in_idx++];
+
+		if (code != 0xFF && in_idx < len)
+			out[out_idx++] = 0;
+	}
+
+	return out_idx;
+}
+
+/* Returned for log text, which oac_rx_next() skips */
+#define OAC_RX_TEXT	2
+
+/*
+ * Log text the MCU writes between v2 frames, each piece ended with a delimiter
+ * so the next frame is still found. The second byte of a frame is its
+ * recipient, 0x01 or 0x02, so a frame is never mistaken for text.
+ */
+static bool oac_rx_is_text(const u8 *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if ((buf[i] < 0x20 || buf[i] > 0x7E) && buf[i] != '\t' && buf[i] != '\r' &&
+		    buf[i] != '\n')
+			return false;
+	}
+	return true;
+}
+
+/* A whole v1 frame of @len bytes, START to END */
+static int oac_rx_v1_frame(const u8 *buf, size_t len, struct oac_rx_frame *frame)
+{
+	if (buf[len - 1] != OAC_MESSAGE_END)
 		return -EBADMSG;
+
+	frame->data = &buf[1];
+	frame->len = len - 2;
+	frame->framing = OAC_PROTOCOL_V1;
+	return 1;
+}
+
+/* Add to the frame in rx->buf from @data, until it is complete or @data runs out */
+static int oac_rx_continue(struct oac_rx *rx, const u8 *data, size_t count, size_t *pos,
+			   struct oac_rx_frame *frame)
+{
+	const u8 *end;
+	size_t want, take;
+	int len;
+
+	if (rx->framing == OAC_PROTOCOL_V2) {
+		end = memchr(&data[*pos], OAC_MESSAGE_DELIMITER, count - *pos);
+		take = (end ? end - data : count) - *pos;
+		if (rx->pos + take > sizeof(rx->buf)) {
+			rx->pos = 0;
+			*pos = end ? end - data + 1 : count;
+			return -EMSGSIZE;
+		}
+
+		memcpy(&rx->buf[rx->pos], &data[*pos], take);
+		rx->pos += take;
+		*pos += take;
+		if (!end)
+			return 0;
+
+		(*pos)++;
+		if (oac_rx_is_text(rx->buf, rx->pos)) {
+			rx->pos = 0;
+			return OAC_RX_TEXT;
+		}
+
+		/* Decoding never grows the data, so it is done in place */
+		len = oac_cobs_decode(rx->buf, rx->pos, rx->buf);
+		rx->pos = 0;
+		if (len < 0)
+			return len;
+
+		frame->data = rx->buf;
+		frame->len = len;
+		frame->framing = OAC_PROTOCOL_V2;
+		return 1;
 	}
 
-	switch (msg->header.message_type) {
-	case OAC_MESSAGE_TYPE_COMMAND:
-		memcpy(&msg->body.payload_command, &buf[5], sizeof(struct CommandBody));
-		break;
-	case OAC_MESSAGE_TYPE_RESPONSE:
-		memcpy(&msg->body.payload_response, &buf[5], sizeof(struct ResponseBody));
-		break;
-	case OAC_MESSAGE_TYPE_STATUS:
-		memcpy(&msg->body.payload_status, &buf[5], sizeof(struct StatusBody));
-		break;
-	case OAC_MESSAGE_TYPE_ERROR:
-		memcpy(&msg->body.payload_error, &buf[5], sizeof(struct ErrorBody));
-		break;
-	default:
-		return -EINVAL;
+	/* START RECIPIENT TYPE LEN, then the rest of the frame LEN makes up */
+	for (;;) {
+		want = rx->expected_len ?: 4;
+		take = min_t(size_t, want - rx->pos, count - *pos);
+		memcpy(&rx->buf[rx->pos], &data[*pos], take);
+		rx->pos += take;
+		*pos += take;
+		if (rx->pos < want)
+			return 0;
+		if (rx->expected_len)
+			break;
+
+		rx->expected_len = OAC_FRAME_LEN_V1(rx->buf[3]);
+		if (rx->expected_len > sizeof(rx->buf)) {
+			rx->pos = 0;
+			return -EMSGSIZE;
+		}
 	}
 
-	return 0;
+	rx->pos = 0;
+	return oac_rx_v1_frame(rx->buf, rx->expected_len, frame);
 }
 
+/* The next frame, or piece of log text, for oac_rx_next() */
+static int oac_rx_find(struct oac_rx *rx, const u8 *data, size_t count, size_t *pos, bool v2,
+		       struct oac_rx_frame *frame)
+{
+	const u8 *start, *end;
+	size_t left, len;
+	int ret;
+
+	if (*pos >= count)
+		return 0;
+	if (rx->pos)
+		return oac_rx_continue(rx, data, count, pos, frame);
 
+	/* A COBS frame never starts with the START byte, so v1 frames are accepted in v2 as well */
+	if (v2) {
+		while (*pos < count && data[*pos] == OAC_MESSAGE_DELIMITER)
+			(*pos)++;
+		if (*pos == count)
+			return 0;
+		start = &data[*pos];
+	} else {
+		start = memchr(&data[*pos], OAC_MESSAGE_START, count - *pos);
+		if (start != &data[*pos])
+			rx->resyncs++;
+		if (!start) {
+			*pos = count;
+			return 0;
+		}
+		*pos = start - data;
+	}
+	left = count - *pos;
+
+	if (*start == OAC_MESSAGE_START) {
+		if (left >= 4) {
+			len = OAC_FRAME_LEN_V1(start[3]);
+			if (len > sizeof(rx->buf)) {
+				*pos += 4;
+				return -EMSGSIZE;
+			}
+			if (len <= left) {
+				*pos += len;
+				return oac_rx_v1_frame(start, len, frame);
+			}
+		}
+		rx->framing = OAC_PROTOCOL_V1;
+	} else {
+		end = memchr(start, OAC_MESSAGE_DELIMITER, left);
+		if (end) {
+			len = end - start;
+			*pos += len + 1;
+			if (len > sizeof(rx->buf))
+				return -EMSGSIZE;
+			if (oac_rx_is_text(start, len))
+				return OAC_RX_TEXT;
+
+			ret = oac_cobs_decode(start, len, rx->buf);
+			if (ret < 0)
+				return ret;
+
+			frame->data = rx->buf;
+			frame->len = ret;
+			frame->framing = OAC_PROTOCOL_V2;
+			return 1;
+		}
+		rx->framing = OAC_PROTOCOL_V2;
+	}
+
+	/* Split across reads */
+	rx->expected_len = 0;
+	return oac_rx_continue(rx, data, count, pos, frame);
+}
+
+/*
+ * oac_rx_next - Find the next frame in bytes received from the MCU
+ * @rx:    receive state, carries a frame split across reads over to the next
+ * @data:  bytes received
+ * @count: number of bytes received
+ * @pos:   position in @data to continue from, advanced past what was used
+ * @v2:    look for COBS (v2) frames as well as v1 frames
+ * @frame: set to the frame found
+ *
+ * A frame that arrives whole in @data is found with memchr() and left where
+ * it is, @frame points into @data, a v2 frame is COBS decoded straight out of
+ * it. Only a frame split across reads is gathered in rx->buf. Log text the MCU
+ * writes between v2 frames is skipped.
+ *
+ * Returns 1 with @frame set, 0 once all of @data is used, or a negative error
+ * for a malformed frame, which has been skipped.
+ */
+int oac_rx_next(struct oac_rx *rx, const u8 *data, size_t count, size_t *pos, bool v2,
+		struct oac_rx_frame *frame)
+{
+	int ret;
+
+	do {
+		ret = oac_rx_find(rx, data, count, pos, v2, frame);
+	} while (ret == OAC_RX_TEXT);
+
+	return ret;
+}
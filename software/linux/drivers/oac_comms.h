@@ -3,91 +3,52 @@
 
 #include <linux/types.h>
 
-/* Message Framing */
-#define OAC_MESSAGE_START 			  0xAA
-#define OAC_MESSAGE_END               0x55
+/* Protocol constants, message types and payload structs, generated from protocol/protocol.def */
+#include "oac_protocol.h"
 
-/* Payload Constraints */
-#define OAC_MAX_PAYLOAD_SIZE 		  128
+#define OAC_MAX_FRAME_SIZE            OAC_FRAME_LEN_V2(OAC_MAX_PAYLOAD_SIZE)	/* v1 is a byte shorter */
 
-/* Message Recipient Definitions */
-#define OAC_COMMS_RECIPIENT_LINUX     0x01
-#define OAC_COMMS_RECIPIENT_FIRMWARE  0x02
+/* Link control commands (0x9xxx) are consumed by oac_dev and never acknowledged */
+#define OAC_COMMAND_IS_LINK(cmd)      (((cmd) & 0xF000) == 0x9000)
 
-/* Command Definitions */
-#define OAC_COMMAND_RECORD_REQ_START  0xF000
-#define OAC_COMMAND_RECORD_STARTED    0xF001
-#define OAC_COMMAND_RECORD_REQ_END    0xE000
-#define OAC_COMMAND_RECORD_ENDED      0xE001
-#define OAC_COMMAND_SHUTDOWN_REQ      0xD000
-#define OAC_COMMAND_SHUTDOWN_STARTED  0xD001
-#define OAC_COMMAND_HB                0xC000 	/* Redundant, use WD_KICK*/
-
-/* Button Definitions */
-#define OAC_COMMAND_BTN_SHORT  		  0xA001
-#define OAC_COMMAND_BTN_LONG   	      0xA002
-
-/* Watchdog Definitions */
-#define OAC_COMMAND_WD_START          0xB000
-#define OAC_COMMAND_WD_STOP           0xB001
-#define OAC_COMMAND_WD_KICK           0xB002
-#define OAC_COMMAND_WD_SET_TO         0xB003
-
-/* Message Type Identifiers */
-enum MessageType {
-	OAC_MESSAGE_TYPE_COMMAND 	= 0x01,
-	OAC_MESSAGE_TYPE_STATUS  	= 0x02,
-	OAC_MESSAGE_TYPE_ERROR   	= 0x03,
-	OAC_MESSAGE_TYPE_DATA    	= 0x04,
-	OAC_MESSAGE_TYPE_RESPONSE	= 0x06,
-};
-
-struct __packed MessageHeader {
-    uint8_t recipient;
-    uint8_t message_type;
-    uint8_t payload_length;
-    uint8_t checksum;
-};
-
-/* Command Payload */
-struct CommandBody {
-	u16 command;
-};
-
-struct ResponseBody {
-	u16 param;
-	u64 val;
-};
-
-/* Status Payload */
-struct StatusBody {
-	u32 bat_volt_uv;
-	uint8_t bat_lvl;
-	u8 state;
-	bool charging;
-	u8 error_code;
+/* Serialization and Deserialization API */
+int oac_serialize_message(const struct Message *msg, u8 version, u8 *out_buf, size_t out_len);
+int oac_deserialize_message(const u8 *buf, size_t len, struct Message *msg);
+int oac_decode_frame(const u8 *frame, size_t len, u8 version, struct Message *msg);
+
+/* Protocol v2 (COBS) framing */
+size_t oac_cobs_encode(const u8 *in, size_t len, u8 *out);
+int oac_cobs_decode(const u8 *in, size_t len, u8 *out);
+u8 oac_crc8(const u8 *data, size_t len);
+
+/* Protocol v2 batching */
+int oac_batch_add(u8 *batch, size_t len, size_t size, const struct Message *msg);
+int oac_serialize_batch(const u8 *batch, size_t len, u8 count, u8 recipient, u8 seq,
+			u8 *out_buf, size_t out_len);
+int oac_batch_next(const struct Message *batch, size_t *pos, struct Message *msg);
+
+/* Receive state for a stream of v1 and v2 frames, see oac_rx_next() */
+struct oac_rx {
+	u8 buf[OAC_MAX_FRAME_SIZE];	/* start of a frame split across reads */
+	size_t pos;			/* bytes in buf, 0 between frames */
+	size_t expected_len;		/* v1: length of the whole frame once LEN is in */
+	u8 framing;			/* framing of the frame in buf */
+	unsigned int resyncs;		/* v1 frame starts found after other bytes, for statistics */
 };
 
-/* Error Payload */
-struct ErrorBody {
-	u8 error_code;
-	char error_message[OAC_MAX_PAYLOAD_SIZE - 1];
+/* A received frame, as oac_decode_frame() takes it */
+struct oac_rx_frame {
+	const u8 *data;		/* in the caller's data or in oac_rx.buf, valid until the next call */
+	size_t len;
+	u8 framing;
 };
 
-/* Tagged Union Message */
-struct Message {
-	struct MessageHeader header;
-	union {
-		struct CommandBody payload_command;
-		struct ResponseBody payload_response;
-		struct StatusBody payload_status;
-		struct ErrorBody payload_error;
-		u8 payload_raw[OAC_MAX_PAYLOAD_SIZE];
-	} body;
-};
+int oac_rx_next(struct oac_rx *rx, const u8 *data, size_t count, size_t *pos, bool v2,
+		struct oac_rx_frame *frame);
 
-/* Serialization and Deserialization API */
-int oac_serialize_message(const struct Message *msg, u8 *out_buf, size_t out_len);
-int oac_deserialize_message(const u8 *buf, size_t len, struct Message *msg);
+static inline void oac_rx_reset(struct oac_rx *rx)
+{
+	rx->pos = 0;
+}
 
 #endif /* _OAC_COMMS_H */
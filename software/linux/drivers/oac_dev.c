@@ -1,173 +1,1275 @@
 // SPDX-License-Identifier: GPL-2.0
+#include <linux/completion.h>
+#include <linux/delay.h>
 #include <linux/module.h>
+#include <linux/rculist.h>
 #include <linux/serdev.h>
+#include <linux/slab.h>
 #include <linux/of_device.h>
 #include <linux/mfd/core.h>
 #include "oac_comms.h"
 #include "oac_dev.h"
 
-static oac_dev_message_cb_t oac_dev_registered_cbs[OAC_DEV_MAX_CB]; 
-static DEFINE_MUTEX(cb_lock); /* callback registration lock */
+#define CREATE_TRACE_POINTS
+#include "oac_trace.h"
 
-static void oac_dev_message_registered_callbacks(struct oac_dev *dev, struct Message *msg)
+/* For the watchdog driver */
+EXPORT_TRACEPOINT_SYMBOL_GPL(oac_watchdog_ping);
+
+/* The key subscriptions to a message select by, see struct oac_dev_subscription */
+static u16 oac_dev_sub_key(const struct Message *msg)
 {
-	mutex_lock(&cb_lock);
-	for (int i = 0; i < ARRAY_SIZE(oac_dev_registered_cbs); i++) {
-		if (oac_dev_registered_cbs[i]){
-			oac_dev_registered_cbs[i](dev, msg);
-		}
-			
+	switch (msg->header.message_type) {
+	case OAC_MESSAGE_TYPE_COMMAND:
+		return msg->body.payload_command.command;
+	case OAC_MESSAGE_TYPE_RESPONSE:
+		return msg->body.payload_response.param;
+	default:
+		return 0;
 	}
-	mutex_unlock(&cb_lock);
 }
 
-int oac_dev_register_callback(struct oac_dev *core, oac_dev_message_cb_t cb)
+/*
+ * Call the subscribers to a message, from rx_work. Lock free, the callbacks
+ * run under rcu_read_lock() and must not sleep.
+ */
+static void oac_dev_publish(struct oac_dev *dev, const struct Message *msg)
 {
+	struct oac_dev_subscription *sub;
+	u16 key = oac_dev_sub_key(msg);
 
-	mutex_lock(&cb_lock);
-	for (int i = 0; i < ARRAY_SIZE(oac_dev_registered_cbs); i++) {
-		if (!oac_dev_registered_cbs[i]) {
-			oac_dev_registered_cbs[i] = cb;
-			mutex_unlock(&cb_lock);
-			return 0;
-		}
+	if (msg->header.message_type >= OAC_DEV_SUB_TYPES)
+		return;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(sub, &dev->subs[msg->header.message_type], node) {
+		if (key >= sub->first && key <= sub->last)
+			sub->cb(dev, msg, sub->context);
 	}
-	mutex_unlock(&cb_lock);
-	return -ENOMEM;
+	rcu_read_unlock();
 }
-EXPORT_SYMBOL_GPL(oac_dev_register_callback);
 
-void oac_dev_unregister_callback(struct oac_dev *core, oac_dev_message_cb_t cb)
+/**
+ * oac_dev_subscribe - Have received messages of a type passed to a callback
+ * @core: the OAC device
+ * @type: OAC_MESSAGE_TYPE_*
+ * @first: first command (COMMAND) or parameter (RESPONSE), 0 for other types
+ * @last: last command or parameter, U16_MAX for other types
+ * @cb: called for each message, in process context but under RCU, it must not sleep
+ * @context: passed to @cb
+ *
+ * Events arrive as the COMMAND they carry.
+ *
+ * Return: 0 on success, negative errno on failure.
+ */
+int oac_dev_subscribe(struct oac_dev *core, u8 type, u16 first, u16 last,
+		      oac_dev_message_cb_t cb, void *context)
 {
+	struct oac_dev_subscription *sub;
 
-	mutex_lock(&cb_lock);
-	for (int i = 0; i < ARRAY_SIZE(oac_dev_registered_cbs); i++) {
-		if (oac_dev_registered_cbs[i] == cb) {
-			oac_dev_registered_cbs[i] = NULL;
-			break;
+	if (type >= OAC_DEV_SUB_TYPES || first > last)
+		return -EINVAL;
+
+	sub = kzalloc(sizeof(*sub), GFP_KERNEL);
+	if (!sub)
+		return -ENOMEM;
+
+	sub->first = first;
+	sub->last = last;
+	sub->cb = cb;
+	sub->context = context;
+
+	mutex_lock(&core->sub_lock);
+	list_add_tail_rcu(&sub->node, &core->subs[type]);
+	mutex_unlock(&core->sub_lock);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(oac_dev_subscribe);
+
+/**
+ * oac_dev_unsubscribe - Remove every subscription of a callback and context
+ * @core: the OAC device
+ * @cb: the callback
+ * @context: its context
+ *
+ * Once this returns @cb is not running and will not be called again, so
+ * @context may be freed.
+ */
+void oac_dev_unsubscribe(struct oac_dev *core, oac_dev_message_cb_t cb, void *context)
+{
+	struct oac_dev_subscription *sub, *tmp;
+	int i;
+
+	mutex_lock(&core->sub_lock);
+	for (i = 0; i < OAC_DEV_SUB_TYPES; i++) {
+		list_for_each_entry_safe(sub, tmp, &core->subs[i], node) {
+			if (sub->cb == cb && sub->context == context) {
+				list_del_rcu(&sub->node);
+				kfree_rcu(sub, rcu);
+			}
 		}
 	}
-	mutex_unlock(&cb_lock);
+	mutex_unlock(&core->sub_lock);
 
+	/* Wait for oac_dev_publish() calls that may still be in cb */
+	synchronize_rcu();
 }
-EXPORT_SYMBOL_GPL(oac_dev_unregister_callback);
+EXPORT_SYMBOL_GPL(oac_dev_unsubscribe);
 
-int oac_dev_send_message(struct oac_dev *dev, struct Message *msg)
+/* Serialize and write a message with its sequence number, tx_lock held */
+static int oac_dev_transmit(struct oac_dev *dev, const struct Message *msg)
 {
-	u8 buf[OAC_MAX_PAYLOAD_SIZE + 6];
+	u8 buf[OAC_MAX_FRAME_SIZE];
 	int len;
 
-	len = oac_serialize_message(msg, buf, sizeof(buf));
+	if (READ_ONCE(dev->fw_active))
+		return -EBUSY;
+
+	len = oac_serialize_message(msg, READ_ONCE(dev->proto_version), buf, sizeof(buf));
 	if (len < 0)
 		return -EINVAL;
 
-	pr_info("OAC: sending message\n");
+	trace_oac_tx_frame(READ_ONCE(dev->proto_version), msg->header.message_type,
+			   msg->header.seq, 1, len);
+	oac_stats_frame(dev, OAC_STATS_TX, msg->header.message_type, len);
+
+	return serdev_device_write_buf(dev->serdev, buf, len);
+}
+
+/* Send the pending batch now, tx_lock held */
+static int oac_dev_batch_flush(struct oac_dev *dev)
+{
+	u8 buf[OAC_MAX_FRAME_SIZE];
+	u8 count = dev->tx_batch_count;
+	int len;
+
+	if (!count)
+		return 0;
+
+	dev->tx_batch_count = 0;
+
+	/* Batches are v2 only, one left over from before a renegotiation is dropped */
+	if (READ_ONCE(dev->proto_version) != OAC_PROTOCOL_V2 || READ_ONCE(dev->fw_active))
+		return 0;
+
+	len = oac_serialize_batch(dev->tx_batch, dev->tx_batch_len, count,
+				  OAC_COMMS_RECIPIENT_FIRMWARE, dev->tx_batch_seq,
+				  buf, sizeof(buf));
+	if (len < 0)
+		return len;
 
+	trace_oac_tx_frame(OAC_PROTOCOL_V2, OAC_MESSAGE_TYPE_BATCH, dev->tx_batch_seq, count, len);
+	oac_stats_frame(dev, OAC_STATS_TX, OAC_MESSAGE_TYPE_BATCH, len);
 	return serdev_device_write_buf(dev->serdev, buf, len);
 }
+
+/*
+ * oac_dev_batch_add - Add a v2 message to the pending batch, tx_lock held
+ *
+ * Only consecutive sequence numbers can share a frame, and a full batch is
+ * sent to make room, so either ends the current batch early.
+ * Returns -EMSGSIZE if the message is too large to be batched at all.
+ */
+static int oac_dev_batch_add(struct oac_dev *dev, const struct Message *msg)
+{
+	int len;
+
+	if (dev->tx_batch_count &&
+	    (u8)(dev->tx_batch_seq + dev->tx_batch_count) != msg->header.seq)
+		oac_dev_batch_flush(dev);
+
+	len = oac_batch_add(dev->tx_batch, dev->tx_batch_count ? dev->tx_batch_len : 0,
+			    sizeof(dev->tx_batch), msg);
+	if (len == -EMSGSIZE && dev->tx_batch_count) {
+		oac_dev_batch_flush(dev);
+		len = oac_batch_add(dev->tx_batch, 0, sizeof(dev->tx_batch), msg);
+	}
+	if (len < 0)
+		return len;
+
+	if (!dev->tx_batch_count++)
+		dev->tx_batch_seq = msg->header.seq;
+	dev->tx_batch_len = len;
+	return 0;
+}
+
+/*
+ * oac_dev_queue - Send a message with its sequence number, tx_lock held
+ *
+ * In v2 the message joins the pending batch, which goes out OAC_BATCH_WINDOW_MS
+ * after it was started. Link commands must go out at the current rate straight
+ * away, and bulk data is paced against the line by oac_bulk.c, so they, and
+ * anything too large to batch, are written directly, after what is already
+ * batched. Once the device is going away nothing is batched, a resend from
+ * retransmit_work goes straight out.
+ */
+static int oac_dev_queue(struct oac_dev *dev, const struct Message *msg)
+{
+	int ret;
+
+	if (READ_ONCE(dev->proto_version) == OAC_PROTOCOL_V2 && !dev->tx_closed &&
+	    msg->header.message_type != OAC_MESSAGE_TYPE_DATA &&
+	    !(msg->header.message_type == OAC_MESSAGE_TYPE_COMMAND &&
+	      OAC_COMMAND_IS_LINK(msg->body.payload_command.command))) {
+		ret = oac_dev_batch_add(dev, msg);
+		if (!ret)
+			schedule_delayed_work(&dev->batch_work,
+					      msecs_to_jiffies(OAC_BATCH_WINDOW_MS));
+		if (ret != -EMSGSIZE)
+			return ret;
+	}
+
+	oac_dev_batch_flush(dev);
+	return oac_dev_transmit(dev, msg);
+}
+
+static void oac_dev_batch_work(struct work_struct *work)
+{
+	struct oac_dev *odev = container_of(to_delayed_work(work),
+					    struct oac_dev, batch_work);
+
+	mutex_lock(&odev->tx_lock);
+	oac_dev_batch_flush(odev);
+	mutex_unlock(&odev->tx_lock);
+}
+
+/*
+ * oac_dev_track_unacked - Keep a v2 command frame until the MCU acknowledges it.
+ * When every slot is taken the oldest command is given up on. tx_lock held.
+ */
+static void oac_dev_track_unacked(struct oac_dev *dev, const struct Message *msg)
+{
+	struct oac_dev_unacked *slot = &dev->unacked[0];
+	int i;
+
+	for (i = 0; i < OAC_MAX_UNACKED; i++) {
+		if (!dev->unacked[i].used) {
+			slot = &dev->unacked[i];
+			break;
+		}
+		if (time_before(dev->unacked[i].sent, slot->sent))
+			slot = &dev->unacked[i];
+	}
+
+	if (slot->used)
+		dev->tx_failures++;
+
+	slot->sent = jiffies;
+	slot->command = msg->body.payload_command.command;
+	slot->seq = msg->header.seq;
+	slot->retries = 0;
+	slot->used = true;
+}
+
+int oac_dev_send_message(struct oac_dev *dev, struct Message *msg)
+{
+	bool tracked = false;
+	int ret;
+
+	mutex_lock(&dev->tx_lock);
+
+	if (dev->tx_closed) {
+		mutex_unlock(&dev->tx_lock);
+		return -ENODEV;
+	}
+
+	msg->header.seq = dev->tx_seq++;
+
+	if (READ_ONCE(dev->proto_version) == OAC_PROTOCOL_V2 &&
+	    msg->header.message_type == OAC_MESSAGE_TYPE_COMMAND &&
+	    !OAC_COMMAND_IS_LINK(msg->body.payload_command.command)) {
+		oac_dev_track_unacked(dev, msg);
+		tracked = true;
+	}
+
+	ret = oac_dev_queue(dev, msg);
+
+	mutex_unlock(&dev->tx_lock);
+
+	if (tracked)
+		schedule_delayed_work(&dev->retransmit_work,
+				      msecs_to_jiffies(OAC_RETRANSMIT_MS));
+
+	return ret;
+}
 EXPORT_SYMBOL_GPL(oac_dev_send_message);
 
-static int oac_dev_receive(struct serdev_device *serdev, const u8 *data, size_t count)
+/* Transmit a tracked command again, with its original sequence number. tx_lock held */
+static void oac_dev_resend(struct oac_dev *dev, struct oac_dev_unacked *slot)
 {
-	struct oac_dev *odev = serdev_device_get_drvdata(serdev);
-	size_t i;
-
-	for (i = 0; i < count; ++i) {
-		u8 byte = data[i];
-
-		/* Validate start byte */
-		if (!odev->receiving) {
-			if (byte == OAC_MESSAGE_START) {
-				odev->receiving = true;
-				odev->rx_pos = 0;
-				odev->expected_len = 0;
-				odev->rx_buf[odev->rx_pos++] = byte;
-			}
+	struct Message msg = {
+		.header = {
+			.recipient = OAC_COMMS_RECIPIENT_FIRMWARE,
+			.message_type = OAC_MESSAGE_TYPE_COMMAND,
+			.seq = slot->seq,
+		},
+		.body.payload_command.command = slot->command,
+	};
+
+	slot->sent = jiffies;
+	slot->retries++;
+	oac_dev_queue(dev, &msg);
+}
+
+/*
+ * oac_dev_retransmit_work - Resend commands whose acknowledgement is overdue,
+ * and give up on those that have been resent OAC_MAX_RETRANSMITS times.
+ */
+static void oac_dev_retransmit_work(struct work_struct *work)
+{
+	struct oac_dev *odev = container_of(to_delayed_work(work),
+					    struct oac_dev, retransmit_work);
+	unsigned long timeout = msecs_to_jiffies(OAC_RETRANSMIT_MS);
+	bool pending = false;
+	int i;
+
+	mutex_lock(&odev->tx_lock);
+	for (i = 0; i < OAC_MAX_UNACKED; i++) {
+		struct oac_dev_unacked *slot = &odev->unacked[i];
+
+		if (!slot->used)
+			continue;
+
+		if (time_before(jiffies, slot->sent + timeout)) {
+			pending = true;
 			continue;
 		}
 
-		/* Append to buffer */
-		if (odev->rx_pos < OAC_RX_BUF_SIZE) {
-			odev->rx_buf[odev->rx_pos++] = byte;
-		} else {
-			dev_warn(&serdev->dev, "RX buffer overflow\n");
-			odev->receiving = false;
-			odev->rx_pos = 0;
+		if (slot->retries >= OAC_MAX_RETRANSMITS) {
+			slot->used = false;
+			odev->tx_failures++;
+			dev_warn_ratelimited(&odev->serdev->dev,
+					     "Command 0x%04X not acknowledged, dropped\n",
+					     slot->command);
 			continue;
 		}
 
-		/*
-		 * Once enough data is received to read the payload length,
-		 * calculate expected total length:
-		 * header (4) + payload + checksum (1) + end byte (1)
-		 */
-		if (odev->rx_pos == 3) {
-			odev->expected_len = 6 + odev->rx_buf[3];
-			if (odev->expected_len > OAC_RX_BUF_SIZE) {
-				dev_warn(&serdev->dev, "Invalid expected message length\n");
-				odev->receiving = false;
-				odev->rx_pos = 0;
-				continue;
-			}
+		oac_dev_resend(odev, slot);
+		pending = true;
+	}
+	mutex_unlock(&odev->tx_lock);
+
+	if (pending)
+		schedule_delayed_work(&odev->retransmit_work, timeout);
+}
+
+/* Forget sequence state, the MCU starts over after a (re)negotiation */
+static void oac_dev_reset_sequence(struct oac_dev *odev)
+{
+	int i;
+
+	mutex_lock(&odev->tx_lock);
+	for (i = 0; i < OAC_MAX_UNACKED; i++)
+		odev->unacked[i].used = false;
+	odev->tx_batch_count = 0;
+	mutex_unlock(&odev->tx_lock);
+
+	odev->rx_seq_valid = false;
+	odev->rx_seen = 0;
+}
+
+/* Acknowledge a command frame, or ask for a missing frame to be resent */
+static void oac_dev_send_ack(struct oac_dev *odev, u8 type, u8 seq)
+{
+	struct Message msg = {
+		.header = {
+			.recipient = OAC_COMMS_RECIPIENT_FIRMWARE,
+			.message_type = type,
+		},
+		.body.payload_ack.seq = seq,
+	};
+
+	oac_dev_send_message(odev, &msg);
+}
+
+/*
+ * oac_dev_handle_sequence - Sequence tracking and ACK/NAK handling for v2 frames
+ *
+ * A jump in the MCU's sequence numbers means frames were lost in between, the
+ * most recent of those are NAKed straight away. The MCU only keeps command
+ * frames, so NAKs for anything else are ignored there. Frames older than
+ * expected are resends, checked against a 64 frame window of what was already
+ * received: a command we already delivered (our ACK was lost) is acknowledged
+ * again and dropped.
+ *
+ * Returns true if the message was consumed and must not be broadcast.
+ */
+static bool oac_dev_handle_sequence(struct oac_dev *odev, const struct Message *msg)
+{
+	u8 seq = msg->header.seq;
+	s8 gap = odev->rx_seq_valid ? (s8)(seq - odev->rx_expected_seq) : 0;
+	bool duplicate = false;
+	int i;
+
+	if (gap >= 0) {
+		for (i = 1; i <= gap && i <= OAC_MAX_UNACKED; i++)
+			oac_dev_send_ack(odev, OAC_MESSAGE_TYPE_NAK, seq - i);
+
+		odev->rx_seen = (gap >= 63) ? 1 : (odev->rx_seen << (gap + 1)) | 1;
+		odev->rx_expected_seq = seq + 1;
+		odev->rx_seq_valid = true;
+	} else {
+		u8 age = -gap - 1;	/* bit index of this frame in rx_seen */
+
+		duplicate = age >= 64 || (odev->rx_seen & BIT_ULL(age));
+		if (!duplicate)
+			odev->rx_seen |= BIT_ULL(age);
+	}
+
+	switch (msg->header.message_type) {
+	case OAC_MESSAGE_TYPE_ACK:
+		mutex_lock(&odev->tx_lock);
+		for (i = 0; i < OAC_MAX_UNACKED; i++) {
+			if (odev->unacked[i].used &&
+			    odev->unacked[i].seq == msg->body.payload_ack.seq)
+				odev->unacked[i].used = false;
 		}
+		mutex_unlock(&odev->tx_lock);
+		return true;
 
-		/* If full message received, validate and parse */
-		if (odev->expected_len > 0 && odev->rx_pos >= odev->expected_len) {
-			u8 *rx_buf = odev->rx_buf;
-			size_t len = odev->expected_len;
+	case OAC_MESSAGE_TYPE_NAK:
+		mutex_lock(&odev->tx_lock);
+		for (i = 0; i < OAC_MAX_UNACKED; i++) {
+			if (odev->unacked[i].used &&
+			    odev->unacked[i].seq == msg->body.payload_ack.seq &&
+			    odev->unacked[i].retries < OAC_MAX_RETRANSMITS)
+				oac_dev_resend(odev, &odev->unacked[i]);
+		}
+		mutex_unlock(&odev->tx_lock);
+		return true;
 
-			if (rx_buf[len - 1] != OAC_MESSAGE_END) {
-				dev_warn(&serdev->dev, "Invalid end byte: 0x%02X\n",
-					 rx_buf[len - 1]);
-				odev->receiving = false;
-				odev->rx_pos = 0;
-				continue;
-			}
+	case OAC_MESSAGE_TYPE_COMMAND:
+		if (!OAC_COMMAND_IS_LINK(msg->body.payload_command.command))
+			oac_dev_send_ack(odev, OAC_MESSAGE_TYPE_ACK, seq);
+		return duplicate;
+
+	case OAC_MESSAGE_TYPE_EVENT:
+		oac_dev_send_ack(odev, OAC_MESSAGE_TYPE_ACK, seq);
+		return duplicate;
+
+	default:
+		return duplicate;
+	}
+}
+
+/* The errno a reply result stands for */
+static int oac_dev_reply_errno(u8 result)
+{
+	switch (result) {
+	case OAC_REPLY_OK:
+		return 0;
+	case OAC_REPLY_E_UNKNOWN:
+		return -EOPNOTSUPP;
+	case OAC_REPLY_E_INVALID:
+		return -EINVAL;
+	case OAC_REPLY_E_BUSY:
+		return -EBUSY;
+	default:
+		return -EIO;
+	}
+}
+
+/* Take the sent request with transaction ID @tid out of its slot, req_lock held */
+static struct oac_dev_request *oac_dev_request_take(struct oac_dev *odev, u8 tid)
+{
+	struct oac_dev_request *req;
+	int i;
+
+	for (i = 0; i < OAC_MAX_REQUESTS; i++) {
+		req = odev->requests[i];
+		if (req && req->sent && req->tid == tid) {
+			odev->requests[i] = NULL;
+			return req;
+		}
+	}
+	return NULL;
+}
+
+static bool oac_dev_tid_in_use(struct oac_dev *odev, u8 tid)
+{
+	int i;
+
+	for (i = 0; i < OAC_MAX_REQUESTS; i++) {
+		if (odev->requests[i] && odev->requests[i]->tid == tid)
+			return true;
+	}
+	return false;
+}
+
+static void oac_dev_request_finish(struct oac_dev *odev, struct oac_dev_request *req, int result)
+{
+	req->result = result;
+	req->complete(odev, req);
+}
+
+/**
+ * oac_dev_request_async - Send a request to the MCU without waiting for the reply
+ * @dev: Pointer to oac_dev structure
+ * @req: Request, with command, val, timeout_ms and complete set
+ *
+ * Does not sleep. The request is sent from a work item and @req->complete is
+ * called exactly once, with the reply or when the timeout expires.
+ *
+ * Returns 0 if the request was queued, -EBUSY if OAC_MAX_REQUESTS are already
+ * outstanding or -ENODEV if the device is going away.
+ */
+int oac_dev_request_async(struct oac_dev *dev, struct oac_dev_request *req)
+{
+	unsigned long flags;
+	int slot = -1;
+	int i;
+
+	if (!req->complete)
+		return -EINVAL;
 
-			/* Deserialize and handle the message */
-			{
-				struct Message msg;
-				if (oac_deserialize_message(rx_buf, len, &msg) == 0) {
-					dev_info(&serdev->dev, "Received message type %u\n",
-							 msg.header.message_type);
-				
-					switch (msg.header.message_type) {
-					case OAC_MESSAGE_TYPE_STATUS:
-					case OAC_MESSAGE_TYPE_COMMAND:
-					case OAC_MESSAGE_TYPE_RESPONSE:
-					case OAC_MESSAGE_TYPE_ERROR:
-					case OAC_MESSAGE_TYPE_DATA:
-						/* Broadcast message to all registered callbacks */
-						oac_dev_message_registered_callbacks(odev, &msg);
-						break;
-				
-					default:
-						dev_warn(&serdev->dev, "Unknown message type: %u\n",
-								 msg.header.message_type);
-						break;
-					}
-				} else {
-					dev_warn(&serdev->dev, "Failed to deserialize message\n");
-				}
-				
+	spin_lock_irqsave(&dev->req_lock, flags);
+
+	if (dev->req_closed) {
+		spin_unlock_irqrestore(&dev->req_lock, flags);
+		return -ENODEV;
+	}
+
+	for (i = 0; i < OAC_MAX_REQUESTS; i++) {
+		if (!dev->requests[i])
+			slot = i;
+	}
+	if (slot < 0) {
+		spin_unlock_irqrestore(&dev->req_lock, flags);
+		return -EBUSY;
+	}
+
+	/* Outstanding requests never share an ID */
+	while (oac_dev_tid_in_use(dev, dev->req_tid))
+		dev->req_tid++;
+
+	req->tid = dev->req_tid++;
+	req->sent = false;
+	req->deadline = jiffies + msecs_to_jiffies(req->timeout_ms ?: OAC_REQUEST_TIMEOUT_MS);
+	dev->requests[slot] = req;
+
+	spin_unlock_irqrestore(&dev->req_lock, flags);
+
+	mod_delayed_work(system_wq, &dev->request_work, 0);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(oac_dev_request_async);
+
+static void oac_dev_request_wake(struct oac_dev *dev, struct oac_dev_request *req)
+{
+	complete(req->context);
+}
+
+/**
+ * oac_dev_request - Send a request to the MCU and wait for the reply
+ * @dev: Pointer to oac_dev structure
+ * @command: Command or parameter, an OAC_COMMAND_*
+ * @val: Argument
+ * @reply: Value returned by the MCU, may be NULL
+ * @timeout_ms: Time the MCU has to reply, 0 for OAC_REQUEST_TIMEOUT_MS
+ *
+ * Returns 0 on success, the error the MCU replied with (-EOPNOTSUPP, -EINVAL,
+ * -EBUSY, -EIO) or -ETIMEDOUT if no reply arrived in time.
+ */
+int oac_dev_request(struct oac_dev *dev, u16 command, u64 val, u64 *reply,
+		    unsigned int timeout_ms)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct oac_dev_request req = {
+		.command = command,
+		.val = val,
+		.timeout_ms = timeout_ms,
+		.complete = oac_dev_request_wake,
+		.context = &done,
+	};
+	int ret;
+
+	might_sleep();
+
+	ret = oac_dev_request_async(dev, &req);
+	if (ret)
+		return ret;
+
+	/* Always completed, by the reply, request_work's timeout or remove */
+	wait_for_completion(&done);
+
+	if (!req.result && reply)
+		*reply = req.val;
+	return req.result;
+}
+EXPORT_SYMBOL_GPL(oac_dev_request);
+
+/*
+ * oac_dev_request_work - Send queued requests and fail those past their deadline
+ *
+ * Runs whenever a request is queued, and again at the earliest deadline.
+ */
+static void oac_dev_request_work(struct work_struct *work)
+{
+	struct oac_dev *odev = container_of(to_delayed_work(work),
+					    struct oac_dev, request_work);
+	struct oac_dev_request *expired[OAC_MAX_REQUESTS];
+	struct oac_dev_request *req;
+	unsigned long flags, next = 0;
+	int n_expired = 0;
+	bool pending = false;
+	int i;
+
+	/* One at a time, a request may be completed as soon as it is sent */
+	for (;;) {
+		struct Message msg = {
+			.header = {
+				.recipient = OAC_COMMS_RECIPIENT_FIRMWARE,
+				.message_type = OAC_MESSAGE_TYPE_REQUEST,
+			},
+		};
+
+		req = NULL;
+		spin_lock_irqsave(&odev->req_lock, flags);
+		for (i = 0; i < OAC_MAX_REQUESTS; i++) {
+			if (odev->requests[i] && !odev->requests[i]->sent) {
+				req = odev->requests[i];
+				req->sent = true;
+				msg.body.payload_request.tid = req->tid;
+				msg.body.payload_request.command = req->command;
+				msg.body.payload_request.val = req->val;
+				break;
 			}
+		}
+		spin_unlock_irqrestore(&odev->req_lock, flags);
+
+		if (!req)
+			break;
+
+		if (oac_dev_send_message(odev, &msg) < 0) {
+			spin_lock_irqsave(&odev->req_lock, flags);
+			req = oac_dev_request_take(odev, msg.body.payload_request.tid);
+			spin_unlock_irqrestore(&odev->req_lock, flags);
+			if (req)
+				oac_dev_request_finish(odev, req, -EIO);
+		}
+	}
+
+	spin_lock_irqsave(&odev->req_lock, flags);
+	for (i = 0; i < OAC_MAX_REQUESTS; i++) {
+		req = odev->requests[i];
+		if (!req)
+			continue;
+
+		if (time_after_eq(jiffies, req->deadline)) {
+			expired[n_expired++] = req;
+			odev->requests[i] = NULL;
+		} else if (!pending || time_before(req->deadline, next)) {
+			next = req->deadline;
+			pending = true;
+		}
+	}
+	spin_unlock_irqrestore(&odev->req_lock, flags);
+
+	for (i = 0; i < n_expired; i++) {
+		dev_warn_ratelimited(&odev->serdev->dev, "Request 0x%04X timed out\n",
+				     expired[i]->command);
+		oac_dev_request_finish(odev, expired[i], -ETIMEDOUT);
+	}
+
+	/* next may have passed while the expired requests were finished */
+	if (pending)
+		schedule_delayed_work(&odev->request_work,
+				      time_after(next, jiffies) ? next - jiffies : 0);
+}
+
+/* Hand a reply to the request waiting for it */
+static void oac_dev_handle_reply(struct oac_dev *odev, const struct ReplyBody *reply)
+{
+	struct oac_dev_request *req;
+	unsigned long flags;
+
+	spin_lock_irqsave(&odev->req_lock, flags);
+	req = oac_dev_request_take(odev, reply->tid);
+	spin_unlock_irqrestore(&odev->req_lock, flags);
+
+	if (!req) {
+		dev_dbg(&odev->serdev->dev, "Reply to unknown request %u\n", reply->tid);
+		return;
+	}
 
-			/* Reset state for next message */
-			odev->receiving = false;
-			odev->rx_pos = 0;
+	req->val = reply->val;
+	oac_dev_request_finish(odev, req, oac_dev_reply_errno(reply->result));
+}
+
+/* Fail every outstanding request and refuse new ones */
+static void oac_dev_request_close(struct oac_dev *odev)
+{
+	struct oac_dev_request *req;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&odev->req_lock, flags);
+	odev->req_closed = true;
+	spin_unlock_irqrestore(&odev->req_lock, flags);
+
+	cancel_delayed_work_sync(&odev->request_work);
+
+	for (i = 0; i < OAC_MAX_REQUESTS; i++) {
+		spin_lock_irqsave(&odev->req_lock, flags);
+		req = odev->requests[i];
+		odev->requests[i] = NULL;
+		spin_unlock_irqrestore(&odev->req_lock, flags);
+
+		if (req)
+			oac_dev_request_finish(odev, req, -ENODEV);
+	}
+}
+
+static const unsigned int oac_baud_ladder[] = OAC_BAUD_LADDER;
+
+/* Current line rate, for pacing */
+unsigned int oac_dev_baud(struct oac_dev *dev)
+{
+	return oac_baud_ladder[READ_ONCE(dev->baud_rung)];
+}
+
+static int oac_dev_send_command(struct oac_dev *odev, u16 command)
+{
+	struct Message msg = {
+		.header = {
+			.recipient = OAC_COMMS_RECIPIENT_FIRMWARE,
+			.message_type = OAC_MESSAGE_TYPE_COMMAND,
+		},
+		.body.payload_command.command = command,
+	};
+
+	return oac_dev_send_message(odev, &msg);
+}
+
+/*
+ * oac_dev_set_baud - Switch the UART to a ladder rung
+ *
+ * Returns -ERANGE if the UART clock cannot get within 2% of the rate.
+ */
+static int oac_dev_set_baud(struct oac_dev *odev, u8 rung)
+{
+	unsigned int baud = oac_baud_ladder[rung];
+	unsigned int actual;
+
+	actual = serdev_device_set_baudrate(odev->serdev, baud);
+	if (actual < baud - baud / 50 || actual > baud + baud / 50)
+		return -ERANGE;
+
+	return 0;
+}
+
+/*
+ * oac_dev_baud_reset_peer - Send the MCU back to rung 0 from wherever it is
+ *
+ * A rung 0 request takes effect without a probe, so it is sent (v1 framed,
+ * which the MCU always accepts) once at every rung above 0. Bytes sent at the
+ * other rungs arrive as garbage, so each request, and the first frame at
+ * rung 0, is preceded by delimiters that end any partial frame they made.
+ */
+static void oac_dev_baud_reset_peer(struct oac_dev *odev)
+{
+	static const u8 idle[4] = { OAC_MESSAGE_DELIMITER, OAC_MESSAGE_DELIMITER,
+				    OAC_MESSAGE_DELIMITER, OAC_MESSAGE_DELIMITER };
+	unsigned long settle = msecs_to_jiffies(OAC_BAUD_SETTLE_MS);
+	int rung;
+
+	for (rung = ARRAY_SIZE(oac_baud_ladder) - 1; rung > 0; rung--) {
+		if (oac_dev_set_baud(odev, rung) < 0)
+			continue;
+
+		serdev_device_write_buf(odev->serdev, idle, sizeof(idle));
+		oac_dev_send_command(odev, OAC_COMMAND_BAUD_REQ | 0);
+		serdev_device_wait_until_sent(odev->serdev, settle);
+		msleep(OAC_BAUD_SETTLE_MS);
+	}
+
+	oac_dev_set_baud(odev, 0);
+	serdev_device_write_buf(odev->serdev, idle, sizeof(idle));
+}
+
+/*
+ * Negotiation is over, at whatever rate. The MCU may have restarted since the
+ * link last settled, so give it back its parameters.
+ */
+static void oac_dev_baud_settled(struct oac_dev *odev)
+{
+	odev->baud_state = OAC_BAUD_IDLE;
+	oac_param_sync(odev);
+}
+
+/*
+ * oac_dev_negotiate_baud - Step the link up to the next rung, baud_lock held
+ *
+ * Each confirmed rung requests the next one, until the top of the ladder or
+ * until a step fails.
+ */
+static void oac_dev_negotiate_baud(struct oac_dev *odev)
+{
+	u8 rung = odev->baud_rung + 1;
+
+	if (odev->baud_closed)
+		return;
+
+	if (rung >= ARRAY_SIZE(oac_baud_ladder)) {
+		oac_dev_baud_settled(odev);
+		return;
+	}
+
+	odev->baud_target = rung;
+	odev->baud_state = OAC_BAUD_WAIT_ACK;
+	oac_dev_send_command(odev, OAC_COMMAND_BAUD_REQ | rung);
+	mod_delayed_work(system_wq, &odev->baud_work, msecs_to_jiffies(OAC_BAUD_PROBE_MS));
+}
+
+/*
+ * oac_dev_baud_work - Switch rates and handle timeouts of the baud negotiation
+ *
+ * Runs immediately when the MCU acknowledges a step or when the error limit is
+ * hit, otherwise OAC_BAUD_PROBE_MS after the last step.
+ */
+static void oac_dev_baud_work(struct work_struct *work)
+{
+	struct oac_dev *odev = container_of(to_delayed_work(work),
+					    struct oac_dev, baud_work);
+	struct device *dev = &odev->serdev->dev;
+	u8 rung;
+
+	mutex_lock(&odev->baud_lock);
+	rung = odev->baud_target;
+
+	switch (odev->baud_state) {
+	case OAC_BAUD_SWITCH:
+		/* Anything queued was meant for the old rate */
+		serdev_device_wait_until_sent(odev->serdev,
+					      msecs_to_jiffies(OAC_BAUD_PROBE_MS));
+		if (oac_dev_set_baud(odev, rung) < 0) {
+			dev_info(dev, "UART cannot do %u baud\n", oac_baud_ladder[rung]);
+			oac_dev_set_baud(odev, odev->baud_rung);
+			oac_dev_baud_settled(odev);
+			break;
 		}
+		odev->baud_state = OAC_BAUD_WAIT_PROBE;
+		oac_dev_send_command(odev, OAC_COMMAND_BAUD_PROBE | rung);
+		mod_delayed_work(system_wq, &odev->baud_work,
+				 msecs_to_jiffies(OAC_BAUD_PROBE_MS));
+		break;
+
+	case OAC_BAUD_WAIT_ACK:
+		/* Older firmware ignores the request */
+		oac_dev_baud_settled(odev);
+		break;
+
+	case OAC_BAUD_WAIT_PROBE:
+		dev_warn(dev, "No probe echo at %u baud, staying at %u\n",
+			 oac_baud_ladder[rung], oac_baud_ladder[odev->baud_rung]);
+		oac_dev_set_baud(odev, odev->baud_rung);
+		oac_dev_baud_settled(odev);
+		break;
+
+	case OAC_BAUD_FALLBACK:
+		dev_warn(dev, "Too many frame errors at %u baud, falling back to %u\n",
+			 oac_baud_ladder[odev->baud_rung], oac_baud_ladder[0]);
+		oac_dev_set_baud(odev, 0);
+		odev->baud_rung = 0;
+		oac_dev_baud_settled(odev);
+		break;
+
+	case OAC_BAUD_IDLE:
+		break;
+	}
+
+	mutex_unlock(&odev->baud_lock);
+}
+
+/* Baud negotiation replies from the MCU */
+static void oac_dev_handle_baud_command(struct oac_dev *odev, u16 command)
+{
+	u8 rung = command & OAC_COMMAND_BAUD_RUNG_MASK;
+
+	mutex_lock(&odev->baud_lock);
+
+	if (odev->baud_closed) {
+		mutex_unlock(&odev->baud_lock);
+		return;
+	}
+
+	switch (command & ~OAC_COMMAND_BAUD_RUNG_MASK) {
+	case OAC_COMMAND_BAUD_ACK:
+		if (odev->baud_state == OAC_BAUD_WAIT_ACK && rung == odev->baud_target) {
+			odev->baud_state = OAC_BAUD_SWITCH;
+			mod_delayed_work(system_wq, &odev->baud_work, 0);
+		}
+		break;
+
+	case OAC_COMMAND_BAUD_PROBE:
+		if (odev->baud_state == OAC_BAUD_WAIT_PROBE && rung == odev->baud_target) {
+			odev->baud_rung = rung;
+			odev->baud_errors = 0;
+			dev_info(&odev->serdev->dev, "Link at %u baud\n", oac_baud_ladder[rung]);
+			oac_dev_negotiate_baud(odev);
+		}
+		break;
+	}
+
+	mutex_unlock(&odev->baud_lock);
+}
+
+/*
+ * oac_dev_negotiate_protocol - Request protocol v2 framing from the MCU.
+ *
+ * We keep transmitting v1 until OAC_COMMAND_PROTO_ACK_V2 arrives. Older
+ * firmware ignores the request, in which case the link simply stays on v1.
+ */
+static int oac_dev_negotiate_protocol(struct oac_dev *odev)
+{
+	struct Message msg = {
+		.header = {
+			.recipient = OAC_COMMS_RECIPIENT_FIRMWARE,
+			.message_type = OAC_MESSAGE_TYPE_COMMAND,
+		},
+		.body.payload_command.command = OAC_COMMAND_PROTO_REQ_V2,
+	};
+
+	/* The request itself is always sent with v1 framing */
+	WRITE_ONCE(odev->proto_version, OAC_PROTOCOL_V1);
+	oac_dev_reset_sequence(odev);
+	odev->proto_negotiating = true;
+	odev->proto_req_time = jiffies;
+
+	return oac_dev_send_message(odev, &msg);
+}
+
+/*
+ * oac_dev_rx_error - Called for every discarded frame.
+ *
+ * While a v2 request is outstanding, errors usually mean the MCU is still
+ * transmitting v2 frames from an earlier session, so ask again (rate limited).
+ */
+static void oac_dev_rx_error(struct oac_dev *odev)
+{
+	if (odev->proto_negotiating &&
+	    time_after(jiffies, odev->proto_req_time + msecs_to_jiffies(OAC_PROTO_RETRY_MS)))
+		oac_dev_negotiate_protocol(odev);
+
+	/*
+	 * A burst of errors above rung 0 means the faster rate is not reliable.
+	 * The MCU does the same, once one side has dropped back the other sees
+	 * nothing but errors and follows.
+	 */
+	mutex_lock(&odev->baud_lock);
+	if (odev->baud_rung != 0 && odev->baud_state != OAC_BAUD_FALLBACK && !odev->baud_closed) {
+		if (time_after(jiffies, odev->baud_error_time +
+			       msecs_to_jiffies(OAC_BAUD_ERROR_WINDOW_MS))) {
+			odev->baud_error_time = jiffies;
+			odev->baud_errors = 0;
+		}
+		if (++odev->baud_errors >= OAC_BAUD_ERROR_LIMIT) {
+			odev->baud_state = OAC_BAUD_FALLBACK;
+			mod_delayed_work(system_wq, &odev->baud_work, 0);
+		}
+	}
+	mutex_unlock(&odev->baud_lock);
+}
+
+/* Consume link control commands, they never reach the subdrivers */
+static void oac_dev_handle_link_command(struct oac_dev *odev, u16 command)
+{
+	if (command == OAC_COMMAND_PROTO_ACK_V2) {
+		oac_dev_reset_sequence(odev);
+		WRITE_ONCE(odev->proto_version, OAC_PROTOCOL_V2);
+		odev->proto_negotiating = false;
+		dev_info(&odev->serdev->dev, "Protocol v2 negotiated\n");
+
+		/* Then step up the link speed */
+		mutex_lock(&odev->baud_lock);
+		oac_dev_negotiate_baud(odev);
+		mutex_unlock(&odev->baud_lock);
+		return;
+	}
+
+	oac_dev_handle_baud_command(odev, command);
+}
+
+/*
+ * Pass a message on to the callbacks from rx_work, the receive path never
+ * waits for them. Dropped when they are OAC_RX_QUEUE_LEN messages behind.
+ */
+static void oac_dev_queue_rx(struct oac_dev *odev, const struct Message *msg)
+{
+	struct oac_dev_rx_msg entry = { .msg = *msg, .rx_ns = odev->rx_ns };
+	unsigned int depth;
+
+	if (!kfifo_put(&odev->rx_queue, entry)) {
+		WRITE_ONCE(odev->rx_drops, odev->rx_drops + 1);
+		dev_warn_ratelimited(&odev->serdev->dev, "RX queue full, message type %u dropped\n",
+				     msg->header.message_type);
+		return;
+	}
+
+	depth = kfifo_len(&odev->rx_queue);
+	if (depth > odev->rx_queue_max)
+		WRITE_ONCE(odev->rx_queue_max, depth);
+
+	queue_work(odev->rx_wq, &odev->rx_work);
+}
+
+/* Hand a received message to the registered callbacks, from rx_work */
+static void oac_dev_dispatch(struct oac_dev *odev, struct Message *msg, u64 rx_ns)
+{
+	u64 start = ktime_get_ns(), end;
+	struct EventBody event;
+
+	switch (msg->header.message_type) {
+	case OAC_MESSAGE_TYPE_EVENT:
+		/* Callbacks get the command an event carries, and it is timed on its way to them */
+		event = msg->body.payload_event;
+		msg->header.message_type = OAC_MESSAGE_TYPE_COMMAND;
+		msg->header.payload_length = sizeof(struct CommandBody);
+		msg->body.payload_command.command = event.command;
+		oac_dev_publish(odev, msg);
+		end = ktime_get_ns();
+		oac_latency_event(odev, &event, rx_ns, end);
+		break;
+
+	case OAC_MESSAGE_TYPE_ERROR_CODE:
+		oac_error_handle(odev, &msg->body.payload_error_code);
+		fallthrough;
+
+	default:
+		oac_dev_publish(odev, msg);
+		end = ktime_get_ns();
+		break;
+	}
+
+	oac_stats_dispatch(odev, end - start);
+	trace_oac_dispatch(msg->header.message_type, oac_dev_sub_key(msg), end - rx_ns);
+}
+
+/*
+ * Run the callbacks for queued messages, in the order they arrived. The
+ * callbacks can be slow, e.g. the battery driver notifying power supply
+ * listeners, which would hold up the tty flip buffer in oac_dev_receive().
+ */
+static void oac_dev_rx_work(struct work_struct *work)
+{
+	struct oac_dev *odev = container_of(work, struct oac_dev, rx_work);
+	struct oac_dev_rx_msg entry;
+
+	while (kfifo_get(&odev->rx_queue, &entry))
+		oac_dev_dispatch(odev, &entry.msg, entry.rx_ns);
+}
+
+static void oac_dev_handle_message(struct oac_dev *odev, struct Message *msg);
+
+/* Handle each message of a batch as if it had arrived in a frame of its own */
+static void oac_dev_handle_batch(struct oac_dev *odev, const struct Message *batch)
+{
+	struct Message msg = {};
+	size_t pos = 0;
+	u8 seq = batch->header.seq;
+	int ret;
+
+	while ((ret = oac_batch_next(batch, &pos, &msg)) != 0) {
+		msg.header.seq = seq++;
+		if (ret < 0) {
+			dev_warn_ratelimited(&odev->serdev->dev, "Malformed message in batch\n");
+			oac_stats_error(odev, OAC_STATS_ERR_MALFORMED);
+			oac_dev_rx_error(odev);
+			continue;
+		}
+		oac_dev_handle_message(odev, &msg);
+	}
+}
+
+static void oac_dev_handle_message(struct oac_dev *odev, struct Message *msg)
+{
+	struct device *dev = &odev->serdev->dev;
+
+	if (msg->header.message_type == OAC_MESSAGE_TYPE_BATCH) {
+		oac_dev_handle_batch(odev, msg);
+		return;
+	}
+
+	if (odev->rx_framing == OAC_PROTOCOL_V2 && oac_dev_handle_sequence(odev, msg))
+		return;
+
+	if (msg->header.message_type == OAC_MESSAGE_TYPE_COMMAND &&
+	    OAC_COMMAND_IS_LINK(msg->body.payload_command.command)) {
+		oac_dev_handle_link_command(odev, msg->body.payload_command.command);
+		return;
+	}
+
+	if (msg->header.message_type == OAC_MESSAGE_TYPE_RESPONSE &&
+	    OAC_COMMAND_IS_LINK(msg->body.payload_response.param)) {
+		oac_clock_handle(odev, msg);
+		return;
+	}
+
+	if (msg->header.message_type == OAC_MESSAGE_TYPE_REPLY) {
+		oac_dev_handle_reply(odev, &msg->body.payload_reply);
+		return;
+	}
+
+	if (msg->header.message_type == OAC_MESSAGE_TYPE_DATA) {
+		oac_bulk_handle(odev, msg);
+		return;
+	}
+
+	switch (msg->header.message_type) {
+	case OAC_MESSAGE_TYPE_STATUS:
+	case OAC_MESSAGE_TYPE_COMMAND:
+	case OAC_MESSAGE_TYPE_RESPONSE:
+	case OAC_MESSAGE_TYPE_ERROR:
+	case OAC_MESSAGE_TYPE_ERROR_CODE:
+	case OAC_MESSAGE_TYPE_EVENT:
+		oac_dev_queue_rx(odev, msg);
+		break;
+
+	default:
+		dev_warn(dev, "Unknown message type: %u\n", msg->header.message_type);
+		break;
+	}
+}
+
+static int oac_dev_receive(struct serdev_device *serdev, const u8 *data, size_t count)
+{
+	struct oac_dev *odev = serdev_device_get_drvdata(serdev);
+	struct oac_rx_frame frame;
+	struct Message msg = {};	/* bytes the decoder leaves reach /dev/oacN readers */
+	size_t pos = 0;
+	int ret;
+
+	if (READ_ONCE(odev->fw_active))
+		return oac_fw_receive(odev, data, count);
+
+	odev->rx_ns = ktime_get_ns();
+
+	/* Read per frame, the one after PROTO_ACK_V2 may already be v2 */
+	while ((ret = oac_rx_next(&odev->rx, data, count, &pos,
+				  READ_ONCE(odev->proto_version) == OAC_PROTOCOL_V2, &frame)) != 0) {
+		if (ret < 0) {
+			oac_stats_rx_error(odev, NULL, ret);
+		} else {
+			ret = oac_decode_frame(frame.data, frame.len, frame.framing, &msg);
+			if (ret < 0)
+				oac_stats_rx_error(odev, &frame, ret);
+		}
+		if (ret < 0) {
+			trace_oac_parse_error(ret, pos, count);
+			dev_warn_ratelimited(&serdev->dev, "Malformed frame dropped: %d\n", ret);
+			oac_dev_rx_error(odev);
+			continue;
+		}
+
+		trace_oac_rx_frame(frame.framing, &msg);
+		/* Both framings add two bytes, START and END or COBS and the delimiter */
+		oac_stats_frame(odev, OAC_STATS_RX, msg.header.message_type, frame.len + 2);
+		odev->rx_framing = frame.framing;
+		oac_dev_handle_message(odev, &msg);
+	}
+
+	if (odev->rx.resyncs) {
+		oac_stats_resync(odev, odev->rx.resyncs);
+		odev->rx.resyncs = 0;
 	}
 
 	return count;
 }
 
+/*
+ * oac_dev_park_link - Hand the UART over, for a firmware update
+ *
+ * Until oac_dev_restart_link() received bytes go to oac_fw_receive() and
+ * messages are not sent, their senders get -EBUSY or time out.
+ */
+void oac_dev_park_link(struct oac_dev *odev)
+{
+	mutex_lock(&odev->tx_lock);
+	WRITE_ONCE(odev->fw_active, true);
+	odev->tx_batch_count = 0;
+	mutex_unlock(&odev->tx_lock);
+
+	mutex_lock(&odev->baud_lock);
+	odev->baud_state = OAC_BAUD_IDLE;
+	mutex_unlock(&odev->baud_lock);
+	cancel_delayed_work_sync(&odev->baud_work);
+
+	serdev_device_wait_until_sent(odev->serdev, msecs_to_jiffies(OAC_BAUD_PROBE_MS));
+}
+
+/* Bring the link up again as at probe, the MCU has restarted */
+void oac_dev_restart_link(struct oac_dev *odev)
+{
+	mutex_lock(&odev->baud_lock);
+	odev->baud_rung = 0;
+	odev->baud_state = OAC_BAUD_IDLE;
+	mutex_unlock(&odev->baud_lock);
+
+	oac_rx_reset(&odev->rx);
+	WRITE_ONCE(odev->proto_version, OAC_PROTOCOL_V1);
+	WRITE_ONCE(odev->fw_active, false);
+
+	oac_dev_baud_reset_peer(odev);
+	if (oac_dev_negotiate_protocol(odev) < 0)
+		dev_warn(&odev->serdev->dev, "Failed to request protocol v2, staying on v1\n");
+}
+
+static ssize_t rx_queue_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct oac_dev *odev = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "depth=%u max=%u drops=%u\n", kfifo_len(&odev->rx_queue),
+			  READ_ONCE(odev->rx_queue_max), READ_ONCE(odev->rx_drops));
+}
+static DEVICE_ATTR_RO(rx_queue);
+
+static struct attribute *oac_dev_attrs[] = {
+	&dev_attr_rx_queue.attr,
+	NULL,
+};
+
+static const struct attribute_group oac_dev_group = {
+	.attrs = oac_dev_attrs,
+};
+
 static const struct serdev_device_ops oac_serdev_ops = {
 	.receive_buf = oac_dev_receive,
 };
 
+/* Undo the probe from the opened port on, the subdrivers are gone */
+static void oac_dev_close_link(struct oac_dev *dev)
+{
+	oac_cdev_exit(dev);
+
+	mutex_lock(&dev->tx_lock);
+	dev->tx_closed = true;
+	mutex_unlock(&dev->tx_lock);
+
+	/* Neither is armed again now, but for retransmit_work by itself */
+	cancel_delayed_work_sync(&dev->batch_work);
+	cancel_delayed_work_sync(&dev->retransmit_work);
+
+	/* Stop the baud negotiation while the port is still open to finish a step on */
+	mutex_lock(&dev->baud_lock);
+	dev->baud_closed = true;
+	dev->baud_state = OAC_BAUD_IDLE;
+	mutex_unlock(&dev->baud_lock);
+	cancel_delayed_work_sync(&dev->baud_work);
+
+	oac_dev_request_close(dev);
+	oac_clock_exit(dev);
+	serdev_device_close(dev->serdev);
+	destroy_workqueue(dev->rx_wq);
+	/* Last, a step that settled before baud_closed queued param_sync_work */
+	oac_param_exit(dev);
+	oac_bulk_exit(dev);
+}
+
 static int oac_dev_probe(struct serdev_device *serdev)
 {
 	struct oac_dev *dev;
+	int i, ret;
 
 	dev_info(&serdev->dev, "Probing oac_dev driver \n");
 	
@@ -191,28 +1293,83 @@ static int oac_dev_probe(struct serdev_device *serdev)
 		return -ENOMEM;
 
 	spin_lock_init(&dev->status_lock);
+	spin_lock_init(&dev->req_lock);
+	mutex_init(&dev->tx_lock);
+	mutex_init(&dev->baud_lock);
+	INIT_DELAYED_WORK(&dev->retransmit_work, oac_dev_retransmit_work);
+	INIT_DELAYED_WORK(&dev->baud_work, oac_dev_baud_work);
+	INIT_DELAYED_WORK(&dev->batch_work, oac_dev_batch_work);
+	INIT_DELAYED_WORK(&dev->request_work, oac_dev_request_work);
+	INIT_WORK(&dev->rx_work, oac_dev_rx_work);
+	INIT_KFIFO(dev->rx_queue);
+	mutex_init(&dev->sub_lock);
+	for (i = 0; i < OAC_DEV_SUB_TYPES; i++)
+		INIT_LIST_HEAD(&dev->subs[i]);
+	dev->proto_version = OAC_PROTOCOL_V1;
+
+	/* Ordered, callbacks see messages in the order they arrived */
+	dev->rx_wq = alloc_ordered_workqueue("oac_rx/%s", WQ_HIGHPRI, dev_name(&serdev->dev));
+	if (!dev->rx_wq)
+		return -ENOMEM;
 
 	serdev_device_set_drvdata(serdev, dev);
 	dev->serdev = serdev;
+	oac_param_init(dev);
+	ret = oac_stats_init(dev);
+	if (ret < 0)
+		goto err_param;
+	oac_bulk_init(dev);
+	oac_fw_init(dev);
+	oac_latency_init(dev);
 
 	serdev_device_set_client_ops(serdev, &oac_serdev_ops);
 
-	if (serdev_device_open(serdev) < 0)
-		return dev_err_probe(&serdev->dev, -ENODEV, "Failed to open serdev");
+	if (serdev_device_open(serdev) < 0) {
+		ret = dev_err_probe(&serdev->dev, -ENODEV, "Failed to open serdev");
+		goto err_param;
+	}
 
 	serdev_device_set_baudrate(serdev, OAC_DEV_BR);
 	serdev_device_set_flow_control(serdev, false);
 	serdev_device_set_parity(serdev, SERDEV_PARITY_NONE);
 
+	/* The MCU may still be on a faster rate negotiated before a reload */
+	oac_dev_baud_reset_peer(dev);
+
+	if (oac_dev_negotiate_protocol(dev) < 0)
+		dev_warn(&serdev->dev, "Failed to request protocol v2, staying on v1\n");
+
+	oac_clock_init(dev);
+
+	if (oac_cdev_init(dev) < 0)
+		dev_warn(&serdev->dev, "Failed to register /dev/oacN\n");
+
+	ret = mfd_add_devices(&serdev->dev, PLATFORM_DEVID_AUTO,
+			      cells, ARRAY_SIZE(cells), NULL, 0, NULL);
+	if (ret) {
+		dev_err(&serdev->dev, "Failed to add subdevices: %d\n", ret);
+		goto err_link;
+	}
+
 	dev_info(&serdev->dev, "Probe complete \n");
+	return 0;
 
-	return devm_mfd_add_devices(&serdev->dev, PLATFORM_DEVID_AUTO,
-				 cells, ARRAY_SIZE(cells), NULL, 0, NULL);
+err_link:
+	oac_dev_close_link(dev);
+	return ret;
+err_param:
+	oac_param_exit(dev);
+	destroy_workqueue(dev->rx_wq);
+	return ret;
 }
 
 static void oac_dev_remove(struct serdev_device *serdev)
 {
-	serdev_device_close(serdev);
+	struct oac_dev *dev = serdev_device_get_drvdata(serdev);
+
+	/* The subdrivers go first, they still send while unbinding */
+	mfd_remove_devices(&serdev->dev);
+	oac_dev_close_link(dev);
 }
 
 static const struct of_device_id oac_dev_of_match[] = {
@@ -221,10 +1378,21 @@ static const struct of_device_id oac_dev_of_match[] = {
 };
 MODULE_DEVICE_TABLE(of, oac_dev_of_match);
 
+static const struct attribute_group *oac_dev_groups[] = {
+	&oac_dev_group,
+	&oac_fw_group,
+	&oac_clock_group,
+	&oac_latency_group,
+	&oac_error_group,
+	&oac_stats_group,
+	NULL,
+};
+
 static struct serdev_device_driver oac_dev_driver = {
 	.driver = {
 		.name = "oac_dev",
 		.of_match_table = oac_dev_of_match,
+		.dev_groups = oac_dev_groups,
 	},
 	.probe = oac_dev_probe,
 	.remove = oac_dev_remove,
@@ -2,16 +2,51 @@
 #ifndef OAC_DEV_H
 #define OAC_DEV_H
 
-#define OAC_RX_BUF_SIZE 128
-#define OAC_DEV_BR		9600
-#define OAC_DEV_MAX_CB	12
+#define OAC_DEV_BR		9600	/* rung 0 of OAC_BAUD_LADDER */
+#define OAC_DEV_SUB_TYPES	16	/* Message types subscriptions can be keyed by */
+#define OAC_RX_QUEUE_LEN	16	/* Messages waiting for the callbacks, power of two */
+#define OAC_PROTO_RETRY_MS	1000	/* Min interval between v2 negotiation retries */
+#define OAC_RETRANSMIT_MS	100	/* Resend a command not acknowledged within this time */
+#define OAC_MAX_RETRANSMITS	3	/* Give up on a command after this many resends */
+#define OAC_MAX_UNACKED		4	/* Commands awaiting acknowledgement */
+#define OAC_BATCH_WINDOW_MS	5	/* Messages sent within this time share one frame */
+#define OAC_MAX_REQUESTS	8	/* Requests awaiting a reply */
+#define OAC_REQUEST_TIMEOUT_MS	500	/* Default time the MCU has to reply to a request */
+#define OAC_BAUD_PROBE_MS	250	/* Probe echo must arrive within this time of switching */
+#define OAC_BAUD_SETTLE_MS	20	/* Time the MCU gets to act on a rung 0 request */
+#define OAC_BAUD_ERROR_LIMIT	8	/* Frame errors within OAC_BAUD_ERROR_WINDOW_MS ... */
+#define OAC_BAUD_ERROR_WINDOW_MS 1000	/* ... above rung 0 drop the link back to rung 0 */
+#define OAC_BULK_RETRY_MS	250	/* Resend from the last credit when no credit arrives within this time */
+#define OAC_BULK_MAX_RETRIES	4	/* Give up after this many resends without progress */
+#define OAC_BULK_RX_WINDOW	2048	/* Bytes the MCU may send ahead of the last credit */
+#define OAC_BULK_MAX_SINKS	4
+#define OAC_CLOCK_SYNC_MS	2000	/* Interval between pings once synchronised */
+#define OAC_CLOCK_FAST_MS	100	/* ... and until OAC_CLOCK_MIN_SAMPLES pings were answered */
+#define OAC_CLOCK_FAST_TRIES	10	/* ... unless this many in a row went unanswered */
+#define OAC_CLOCK_MIN_SAMPLES	4
+#define OAC_CLOCK_SAMPLES	32	/* Pings the estimate is made from */
+#define OAC_CLOCK_WINDOW_S	120	/* Older pings are not used */
+#define OAC_LATENCY_SUB_BITS	3	/* Histogram buckets per octave, as a power of two */
+#define OAC_LATENCY_BUCKETS	((32 - OAC_LATENCY_SUB_BITS + 1) << OAC_LATENCY_SUB_BITS)
+#define OAC_STATS_TYPES		16	/* Message types counted apart, higher ones are unknown */
 
 #include <linux/types.h>
+#include <linux/kfifo.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
 #include <linux/serdev.h>
+#include <linux/spinlock.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 #include "oac_comms.h"
 
-/* Forward declaration */
+/* Forward declarations */
 struct oac_dev;
+struct oac_cdev;
 
 /* Watchdog operation interface (used by subdrivers) */
 struct oac_watchdog_ops {
@@ -21,14 +56,302 @@ struct oac_watchdog_ops {
 	int (*set_timeout)(struct oac_dev *dev);
 };
 
+/* Protocol v2 command frame awaiting acknowledgement */
+struct oac_dev_unacked {
+	unsigned long sent;	/* jiffies of the last transmission */
+	u16 command;
+	u8 seq;
+	u8 retries;
+	bool used;
+};
+
+/* MCU parameters, cached by oac_dev, see oac_param.c */
+enum oac_param {
+	OAC_PARAM_STATUS_VOLT_DELTA,
+	OAC_PARAM_STATUS_LVL_DELTA,
+	OAC_PARAM_STATUS_EVENTS,
+	OAC_PARAM_STATUS_KEEPALIVE,
+	OAC_PARAM_STATUS_MIN_INTERVAL,
+	OAC_PARAM_LED_BRIGHTNESS,
+	OAC_PARAM_COUNT,
+};
+
+struct oac_param_val {
+	enum oac_param param;
+	u64 val;
+};
+
+struct oac_dev_request;
+typedef void (*oac_dev_request_cb_t)(struct oac_dev *dev, struct oac_dev_request *req);
+
+/*
+ * A request to the MCU, answered by a reply carrying the same transaction ID.
+ * Owned by the caller, which must keep it until @complete has been called.
+ */
+struct oac_dev_request {
+	u16 command;
+	u64 val;			/* argument, replaced by the reply's value */
+	unsigned int timeout_ms;	/* 0 for OAC_REQUEST_TIMEOUT_MS */
+	int result;			/* 0, the MCU's error, -ETIMEDOUT or -ENODEV */
+	oac_dev_request_cb_t complete;	/* called once with the result, must not sleep */
+	void *context;
+
+	/* Private to oac_dev */
+	u8 tid;
+	bool sent;
+	unsigned long deadline;
+};
+
+/* Baud rate negotiation state, see oac_dev_baud_work() */
+enum oac_baud_state {
+	OAC_BAUD_IDLE,
+	OAC_BAUD_WAIT_ACK,	/* request sent at the current rate */
+	OAC_BAUD_SWITCH,	/* MCU acknowledged, switch and probe */
+	OAC_BAUD_WAIT_PROBE,	/* switched, waiting for the probe echo */
+	OAC_BAUD_FALLBACK,	/* too many errors, back to rung 0 */
+};
+
+/* Bulk transfer state, see oac_bulk.c */
+enum oac_bulk_state {
+	OAC_BULK_IDLE,
+	OAC_BULK_OPENING,	/* sender: OPEN sent, waiting for the first credit */
+	OAC_BULK_SENDING,	/* sender: credit received / receiver: object open */
+	OAC_BULK_DONE,		/* receiver: complete, the final credit is repeated on request */
+};
+
+typedef void (*oac_bulk_done_t)(struct oac_dev *dev, int result, void *context);
+typedef void (*oac_bulk_sink_t)(struct oac_dev *dev, u8 object, const void *data,
+				size_t size, void *context);
+
+/* Object being sent, the caller's buffer is read until @done has been called */
+struct oac_bulk_tx {
+	enum oac_bulk_state state;
+	const u8 *data;
+	u32 size;
+	u8 object;
+	u8 xfer;		/* transfer ID, 0 until the first transfer */
+	u8 retries;		/* resends since the last progress */
+	u32 acked;		/* everything below arrived */
+	u32 next;		/* next byte to send */
+	u32 limit;		/* credit, bytes below may be sent */
+	unsigned long time;	/* jiffies of the last progress or resend */
+	u64 busy_until;		/* ktime_get_ns() at which the UART will have sent the chunks */
+	oac_bulk_done_t done;
+	void *context;
+};
+
+/* Object being received, kept after a failed transfer so the next OPEN can resume it */
+struct oac_bulk_rx {
+	enum oac_bulk_state state;
+	u8 object;
+	u8 xfer;
+	bool resent;		/* RESEND sent since the last progress */
+	unsigned long resend_time;
+	u32 size;
+	u32 offset;		/* everything below is in buf */
+	u32 credited;		/* offset of the last credit sent */
+	u8 *buf;
+};
+
+struct oac_bulk_sink {
+	u8 object;
+	size_t max_size;
+	oac_bulk_sink_t cb;	/* NULL for a free slot */
+	void *context;
+};
+
+/* MCU clock synchronisation, see oac_clock.c */
+struct oac_clock_sample {
+	u64 fw_us;
+	s64 mono_ns;		/* ktime_get_ns() at fw_us */
+	s64 delay_ns;		/* round trip less the time on the line */
+};
+
+/* MCU time fw_us is CLOCK_MONOTONIC mono_ns, which runs drift_ppb faster */
+struct oac_clock_fit {
+	u64 fw_us;
+	s64 mono_ns;
+	s32 drift_ppb;
+	u32 error_ns;		/* half the quickest delay */
+	unsigned int samples;	/* the fit was made from */
+};
+
+/* Event latency, see oac_latency.c */
+enum oac_latency_span {
+	OAC_LATENCY_FIRMWARE,
+	OAC_LATENCY_LINK,
+	OAC_LATENCY_DISPATCH,
+	OAC_LATENCY_SPANS,
+};
+
+struct oac_latency_hist {
+	u32 buckets[OAC_LATENCY_BUCKETS];
+	u32 count;
+	u32 max_us;
+};
+
+/* Link statistics, see oac_stats.c */
+enum oac_stats_dir {
+	OAC_STATS_RX,
+	OAC_STATS_TX,
+	OAC_STATS_DIRS,
+};
+
+/* Why a received frame was dropped */
+enum oac_stats_error {
+	OAC_STATS_ERR_OVERFLOW,		/* longer than the receive buffer */
+	OAC_STATS_ERR_FRAMING,		/* bad END byte or COBS encoding */
+	OAC_STATS_ERR_CHECKSUM,		/* v1 checksum or v2 CRC mismatch */
+	OAC_STATS_ERR_UNKNOWN_TYPE,
+	OAC_STATS_ERR_MALFORMED,	/* length or payload does not decode, in a batch too */
+	OAC_STATS_ERRORS,
+};
+
+/* Per CPU, added up by oac_stats_sum() */
+struct oac_stats {
+	u64_stats_t frames[OAC_STATS_DIRS][OAC_STATS_TYPES];
+	u64_stats_t bytes[OAC_STATS_DIRS][OAC_STATS_TYPES];
+	u64_stats_t errors[OAC_STATS_ERRORS];
+	u64_stats_t resyncs;		/* frame starts found after skipping other bytes */
+	u64_stats_t dispatches;
+	u64_stats_t dispatch_ns;	/* in the callbacks, in total */
+	struct u64_stats_sync syncp;
+};
+
+typedef void (*oac_dev_message_cb_t)(struct oac_dev *core, const struct Message *msg, void *context);
+
+/*
+ * A subscriber to one message type, see oac_dev_subscribe(). @first and
+ * @last select the commands of COMMAND messages (events arrive as these) and
+ * the parameters of RESPONSE messages.
+ */
+struct oac_dev_subscription {
+	struct list_head node;
+	u16 first;
+	u16 last;
+	oac_dev_message_cb_t cb;
+	void *context;
+	struct rcu_head rcu;
+};
+
+/* A received message on its way to the callbacks */
+struct oac_dev_rx_msg {
+	struct Message msg;
+	u64 rx_ns;		/* ktime_get_ns() its bytes arrived at */
+};
+
 /* Top-level device structure for the OAC Device */
 struct oac_dev {
 	struct serdev_device *serdev;
 
-	u8 rx_buf[OAC_RX_BUF_SIZE];
-	int rx_pos;
-	bool receiving;
-	size_t expected_len;
+	struct oac_rx rx;
+	u8 rx_framing;		/* framing of the message being handled */
+	u64 rx_ns;		/* ktime_get_ns() the bytes being parsed arrived at */
+
+	/*
+	 * Messages for the callbacks, see oac_dev_rx_work(). Filled by the receive
+	 * path and emptied by rx_work only, so the kfifo needs no lock.
+	 */
+	DECLARE_KFIFO(rx_queue, struct oac_dev_rx_msg, OAC_RX_QUEUE_LEN);
+	struct workqueue_struct *rx_wq;
+	struct work_struct rx_work;
+	unsigned int rx_queue_max;	/* deepest rx_queue has been */
+	unsigned int rx_drops;		/* messages dropped on a full rx_queue */
+
+	/* Subscriptions by message type, read under RCU, see oac_dev_publish() */
+	struct mutex sub_lock;		/* serializes changes to subs */
+	struct list_head subs[OAC_DEV_SUB_TYPES];
+
+	/* Negotiated protocol version, selects the framing we transmit with */
+	u8 proto_version;
+	bool proto_negotiating;
+	unsigned long proto_req_time;
+
+	/* Protocol v2 reliable delivery, see oac_dev_handle_sequence() */
+	struct mutex tx_lock;		/* serializes transmission, protects tx_seq and unacked */
+	u8 tx_seq;
+	struct oac_dev_unacked unacked[OAC_MAX_UNACKED];
+	unsigned int tx_failures;	/* commands dropped without acknowledgement */
+	bool tx_closed;			/* device going away, nothing more is sent */
+	struct delayed_work retransmit_work;
+	u8 rx_expected_seq;
+	bool rx_seq_valid;
+	u64 rx_seen;			/* bit n: frame rx_expected_seq - 1 - n received */
+
+	/* Protocol v2 batching, see oac_dev_queue(). Protected by tx_lock */
+	u8 tx_batch[OAC_MAX_PAYLOAD_SIZE];
+	size_t tx_batch_len;
+	u8 tx_batch_count;		/* messages in tx_batch */
+	u8 tx_batch_seq;		/* sequence number of the first */
+	struct delayed_work batch_work;
+
+	/* Requests awaiting a reply, see oac_dev_request_async() */
+	spinlock_t req_lock;		/* protects the req_* fields and requests */
+	u8 req_tid;			/* next transaction ID */
+	bool req_closed;		/* device going away, no new requests */
+	struct oac_dev_request *requests[OAC_MAX_REQUESTS];
+	struct delayed_work request_work;
+
+	/* MCU parameter cache, see oac_param.c */
+	struct mutex param_lock;	/* serializes parameter writes */
+	u64 param_cache[OAC_PARAM_COUNT];	/* written under param_lock, read without */
+	unsigned long param_dirty;	/* bit n: parameter n differs from the MCU's default */
+	struct work_struct param_sync_work;
+	struct dentry *debugfs;
+
+	/* Link speed, a rung of OAC_BAUD_LADDER */
+	struct mutex baud_lock;		/* protects the baud_* fields */
+	u8 baud_rung;			/* confirmed rung */
+	u8 baud_target;			/* rung being negotiated */
+	enum oac_baud_state baud_state;
+	unsigned int baud_errors;	/* frame errors in the current window */
+	unsigned long baud_error_time;	/* start of the current window */
+	bool baud_closed;		/* device going away, baud_work is not armed again */
+	struct delayed_work baud_work;
+
+	/* Bulk transfers, see oac_bulk.c */
+	struct mutex bulk_lock;		/* protects the bulk_* fields */
+	struct oac_bulk_tx bulk_tx;
+	struct oac_bulk_rx bulk_rx;
+	struct oac_bulk_sink bulk_sinks[OAC_BULK_MAX_SINKS];
+	struct delayed_work bulk_work;
+
+	/* MCU firmware update, see oac_fw.c */
+	struct mutex fw_lock;		/* serializes updates */
+	bool fw_active;			/* the bootloader has the link, frames are not sent */
+	spinlock_t fw_rx_lock;		/* protects fw_rx, fw_rx_len and fw_result */
+	u8 fw_rx[OAC_FW_PAGE_SIZE + 2];
+	size_t fw_rx_len;
+	wait_queue_head_t fw_wait;
+	u32 fw_resume_crc;		/* image of an update that stopped part way, 0 if none */
+	unsigned int fw_resume_page;	/* first page of it not written yet */
+	char fw_result[64];		/* progress or outcome, for sysfs */
+
+	/* MCU clock synchronisation, see oac_clock.c */
+	spinlock_t clock_lock;		/* protects the clock_* fields */
+	struct oac_clock_sample clock_samples[OAC_CLOCK_SAMPLES];
+	unsigned int clock_count;	/* samples in clock_samples */
+	unsigned int clock_next;	/* slot of the next sample */
+	u8 clock_ping_id;
+	bool clock_ping_pending;
+	u8 clock_missed;		/* pings given up on since the last answer */
+	u64 clock_ping_ns;		/* ktime_get_ns() the pending ping was sent at */
+	s64 clock_ping_line_ns;		/* its time on the line */
+	struct oac_clock_fit clock_fit;
+	struct delayed_work clock_work;
+
+	/* Event latency histograms, see oac_latency.c */
+	spinlock_t latency_lock;
+	struct oac_latency_hist latency[OAC_LATENCY_SPANS];
+
+	/* Link statistics, see oac_stats.c */
+	struct oac_stats __percpu *stats;
+
+	/* /dev/oacN, see oac_cdev.c */
+	struct oac_cdev *cdev;
+
+	/* MCU error occurrences by code, see oac_error.c */
+	unsigned int error_counts[OAC_ERROR_CODES];
 
 	/* Last received status from MCU */
 	struct StatusBody latest_status;
@@ -39,13 +362,61 @@ struct oac_dev {
 
 };
 
-typedef void (*oac_dev_message_cb_t)(struct oac_dev *core, const struct Message *msg);
-
-int oac_dev_register_callback(struct oac_dev *core, oac_dev_message_cb_t cb);
-void oac_dev_unregister_callback(struct oac_dev *core, oac_dev_message_cb_t cb);
+int oac_dev_subscribe(struct oac_dev *core, u8 type, u16 first, u16 last,
+		      oac_dev_message_cb_t cb, void *context);
+void oac_dev_unsubscribe(struct oac_dev *core, oac_dev_message_cb_t cb, void *context);
 
 int oac_dev_send_message(struct oac_dev *dev, struct Message *msg);
-struct list_head message_callbacks;
+int oac_dev_request_async(struct oac_dev *dev, struct oac_dev_request *req);
+int oac_dev_request(struct oac_dev *dev, u16 command, u64 val, u64 *reply,
+		    unsigned int timeout_ms);
+
+int oac_dev_param_get(struct oac_dev *dev, enum oac_param param, u64 *val);
+int oac_dev_param_set(struct oac_dev *dev, enum oac_param param, u64 val);
+int oac_dev_param_set_bulk(struct oac_dev *dev, const struct oac_param_val *vals,
+			   unsigned int count);
+
+int oac_bulk_send(struct oac_dev *dev, u8 object, const void *data, size_t size,
+		  oac_bulk_done_t done, void *context);
+void oac_bulk_cancel(struct oac_dev *dev);
+int oac_bulk_register_sink(struct oac_dev *dev, u8 object, size_t max_size,
+			   oac_bulk_sink_t cb, void *context);
+void oac_bulk_unregister_sink(struct oac_dev *dev, u8 object);
+
+int oac_clock_get(struct oac_dev *dev, struct oac_clock_fit *fit);
+int oac_clock_to_ktime(struct oac_dev *dev, u64 fw_us, ktime_t *mono);
+
+/* Internal to oac_driver */
+void oac_param_init(struct oac_dev *dev);
+void oac_param_sync(struct oac_dev *dev);
+void oac_param_exit(struct oac_dev *dev);
+void oac_bulk_init(struct oac_dev *dev);
+void oac_bulk_handle(struct oac_dev *dev, const struct Message *msg);
+void oac_bulk_exit(struct oac_dev *dev);
+unsigned int oac_dev_baud(struct oac_dev *dev);
+void oac_fw_init(struct oac_dev *dev);
+int oac_fw_receive(struct oac_dev *dev, const u8 *data, size_t count);
+extern const struct attribute_group oac_fw_group;
+void oac_dev_park_link(struct oac_dev *dev);
+void oac_dev_restart_link(struct oac_dev *dev);
+void oac_clock_init(struct oac_dev *dev);
+void oac_clock_handle(struct oac_dev *dev, const struct Message *msg);
+void oac_clock_exit(struct oac_dev *dev);
+extern const struct attribute_group oac_clock_group;
+void oac_latency_init(struct oac_dev *dev);
+void oac_latency_event(struct oac_dev *dev, const struct EventBody *event, u64 rx_ns, u64 done_ns);
+extern const struct attribute_group oac_latency_group;
+void oac_error_handle(struct oac_dev *dev, const struct ErrorCodeBody *err);
+extern const struct attribute_group oac_error_group;
+int oac_stats_init(struct oac_dev *dev);
+void oac_stats_frame(struct oac_dev *dev, enum oac_stats_dir dir, u8 type, size_t bytes);
+void oac_stats_rx_error(struct oac_dev *dev, const struct oac_rx_frame *frame, int err);
+void oac_stats_error(struct oac_dev *dev, enum oac_stats_error err);
+void oac_stats_resync(struct oac_dev *dev, unsigned int count);
+void oac_stats_dispatch(struct oac_dev *dev, u64 ns);
+extern const struct attribute_group oac_stats_group;
+int oac_cdev_init(struct oac_dev *dev);
+void oac_cdev_exit(struct oac_dev *dev);
 
 
 #endif /* OAC_DEV_H */
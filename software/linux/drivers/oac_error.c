@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * MCU errors
+ *
+ * The MCU sends an error as its code from the error catalog in protocol.def,
+ * with a context value and how often it happened since it last sent it, at
+ * most once per limit of the catalog. The message is looked up here and the
+ * occurrences are added up per code, for the errors attribute of the serdev
+ * device.
+ */
+#include <linux/serdev.h>
+#include <linux/sysfs.h>
+#include "oac_comms.h"
+#include "oac_dev.h"
+
+static const char *oac_error_message(u8 code)
+{
+	switch (code) {
+#define OAC_ERROR_MESSAGE(code, origin, limit_ms, message) case code: return message;
+	OAC_ERROR_CATALOG(OAC_ERROR_MESSAGE)
+#undef OAC_ERROR_MESSAGE
+	default:
+		return "Unknown error";
+	}
+}
+
+/* Log an ERROR_CODE message and count its occurrences */
+void oac_error_handle(struct oac_dev *odev, const struct ErrorCodeBody *err)
+{
+	if (err->code < OAC_ERROR_CODES)
+		WRITE_ONCE(odev->error_counts[err->code],
+			   odev->error_counts[err->code] + err->count);
+
+	dev_warn(&odev->serdev->dev, "MCU error %u: %s (x%u, context %u)\n",
+		 err->code, oac_error_message(err->code), err->count, err->context);
+}
+
+static ssize_t errors_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct oac_dev *odev = dev_get_drvdata(dev);
+	unsigned int count;
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < OAC_ERROR_CODES; i++) {
+		count = READ_ONCE(odev->error_counts[i]);
+		if (count)
+			len += sysfs_emit_at(buf, len, "%d count=%u %s\n",
+					     i, count, oac_error_message(i));
+	}
+	return len;
+}
+static DEVICE_ATTR_RO(errors);
+
+static struct attribute *oac_error_attrs[] = {
+	&dev_attr_errors.attr,
+	NULL,
+};
+
+const struct attribute_group oac_error_group = {
+	.attrs = oac_error_attrs,
+};
@@ -0,0 +1,371 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * MCU firmware update over the serdev link
+ *
+ * The ATmega can only write its flash from the boot section, and has no room
+ * for a second image, so updates go through the Optiboot bootloader already
+ * on it. The firmware hands the UART over when asked with COMMAND_FW_UPDATE,
+ * and the image is written one FW_PAGE_SIZE page at a time with STK500v1,
+ * each page read back and compared before the next.
+ *
+ * Page 0 is first replaced with a stub that restarts the bootloader, and only
+ * written with the image's own page 0 once every other page is in place. An
+ * interrupted update leaves the MCU going round the bootloader, and writing
+ * the same image again picks up at the page it stopped at.
+ *
+ * Start an update by writing a file name under /lib/firmware to the
+ * firmware_update attribute of the serdev device, reading it shows progress
+ * or the outcome of the last update.
+ */
+#include <linux/crc32.h>
+#include <linux/delay.h>
+#include <linux/firmware.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/serdev.h>
+#include <linux/sysfs.h>
+#include <linux/wait.h>
+#include "oac_comms.h"
+#include "oac_dev.h"
+
+/* STK500v1, the part Optiboot implements */
+#define STK_OK			0x10
+#define STK_INSYNC		0x14
+#define STK_CRC_EOP		0x20
+#define STK_GET_SYNC		0x30
+#define STK_LEAVE_PROGMODE	0x51
+#define STK_LOAD_ADDRESS	0x55
+#define STK_PROG_PAGE		0x64
+#define STK_READ_PAGE		0x74
+#define STK_READ_SIGN		0x75
+
+#define OAC_FW_SYNC_MS		50	/* Each sync attempt */
+#define OAC_FW_CMD_MS		500	/* Any other command, a page write takes about 5 ms */
+#define OAC_FW_WAIT_MS		2000	/* Bootloader timeout, it restarts the firmware after it */
+#define OAC_FW_BOOT_MS		200	/* Time the new firmware gets to start */
+#define OAC_FW_RETRIES		3	/* Attempts per page */
+
+/* Page 0 while the update runs: clear MCUSR and start the bootloader again */
+static const u8 oac_fw_stub[] = {
+	0x11, 0x24,			/* eor r1, r1 */
+	0x14, 0xbe,			/* out MCUSR, r1 */
+	0x0c, 0x94,			/* jmp ... */
+	(OAC_FW_APP_SIZE / 2) & 0xff, (OAC_FW_APP_SIZE / 2) >> 8,	/* ... Optiboot */
+};
+
+/* Bytes from the MCU while the update runs, called instead of the frame parser */
+int oac_fw_receive(struct oac_dev *odev, const u8 *data, size_t count)
+{
+	unsigned long flags;
+	size_t n;
+
+	spin_lock_irqsave(&odev->fw_rx_lock, flags);
+	n = min(count, sizeof(odev->fw_rx) - odev->fw_rx_len);
+	memcpy(&odev->fw_rx[odev->fw_rx_len], data, n);
+	odev->fw_rx_len += n;
+	spin_unlock_irqrestore(&odev->fw_rx_lock, flags);
+
+	wake_up(&odev->fw_wait);
+	return count;
+}
+
+static size_t oac_fw_rx_len(struct oac_dev *odev)
+{
+	unsigned long flags;
+	size_t len;
+
+	spin_lock_irqsave(&odev->fw_rx_lock, flags);
+	len = odev->fw_rx_len;
+	spin_unlock_irqrestore(&odev->fw_rx_lock, flags);
+
+	return len;
+}
+
+/*
+ * oac_fw_command - Send an STK500 command and collect its answer
+ * @resp: the bytes between STK_INSYNC and STK_OK, resp_len of them
+ *
+ * Returns 0, -ETIMEDOUT, or -EPROTO if the bootloader is out of sync.
+ */
+static int oac_fw_command(struct oac_dev *odev, const u8 *cmd, size_t len,
+			  u8 *resp, size_t resp_len, unsigned int timeout_ms)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&odev->fw_rx_lock, flags);
+	odev->fw_rx_len = 0;
+	spin_unlock_irqrestore(&odev->fw_rx_lock, flags);
+
+	ret = serdev_device_write(odev->serdev, cmd, len, msecs_to_jiffies(timeout_ms));
+	if (ret < 0)
+		return ret;
+
+	if (!wait_event_timeout(odev->fw_wait, oac_fw_rx_len(odev) >= resp_len + 2,
+				msecs_to_jiffies(timeout_ms)))
+		return -ETIMEDOUT;
+
+	if (odev->fw_rx[0] != STK_INSYNC || odev->fw_rx[resp_len + 1] != STK_OK)
+		return -EPROTO;
+
+	if (resp_len)
+		memcpy(resp, &odev->fw_rx[1], resp_len);
+	return 0;
+}
+
+/* The bootloader reads its first bytes after a reset as noise, try until it answers */
+static int oac_fw_sync(struct oac_dev *odev)
+{
+	static const u8 cmd[] = { STK_GET_SYNC, STK_CRC_EOP };
+	unsigned long deadline = jiffies + msecs_to_jiffies(OAC_FW_WAIT_MS);
+	int ret;
+
+	do {
+		ret = oac_fw_command(odev, cmd, sizeof(cmd), NULL, 0, OAC_FW_SYNC_MS);
+		if (!ret)
+			return 0;
+	} while (time_before(jiffies, deadline));
+
+	return ret;
+}
+
+/* Check the bootloader belongs to an ATmega328P or 328PB */
+static int oac_fw_check_signature(struct oac_dev *odev)
+{
+	static const u8 cmd[] = { STK_READ_SIGN, STK_CRC_EOP };
+	u8 sig[3];
+	int ret;
+
+	ret = oac_fw_command(odev, cmd, sizeof(cmd), sig, sizeof(sig), OAC_FW_CMD_MS);
+	if (ret)
+		return ret;
+
+	if (sig[0] != 0x1e || sig[1] != 0x95 || (sig[2] != 0x0f && sig[2] != 0x16)) {
+		dev_err(&odev->serdev->dev, "Unexpected MCU signature %02x %02x %02x\n",
+			sig[0], sig[1], sig[2]);
+		return -ENODEV;
+	}
+	return 0;
+}
+
+static int oac_fw_load_address(struct oac_dev *odev, unsigned int page)
+{
+	unsigned int addr = page * OAC_FW_PAGE_SIZE / 2;	/* words */
+	u8 cmd[] = { STK_LOAD_ADDRESS, addr & 0xff, addr >> 8, STK_CRC_EOP };
+
+	return oac_fw_command(odev, cmd, sizeof(cmd), NULL, 0, OAC_FW_CMD_MS);
+}
+
+/* Write a page and read it back, data is OAC_FW_PAGE_SIZE bytes */
+static int oac_fw_write_page(struct oac_dev *odev, unsigned int page, const u8 *data)
+{
+	static const u8 read[] = { STK_READ_PAGE, 0, OAC_FW_PAGE_SIZE, 'F', STK_CRC_EOP };
+	u8 cmd[5 + OAC_FW_PAGE_SIZE];
+	u8 readback[OAC_FW_PAGE_SIZE];
+	int ret;
+
+	cmd[0] = STK_PROG_PAGE;
+	cmd[1] = 0;
+	cmd[2] = OAC_FW_PAGE_SIZE;
+	cmd[3] = 'F';
+	memcpy(&cmd[4], data, OAC_FW_PAGE_SIZE);
+	cmd[4 + OAC_FW_PAGE_SIZE] = STK_CRC_EOP;
+
+	ret = oac_fw_load_address(odev, page);
+	if (!ret)
+		ret = oac_fw_command(odev, cmd, sizeof(cmd), NULL, 0, OAC_FW_CMD_MS);
+	if (!ret)
+		ret = oac_fw_load_address(odev, page);
+	if (!ret)
+		ret = oac_fw_command(odev, read, sizeof(read), readback, sizeof(readback),
+				     OAC_FW_CMD_MS);
+	if (!ret && memcmp(readback, data, OAC_FW_PAGE_SIZE))
+		ret = -EIO;
+
+	return ret;
+}
+
+/* Write a page of the image, or of the stub for page 0 if stub is set, with retries */
+static int oac_fw_program(struct oac_dev *odev, const u8 *image, size_t size,
+			  unsigned int page, bool stub)
+{
+	u8 data[OAC_FW_PAGE_SIZE];
+	size_t offset = page * OAC_FW_PAGE_SIZE;
+	int attempt, ret;
+
+	memset(data, 0xff, sizeof(data));
+	if (stub)
+		memcpy(data, oac_fw_stub, sizeof(oac_fw_stub));
+	else
+		memcpy(data, image + offset, min_t(size_t, size - offset, OAC_FW_PAGE_SIZE));
+
+	for (attempt = 0; attempt < OAC_FW_RETRIES; attempt++) {
+		ret = oac_fw_write_page(odev, page, data);
+		if (!ret)
+			return 0;
+
+		dev_warn(&odev->serdev->dev, "Page %u failed (%d), retrying\n", page, ret);
+		msleep(OAC_FW_SYNC_MS);
+		oac_fw_sync(odev);
+	}
+	return ret;
+}
+
+static __printf(2, 3) void oac_fw_set_result(struct oac_dev *odev, const char *fmt, ...)
+{
+	unsigned long flags;
+	va_list args;
+
+	spin_lock_irqsave(&odev->fw_rx_lock, flags);
+	va_start(args, fmt);
+	vsnprintf(odev->fw_result, sizeof(odev->fw_result), fmt, args);
+	va_end(args);
+	spin_unlock_irqrestore(&odev->fw_rx_lock, flags);
+}
+
+/*
+ * oac_fw_update - Write a firmware image to the MCU, fw_lock held
+ * @image: raw flash contents from address 0
+ *
+ * Returns 0 once the MCU runs the new image.
+ */
+static int oac_fw_update(struct oac_dev *odev, const u8 *image, size_t size)
+{
+	static const u8 leave[] = { STK_LEAVE_PROGMODE, STK_CRC_EOP };
+	struct device *dev = &odev->serdev->dev;
+	unsigned int pages = DIV_ROUND_UP(size, OAC_FW_PAGE_SIZE);
+	unsigned int page, first = 1;
+	u32 crc = crc32(~0, image, size);
+	ktime_t start = ktime_get();
+	bool stubbed = false;
+	s64 us, rate;
+	int ret;
+
+	if (!size || size > OAC_FW_APP_SIZE)
+		return -EFBIG;
+
+	/*
+	 * Ask the firmware for its bootloader. A firmware that does not answer
+	 * may be an update that was interrupted, try the bootloader regardless.
+	 */
+	ret = oac_dev_request(odev, OAC_COMMAND_FW_UPDATE, OAC_FW_UPDATE_KEY, NULL, 0);
+	if (ret && ret != -ETIMEDOUT)
+		return ret;
+
+	oac_dev_park_link(odev);
+	serdev_device_set_baudrate(odev->serdev, OAC_FW_UPDATE_BAUD);
+
+	ret = oac_fw_sync(odev);
+	if (ret) {
+		dev_err(dev, "No answer from the bootloader: %d\n", ret);
+		goto out;
+	}
+	ret = oac_fw_check_signature(odev);
+	if (ret)
+		goto out;
+
+	/* The same image as an update that stopped part way picks up where it stopped */
+	if (odev->fw_resume_crc == crc && odev->fw_resume_page > 1 && odev->fw_resume_page <= pages) {
+		first = odev->fw_resume_page;
+		stubbed = true;
+		dev_info(dev, "Resuming firmware update at page %u/%u\n", first, pages);
+	} else {
+		ret = oac_fw_program(odev, image, size, 0, true);
+		if (ret)
+			goto out;
+		stubbed = true;
+	}
+
+	for (page = first; page < pages; page++) {
+		oac_fw_set_result(odev, "updating %u/%u\n", page, pages);
+		ret = oac_fw_program(odev, image, size, page, false);
+		if (ret)
+			goto out;
+		odev->fw_resume_crc = crc;
+		odev->fw_resume_page = page + 1;
+	}
+
+	/* Every other page is in place, the image's own page 0 makes it bootable */
+	ret = oac_fw_program(odev, image, size, 0, false);
+	if (ret)
+		goto out;
+	odev->fw_resume_crc = 0;
+	stubbed = false;
+
+	oac_fw_command(odev, leave, sizeof(leave), NULL, 0, OAC_FW_CMD_MS);
+
+	/* 64-bit divisions spelled out for 32-bit kernels */
+	us = max_t(s64, ktime_us_delta(ktime_get(), start), 1);
+	rate = div64_s64((s64)size * USEC_PER_SEC, us);
+	oac_fw_set_result(odev, "ok %zu bytes, %u pages in %lld ms, %lld B/s\n",
+			  size, pages - first + 1, div_s64(us, 1000), rate);
+	dev_info(dev, "Firmware updated: %zu bytes, %u pages in %lld ms, %lld B/s\n",
+		 size, pages - first + 1, div_s64(us, 1000), rate);
+
+out:
+	if (ret) {
+		oac_fw_set_result(odev, "failed %d%s\n", ret, stubbed ? ", resumable" : "");
+		if (stubbed)
+			dev_err(dev, "Firmware update failed: %d. The MCU stays in its bootloader, "
+				"write the image again to resume\n", ret);
+	}
+
+	/* The MCU starts over, the new firmware now or the old one after the bootloader's timeout */
+	msleep(ret ? OAC_FW_WAIT_MS : OAC_FW_BOOT_MS);
+	oac_dev_restart_link(odev);
+	return ret;
+}
+
+static ssize_t firmware_update_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct oac_dev *odev = dev_get_drvdata(dev);
+	unsigned long flags;
+	ssize_t len;
+
+	spin_lock_irqsave(&odev->fw_rx_lock, flags);
+	len = sysfs_emit(buf, "%s", odev->fw_result[0] ? odev->fw_result : "none\n");
+	spin_unlock_irqrestore(&odev->fw_rx_lock, flags);
+
+	return len;
+}
+
+/* Write the named image from /lib/firmware, returns once the MCU runs it */
+static ssize_t firmware_update_store(struct device *dev, struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct oac_dev *odev = dev_get_drvdata(dev);
+	const struct firmware *fw;
+	char name[64];
+	int ret;
+
+	strscpy(name, buf, sizeof(name));
+	ret = request_firmware(&fw, strim(name), dev);
+	if (ret)
+		return ret;
+
+	mutex_lock(&odev->fw_lock);
+	ret = oac_fw_update(odev, fw->data, fw->size);
+	mutex_unlock(&odev->fw_lock);
+
+	release_firmware(fw);
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(firmware_update);
+
+static struct attribute *oac_fw_attrs[] = {
+	&dev_attr_firmware_update.attr,
+	NULL,
+};
+
+const struct attribute_group oac_fw_group = {
+	.attrs = oac_fw_attrs,
+};
+
+void oac_fw_init(struct oac_dev *odev)
+{
+	mutex_init(&odev->fw_lock);
+	spin_lock_init(&odev->fw_rx_lock);
+	init_waitqueue_head(&odev->fw_wait);
+}
@@ -0,0 +1,164 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * MCU event latency
+ *
+ * The MCU sends a button press as an EVENT carrying a trace ID, the time it
+ * happened on its clock and how long it took to send it. Converted with the
+ * clock synchronisation, that times each event on its way to the input layer:
+ *
+ *   firmware  button released until the frame was sent
+ *   link      frame sent until its bytes reached oac_dev_receive()
+ *   dispatch  from there, through the RX queue, until the callbacks returned
+ *
+ * Each span goes into a histogram with a bucket every 1/8 octave, so the
+ * percentiles in the latency attribute of the serdev device are within 12.5%.
+ * Spans involving the MCU clock are left out until it is synchronised.
+ */
+#include <linux/bitops.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/serdev.h>
+#include <linux/slab.h>
+#include <linux/sysfs.h>
+#include "oac_comms.h"
+#include "oac_dev.h"
+
+#define OAC_LATENCY_SUB		BIT(OAC_LATENCY_SUB_BITS)
+
+static const char * const oac_latency_names[OAC_LATENCY_SPANS] = {
+	[OAC_LATENCY_FIRMWARE] = "firmware",
+	[OAC_LATENCY_LINK] = "link",
+	[OAC_LATENCY_DISPATCH] = "dispatch",
+};
+
+static unsigned int oac_latency_bucket(u32 us)
+{
+	unsigned int msb;
+
+	if (us < OAC_LATENCY_SUB)
+		return us;
+
+	msb = __fls(us);
+	return (msb - OAC_LATENCY_SUB_BITS + 1) * OAC_LATENCY_SUB +
+	       ((us >> (msb - OAC_LATENCY_SUB_BITS)) & (OAC_LATENCY_SUB - 1));
+}
+
+/* Smallest value in a bucket */
+static u32 oac_latency_bucket_low(unsigned int bucket)
+{
+	unsigned int msb;
+
+	if (bucket < OAC_LATENCY_SUB)
+		return bucket;
+
+	msb = bucket / OAC_LATENCY_SUB + OAC_LATENCY_SUB_BITS - 1;
+	return (u32)(OAC_LATENCY_SUB + bucket % OAC_LATENCY_SUB) << (msb - OAC_LATENCY_SUB_BITS);
+}
+
+/* Top of the bucket @percent of the samples are in, at most the largest sample */
+static u32 oac_latency_percentile(const struct oac_latency_hist *hist, unsigned int percent)
+{
+	u64 target = div_u64((u64)hist->count * percent + 99, 100);
+	u64 seen = 0;
+	unsigned int i;
+	u32 top;
+
+	for (i = 0; i < OAC_LATENCY_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen && seen >= target) {
+			top = i + 1 < OAC_LATENCY_BUCKETS ? oac_latency_bucket_low(i + 1) - 1 : U32_MAX;
+			return min(top, hist->max_us);
+		}
+	}
+	return hist->max_us;
+}
+
+/* latency_lock held */
+static void oac_latency_add(struct oac_dev *odev, enum oac_latency_span span, s64 ns)
+{
+	struct oac_latency_hist *hist = &odev->latency[span];
+	u32 us = clamp_t(s64, div_s64(ns, NSEC_PER_USEC), 0, U32_MAX);
+
+	hist->buckets[oac_latency_bucket(us)]++;
+	hist->count++;
+	hist->max_us = max(hist->max_us, us);
+}
+
+/*
+ * oac_latency_event - Time an event on its way to the registered callbacks
+ *
+ * @rx_ns is ktime_get_ns() its frame reached oac_dev_receive() at, @done_ns
+ * the callbacks returned at.
+ */
+void oac_latency_event(struct oac_dev *odev, const struct EventBody *event, u64 rx_ns, u64 done_ns)
+{
+	unsigned long flags;
+	ktime_t button;
+	s64 sent_ns;
+	int error_ns;
+
+	error_ns = oac_clock_to_ktime(odev, event->time_us, &button);
+	sent_ns = ktime_to_ns(button) + (s64)event->queued_us * NSEC_PER_USEC;
+
+	spin_lock_irqsave(&odev->latency_lock, flags);
+	if (error_ns >= 0) {
+		oac_latency_add(odev, OAC_LATENCY_FIRMWARE, (s64)event->queued_us * NSEC_PER_USEC);
+		oac_latency_add(odev, OAC_LATENCY_LINK, rx_ns - sent_ns);
+	}
+	oac_latency_add(odev, OAC_LATENCY_DISPATCH, done_ns - rx_ns);
+	spin_unlock_irqrestore(&odev->latency_lock, flags);
+
+	if (error_ns >= 0)
+		dev_dbg(&odev->serdev->dev,
+			"Event 0x%04X trace %u: firmware %u us, link %lld us, dispatch %llu us (clock +/-%d us)\n",
+			event->command, event->trace, event->queued_us,
+			div_s64(rx_ns - sent_ns, NSEC_PER_USEC), div_u64(done_ns - rx_ns, NSEC_PER_USEC),
+			(int)(error_ns / NSEC_PER_USEC));
+	else
+		dev_dbg(&odev->serdev->dev,
+			"Event 0x%04X trace %u: firmware %u us, dispatch %llu us (clock unsynchronised)\n",
+			event->command, event->trace, event->queued_us,
+			div_u64(done_ns - rx_ns, NSEC_PER_USEC));
+}
+
+static ssize_t latency_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct oac_dev *odev = dev_get_drvdata(dev);
+	struct oac_latency_hist *hist;
+	unsigned long flags;
+	ssize_t len = 0;
+	int i;
+
+	/* Copied out, the histograms are too large to format under the lock */
+	hist = kmalloc_array(OAC_LATENCY_SPANS, sizeof(*hist), GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&odev->latency_lock, flags);
+	memcpy(hist, odev->latency, sizeof(odev->latency));
+	spin_unlock_irqrestore(&odev->latency_lock, flags);
+
+	for (i = 0; i < OAC_LATENCY_SPANS; i++)
+		len += sysfs_emit_at(buf, len, "%s count=%u p50_us=%u p99_us=%u max_us=%u\n",
+				     oac_latency_names[i], hist[i].count,
+				     oac_latency_percentile(&hist[i], 50),
+				     oac_latency_percentile(&hist[i], 99), hist[i].max_us);
+
+	kfree(hist);
+	return len;
+}
+static DEVICE_ATTR_RO(latency);
+
+static struct attribute *oac_latency_attrs[] = {
+	&dev_attr_latency.attr,
+	NULL,
+};
+
+const struct attribute_group oac_latency_group = {
+	.attrs = oac_latency_attrs,
+};
+
+void oac_latency_init(struct oac_dev *odev)
+{
+	spin_lock_init(&odev->latency_lock);
+}
@@ -0,0 +1,283 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * MCU parameter registry
+ *
+ * Every MCU parameter is described once, in oac_params[]. Their values are
+ * cached here, so reading one never touches the link. Writes are requests:
+ * the cache only changes once the MCU has accepted a value, and values written
+ * together share one batch frame. The MCU forgets everything when it restarts,
+ * so each parameter that differs from its default is written again whenever
+ * the link has (re)settled.
+ */
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/module.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include "oac_comms.h"
+#include "oac_dev.h"
+
+struct oac_param_desc {
+	const char *name;
+	u16 command;		/* request command that sets it */
+	u64 min;
+	u64 max;
+	u64 def;		/* value the MCU starts with */
+};
+
+static const struct oac_param_desc oac_params[OAC_PARAM_COUNT] = {
+	[OAC_PARAM_STATUS_VOLT_DELTA] = {
+		"status_volt_delta_uv", OAC_COMMAND_STATUS_SET_VOLT_DELTA,
+		0, U32_MAX, OAC_STATUS_DEFAULT_VOLT_DELTA_UV },
+	[OAC_PARAM_STATUS_LVL_DELTA] = {
+		"status_lvl_delta", OAC_COMMAND_STATUS_SET_LVL_DELTA,
+		0, 100, OAC_STATUS_DEFAULT_LVL_DELTA },
+	[OAC_PARAM_STATUS_EVENTS] = {
+		"status_events", OAC_COMMAND_STATUS_SET_EVENTS,
+		0, OAC_STATUS_EVENT_CHARGING | OAC_STATUS_EVENT_STATE | OAC_STATUS_EVENT_ERROR,
+		OAC_STATUS_DEFAULT_EVENTS },
+	[OAC_PARAM_STATUS_KEEPALIVE] = {
+		"status_keepalive_ms", OAC_COMMAND_STATUS_SET_KEEPALIVE,
+		0, U32_MAX, OAC_STATUS_DEFAULT_KEEPALIVE_MS },
+	[OAC_PARAM_STATUS_MIN_INTERVAL] = {
+		"status_min_interval_ms", OAC_COMMAND_STATUS_SET_MIN_INTERVAL,
+		0, U32_MAX, OAC_STATUS_DEFAULT_MIN_INTERVAL_MS },
+	[OAC_PARAM_LED_BRIGHTNESS] = {
+		"led_brightness", OAC_COMMAND_LED_SET_BRIGHTNESS,
+		0, 255, OAC_LED_DEFAULT_BRIGHTNESS },
+};
+
+struct oac_param_req {
+	struct oac_dev_request req;
+	struct completion done;
+};
+
+static void oac_param_req_done(struct oac_dev *dev, struct oac_dev_request *req)
+{
+	complete(req->context);
+}
+
+/* Cache a value the MCU accepted, param_lock held */
+static void oac_param_store(struct oac_dev *odev, enum oac_param param, u64 val)
+{
+	WRITE_ONCE(odev->param_cache[param], val);
+	if (val != oac_params[param].def)
+		set_bit(param, &odev->param_dirty);
+	else
+		clear_bit(param, &odev->param_dirty);
+}
+
+/*
+ * oac_param_write - Send parameters to the MCU and cache those it accepts,
+ * param_lock held. The requests are queued back to back, so they share a
+ * batch frame. Returns the first error.
+ */
+static int oac_param_write(struct oac_dev *odev, const struct oac_param_val *vals,
+			   unsigned int count)
+{
+	struct oac_param_req *reqs;
+	unsigned int i, queued;
+	int ret = 0;
+
+	if (count > OAC_MAX_REQUESTS)
+		return -E2BIG;
+
+	reqs = kcalloc(count, sizeof(*reqs), GFP_KERNEL);
+	if (!reqs)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		init_completion(&reqs[i].done);
+		reqs[i].req.command = oac_params[vals[i].param].command;
+		reqs[i].req.val = vals[i].val;
+		reqs[i].req.complete = oac_param_req_done;
+		reqs[i].req.context = &reqs[i].done;
+
+		ret = oac_dev_request_async(odev, &reqs[i].req);
+		if (ret)
+			break;
+	}
+	queued = i;
+
+	for (i = 0; i < queued; i++) {
+		wait_for_completion(&reqs[i].done);
+
+		if (reqs[i].req.result) {
+			if (!ret)
+				ret = reqs[i].req.result;
+			continue;
+		}
+		oac_param_store(odev, vals[i].param, vals[i].val);
+	}
+
+	kfree(reqs);
+	return ret;
+}
+
+/**
+ * oac_dev_param_get - Read a parameter from the cache, without using the link
+ * @dev: Pointer to oac_dev structure
+ * @param: Parameter
+ * @val: Its value
+ */
+int oac_dev_param_get(struct oac_dev *dev, enum oac_param param, u64 *val)
+{
+	if (param >= OAC_PARAM_COUNT)
+		return -EINVAL;
+
+	*val = READ_ONCE(dev->param_cache[param]);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(oac_dev_param_get);
+
+/**
+ * oac_dev_param_set_bulk - Write several parameters in one frame
+ * @dev: Pointer to oac_dev structure
+ * @vals: Parameters and their values
+ * @count: Number of parameters, at most OAC_MAX_REQUESTS
+ *
+ * Values are range checked before anything is sent. Each parameter the MCU
+ * accepts is cached, even if another fails.
+ *
+ * Returns 0 on success or the first error, see oac_dev_request().
+ */
+int oac_dev_param_set_bulk(struct oac_dev *dev, const struct oac_param_val *vals,
+			   unsigned int count)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < count; i++) {
+		if (vals[i].param >= OAC_PARAM_COUNT ||
+		    vals[i].val < oac_params[vals[i].param].min ||
+		    vals[i].val > oac_params[vals[i].param].max)
+			return -EINVAL;
+	}
+
+	mutex_lock(&dev->param_lock);
+	ret = oac_param_write(dev, vals, count);
+	mutex_unlock(&dev->param_lock);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(oac_dev_param_set_bulk);
+
+int oac_dev_param_set(struct oac_dev *dev, enum oac_param param, u64 val)
+{
+	struct oac_param_val pv = { .param = param, .val = val };
+
+	return oac_dev_param_set_bulk(dev, &pv, 1);
+}
+EXPORT_SYMBOL_GPL(oac_dev_param_set);
+
+/* Write every parameter that differs from its default back to the MCU */
+static void oac_param_sync_work(struct work_struct *work)
+{
+	struct oac_dev *odev = container_of(work, struct oac_dev, param_sync_work);
+	struct oac_param_val vals[OAC_PARAM_COUNT];
+	unsigned int count = 0;
+	int i, ret;
+
+	mutex_lock(&odev->param_lock);
+
+	for (i = 0; i < OAC_PARAM_COUNT; i++) {
+		if (test_bit(i, &odev->param_dirty)) {
+			vals[count].param = i;
+			vals[count].val = odev->param_cache[i];
+			count++;
+		}
+	}
+
+	ret = count ? oac_param_write(odev, vals, count) : 0;
+
+	mutex_unlock(&odev->param_lock);
+
+	if (ret)
+		dev_warn(&odev->serdev->dev, "Failed to restore MCU parameters: %d\n", ret);
+}
+
+void oac_param_sync(struct oac_dev *odev)
+{
+	schedule_work(&odev->param_sync_work);
+}
+
+/* debugfs: one line per parameter, write "<name> <value>" to set one */
+static int oac_param_show(struct seq_file *s, void *unused)
+{
+	struct oac_dev *odev = s->private;
+	int i;
+
+	for (i = 0; i < OAC_PARAM_COUNT; i++)
+		seq_printf(s, "%-24s %llu (default %llu)\n", oac_params[i].name,
+			   READ_ONCE(odev->param_cache[i]), oac_params[i].def);
+	return 0;
+}
+
+static int oac_param_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, oac_param_show, inode->i_private);
+}
+
+static ssize_t oac_param_write_file(struct file *file, const char __user *ubuf,
+				    size_t count, loff_t *ppos)
+{
+	struct oac_dev *odev = ((struct seq_file *)file->private_data)->private;
+	char buf[64], *name, *value;
+	u64 val;
+	int i, ret;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	value = strim(buf);
+	name = strsep(&value, " ");
+	if (!value)
+		return -EINVAL;
+
+	ret = kstrtou64(strim(value), 0, &val);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < OAC_PARAM_COUNT; i++) {
+		if (!strcmp(name, oac_params[i].name))
+			break;
+	}
+	if (i == OAC_PARAM_COUNT)
+		return -EINVAL;
+
+	ret = oac_dev_param_set(odev, i, val);
+	return ret ? ret : count;
+}
+
+static const struct file_operations oac_param_fops = {
+	.owner = THIS_MODULE,
+	.open = oac_param_open,
+	.read = seq_read,
+	.write = oac_param_write_file,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void oac_param_init(struct oac_dev *odev)
+{
+	int i;
+
+	mutex_init(&odev->param_lock);
+	INIT_WORK(&odev->param_sync_work, oac_param_sync_work);
+
+	for (i = 0; i < OAC_PARAM_COUNT; i++)
+		odev->param_cache[i] = oac_params[i].def;
+
+	odev->debugfs = debugfs_create_dir(dev_name(&odev->serdev->dev), NULL);
+	debugfs_create_file("params", 0644, odev->debugfs, odev, &oac_param_fops);
+}
+
+void oac_param_exit(struct oac_dev *odev)
+{
+	debugfs_remove_recursive(odev->debugfs);
+	cancel_work_sync(&odev->param_sync_work);
+}
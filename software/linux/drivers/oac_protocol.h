@@ -0,0 +1,342 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * oac_protocol.h - Open Action Cam serial protocol, constants and message layouts
+ *
+ * Generated by protocol/gen_protocol.py from protocol/protocol.def, do not edit.
+ */
+#ifndef OAC_PROTOCOL_H
+#define OAC_PROTOCOL_H
+
+#include <linux/types.h>
+
+/* Message Framing */
+#define OAC_MESSAGE_START     0xAA
+#define OAC_MESSAGE_END       0x55
+#define OAC_MESSAGE_DELIMITER 0x00  /* Protocol v2: terminates every COBS encoded frame */
+
+/* Protocol Versions */
+#define OAC_PROTOCOL_V1 1  /* START/END framing, length delimited */
+#define OAC_PROTOCOL_V2 2  /* COBS framing, 0x00 delimited */
+
+/* Payload Constraints */
+#define OAC_MAX_PAYLOAD_SIZE 128
+
+/* Message Recipient Definitions */
+#define OAC_COMMS_RECIPIENT_LINUX    0x01
+#define OAC_COMMS_RECIPIENT_FIRMWARE 0x02
+
+/*
+ * Baud rate ladder. Rung 0 is the rate both sides start at, Linux steps up from
+ * there. Every rate divides 16 MHz exactly with U2X except 115200 (2.1% error).
+ */
+#define OAC_BAUD_LADDER { 9600, 115200, 250000, 500000, 1000000 }
+
+/* Command Definitions */
+#define OAC_COMMAND_RECORD_REQ_START 0xF000
+#define OAC_COMMAND_RECORD_STARTED   0xF001
+#define OAC_COMMAND_RECORD_REQ_END   0xE000
+#define OAC_COMMAND_RECORD_ENDED     0xE001
+#define OAC_COMMAND_SHUTDOWN_REQ     0xD000
+#define OAC_COMMAND_SHUTDOWN_STARTED 0xD001
+#define OAC_COMMAND_HB               0xC000  /* Redundant, use COMMAND_WD_KICK */
+
+/*
+ * Protocol negotiation. Requests and acks are always sent with v1 framing.
+ * Link control commands (0x9xxx) are consumed by the comms layer and never acknowledged.
+ */
+#define OAC_COMMAND_PROTO_REQ_V2 0x9002
+#define OAC_COMMAND_PROTO_ACK_V2 0x9102
+
+/* Baud rate negotiation, the low nibble is the BAUD_LADDER rung */
+#define OAC_COMMAND_BAUD_REQ       0x9200  /* Linux: please switch to rung n. Rung 0 needs no probe */
+#define OAC_COMMAND_BAUD_ACK       0x9300  /* Firmware: switching now */
+#define OAC_COMMAND_BAUD_PROBE     0x9400  /* Linux, at the new rate. The firmware echoes it to confirm */
+#define OAC_COMMAND_BAUD_RUNG_MASK 0x000F
+
+/*
+ * Clock synchronisation, the low nibble is a ping ID. Linux sends COMMAND_TIME_PING | id,
+ * the firmware answers straight away with a RESPONSE: param = COMMAND_TIME_PING | id,
+ * val = comms_clock_us(), its clock in microseconds since it started. Neither is batched.
+ */
+#define OAC_COMMAND_TIME_PING    0x9500
+#define OAC_COMMAND_TIME_ID_MASK 0x000F
+
+/*
+ * Status reporting. The firmware sends a status when a value changes by at least its
+ * threshold, no more often than the minimum interval, and otherwise every keepalive.
+ * Linux sets a threshold with a REQUEST: command = COMMAND_STATUS_SET_*, val, or without
+ * a reply with a RESPONSE message: param = COMMAND_STATUS_SET_*, val.
+ * A threshold of 0 disables that trigger.
+ */
+#define OAC_COMMAND_STATUS_REQ              0x8000  /* Linux: send a status now */
+#define OAC_COMMAND_STATUS_SET_VOLT_DELTA   0x8100  /* Battery voltage change, uV */
+#define OAC_COMMAND_STATUS_SET_LVL_DELTA    0x8101  /* Battery level change, percent */
+#define OAC_COMMAND_STATUS_SET_EVENTS       0x8102  /* STATUS_EVENT_* changes reported */
+#define OAC_COMMAND_STATUS_SET_KEEPALIVE    0x8103  /* Longest time between statuses, ms */
+#define OAC_COMMAND_STATUS_SET_MIN_INTERVAL 0x8104  /* Shortest time between statuses, ms */
+
+#define OAC_STATUS_EVENT_CHARGING 0x01
+#define OAC_STATUS_EVENT_STATE    0x02
+#define OAC_STATUS_EVENT_ERROR    0x04
+
+#define OAC_STATUS_DEFAULT_VOLT_DELTA_UV   50000
+#define OAC_STATUS_DEFAULT_LVL_DELTA       1
+#define OAC_STATUS_DEFAULT_EVENTS          (OAC_STATUS_EVENT_CHARGING | OAC_STATUS_EVENT_STATE | OAC_STATUS_EVENT_ERROR)
+#define OAC_STATUS_DEFAULT_KEEPALIVE_MS    5000
+#define OAC_STATUS_DEFAULT_MIN_INTERVAL_MS 100
+
+/* LED, set like the status thresholds */
+#define OAC_COMMAND_LED_SET_BRIGHTNESS 0x8200  /* 0-255 */
+#define OAC_LED_DEFAULT_BRIGHTNESS     8
+
+/* Button Definitions */
+#define OAC_COMMAND_BTN_SHORT 0xA001
+#define OAC_COMMAND_BTN_LONG  0xA002
+
+/* Watchdog Definitions */
+#define OAC_COMMAND_WD_START   0xB000
+#define OAC_COMMAND_WD_STOP    0xB001
+#define OAC_COMMAND_WD_KICK    0xB002
+#define OAC_COMMAND_WD_SET_TO  0xB003
+#define OAC_WD_MIN_TIMEOUT     1       /* seconds */
+#define OAC_WD_MAX_TIMEOUT     60
+#define OAC_WD_DEFAULT_TIMEOUT 10
+
+/*
+ * Firmware update. Linux sends a REQUEST: command = COMMAND_FW_UPDATE, val = FW_UPDATE_KEY.
+ * The firmware replies, then hands the UART to its bootloader (Optiboot 6.2 or later,
+ * STK500v1 at FW_UPDATE_BAUD), which Linux programs page by page. Refused with
+ * REPLY_E_BUSY while the firmware is shutting Linux down.
+ */
+#define OAC_COMMAND_FW_UPDATE 0x8300
+#define OAC_FW_UPDATE_KEY     0x4F414355  /* "OACU", a stray request never starts an update */
+#define OAC_FW_UPDATE_BAUD    115200
+#define OAC_FW_PAGE_SIZE      128         /* ATmega328 flash page */
+#define OAC_FW_APP_SIZE       0x7E00      /* Flash below Optiboot's 512 byte boot section */
+
+/* Reply Results */
+#define OAC_REPLY_OK        0x00
+#define OAC_REPLY_E_UNKNOWN 0x01  /* Command not supported by this firmware */
+#define OAC_REPLY_E_INVALID 0x02  /* Value out of range */
+#define OAC_REPLY_E_BUSY    0x03  /* Cannot be done in the current state */
+
+/*
+ * Bulk transfer, carried in DATA payloads: OP XFER, then by operation
+ * OPEN    object:1 size:4         sender: offer an object of size bytes
+ * CHUNK   offset:4 data           sender: bytes of the object from offset on
+ * CANCEL  reason:1                sender: giving up on the transfer
+ * CREDIT  offset:4 window:2       receiver: everything below offset arrived,
+ * send up to offset + window
+ * RESEND  offset:4 window:2       receiver: as CREDIT, and send everything from
+ * offset again, a chunk went missing
+ * ABORT   reason:1                receiver: refusing or giving up on the transfer
+ * XFER is chosen by the sender, anything for another transfer is ignored. The
+ * CREDIT answering OPEN gives the offset the receiver resumes from, one with
+ * offset = size completes the transfer. Operations sent by the receiver have the
+ * top bit set.
+ */
+#define OAC_BULK_OP_OPEN          0x01
+#define OAC_BULK_OP_CHUNK         0x02
+#define OAC_BULK_OP_CANCEL        0x03
+#define OAC_BULK_OP_CREDIT        0x81
+#define OAC_BULK_OP_ABORT         0x82
+#define OAC_BULK_OP_RESEND        0x83
+#define OAC_BULK_CHUNK_HEADER_LEN 6
+#define OAC_BULK_CHUNK_MAX        (OAC_MAX_PAYLOAD_SIZE - OAC_BULK_CHUNK_HEADER_LEN)
+
+#define OAC_BULK_E_CANCELLED 0x01  /* Sender or receiver gave up */
+#define OAC_BULK_E_NO_SINK   0x02  /* Receiver takes no objects of this kind */
+#define OAC_BULK_E_TOO_LARGE 0x03  /* Receiver cannot hold the object */
+#define OAC_BULK_E_IO        0x04  /* Data could not be read or stored */
+#define OAC_BULK_E_TIMEOUT   0x05  /* No credit from the receiver */
+
+/* Bulk objects */
+#define OAC_BULK_OBJECT_EVENT_LOG   0x01  /* Firmware: events logged since boot */
+#define OAC_BULK_OBJECT_CALIBRATION 0x02  /* Linux: calibration table for the firmware */
+
+/* Side raising an error */
+#define OAC_ERROR_ORIGIN_MCU   1
+#define OAC_ERROR_ORIGIN_LINUX 2
+
+/*
+ * Error catalog. An error travels as an ERROR_CODE message, its code and a context value,
+ * and the receiver looks the message up here. The sender sends a code at most once per
+ * LIMIT_MS and counts the occurrences in between, the next message carries the count.
+ */
+#define OAC_ERROR_CODE_LOW_BATTERY              2   /* Low Battery */
+#define OAC_ERROR_CODE_INSUFFICIENT_SPACE       3   /* Insufficient storage space! */
+#define OAC_ERROR_CODE_CHARGER_FAULT            4   /* Charger error */
+#define OAC_ERROR_CODE_BATTERY_OV               6   /* Battery over-voltage detected */
+#define OAC_ERROR_CODE_NO_COMM_RPI              7   /* No contact with RPI! */
+#define OAC_ERROR_CODE_RPI_SHUTDOWN_REQ_TIMEOUT 8   /* RPI did not acknowledge shutdown! */
+#define OAC_ERROR_CODE_RPI_SHUTDOWN_TIMEOUT     9   /* Could not kill RPI - no serial hangup! */
+#define OAC_ERROR_CODE_STORAGE_CHECK_FAILED     10  /* Failed to check available storage. */
+#define OAC_ERROR_CODE_INVALID_RESOLUTION       12  /* Invalid resolution format. */
+#define OAC_ERROR_CODE_PIPE_CREATION_FAILED     13  /* Failed to create pipe. */
+#define OAC_ERROR_CODE_MONITOR_THREAD_FAILED    14  /* Failed to create monitor thread. */
+#define OAC_ERROR_CODE_CAMERA_NOT_FOUND         15  /* No camera detected. */
+#define OAC_ERROR_CODE_RECORD_START_FAILED      16  /* Recording failed to start. */
+#define OAC_ERROR_CODE_TRANSCODE_FAILED         17  /* Transcoding process failed. */
+#define OAC_ERROR_CODES 18  /* One past the highest code */
+
+/* X(code, origin, limit_ms, message) for every error in the catalog */
+#define OAC_ERROR_CATALOG(X) \
+	X(OAC_ERROR_CODE_LOW_BATTERY, OAC_ERROR_ORIGIN_MCU, 60000, "Low Battery")                                     \
+	X(OAC_ERROR_CODE_INSUFFICIENT_SPACE, OAC_ERROR_ORIGIN_LINUX, 10000, "Insufficient storage space!")            \
+	X(OAC_ERROR_CODE_CHARGER_FAULT, OAC_ERROR_ORIGIN_MCU, 60000, "Charger error")                                 \
+	X(OAC_ERROR_CODE_BATTERY_OV, OAC_ERROR_ORIGIN_MCU, 60000, "Battery over-voltage detected")                    \
+	X(OAC_ERROR_CODE_NO_COMM_RPI, OAC_ERROR_ORIGIN_MCU, 10000, "No contact with RPI!")                            \
+	X(OAC_ERROR_CODE_RPI_SHUTDOWN_REQ_TIMEOUT, OAC_ERROR_ORIGIN_MCU, 10000, "RPI did not acknowledge shutdown!")  \
+	X(OAC_ERROR_CODE_RPI_SHUTDOWN_TIMEOUT, OAC_ERROR_ORIGIN_MCU, 10000, "Could not kill RPI - no serial hangup!") \
+	X(OAC_ERROR_CODE_STORAGE_CHECK_FAILED, OAC_ERROR_ORIGIN_LINUX, 10000, "Failed to check available storage.")   \
+	X(OAC_ERROR_CODE_INVALID_RESOLUTION, OAC_ERROR_ORIGIN_LINUX, 10000, "Invalid resolution format.")             \
+	X(OAC_ERROR_CODE_PIPE_CREATION_FAILED, OAC_ERROR_ORIGIN_LINUX, 10000, "Failed to create pipe.")               \
+	X(OAC_ERROR_CODE_MONITOR_THREAD_FAILED, OAC_ERROR_ORIGIN_LINUX, 10000, "Failed to create monitor thread.")    \
+	X(OAC_ERROR_CODE_CAMERA_NOT_FOUND, OAC_ERROR_ORIGIN_LINUX, 10000, "No camera detected.")                      \
+	X(OAC_ERROR_CODE_RECORD_START_FAILED, OAC_ERROR_ORIGIN_LINUX, 10000, "Recording failed to start.")            \
+	X(OAC_ERROR_CODE_TRANSCODE_FAILED, OAC_ERROR_ORIGIN_LINUX, 10000, "Transcoding process failed.")
+
+/* Message Type Identifiers */
+enum MessageType {
+	OAC_MESSAGE_TYPE_COMMAND    = 0x01,
+	OAC_MESSAGE_TYPE_STATUS     = 0x02,
+	OAC_MESSAGE_TYPE_ERROR      = 0x03,
+	OAC_MESSAGE_TYPE_DATA       = 0x04,  /* Bulk transfer, see BULK_OP_* */
+	OAC_MESSAGE_TYPE_RESPONSE   = 0x06,
+	OAC_MESSAGE_TYPE_ACK        = 0x07,  /* Protocol v2: command frame received */
+	OAC_MESSAGE_TYPE_NAK        = 0x08,  /* Protocol v2: frame missing, please resend */
+	OAC_MESSAGE_TYPE_BATCH      = 0x09,  /* Protocol v2: several messages in one frame */
+	OAC_MESSAGE_TYPE_REQUEST    = 0x0A,  /* Linux: carry out a command, answered by a REPLY */
+	OAC_MESSAGE_TYPE_REPLY      = 0x0B,  /* Firmware: outcome of the REQUEST with the same tid */
+	OAC_MESSAGE_TYPE_EVENT      = 0x0C,  /* Firmware: a COMMAND traced from when it happened, acknowledged alike */
+	OAC_MESSAGE_TYPE_ERROR_CODE = 0x0D,  /* An error from the error catalog, rate limited by the sender */
+};
+
+/* X(type, name) for every message type */
+#define OAC_MESSAGE_TYPES(X) \
+	X(OAC_MESSAGE_TYPE_COMMAND, "COMMAND")       \
+	X(OAC_MESSAGE_TYPE_STATUS, "STATUS")         \
+	X(OAC_MESSAGE_TYPE_ERROR, "ERROR")           \
+	X(OAC_MESSAGE_TYPE_DATA, "DATA")             \
+	X(OAC_MESSAGE_TYPE_RESPONSE, "RESPONSE")     \
+	X(OAC_MESSAGE_TYPE_ACK, "ACK")               \
+	X(OAC_MESSAGE_TYPE_NAK, "NAK")               \
+	X(OAC_MESSAGE_TYPE_BATCH, "BATCH")           \
+	X(OAC_MESSAGE_TYPE_REQUEST, "REQUEST")       \
+	X(OAC_MESSAGE_TYPE_REPLY, "REPLY")           \
+	X(OAC_MESSAGE_TYPE_EVENT, "EVENT")           \
+	X(OAC_MESSAGE_TYPE_ERROR_CODE, "ERROR_CODE")
+
+/* Message Header */
+struct MessageHeader {
+	u8 recipient;
+	u8 message_type;
+	u8 payload_length;
+	u8 checksum;        /* v1: XOR, v2: CRC-8 */
+	u8 seq;             /* v2 only: per sender sequence number */
+};
+
+/* Command Payload */
+struct CommandBody {
+	u16 command;
+};
+
+/* Response Payload */
+struct ResponseBody {
+	u16 param;
+	u64 val;
+};
+
+/* Status Payload */
+struct StatusBody {
+	u32  bat_volt_uv;
+	u8   bat_lvl;
+	u8   state;
+	bool charging;
+	u8   error_code;
+};
+
+/* Error Payload, the text is sent without its terminator */
+struct ErrorBody {
+	u8   error_code;
+	char error_message[OAC_MAX_PAYLOAD_SIZE - 1];
+};
+
+/* Error Code Payload, the message is in the error catalog */
+struct ErrorCodeBody {
+	u8  code;
+	u16 count;    /* Occurrences since the last one sent, this one included */
+	u32 context;  /* Error specific, e.g. the battery voltage in mV */
+};
+
+/* Acknowledgement Payload (ACK and NAK) */
+struct AckBody {
+	u8 seq;
+};
+
+/* Request Payload */
+struct RequestBody {
+	u8  tid;      /* Transaction ID, echoed in the reply */
+	u16 command;
+	u64 val;
+};
+
+/* Reply Payload */
+struct ReplyBody {
+	u8  tid;
+	u8  result;  /* REPLY_OK or REPLY_E_* */
+	u64 val;
+};
+
+/* Event Payload, a command with the time it happened, so the receiver can time what it sets off */
+struct EventBody {
+	u16 command;
+	u16 trace;      /* Trace ID, counts up from 1 with every event since the firmware started */
+	u64 time_us;    /* comms_clock_us() when it happened */
+	u32 queued_us;  /* From then until the frame was sent */
+};
+
+/* Full Message (Tagged Union) */
+struct Message {
+	struct MessageHeader header;
+	union {
+		struct CommandBody payload_command;
+		struct ResponseBody payload_response;
+		struct StatusBody payload_status;
+		struct ErrorBody payload_error;
+		struct ErrorCodeBody payload_error_code;
+		struct AckBody payload_ack;
+		struct RequestBody payload_request;
+		struct ReplyBody payload_reply;
+		struct EventBody payload_event;
+		u8 payload_raw[OAC_MAX_PAYLOAD_SIZE];  /* Raw access (DATA and BATCH) */
+	} body;
+};
+
+/*
+ * Encoded payload lengths, _LEN_ where the layout is fixed and _MAX_ where
+ * it varies, and the length of the frame carrying a payload of n bytes.
+ */
+#define OAC_PAYLOAD_LEN_COMMAND_V1   2
+#define OAC_PAYLOAD_LEN_COMMAND_V2   2
+#define OAC_PAYLOAD_LEN_RESPONSE_V1  10
+#define OAC_PAYLOAD_MAX_RESPONSE_V2  12
+#define OAC_PAYLOAD_LEN_STATUS_V1    8
+#define OAC_PAYLOAD_MAX_STATUS_V2    8
+#define OAC_PAYLOAD_MAX_ERROR_V1     127
+#define OAC_PAYLOAD_MAX_ERROR_V2     127
+#define OAC_PAYLOAD_LEN_ERRORCODE_V1 7
+#define OAC_PAYLOAD_MAX_ERRORCODE_V2 9
+#define OAC_PAYLOAD_LEN_ACK_V1       1
+#define OAC_PAYLOAD_LEN_ACK_V2       1
+#define OAC_PAYLOAD_LEN_REQUEST_V1   11
+#define OAC_PAYLOAD_MAX_REQUEST_V2   13
+#define OAC_PAYLOAD_LEN_REPLY_V1     10
+#define OAC_PAYLOAD_MAX_REPLY_V2     12
+#define OAC_PAYLOAD_LEN_EVENT_V1     16
+#define OAC_PAYLOAD_MAX_EVENT_V2     20
+
+#define OAC_FRAME_LEN_V1(n) ((n) + 6)  /* START header payload END */
+#define OAC_FRAME_LEN_V2(n) ((n) + 7)  /* COBS(header payload CRC) delimiter */
+
+#endif /* OAC_PROTOCOL_H */
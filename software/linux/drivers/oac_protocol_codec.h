@@ -0,0 +1,532 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * oac_protocol_codec.h - Open Action Cam payload encoders and decoders
+ *
+ * Generated by protocol/gen_protocol.py from protocol/protocol.def, do not edit.
+ *
+ * Fields are written one byte at a time, least significant first, so neither
+ * the host's byte order nor its struct padding reaches the wire. v1 keeps the
+ * unpadded AVR struct layout older firmware memcpy()s, v2 packs it further:
+ *
+ *   COMMAND     v1, v2  command:2
+ *   STATUS      v1      bat_volt_uv:4 bat_lvl:1 state:1 charging:1 error_code:1
+ *               v2      bat_volt_uv:varint bat_lvl:1 (charging << 7 | state):1 error_code:1
+ *   ERROR       v1, v2  error_code:1 error_message:text
+ *   DATA        v1, v2  raw
+ *   RESPONSE    v1      param:2 val:8
+ *               v2      param:2 val:varint
+ *   ACK/NAK     v1, v2  seq:1
+ *   BATCH       v2      (type:1 len:1 payload:len) per message, at least one
+ *   REQUEST     v1      tid:1 command:2 val:8
+ *               v2      tid:1 command:2 val:varint
+ *   REPLY       v1      tid:1 result:1 val:8
+ *               v2      tid:1 result:1 val:varint
+ *   EVENT       v1      command:2 trace:2 time_us:8 queued_us:4
+ *               v2      command:2 trace:varint time_us:varint queued_us:varint
+ *   ERROR_CODE  v1      code:1 count:2 context:4
+ *               v2      code:1 count:varint context:varint
+ *
+ * A varint is LEB128: 7 bits per byte, least significant group first, the top
+ * bit set on every byte but the last. Text is sent without its terminator, the
+ * payload length gives its exact length. Decoders check the length is exact.
+ */
+#ifndef OAC_PROTOCOL_CODEC_H
+#define OAC_PROTOCOL_CODEC_H
+
+#include <linux/build_bug.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <asm/unaligned.h>
+#include "oac_protocol.h"
+
+/* Every payload fits, and a v2 frame is COBS encoded with a single overhead byte */
+static_assert(OAC_PAYLOAD_LEN_COMMAND_V1 <= OAC_MAX_PAYLOAD_SIZE, "OAC_PAYLOAD_LEN_COMMAND_V1 too long");
+static_assert(OAC_PAYLOAD_LEN_COMMAND_V2 <= OAC_MAX_PAYLOAD_SIZE, "OAC_PAYLOAD_LEN_COMMAND_V2 too long");
+static_assert(OAC_PAYLOAD_LEN_RESPONSE_V1 <= OAC_MAX_PAYLOAD_SIZE, "OAC_PAYLOAD_LEN_RESPONSE_V1 too long");
+static_assert(OAC_PAYLOAD_MAX_RESPONSE_V2 <= OAC_MAX_PAYLOAD_SIZE, "OAC_PAYLOAD_MAX_RESPONSE_V2 too long");
+static_assert(OAC_PAYLOAD_LEN_STATUS_V1 <= OAC_MAX_PAYLOAD_SIZE, "OAC_PAYLOAD_LEN_STATUS_V1 too long");
+static_assert(OAC_PAYLOAD_MAX_STATUS_V2 <= OAC_MAX_PAYLOAD_SIZE, "OAC_PAYLOAD_MAX_STATUS_V2 too long");
+static_assert(OAC_PAYLOAD_MAX_ERROR_V1 <= OAC_MAX_PAYLOAD_SIZE, "OAC_PAYLOAD_MAX_ERROR_V1 too long");
+static_assert(OAC_PAYLOAD_MAX_ERROR_V2 <= OAC_MAX_PAYLOAD_SIZE, "OAC_PAYLOAD_MAX_ERROR_V2 too long");
+static_assert(OAC_PAYLOAD_LEN_ERRORCODE_V1 <= OAC_MAX_PAYLOAD_SIZE, "OAC_PAYLOAD_LEN_ERRORCODE_V1 too long");
+static_assert(OAC_PAYLOAD_MAX_ERRORCODE_V2 <= OAC_MAX_PAYLOAD_SIZE, "OAC_PAYLOAD_MAX_ERRORCODE_V2 too long");
+static_assert(OAC_PAYLOAD_LEN_ACK_V1 <= OAC_MAX_PAYLOAD_SIZE, "OAC_PAYLOAD_LEN_ACK_V1 too long");
+static_assert(OAC_PAYLOAD_LEN_ACK_V2 <= OAC_MAX_PAYLOAD_SIZE, "OAC_PAYLOAD_LEN_ACK_V2 too long");
+static_assert(OAC_PAYLOAD_LEN_REQUEST_V1 <= OAC_MAX_PAYLOAD_SIZE, "OAC_PAYLOAD_LEN_REQUEST_V1 too long");
+static_assert(OAC_PAYLOAD_MAX_REQUEST_V2 <= OAC_MAX_PAYLOAD_SIZE, "OAC_PAYLOAD_MAX_REQUEST_V2 too long");
+static_assert(OAC_PAYLOAD_LEN_REPLY_V1 <= OAC_MAX_PAYLOAD_SIZE, "OAC_PAYLOAD_LEN_REPLY_V1 too long");
+static_assert(OAC_PAYLOAD_MAX_REPLY_V2 <= OAC_MAX_PAYLOAD_SIZE, "OAC_PAYLOAD_MAX_REPLY_V2 too long");
+static_assert(OAC_PAYLOAD_LEN_EVENT_V1 <= OAC_MAX_PAYLOAD_SIZE, "OAC_PAYLOAD_LEN_EVENT_V1 too long");
+static_assert(OAC_PAYLOAD_MAX_EVENT_V2 <= OAC_MAX_PAYLOAD_SIZE, "OAC_PAYLOAD_MAX_EVENT_V2 too long");
+static_assert(OAC_MAX_PAYLOAD_SIZE + 5 < 254, "v2 frame needs more than one COBS block");
+
+static inline u8 oac_proto_put_varint(u8 *out, u64 value)
+{
+	u8 n = 0;
+
+	while (value >= 0x80) {
+		out[n++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	out[n++] = value;
+	return n;
+}
+
+/* Returns the bytes consumed, or -EBADMSG if truncated or wider than 64 bits */
+static inline int oac_proto_get_varint(const u8 *in, size_t length, u64 *value)
+{
+	u64 v = 0;
+	size_t i;
+
+	for (i = 0; i < length && i < 10; i++) {
+		v |= (u64)(in[i] & 0x7F) << (7 * i);
+		if (!(in[i] & 0x80)) {
+			*value = v;
+			return i + 1;
+		}
+	}
+	return -EBADMSG;
+}
+
+static inline u8 oac_proto_encode_command(const struct CommandBody *b, u8 *out)
+{
+	put_unaligned_le16(b->command, out);
+	return OAC_PAYLOAD_LEN_COMMAND_V1;
+}
+
+static inline int oac_proto_decode_command(const u8 *in, u8 length, struct CommandBody *b)
+{
+	if (length != OAC_PAYLOAD_LEN_COMMAND_V1)
+		return -EBADMSG;
+	b->command = get_unaligned_le16(in);
+	return 0;
+}
+
+static inline u8 oac_proto_encode_response_v1(const struct ResponseBody *b, u8 *out)
+{
+	put_unaligned_le16(b->param, out);
+	put_unaligned_le64(b->val, &out[2]);
+	return OAC_PAYLOAD_LEN_RESPONSE_V1;
+}
+
+static inline u8 oac_proto_encode_response_v2(const struct ResponseBody *b, u8 *out)
+{
+	put_unaligned_le16(b->param, out);
+	return 2 + oac_proto_put_varint(&out[2], b->val);
+}
+
+static inline int oac_proto_decode_response_v1(const u8 *in, u8 length, struct ResponseBody *b)
+{
+	if (length != OAC_PAYLOAD_LEN_RESPONSE_V1)
+		return -EBADMSG;
+	b->param = get_unaligned_le16(in);
+	b->val = get_unaligned_le64(&in[2]);
+	return 0;
+}
+
+static inline int oac_proto_decode_response_v2(const u8 *in, u8 length, struct ResponseBody *b)
+{
+	u64 v;
+	int n;
+
+	if (length < 2)
+		return -EBADMSG;
+	b->param = get_unaligned_le16(in);
+	n = oac_proto_get_varint(&in[2], length - 2, &v);
+	if (n < 0 || 2 + n != length)
+		return -EBADMSG;
+	b->val = v;
+	return 0;
+}
+
+static inline u8 oac_proto_encode_status_v1(const struct StatusBody *b, u8 *out)
+{
+	put_unaligned_le32(b->bat_volt_uv, out);
+	out[4] = b->bat_lvl;
+	out[5] = b->state;
+	out[6] = b->charging;
+	out[7] = b->error_code;
+	return OAC_PAYLOAD_LEN_STATUS_V1;
+}
+
+static inline u8 oac_proto_encode_status_v2(const struct StatusBody *b, u8 *out)
+{
+	u8 n;
+
+	n = oac_proto_put_varint(out, b->bat_volt_uv);
+	out[n] = b->bat_lvl;
+	out[n + 1] = (b->state & 0x7F) | (b->charging << 7);
+	out[n + 2] = b->error_code;
+	return n + 3;
+}
+
+static inline int oac_proto_decode_status_v1(const u8 *in, u8 length, struct StatusBody *b)
+{
+	if (length != OAC_PAYLOAD_LEN_STATUS_V1)
+		return -EBADMSG;
+	b->bat_volt_uv = get_unaligned_le32(in);
+	b->bat_lvl = in[4];
+	b->state = in[5];
+	b->charging = in[6] != 0;
+	b->error_code = in[7];
+	return 0;
+}
+
+static inline int oac_proto_decode_status_v2(const u8 *in, u8 length, struct StatusBody *b)
+{
+	u64 v;
+	int n;
+
+	n = oac_proto_get_varint(in, length, &v);
+	if (n < 0 || v > U32_MAX)
+		return -EBADMSG;
+	b->bat_volt_uv = v;
+	if (n + 3 != length)
+		return -EBADMSG;
+	b->bat_lvl = in[n];
+	b->state = in[n + 1] & 0x7F;
+	b->charging = in[n + 1] >> 7;
+	b->error_code = in[n + 2];
+	return 0;
+}
+
+static inline u8 oac_proto_encode_error(const struct ErrorBody *b, u8 *out)
+{
+	size_t len = strnlen(b->error_message, sizeof(b->error_message) - 1);
+
+	out[0] = b->error_code;
+	memcpy(&out[1], b->error_message, len);
+	return 1 + len;
+}
+
+static inline int oac_proto_decode_error(const u8 *in, u8 length, struct ErrorBody *b)
+{
+	size_t len;
+
+	if (length < 1)
+		return -EBADMSG;
+	b->error_code = in[0];
+	len = min_t(size_t, length - 1, sizeof(b->error_message) - 1);
+	memcpy(b->error_message, &in[1], len);
+	b->error_message[len] = '\0';
+	return 0;
+}
+
+static inline u8 oac_proto_encode_errorcode_v1(const struct ErrorCodeBody *b, u8 *out)
+{
+	out[0] = b->code;
+	put_unaligned_le16(b->count, &out[1]);
+	put_unaligned_le32(b->context, &out[3]);
+	return OAC_PAYLOAD_LEN_ERRORCODE_V1;
+}
+
+static inline u8 oac_proto_encode_errorcode_v2(const struct ErrorCodeBody *b, u8 *out)
+{
+	u8 n;
+
+	out[0] = b->code;
+	n = 1 + oac_proto_put_varint(&out[1], b->count);
+	return n + oac_proto_put_varint(&out[n], b->context);
+}
+
+static inline int oac_proto_decode_errorcode_v1(const u8 *in, u8 length, struct ErrorCodeBody *b)
+{
+	if (length != OAC_PAYLOAD_LEN_ERRORCODE_V1)
+		return -EBADMSG;
+	b->code = in[0];
+	b->count = get_unaligned_le16(&in[1]);
+	b->context = get_unaligned_le32(&in[3]);
+	return 0;
+}
+
+static inline int oac_proto_decode_errorcode_v2(const u8 *in, u8 length, struct ErrorCodeBody *b)
+{
+	u64 v;
+	int n;
+	int r;
+
+	if (length < 1)
+		return -EBADMSG;
+	b->code = in[0];
+	n = oac_proto_get_varint(&in[1], length - 1, &v);
+	if (n < 0 || v > U16_MAX)
+		return -EBADMSG;
+	b->count = v;
+	n += 1;
+	r = oac_proto_get_varint(&in[n], length - (n), &v);
+	if (r < 0 || v > U32_MAX || n + r != length)
+		return -EBADMSG;
+	b->context = v;
+	return 0;
+}
+
+static inline u8 oac_proto_encode_ack(const struct AckBody *b, u8 *out)
+{
+	out[0] = b->seq;
+	return OAC_PAYLOAD_LEN_ACK_V1;
+}
+
+static inline int oac_proto_decode_ack(const u8 *in, u8 length, struct AckBody *b)
+{
+	if (length != OAC_PAYLOAD_LEN_ACK_V1)
+		return -EBADMSG;
+	b->seq = in[0];
+	return 0;
+}
+
+static inline u8 oac_proto_encode_request_v1(const struct RequestBody *b, u8 *out)
+{
+	out[0] = b->tid;
+	put_unaligned_le16(b->command, &out[1]);
+	put_unaligned_le64(b->val, &out[3]);
+	return OAC_PAYLOAD_LEN_REQUEST_V1;
+}
+
+static inline u8 oac_proto_encode_request_v2(const struct RequestBody *b, u8 *out)
+{
+	out[0] = b->tid;
+	put_unaligned_le16(b->command, &out[1]);
+	return 3 + oac_proto_put_varint(&out[3], b->val);
+}
+
+static inline int oac_proto_decode_request_v1(const u8 *in, u8 length, struct RequestBody *b)
+{
+	if (length != OAC_PAYLOAD_LEN_REQUEST_V1)
+		return -EBADMSG;
+	b->tid = in[0];
+	b->command = get_unaligned_le16(&in[1]);
+	b->val = get_unaligned_le64(&in[3]);
+	return 0;
+}
+
+static inline int oac_proto_decode_request_v2(const u8 *in, u8 length, struct RequestBody *b)
+{
+	u64 v;
+	int n;
+
+	if (length < 3)
+		return -EBADMSG;
+	b->tid = in[0];
+	b->command = get_unaligned_le16(&in[1]);
+	n = oac_proto_get_varint(&in[3], length - 3, &v);
+	if (n < 0 || 3 + n != length)
+		return -EBADMSG;
+	b->val = v;
+	return 0;
+}
+
+static inline u8 oac_proto_encode_reply_v1(const struct ReplyBody *b, u8 *out)
+{
+	out[0] = b->tid;
+	out[1] = b->result;
+	put_unaligned_le64(b->val, &out[2]);
+	return OAC_PAYLOAD_LEN_REPLY_V1;
+}
+
+static inline u8 oac_proto_encode_reply_v2(const struct ReplyBody *b, u8 *out)
+{
+	out[0] = b->tid;
+	out[1] = b->result;
+	return 2 + oac_proto_put_varint(&out[2], b->val);
+}
+
+static inline int oac_proto_decode_reply_v1(const u8 *in, u8 length, struct ReplyBody *b)
+{
+	if (length != OAC_PAYLOAD_LEN_REPLY_V1)
+		return -EBADMSG;
+	b->tid = in[0];
+	b->result = in[1];
+	b->val = get_unaligned_le64(&in[2]);
+	return 0;
+}
+
+static inline int oac_proto_decode_reply_v2(const u8 *in, u8 length, struct ReplyBody *b)
+{
+	u64 v;
+	int n;
+
+	if (length < 2)
+		return -EBADMSG;
+	b->tid = in[0];
+	b->result = in[1];
+	n = oac_proto_get_varint(&in[2], length - 2, &v);
+	if (n < 0 || 2 + n != length)
+		return -EBADMSG;
+	b->val = v;
+	return 0;
+}
+
+static inline u8 oac_proto_encode_event_v1(const struct EventBody *b, u8 *out)
+{
+	put_unaligned_le16(b->command, out);
+	put_unaligned_le16(b->trace, &out[2]);
+	put_unaligned_le64(b->time_us, &out[4]);
+	put_unaligned_le32(b->queued_us, &out[12]);
+	return OAC_PAYLOAD_LEN_EVENT_V1;
+}
+
+static inline u8 oac_proto_encode_event_v2(const struct EventBody *b, u8 *out)
+{
+	u8 n;
+
+	put_unaligned_le16(b->command, out);
+	n = 2 + oac_proto_put_varint(&out[2], b->trace);
+	n += oac_proto_put_varint(&out[n], b->time_us);
+	return n + oac_proto_put_varint(&out[n], b->queued_us);
+}
+
+static inline int oac_proto_decode_event_v1(const u8 *in, u8 length, struct EventBody *b)
+{
+	if (length != OAC_PAYLOAD_LEN_EVENT_V1)
+		return -EBADMSG;
+	b->command = get_unaligned_le16(in);
+	b->trace = get_unaligned_le16(&in[2]);
+	b->time_us = get_unaligned_le64(&in[4]);
+	b->queued_us = get_unaligned_le32(&in[12]);
+	return 0;
+}
+
+static inline int oac_proto_decode_event_v2(const u8 *in, u8 length, struct EventBody *b)
+{
+	u64 v;
+	int n;
+	int r;
+
+	if (length < 2)
+		return -EBADMSG;
+	b->command = get_unaligned_le16(in);
+	n = oac_proto_get_varint(&in[2], length - 2, &v);
+	if (n < 0 || v > U16_MAX)
+		return -EBADMSG;
+	b->trace = v;
+	n += 2;
+	r = oac_proto_get_varint(&in[n], length - (n), &v);
+	if (r < 0)
+		return -EBADMSG;
+	b->time_us = v;
+	n += r;
+	r = oac_proto_get_varint(&in[n], length - (n), &v);
+	if (r < 0 || v > U32_MAX || n + r != length)
+		return -EBADMSG;
+	b->queued_us = v;
+	return 0;
+}
+
+/* Every message in a batch must fit, each is decoded as it is unpacked */
+static inline int oac_proto_decode_batch(const u8 *in, u8 length, u8 *raw)
+{
+	size_t pos;
+
+	if (length == 0)
+		return -EBADMSG;
+	for (pos = 0; pos < length; pos += 2 + in[pos + 1]) {
+		if (length - pos < 2 || in[pos] == OAC_MESSAGE_TYPE_BATCH ||
+		    in[pos + 1] > length - pos - 2)
+			return -EBADMSG;
+	}
+	memcpy(raw, in, length);
+	return 0;
+}
+
+/*
+ * oac_encode_payload - Write the payload of msg in the version encoding
+ * @out: at least OAC_MAX_PAYLOAD_SIZE bytes
+ *
+ * Returns the payload length, or < 0 for a type that cannot be encoded.
+ */
+static inline int oac_encode_payload(const struct Message *msg, u8 version, u8 *out)
+{
+	switch (msg->header.message_type) {
+	case OAC_MESSAGE_TYPE_COMMAND:
+		return oac_proto_encode_command(&msg->body.payload_command, out);
+	case OAC_MESSAGE_TYPE_STATUS:
+		if (version == OAC_PROTOCOL_V2)
+			return oac_proto_encode_status_v2(&msg->body.payload_status, out);
+		return oac_proto_encode_status_v1(&msg->body.payload_status, out);
+	case OAC_MESSAGE_TYPE_ERROR:
+		return oac_proto_encode_error(&msg->body.payload_error, out);
+	case OAC_MESSAGE_TYPE_DATA:
+		if (msg->header.payload_length > OAC_MAX_PAYLOAD_SIZE)
+			return -EMSGSIZE;
+		memcpy(out, msg->body.payload_raw, msg->header.payload_length);
+		return msg->header.payload_length;
+	case OAC_MESSAGE_TYPE_RESPONSE:
+		if (version == OAC_PROTOCOL_V2)
+			return oac_proto_encode_response_v2(&msg->body.payload_response, out);
+		return oac_proto_encode_response_v1(&msg->body.payload_response, out);
+	case OAC_MESSAGE_TYPE_ACK:
+	case OAC_MESSAGE_TYPE_NAK:
+		return oac_proto_encode_ack(&msg->body.payload_ack, out);
+	case OAC_MESSAGE_TYPE_REQUEST:
+		if (version == OAC_PROTOCOL_V2)
+			return oac_proto_encode_request_v2(&msg->body.payload_request, out);
+		return oac_proto_encode_request_v1(&msg->body.payload_request, out);
+	case OAC_MESSAGE_TYPE_REPLY:
+		if (version == OAC_PROTOCOL_V2)
+			return oac_proto_encode_reply_v2(&msg->body.payload_reply, out);
+		return oac_proto_encode_reply_v1(&msg->body.payload_reply, out);
+	case OAC_MESSAGE_TYPE_EVENT:
+		if (version == OAC_PROTOCOL_V2)
+			return oac_proto_encode_event_v2(&msg->body.payload_event, out);
+		return oac_proto_encode_event_v1(&msg->body.payload_event, out);
+	case OAC_MESSAGE_TYPE_ERROR_CODE:
+		if (version == OAC_PROTOCOL_V2)
+			return oac_proto_encode_errorcode_v2(&msg->body.payload_error_code, out);
+		return oac_proto_encode_errorcode_v1(&msg->body.payload_error_code, out);
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * oac_decode_payload - Reverse oac_encode_payload into msg, whose type is set
+ *
+ * Returns 0, or < 0 if the payload is malformed or its type unknown.
+ */
+static inline int oac_decode_payload(const u8 *in, u8 length, u8 version, struct Message *msg)
+{
+	switch (msg->header.message_type) {
+	case OAC_MESSAGE_TYPE_COMMAND:
+		return oac_proto_decode_command(in, length, &msg->body.payload_command);
+	case OAC_MESSAGE_TYPE_STATUS:
+		if (version == OAC_PROTOCOL_V2)
+			return oac_proto_decode_status_v2(in, length, &msg->body.payload_status);
+		return oac_proto_decode_status_v1(in, length, &msg->body.payload_status);
+	case OAC_MESSAGE_TYPE_ERROR:
+		return oac_proto_decode_error(in, length, &msg->body.payload_error);
+	case OAC_MESSAGE_TYPE_DATA:
+		memcpy(msg->body.payload_raw, in, length);
+		return 0;
+	case OAC_MESSAGE_TYPE_RESPONSE:
+		if (version == OAC_PROTOCOL_V2)
+			return oac_proto_decode_response_v2(in, length, &msg->body.payload_response);
+		return oac_proto_decode_response_v1(in, length, &msg->body.payload_response);
+	case OAC_MESSAGE_TYPE_ACK:
+	case OAC_MESSAGE_TYPE_NAK:
+		return oac_proto_decode_ack(in, length, &msg->body.payload_ack);
+	case OAC_MESSAGE_TYPE_BATCH:
+		if (version != OAC_PROTOCOL_V2)
+			return -EBADMSG;
+		return oac_proto_decode_batch(in, length, msg->body.payload_raw);
+	case OAC_MESSAGE_TYPE_REQUEST:
+		if (version == OAC_PROTOCOL_V2)
+			return oac_proto_decode_request_v2(in, length, &msg->body.payload_request);
+		return oac_proto_decode_request_v1(in, length, &msg->body.payload_request);
+	case OAC_MESSAGE_TYPE_REPLY:
+		if (version == OAC_PROTOCOL_V2)
+			return oac_proto_decode_reply_v2(in, length, &msg->body.payload_reply);
+		return oac_proto_decode_reply_v1(in, length, &msg->body.payload_reply);
+	case OAC_MESSAGE_TYPE_EVENT:
+		if (version == OAC_PROTOCOL_V2)
+			return oac_proto_decode_event_v2(in, length, &msg->body.payload_event);
+		return oac_proto_decode_event_v1(in, length, &msg->body.payload_event);
+	case OAC_MESSAGE_TYPE_ERROR_CODE:
+		if (version == OAC_PROTOCOL_V2)
+			return oac_proto_decode_errorcode_v2(in, length, &msg->body.payload_error_code);
+		return oac_proto_decode_errorcode_v1(in, length, &msg->body.payload_error_code);
+	default:
+		return -EINVAL;
+	}
+}
+
+#endif /* OAC_PROTOCOL_CODEC_H */
@@ -0,0 +1,260 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Link statistics
+ *
+ * Frames and bytes by direction and message type, received frames dropped by
+ * reason, resynchronisations and the time spent in the callbacks. Counted per
+ * CPU without a lock, and added up on reading: one total per attribute in the
+ * stats group of the serdev device, and by message type in the stats file in
+ * debugfs.
+ */
+#include <linux/debugfs.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/serdev.h>
+#include <linux/sysfs.h>
+#include <linux/u64_stats_sync.h>
+#include "oac_comms.h"
+#include "oac_dev.h"
+
+/* A message type beyond OAC_STATS_TYPES fails to build here */
+#define OAC_STATS_TYPE_NAME(type, name)	[type] = name,
+static const char * const oac_stats_type_names[OAC_STATS_TYPES] = {
+	OAC_MESSAGE_TYPES(OAC_STATS_TYPE_NAME)
+};
+#undef OAC_STATS_TYPE_NAME
+
+static const char * const oac_stats_dir_names[OAC_STATS_DIRS] = {
+	[OAC_STATS_RX] = "rx",
+	[OAC_STATS_TX] = "tx",
+};
+
+static const char * const oac_stats_error_names[OAC_STATS_ERRORS] = {
+	[OAC_STATS_ERR_OVERFLOW] = "overflow",
+	[OAC_STATS_ERR_FRAMING] = "framing",
+	[OAC_STATS_ERR_CHECKSUM] = "checksum",
+	[OAC_STATS_ERR_UNKNOWN_TYPE] = "unknown_type",
+	[OAC_STATS_ERR_MALFORMED] = "malformed",
+};
+
+/*
+ * The counters are updated with preemption disabled, and never from interrupt
+ * context, so one CPU's are only ever written by one caller at a time.
+ */
+void oac_stats_frame(struct oac_dev *odev, enum oac_stats_dir dir, u8 type, size_t bytes)
+{
+	struct oac_stats *stats;
+
+	if (type >= OAC_STATS_TYPES)
+		return;
+
+	stats = get_cpu_ptr(odev->stats);
+	u64_stats_update_begin(&stats->syncp);
+	u64_stats_inc(&stats->frames[dir][type]);
+	u64_stats_add(&stats->bytes[dir][type], bytes);
+	u64_stats_update_end(&stats->syncp);
+	put_cpu_ptr(odev->stats);
+}
+
+void oac_stats_error(struct oac_dev *odev, enum oac_stats_error err)
+{
+	struct oac_stats *stats = get_cpu_ptr(odev->stats);
+
+	u64_stats_update_begin(&stats->syncp);
+	u64_stats_inc(&stats->errors[err]);
+	u64_stats_update_end(&stats->syncp);
+	put_cpu_ptr(odev->stats);
+}
+
+/*
+ * Count a dropped frame by why, from the error of oac_rx_next(), @frame NULL,
+ * or that of oac_decode_frame() for @frame
+ */
+void oac_stats_rx_error(struct oac_dev *odev, const struct oac_rx_frame *frame, int err)
+{
+	enum oac_stats_error class;
+
+	if (!frame)
+		class = err == -EMSGSIZE ? OAC_STATS_ERR_OVERFLOW : OAC_STATS_ERR_FRAMING;
+	else if (err == -EILSEQ)
+		class = OAC_STATS_ERR_CHECKSUM;
+	else if (frame->len >= 2 &&
+		 (frame->data[1] >= OAC_STATS_TYPES || !oac_stats_type_names[frame->data[1]]))
+		class = OAC_STATS_ERR_UNKNOWN_TYPE;
+	else
+		class = OAC_STATS_ERR_MALFORMED;
+
+	oac_stats_error(odev, class);
+}
+
+void oac_stats_resync(struct oac_dev *odev, unsigned int count)
+{
+	struct oac_stats *stats = get_cpu_ptr(odev->stats);
+
+	u64_stats_update_begin(&stats->syncp);
+	u64_stats_add(&stats->resyncs, count);
+	u64_stats_update_end(&stats->syncp);
+	put_cpu_ptr(odev->stats);
+}
+
+/* The callbacks for a message took @ns */
+void oac_stats_dispatch(struct oac_dev *odev, u64 ns)
+{
+	struct oac_stats *stats = get_cpu_ptr(odev->stats);
+
+	u64_stats_update_begin(&stats->syncp);
+	u64_stats_inc(&stats->dispatches);
+	u64_stats_add(&stats->dispatch_ns, ns);
+	u64_stats_update_end(&stats->syncp);
+	put_cpu_ptr(odev->stats);
+}
+
+/* Sum of @n adjacent counters at @offset in struct oac_stats, over all CPUs */
+static u64 oac_stats_fold(struct oac_dev *odev, size_t offset, unsigned int n)
+{
+	const struct oac_stats *stats;
+	const u64_stats_t *field;
+	unsigned int start, i;
+	u64 total = 0, val;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(odev->stats, cpu);
+		field = (const void *)stats + offset;
+		do {
+			start = u64_stats_fetch_begin(&stats->syncp);
+			val = 0;
+			for (i = 0; i < n; i++)
+				val += u64_stats_read(&field[i]);
+		} while (u64_stats_fetch_retry(&stats->syncp, start));
+		total += val;
+	}
+	return total;
+}
+
+#define oac_stats_total(odev, field, n)	oac_stats_fold(odev, offsetof(struct oac_stats, field), n)
+
+/* sysfs: one total per attribute, for monitoring */
+#define OAC_STATS_ATTR(_name, _field, _n)						\
+static ssize_t _name##_show(struct device *dev, struct device_attribute *attr, char *buf)	\
+{											\
+	return sysfs_emit(buf, "%llu\n", oac_stats_total(dev_get_drvdata(dev), _field, _n));	\
+}											\
+static DEVICE_ATTR_RO(_name)
+
+OAC_STATS_ATTR(rx_frames, frames[OAC_STATS_RX], OAC_STATS_TYPES);
+OAC_STATS_ATTR(rx_bytes, bytes[OAC_STATS_RX], OAC_STATS_TYPES);
+OAC_STATS_ATTR(tx_frames, frames[OAC_STATS_TX], OAC_STATS_TYPES);
+OAC_STATS_ATTR(tx_bytes, bytes[OAC_STATS_TX], OAC_STATS_TYPES);
+OAC_STATS_ATTR(rx_errors, errors, OAC_STATS_ERRORS);
+OAC_STATS_ATTR(rx_overflow_errors, errors[OAC_STATS_ERR_OVERFLOW], 1);
+OAC_STATS_ATTR(rx_framing_errors, errors[OAC_STATS_ERR_FRAMING], 1);
+OAC_STATS_ATTR(rx_checksum_errors, errors[OAC_STATS_ERR_CHECKSUM], 1);
+OAC_STATS_ATTR(rx_unknown_type_errors, errors[OAC_STATS_ERR_UNKNOWN_TYPE], 1);
+OAC_STATS_ATTR(rx_malformed_errors, errors[OAC_STATS_ERR_MALFORMED], 1);
+OAC_STATS_ATTR(rx_resyncs, resyncs, 1);
+OAC_STATS_ATTR(dispatches, dispatches, 1);
+OAC_STATS_ATTR(dispatch_ns, dispatch_ns, 1);
+
+/* Messages dropped on a full RX queue, as in the rx_queue attribute */
+static ssize_t rx_dropped_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct oac_dev *odev = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(odev->rx_drops));
+}
+static DEVICE_ATTR_RO(rx_dropped);
+
+/* Commands given up on without an acknowledgement */
+static ssize_t tx_failures_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct oac_dev *odev = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(odev->tx_failures));
+}
+static DEVICE_ATTR_RO(tx_failures);
+
+/* Bytes of messages waiting in the batch, not yet written to the UART */
+static ssize_t tx_pending_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct oac_dev *odev = dev_get_drvdata(dev);
+	size_t len;
+
+	mutex_lock(&odev->tx_lock);
+	len = odev->tx_batch_count ? odev->tx_batch_len : 0;
+	mutex_unlock(&odev->tx_lock);
+
+	return sysfs_emit(buf, "%zu\n", len);
+}
+static DEVICE_ATTR_RO(tx_pending);
+
+static struct attribute *oac_stats_attrs[] = {
+	&dev_attr_rx_frames.attr,
+	&dev_attr_rx_bytes.attr,
+	&dev_attr_tx_frames.attr,
+	&dev_attr_tx_bytes.attr,
+	&dev_attr_rx_errors.attr,
+	&dev_attr_rx_overflow_errors.attr,
+	&dev_attr_rx_framing_errors.attr,
+	&dev_attr_rx_checksum_errors.attr,
+	&dev_attr_rx_unknown_type_errors.attr,
+	&dev_attr_rx_malformed_errors.attr,
+	&dev_attr_rx_resyncs.attr,
+	&dev_attr_rx_dropped.attr,
+	&dev_attr_dispatches.attr,
+	&dev_attr_dispatch_ns.attr,
+	&dev_attr_tx_failures.attr,
+	&dev_attr_tx_pending.attr,
+	NULL,
+};
+
+const struct attribute_group oac_stats_group = {
+	.name = "stats",
+	.attrs = oac_stats_attrs,
+};
+
+/* debugfs: frames and bytes by message type, then the drops by reason */
+static int oac_stats_show(struct seq_file *s, void *unused)
+{
+	struct oac_dev *odev = s->private;
+	u64 count, calls;
+	int dir, type, i;
+
+	for (dir = 0; dir < OAC_STATS_DIRS; dir++) {
+		for (type = 0; type < OAC_STATS_TYPES; type++) {
+			count = oac_stats_total(odev, frames[dir][type], 1);
+			if (count)
+				seq_printf(s, "%s %-10s frames=%llu bytes=%llu\n",
+					   oac_stats_dir_names[dir], oac_stats_type_names[type] ?: "?", count,
+					   oac_stats_total(odev, bytes[dir][type], 1));
+		}
+	}
+
+	for (i = 0; i < OAC_STATS_ERRORS; i++)
+		seq_printf(s, "error %-12s %llu\n", oac_stats_error_names[i],
+			   oac_stats_total(odev, errors[i], 1));
+
+	calls = oac_stats_total(odev, dispatches, 1);
+	seq_printf(s, "resyncs=%llu dispatches=%llu dispatch_avg_ns=%llu\n",
+		   oac_stats_total(odev, resyncs, 1), calls,
+		   calls ? div64_u64(oac_stats_total(odev, dispatch_ns, 1), calls) : 0);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(oac_stats);
+
+/* After oac_param_init(), which creates the debugfs directory */
+int oac_stats_init(struct oac_dev *odev)
+{
+	int cpu;
+
+	odev->stats = devm_alloc_percpu(&odev->serdev->dev, struct oac_stats);
+	if (!odev->stats)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(odev->stats, cpu)->syncp);
+
+	debugfs_create_file("stats", 0444, odev->debugfs, odev, &oac_stats_fops);
+	return 0;
+}
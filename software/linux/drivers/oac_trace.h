@@ -0,0 +1,148 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Tracepoints of the OAC serial link, in place of logging every message
+ *
+ *   echo 1 > /sys/kernel/tracing/events/oac/enable
+ *   cat /sys/kernel/tracing/trace_pipe
+ *
+ * or perf record -e 'oac:*'. They cost nothing while disabled.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM oac
+
+#if !defined(_OAC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _OAC_TRACE_H
+
+#include <linux/tracepoint.h>
+#include "oac_protocol.h"
+
+/* Message type names for the output, their values exported for perf and trace-cmd */
+#undef OAC_TRACE_TYPE
+#define OAC_TRACE_TYPE(type, name)	TRACE_DEFINE_ENUM(type);
+OAC_MESSAGE_TYPES(OAC_TRACE_TYPE)
+
+#undef OAC_TRACE_TYPE
+#define OAC_TRACE_TYPE(type, name)	{ type, name },
+#define oac_trace_show_type(type)	__print_symbolic(type, OAC_MESSAGE_TYPES(OAC_TRACE_TYPE))
+
+TRACE_EVENT(oac_rx_frame,
+
+	TP_PROTO(u8 framing, const struct Message *msg),
+
+	TP_ARGS(framing, msg),
+
+	TP_STRUCT__entry(
+		__field(u8, framing)
+		__field(u8, type)
+		__field(u8, len)
+		__field(u8, seq)
+	),
+
+	TP_fast_assign(
+		__entry->framing = framing;
+		__entry->type = msg->header.message_type;
+		__entry->len = msg->header.payload_length;
+		__entry->seq = msg->header.seq;
+	),
+
+	TP_printk("v%u type=%s len=%u seq=%u", __entry->framing,
+		  oac_trace_show_type(__entry->type), __entry->len, __entry->seq)
+);
+
+/* @count messages went out in a frame of @bytes, more than one in a batch */
+TRACE_EVENT(oac_tx_frame,
+
+	TP_PROTO(u8 version, u8 type, u8 seq, u8 count, int bytes),
+
+	TP_ARGS(version, type, seq, count, bytes),
+
+	TP_STRUCT__entry(
+		__field(u8, version)
+		__field(u8, type)
+		__field(u8, seq)
+		__field(u8, count)
+		__field(int, bytes)
+	),
+
+	TP_fast_assign(
+		__entry->version = version;
+		__entry->type = type;
+		__entry->seq = seq;
+		__entry->count = count;
+		__entry->bytes = bytes;
+	),
+
+	TP_printk("v%u type=%s seq=%u count=%u bytes=%d", __entry->version,
+		  oac_trace_show_type(__entry->type), __entry->seq, __entry->count, __entry->bytes)
+);
+
+/* A frame was dropped, it ended @pos bytes into a read of @count */
+TRACE_EVENT(oac_parse_error,
+
+	TP_PROTO(int err, size_t pos, size_t count),
+
+	TP_ARGS(err, pos, count),
+
+	TP_STRUCT__entry(
+		__field(int, err)
+		__field(unsigned int, pos)
+		__field(unsigned int, count)
+	),
+
+	TP_fast_assign(
+		__entry->err = err;
+		__entry->pos = pos;
+		__entry->count = count;
+	),
+
+	TP_printk("err=%d pos=%u count=%u", __entry->err, __entry->pos, __entry->count)
+);
+
+/* The callbacks for a message returned, @latency_ns after its bytes arrived */
+TRACE_EVENT(oac_dispatch,
+
+	TP_PROTO(u8 type, u16 key, u64 latency_ns),
+
+	TP_ARGS(type, key, latency_ns),
+
+	TP_STRUCT__entry(
+		__field(u8, type)
+		__field(u16, key)
+		__field(u64, latency_ns)
+	),
+
+	TP_fast_assign(
+		__entry->type = type;
+		__entry->key = key;
+		__entry->latency_ns = latency_ns;
+	),
+
+	TP_printk("type=%s key=0x%04x latency_ns=%llu", oac_trace_show_type(__entry->type),
+		  __entry->key, __entry->latency_ns)
+);
+
+TRACE_EVENT(oac_watchdog_ping,
+
+	TP_PROTO(int ret),
+
+	TP_ARGS(ret),
+
+	TP_STRUCT__entry(
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->ret = ret;
+	),
+
+	TP_printk("ret=%d", __entry->ret)
+);
+
+#endif /* _OAC_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE oac_trace
+#include <trace/define_trace.h>
@@ -5,6 +5,7 @@
 #include <linux/of_device.h>
 #include "oac_comms.h"
 #include "oac_dev.h"
+#include "oac_trace.h"
 
 struct oac_watchdog {
 	struct watchdog_device wdd;
@@ -13,8 +14,9 @@ struct oac_watchdog {
 
 static int oac_wd_ping(struct watchdog_device *wdd)
 {
-	pr_info("OAC watchdog: ping\n");
 	struct oac_watchdog *owd = watchdog_get_drvdata(wdd);
+	int ret;
+
 	if (!owd || !owd->core)
 		return -EINVAL;
 
@@ -23,7 +25,9 @@ static int oac_wd_ping(struct watchdog_device *wdd)
 		.body.payload_command.command = OAC_COMMAND_WD_KICK,
 	};
 
-	return oac_dev_send_message(owd->core, &msg);
+	ret = oac_dev_send_message(owd->core, &msg);
+	trace_oac_watchdog_ping(ret);
+	return ret;
 }
 
 static int oac_wd_start(struct watchdog_device *wdd)
@@ -63,25 +67,10 @@ static int oac_wd_stop(struct watchdog_device *wdd)
 	return oac_dev_send_message(owd->core, &msg);
 }
 
+/* The firmware has no handler for WD_SET_TO, it keeps OAC_WD_DEFAULT_TIMEOUT */
 static int oac_wd_set_timeout(struct watchdog_device *wdd, unsigned int timeout)
 {
-	/* TODO: Implement watchdog timeout setting */
-	pr_info("OAC watchdog: set_timeout NOT IMPLEMENTED\n");
-	struct oac_watchdog *owd = watchdog_get_drvdata(wdd);
-	if (!owd || !owd->core)
-		return -ENODEV;
-
-	struct Message msg = {
-		.header = {
-			.message_type = OAC_MESSAGE_TYPE_RESPONSE,
-			.recipient = OAC_COMMS_RECIPIENT_FIRMWARE,
-			.payload_length = sizeof(struct ResponseBody),
-		},
-		.body.payload_response.param = OAC_COMMAND_WD_SET_TO,
-		.body.payload_response.val = timeout,
-	};
-
-	return oac_dev_send_message(owd->core, &msg);
+	return -EOPNOTSUPP;
 }
 
 
@@ -115,11 +104,11 @@ static int oac_watchdog_probe(struct platform_device *pdev)
 	owd->wdd.info = &oac_wd_info;
 	owd->wdd.ops = &oac_wd_ops;
 	owd->wdd.parent = &pdev->dev;
-	owd->wdd.min_timeout = 1;
-	owd->wdd.max_timeout = 60;
+	owd->wdd.min_timeout = OAC_WD_MIN_TIMEOUT;
+	owd->wdd.max_timeout = OAC_WD_MAX_TIMEOUT;
 
 	/* Register default timeout with system (can be overridden via devicetree or kernel cmdline) */
-	ret = watchdog_init_timeout(&owd->wdd, 10, &pdev->dev);
+	ret = watchdog_init_timeout(&owd->wdd, OAC_WD_DEFAULT_TIMEOUT, &pdev->dev);
 	if (ret)
 		dev_warn(&pdev->dev, "unable to set default timeout, using 10s\n");
 
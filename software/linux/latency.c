@@ -0,0 +1,217 @@
+/*
+ * latency.c - Button to recording latency, traced stage by stage
+ *
+ * The firmware sends a button press as an EVENT carrying a trace ID, the time of the
+ * release on its clock and how long it took to send it. The release is put on
+ * CLOCK_MONOTONIC with the clock synchronisation in comms.c, and the stages after it
+ * are timestamped here as the press makes its way to the first frame on storage. Each
+ * span between two stages goes into a histogram with a bucket every 1/8 octave, so
+ * percentiles are within 12.5%. The histograms are rewritten to a file after every
+ * trace, and each trace is logged as it completes.
+ */
+
+#include "latency.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#define SUB_BITS 3                          /* Buckets per octave, as a power of two */
+#define SUB (1 << SUB_BITS)
+#define BUCKETS ((32 - SUB_BITS + 1) * SUB) /* Enough for any uint32_t */
+
+struct Span {
+    const char *name;
+    enum latency_stage from;
+    enum latency_stage to;
+};
+
+static const struct Span spans[] = {
+    { "firmware", LATENCY_BUTTON,   LATENCY_SENT },         /* handle_button_press() and the loop */
+    { "link",     LATENCY_SENT,     LATENCY_RECEIVED },     /* UART, comms and the main loop */
+    { "dispatch", LATENCY_RECEIVED, LATENCY_RECORD },
+    { "camera",   LATENCY_RECORD,   LATENCY_FIRST_FRAME },  /* libcamera-vid start up to its first frame */
+    { "start",    LATENCY_RECORD,   LATENCY_STARTED },      /* start_record(), waiting on libcamera-vid */
+    { "total",    LATENCY_BUTTON,   LATENCY_FIRST_FRAME },
+};
+#define SPANS (sizeof(spans) / sizeof(spans[0]))
+
+struct Histogram {
+    uint32_t buckets[BUCKETS];
+    uint32_t count;
+    uint32_t max_us;
+};
+
+static struct Histogram histograms[SPANS];
+static const char *export_path = LATENCY_DEFAULT_PATH;
+
+/* The trace in progress, stage times on CLOCK_MONOTONIC, 0 if not reached or unknown */
+static bool active = false;
+static uint16_t trace_id;
+static int32_t clock_error_ns;              /* Of the firmware stages, < 0 if unsynchronised */
+static int64_t stage_ns[LATENCY_STAGES];
+
+static unsigned int bucket_of(uint32_t us)
+{
+    if (us < SUB)
+        return us;
+
+    unsigned int msb = 31 - __builtin_clz(us);
+    return (msb - SUB_BITS + 1) * SUB + ((us >> (msb - SUB_BITS)) & (SUB - 1));
+}
+
+/* Smallest value in a bucket */
+static uint32_t bucket_low(unsigned int bucket)
+{
+    if (bucket < SUB)
+        return bucket;
+
+    unsigned int msb = bucket / SUB + SUB_BITS - 1;
+    return (uint32_t)(SUB + bucket % SUB) << (msb - SUB_BITS);
+}
+
+/*
+ * percentile - Value below which percent of the samples fall.
+ * @return The top of the bucket it is in, at most the largest sample
+ */
+static uint32_t percentile(const struct Histogram *h, unsigned int percent)
+{
+    uint64_t target = ((uint64_t)h->count * percent + 99) / 100;
+    uint64_t seen = 0;
+
+    for (unsigned int i = 0; i < BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target && seen > 0) {
+            uint32_t top = (i + 1 < BUCKETS) ? bucket_low(i + 1) - 1 : UINT32_MAX;
+            return top < h->max_us ? top : h->max_us;
+        }
+    }
+    return h->max_us;
+}
+
+static void histogram_add(struct Histogram *h, int64_t ns)
+{
+    uint32_t us = ns <= 0 ? 0 : (ns / 1000 > UINT32_MAX ? UINT32_MAX : (uint32_t)(ns / 1000));
+
+    h->buckets[bucket_of(us)]++;
+    h->count++;
+    if (us > h->max_us)
+        h->max_us = us;
+}
+
+/*
+ * latency_export - Write every histogram to the export file.
+ * @note Written to a temporary file first, so readers never see half of it.
+ */
+static void latency_export(void)
+{
+    char tmp[256];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", export_path);
+
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+        return;
+
+    fprintf(f, "# span count p50_us p99_us max_us\n");
+    for (size_t i = 0; i < SPANS; i++) {
+        const struct Histogram *h = &histograms[i];
+        fprintf(f, "%s %u %u %u %u\n", spans[i].name, h->count,
+                percentile(h, 50), percentile(h, 99), h->max_us);
+    }
+
+    if (fclose(f) == 0)
+        rename(tmp, export_path);
+    else
+        remove(tmp);
+}
+
+/*
+ * latency_finish - Add the trace in progress to the histograms and log it.
+ * @note Spans with a stage that was never reached are left out.
+ */
+static void latency_finish(void)
+{
+    char line[256];
+    int len = snprintf(line, sizeof(line), "[LATENCY] trace %u:", trace_id);
+
+    for (size_t i = 0; i < SPANS; i++) {
+        int64_t from = stage_ns[spans[i].from], to = stage_ns[spans[i].to];
+
+        if (from && to) {
+            histogram_add(&histograms[i], to - from);
+            len += snprintf(line + len, sizeof(line) - len, "%s %s %.1f ms",
+                            i ? "," : "", spans[i].name, (to - from) / 1e6);
+        } else {
+            len += snprintf(line + len, sizeof(line) - len, "%s %s -", i ? "," : "", spans[i].name);
+        }
+        if (len >= (int)sizeof(line))
+            break;
+    }
+    if (clock_error_ns >= 0 && len < (int)sizeof(line))
+        snprintf(line + len, sizeof(line) - len, " (clock +/-%.1f ms)", clock_error_ns / 1e6);
+
+    printf("%s\n", line);
+    syslog(LOG_INFO, "%s", line);
+
+    active = false;
+    latency_export();
+}
+
+/*
+ * latency_init - Set where the histograms are written.
+ * @param path: The export file, NULL for LATENCY_DEFAULT_PATH
+ */
+void latency_init(const char *path)
+{
+    if (path)
+        export_path = path;
+}
+
+/*
+ * latency_begin - Start timing an event from the firmware.
+ * @param event: The event, just handed over by comms_receive_messages()
+ * @note Until the firmware clock is synchronised only the stages on this side are known.
+ */
+void latency_begin(const struct EventBody *event)
+{
+    int64_t button_ns;
+
+    if (active)
+        latency_finish();
+
+    memset(stage_ns, 0, sizeof(stage_ns));
+    stage_ns[LATENCY_RECEIVED] = GET_TIME_NS();
+    trace_id = event->trace;
+
+    clock_error_ns = comms_clock_to_mono_ns(event->time_us, &button_ns);
+    if (clock_error_ns >= 0) {
+        stage_ns[LATENCY_BUTTON] = button_ns;
+        stage_ns[LATENCY_SENT] = button_ns + (int64_t)event->queued_us * 1000;
+    }
+    active = true;
+}
+
+/*
+ * latency_mark - Timestamp a stage of the trace in progress, if there is one.
+ * @note The trace is complete once the first frame is stored and start_record() is
+ *       done, whichever comes last.
+ */
+void latency_mark(enum latency_stage stage)
+{
+    if (!active || stage_ns[stage])
+        return;
+
+    stage_ns[stage] = GET_TIME_NS();
+
+    if (stage_ns[LATENCY_FIRST_FRAME] && stage_ns[LATENCY_STARTED])
+        latency_finish();
+}
+
+/*
+ * latency_poll - Give up on a trace after LATENCY_TIMEOUT_MS, e.g. the recording failed.
+ */
+void latency_poll(void)
+{
+    if (active && GET_TIME_NS() - stage_ns[LATENCY_RECEIVED] > (int64_t)LATENCY_TIMEOUT_MS * 1000000)
+        latency_finish();
+}
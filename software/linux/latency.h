@@ -0,0 +1,32 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdbool.h>
+#include "comms.h"
+
+/* Histograms are written here unless OAC_LATENCY names another file */
+#define LATENCY_DEFAULT_PATH "/home/pi/shared/latency.txt"
+
+/* A trace not complete by then is logged with what it has */
+#define LATENCY_TIMEOUT_MS 10000
+
+/* Points on the way from a button press to the first frame of the recording on storage */
+enum latency_stage {
+    LATENCY_BUTTON,         /* Firmware: button released, button_isr() */
+    LATENCY_SENT,           /* Firmware: event frame sent, after handle_button_press() */
+    LATENCY_RECEIVED,       /* Event handed over by comms_receive_messages() */
+    LATENCY_RECORD,         /* start_record() entered */
+    LATENCY_FIRST_FRAME,    /* libcamera-vid wrote the first frame */
+    LATENCY_STARTED,        /* start_record() done, recording */
+    LATENCY_STAGES
+};
+
+void latency_init(const char *path);
+
+void latency_begin(const struct EventBody *event);
+
+void latency_mark(enum latency_stage stage);
+
+void latency_poll(void);
+
+#endif /* LATENCY_H */
@@ -11,6 +11,9 @@
 #include "comms.h"
 #include "record.h"
 #include "error.h"
+#include "latency.h"
+
+#define RX_BATCH_SIZE 8  /* Max messages handled per poll */
 
 /*
  * cleanup - Handles SIGINT (Ctrl+C), ensuring recording is stopped before exit.
@@ -24,14 +27,102 @@ static void cleanup(int signo)
 
     DEBUG_MESSAGE("Received SIGINT. Stopping recording and cleaning up...\n");
     end_record();
+    comms_trace_stop();
     DEBUG_MESSAGE("Cleanup complete. Exiting.\n");
 
     exit(0);
 }
 
+/*
+ * handle_message - Act on a single message received from the firmware.
+ * @msg: The received message.
+ * @params: Recording parameters used when a recording is requested.
+ */
+static void handle_message(const struct Message *msg, recording_params_t params)
+{
+    switch (msg->header.message_type)
+    {
+
+    case MESSAGE_TYPE_COMMAND:
+        switch (msg->body.payload_command.command)
+        {
+        case COMMAND_RECORD_REQ_START:
+            DEBUG_MESSAGE("Received RECORD START command\n");
+            start_record(params);
+            break;
+
+        case COMMAND_RECORD_REQ_END:
+            DEBUG_MESSAGE("Received RECORD STOP command\n");
+            end_record();
+            break;
+
+        case COMMAND_SHUTDOWN_REQ:
+            DEBUG_MESSAGE("Received SHUTDOWN REQUEST command\n");
+            end_record();
+            comms_send_command(COMMAND_SHUTDOWN_STARTED);
+            break;
+
+        default:
+            WARN("Unknown command: 0x%04x\n", msg->body.payload_command.command);
+            break;
+        }
+        break;
+
+    case MESSAGE_TYPE_EVENT:
+        switch (msg->body.payload_event.command)
+        {
+        case COMMAND_BTN_SHORT:
+            if (is_recording()) {
+                DEBUG_MESSAGE("Button pressed, stopping recording\n");
+                end_record();
+                break;
+            }
+            DEBUG_MESSAGE("Button pressed, starting recording (trace %u)\n", msg->body.payload_event.trace);
+            latency_begin(&msg->body.payload_event);
+            comms_tx_flush(); /* Acknowledge it now, start_record() takes a while */
+            start_record(params);
+            break;
+
+        default:
+            DEBUG_MESSAGE("Ignoring event 0x%04x\n", msg->body.payload_event.command);
+            break;
+        }
+        break;
+
+    case MESSAGE_TYPE_ERROR: /* Log errors received from firmware */
+        WARN("[FIRMWARE ERROR] Code %d: %s",
+             msg->body.payload_error.error_code,
+             msg->body.payload_error.error_message);
+    break;
+
+    case MESSAGE_TYPE_ERROR_CODE: /* Errors from the catalog, counted while rate limited */
+    {
+        const struct ErrorCodeBody *e = &msg->body.payload_error_code;
+        WARN("[FIRMWARE ERROR] Code %d: %s (x%u, context %lu)",
+             e->code, comms_error_message(e->code), e->count, (unsigned long)e->context);
+        break;
+    }
+
+    case MESSAGE_TYPE_STATUS:
+    {
+        const struct StatusBody *s = &msg->body.payload_status;
+        DEBUG_MESSAGE("[STATUS] Battery: %lu µV | State: %d | Charging: %s | Error: %d\n",
+               (unsigned long)s->bat_volt_uv,
+               s->state,
+               s->charging ? "Yes" : "No",
+               s->error_code);
+        break;
+    }
+
+    default:
+        DEBUG_MESSAGE("[WARN] Unknown message type: 0x%02x\n", msg->header.message_type);
+        break;
+    }
+}
+
 int main(void)
 {
-    struct Message msg;
+    struct Message msgs[RX_BATCH_SIZE];
     recording_params_t params = {
         .shutter = 5000,
         .awb = "incandescent",
@@ -47,67 +138,35 @@ int main(void)
 
     init_error_system();
 
+    /* OAC_TRACE=<file> captures the link for offline analysis, see tools/oac_trace.c */
+    const char *trace = getenv("OAC_TRACE");
+    if (trace && comms_trace_start(trace) < 0)
+        WARN("Could not start link trace %s\n", trace);
+
+    /* Button to recording latency histograms, OAC_LATENCY=<file> to write them elsewhere */
+    latency_init(getenv("OAC_LATENCY"));
+
     /* Initialize communication */
     comms_init();
 
     /* Process serial messages */
     while (1)
     {
-        if (comms_receive_message(&msg))
-        {
-            switch (msg.header.message_type)
-            {
-
-            case MESSAGE_TYPE_COMMAND:
-                switch (msg.body.payload_command.command)
-                {
-                case COMMAND_RECORD_REQ_START:
-                    DEBUG_MESSAGE("Received RECORD START command\n");
-                    start_record(params);
-                    break;
-
-                case COMMAND_RECORD_REQ_END:
-                    DEBUG_MESSAGE("Received RECORD STOP command\n");
-                    end_record();
-                    break;
-
-                case COMMAND_SHUTDOWN_REQ:
-                    DEBUG_MESSAGE("Received SHUTDOWN REQUEST command\n");
-                    end_record();
-                    comms_send_command(COMMAND_SHUTDOWN_STARTED);
-                    break;
-
-                default:
-                    WARN("Unknown command: 0x%04x\n", msg.body.payload_command.command);
-                    break;
-                }
-                break;
+        /* Drain every frame that arrived since the last poll */
+        int count = comms_receive_messages(msgs, RX_BATCH_SIZE);
+        for (int i = 0; i < count; i++)
+            handle_message(&msgs[i], params);
 
-            case MESSAGE_TYPE_ERROR: /* Log errors received from firmware */
-                WARN("[FIRMWARE ERROR] Code %d: %s",
-                     msg.body.payload_error.error_code,
-                     msg.body.payload_error.error_message);
-            break;
+        /* Push out anything the UART could not take on a previous pass */
+        comms_tx_flush();
 
-            case MESSAGE_TYPE_STATUS:
-            {
-                const struct StatusBody *s = &msg.body.payload_status;
-                DEBUG_MESSAGE("[STATUS] Battery: %d µV | State: %d | Charging: %s | Error: %d\n",
-                       s->bat_volt,
-                       s->state,
-                       s->charging ? "Yes" : "No",
-                       s->error_code);
-                break;
-            }
-
-            default:
-                DEBUG_MESSAGE("[WARN] Unknown message type: 0x%02x\n", msg.header.message_type);
-                break;
-            }
-        }
+        record_poll();
+        latency_poll();
 
-        /* Send heartbeat command to indicate system is fully running */
-        comms_send_command(COMMAND_HB);
+        /* Send heartbeat command to indicate system is fully running.
+         * Skipped while earlier frames are still queued so heartbeats never pile up. */
+        if (comms_tx_queue_depth() == 0)
+            comms_send_command(COMMAND_HB);
 
         usleep(50); /* 50ms poll interval */
     }
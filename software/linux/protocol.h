@@ -0,0 +1 @@
+../shared/protocol.h
\ No newline at end of file
@@ -4,11 +4,13 @@
 
  #include "record.h"
  #include "error.h"
+ #include "latency.h"
  #include <stdio.h>
  #include <stdlib.h>
  #include <string.h>
  #include <unistd.h>
  #include <sys/wait.h>
+ #include <sys/stat.h>
  #include <sys/statvfs.h>
  #include <pthread.h>
  #include <fcntl.h>
@@ -17,8 +19,11 @@
  #define RAW_VIDEO OUTPUT_DIR"/video.264"
  #define ENCODED_VIDEO OUTPUT_DIR"/video.mp4"
  #define MIN_FREE_SPACE_MB 500  /* Minimum required free space in MB */
+ #define START_WAIT_MS 2000     /* libcamera-vid must still be running after this */
+ #define FRAME_POLL_MS 5        /* Interval the raw video is checked for its first frame */
  
  static volatile sig_atomic_t recording;
+ static bool awaiting_frame;    /* libcamera-vid started, nothing written yet */
  static pid_t libcamera_pid;
  static pthread_t stderr_thread;
  static int stderr_fd = -1;
@@ -98,6 +103,8 @@
       int pipefd[2];
       int status;
   
+      latency_mark(LATENCY_RECORD);
+
       if (recording) {
           WARN("Already recording!");
           return;
@@ -114,6 +121,7 @@
       }
   
       system("mkdir -p " OUTPUT_DIR);
+      unlink(RAW_VIDEO); /* The first frame is seen by the file growing */
   
       char libcamera_cmd[1024];
       snprintf(libcamera_cmd, sizeof(libcamera_cmd),
@@ -142,26 +150,54 @@
       // Parent
       close(pipefd[1]);
       stderr_fd = pipefd[0];
+      awaiting_frame = true;
   
       // Launch monitor thread
       if (pthread_create(&stderr_thread, NULL, stderr_monitor_thread, NULL) != 0) {
           ERROR(ERR_MONITOR_THREAD_FAILED);
           kill(libcamera_pid, SIGINT);
           waitpid(libcamera_pid, NULL, 0);
+          awaiting_frame = false;
           return;
       }
   
-      sleep(2); // Let it run briefly
+      // Let it run briefly, watching for the first frame meanwhile
+      for (int waited = 0; waited < START_WAIT_MS; waited += FRAME_POLL_MS) {
+          record_poll();
+          usleep(FRAME_POLL_MS * 1000);
+      }
   
       if (waitpid(libcamera_pid, &status, WNOHANG) > 0) {
           ERROR(ERR_RECORD_START_FAILED);
+          awaiting_frame = false;
           return;
       }
   
       recording = 1;
+      latency_mark(LATENCY_STARTED);
       DEBUG_MESSAGE("Recording started successfully.");
   }
 
+ /*
+  * record_poll - Check whether libcamera-vid wrote its first frame yet.
+  * @note Called while start_record() waits, and from the main loop for a camera
+  *       slower than that.
+  */
+ void record_poll(void)
+ {
+     struct stat st;
+
+     if (awaiting_frame && stat(RAW_VIDEO, &st) == 0 && st.st_size > 0) {
+         awaiting_frame = false;
+         latency_mark(LATENCY_FIRST_FRAME);
+     }
+ }
+
+ bool is_recording(void)
+ {
+     return recording;
+ }
+
  /*
   * end_record - Stop recording if active, then transcode the video.
   */
@@ -178,6 +214,7 @@
      kill(libcamera_pid, SIGINT);
      waitpid(libcamera_pid, NULL, 0);
      pthread_join(stderr_thread, NULL);
+     awaiting_frame = false;
  
      printf("Recording stopped. Flushing data...\n");
      system("sync");
@@ -16,6 +16,7 @@ typedef struct {
 } recording_params_t;
 
 void start_record(recording_params_t params);
+void record_poll(void);
 bool is_recording();
 void end_record();
 
@@ -0,0 +1,525 @@
+/*
+ * oac_trace.c - Analyse and replay UART link traces, see comms_trace.h
+ *
+ *   oac_trace stat TRACE
+ *   oac_trace replay [-x SPEED] [-o OUT] TRACE
+ *
+ * stat prints one line of key=value pairs per finding, like the benchmarks:
+ *   link   : per direction, frames and bytes, and how busy the line was on
+ *            average and in the busiest UTIL_WINDOW_MS, at 10 bits per byte
+ *   gaps   : per direction, the time between consecutive frames
+ *   errors : discarded frames, in total and by parser error
+ *   burst  : the largest runs of errors less than BURST_GAP_MS apart
+ *
+ * replay writes the received bytes of a trace into a pty, at their original
+ * timing or SPEED times faster (0 for no waiting), and runs comms_receive_message()
+ * on the other side as oacd does. Anything comms sends back is read and discarded.
+ * With -o the replay is itself captured, so stat can compare it with the original.
+ * Timeouts inside comms run in real time, so an accelerated replay can join up
+ * frames that timed out in the original.
+ *
+ * NOTE: comms.c is compiled into this file, as in the benchmarks, so serial_fd can
+ * be pointed at the pty.
+ */
+
+#define _GNU_SOURCE
+#include "comms.c"
+
+#include <stdlib.h>
+#include <getopt.h>
+#include <inttypes.h>
+
+#define UTIL_WINDOW_MS 100      /* Window for the peak link utilisation */
+#define BURST_GAP_MS 100        /* Errors closer than this belong to the same burst */
+#define BURST_MIN_ERRORS 3      /* Fewer errors than this are not reported as a burst */
+#define BURST_REPORT 5          /* Largest bursts listed */
+
+#define NS_PER_MS 1000000ull
+
+enum { DIR_RX, DIR_TX, DIRS };
+static const char *const dir_names[DIRS] = { "rx", "tx" };
+
+struct Trace {
+    uint8_t *buf;
+    size_t length;
+    uint32_t baud;
+    uint64_t start_ns;
+};
+
+/* Times between consecutive frames in one direction */
+struct Gaps {
+    uint64_t *ns;
+    size_t count;
+    size_t size;
+    uint64_t last;
+};
+
+struct Burst {
+    uint64_t start;
+    uint64_t end;
+    unsigned long errors;
+};
+
+/*
+ * trace_load - Read a whole trace into memory and check its header.
+ * @return 0 on success, -1 on error
+ */
+static int trace_load(const char *path, struct Trace *t)
+{
+    FILE *f = fopen(path, "rb");
+    long size;
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    if (fseek(f, 0, SEEK_END) < 0 || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) < 0) {
+        perror(path);
+        fclose(f);
+        return -1;
+    }
+
+    t->length = size;
+    t->buf = malloc(t->length ? t->length : 1);
+    if (!t->buf || fread(t->buf, 1, t->length, f) != t->length) {
+        fprintf(stderr, "%s: read failed\n", path);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    if (trace_get_header(t->buf, t->length, &t->baud, &t->start_ns) < 0) {
+        fprintf(stderr, "%s: not a link trace\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * trace_next - Step to the next record.
+ * @pos: offset of the record, advanced past it
+ * @return 1 if rec was filled, 0 at the end of the trace
+ */
+static int trace_next(const struct Trace *t, size_t *pos, struct TraceRecord *rec)
+{
+    int n = trace_get_record(&t->buf[*pos], t->length - *pos, rec);
+
+    if (n < 0)
+        fprintf(stderr, "Trace truncated at offset %zu\n", *pos);
+    if (n <= 0)
+        return 0;
+
+    *pos += n;
+    return 1;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void gaps_add(struct Gaps *g, uint64_t time)
+{
+    if (g->last && time >= g->last) {
+        if (g->count == g->size) {
+            g->size = g->size ? 2 * g->size : 1024;
+            g->ns = realloc(g->ns, g->size * sizeof(*g->ns));
+            if (!g->ns) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        g->ns[g->count++] = time - g->last;
+    }
+    g->last = time;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static int compare_burst(const void *a, const void *b)
+{
+    const struct Burst *x = a, *y = b;
+
+    return (y->errors > x->errors) - (y->errors < x->errors);
+}
+
+static const char *error_name(uint8_t code)
+{
+    switch (code) {
+    case 2: return "timeout";
+    case 4: return "stray";
+    case 5: return "overflow";
+    case 6: return "end";
+    case 7: return "encoding";
+    case 8: return "decode";
+    default: return "other";
+    }
+}
+
+/*
+ * trace_stat - Report link utilisation, inter-frame gaps and error bursts.
+ */
+static int trace_stat(const struct Trace *t)
+{
+    static const uint8_t codes[] = { 2, 4, 5, 6, 7, 8, 0 };
+    unsigned long frames[DIRS] = { 0 }, bytes[DIRS] = { 0 };
+    uint64_t busy[DIRS] = { 0 }, window_busy[DIRS] = { 0 }, peak[DIRS] = { 0 };
+    uint64_t window_start = 0, first = 0, last = 0;
+    unsigned long by_code[sizeof(codes)] = { 0 }, errors = 0;
+    struct Gaps gaps[DIRS] = { { 0 } };
+    struct Burst *bursts = NULL;
+    size_t burst_count = 0, pos = TRACE_HEADER_LEN;
+    uint32_t baud = t->baud;
+    struct TraceRecord rec;
+
+    while (trace_next(t, &pos, &rec)) {
+        if (!first)
+            first = window_start = rec.time_ns;
+        last = rec.time_ns;
+
+        while (rec.time_ns - window_start >= UTIL_WINDOW_MS * NS_PER_MS) {
+            for (int d = 0; d < DIRS; d++) {
+                if (window_busy[d] > peak[d])
+                    peak[d] = window_busy[d];
+                window_busy[d] = 0;
+            }
+            window_start += UTIL_WINDOW_MS * NS_PER_MS;
+        }
+
+        switch (rec.kind) {
+        case TRACE_RX_BYTES:
+        case TRACE_TX_BYTES: {
+            int d = (rec.kind == TRACE_RX_BYTES) ? DIR_RX : DIR_TX;
+            uint64_t ns = baud ? (uint64_t)rec.length * 10 * 1000000000u / baud : 0;
+
+            bytes[d] += rec.length;
+            busy[d] += ns;
+            window_busy[d] += ns;
+            break;
+        }
+        case TRACE_RX_FRAME:
+        case TRACE_TX_FRAME: {
+            int d = (rec.kind == TRACE_RX_FRAME) ? DIR_RX : DIR_TX;
+
+            frames[d]++;
+            gaps_add(&gaps[d], rec.time_ns);
+            break;
+        }
+        case TRACE_RX_ERROR: {
+            size_t i = 0;
+
+            errors++;
+            while (codes[i] && codes[i] != rec.arg)
+                i++;
+            by_code[i]++;
+
+            if (burst_count && rec.time_ns - bursts[burst_count - 1].end < BURST_GAP_MS * NS_PER_MS) {
+                bursts[burst_count - 1].end = rec.time_ns;
+                bursts[burst_count - 1].errors++;
+                break;
+            }
+            bursts = realloc(bursts, (burst_count + 1) * sizeof(*bursts));
+            if (!bursts) {
+                perror("realloc");
+                return 1;
+            }
+            bursts[burst_count].start = bursts[burst_count].end = rec.time_ns;
+            bursts[burst_count].errors = 1;
+            burst_count++;
+            break;
+        }
+        case TRACE_BAUD:
+            if (rec.length >= 4)
+                baud = proto_get_le32(rec.data);
+            break;
+        }
+    }
+
+    uint64_t duration = last - first;
+
+    printf("trace duration_s=%.3f baud=%" PRIu32 "\n", duration / 1e9, t->baud);
+
+    for (int d = 0; d < DIRS; d++) {
+        if (window_busy[d] > peak[d])
+            peak[d] = window_busy[d];
+        printf("link dir=%s frames=%lu bytes=%lu util_avg=%.1f%% util_peak=%.1f%%\n",
+               dir_names[d], frames[d], bytes[d],
+               duration ? busy[d] * 100.0 / duration : 0.0,
+               peak[d] * 100.0 / (UTIL_WINDOW_MS * NS_PER_MS));
+    }
+
+    for (int d = 0; d < DIRS; d++) {
+        struct Gaps *g = &gaps[d];
+        uint64_t sum = 0;
+
+        if (!g->count)
+            continue;
+
+        qsort(g->ns, g->count, sizeof(*g->ns), compare_u64);
+        for (size_t i = 0; i < g->count; i++)
+            sum += g->ns[i];
+
+        printf("gaps dir=%s count=%zu min_ms=%.3f p50_ms=%.3f p99_ms=%.3f max_ms=%.3f mean_ms=%.3f\n",
+               dir_names[d], g->count, g->ns[0] / 1e6, g->ns[g->count / 2] / 1e6,
+               g->ns[g->count * 99 / 100] / 1e6, g->ns[g->count - 1] / 1e6,
+               (double)sum / g->count / 1e6);
+        free(g->ns);
+    }
+
+    size_t reported = 0;
+
+    printf("errors count=%lu", errors);
+    for (size_t i = 0; i < sizeof(codes); i++)
+        if (by_code[i])
+            printf(" %s=%lu", error_name(codes[i]), by_code[i]);
+    for (size_t i = 0; i < burst_count; i++)
+        if (bursts[i].errors >= BURST_MIN_ERRORS)
+            reported++;
+    printf(" bursts=%zu\n", reported);
+
+    qsort(bursts, burst_count, sizeof(*bursts), compare_burst);
+    for (size_t i = 0; i < burst_count && i < BURST_REPORT; i++) {
+        if (bursts[i].errors < BURST_MIN_ERRORS)
+            break;
+        printf("burst start_s=%.3f errors=%lu span_ms=%.3f\n",
+               (bursts[i].start - first) / 1e9, bursts[i].errors,
+               (bursts[i].end - bursts[i].start) / 1e6);
+    }
+    free(bursts);
+
+    return 0;
+}
+
+/*
+ * replay_open_pty - Open a raw pty, serial_fd becomes its slave side.
+ * @return the master side, or -1 on error
+ */
+static int replay_open_pty(void)
+{
+    struct termios options;
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+        perror("pty");
+        return -1;
+    }
+
+    serial_fd = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (serial_fd < 0) {
+        perror(ptsname(master));
+        return -1;
+    }
+
+    tcgetattr(serial_fd, &options);
+    cfmakeraw(&options);
+    tcsetattr(serial_fd, TCSANOW, &options);
+
+    fcntl(master, F_SETFL, O_NONBLOCK);
+    fcntl(serial_fd, F_SETFL, O_NONBLOCK);
+    return master;
+}
+
+struct Replay {
+    int master;
+    unsigned long frames;     /* Returned by comms_receive_message() */
+    unsigned long errors;
+    unsigned long tx_bytes;   /* Sent back by comms */
+    uint64_t receive_ns;      /* Spent in comms_receive_message() */
+};
+
+/*
+ * replay_receive - Run comms over everything written to the pty so far.
+ */
+static void replay_receive(struct Replay *r)
+{
+    uint8_t discard[256];
+    struct Message msg;
+    ssize_t n;
+    int ret, pending;
+
+    for (;;) {
+        uint64_t start = now_ns();
+
+        ret = comms_receive_message(&msg);
+        r->receive_ns += now_ns() - start;
+
+        if (ret > 0)
+            r->frames++;
+        else if (ret < 0 && ret != -3)
+            r->errors++;
+        else if (ret == 0 && (ioctl(serial_fd, FIONREAD, &pending) < 0 || pending == 0))
+            break;
+        if (ret == -3)
+            break;
+    }
+
+    comms_tx_flush();
+    while ((n = read(r->master, discard, sizeof(discard))) > 0)
+        r->tx_bytes += n;
+}
+
+/*
+ * replay_write - Write bytes to the pty, running comms whenever it is full.
+ * @return 0 on success, -1 on error
+ */
+static int replay_write(struct Replay *r, const uint8_t *data, size_t length)
+{
+    while (length) {
+        ssize_t n = write(r->master, data, length);
+
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            perror("write");
+            return -1;
+        }
+        if (n > 0) {
+            data += n;
+            length -= n;
+        }
+        replay_receive(r);
+    }
+    return 0;
+}
+
+/*
+ * replay_is_delivered - Whether comms hands a recorded frame to the application.
+ * @note Acknowledgements and link commands are consumed by comms itself.
+ */
+static bool replay_is_delivered(const struct TraceRecord *rec)
+{
+    if (rec->length < TRACE_FRAME_HEADER_LEN)
+        return false;
+
+    switch (rec->data[1]) {
+    case MESSAGE_TYPE_ACK:
+    case MESSAGE_TYPE_NAK:
+        return false;
+    case MESSAGE_TYPE_COMMAND:
+        return rec->length < TRACE_FRAME_HEADER_LEN + 2 ||
+               !COMMAND_IS_LINK(proto_get_le16(&rec->data[TRACE_FRAME_HEADER_LEN]));
+    default:
+        return true;
+    }
+}
+
+/*
+ * trace_replay - Feed the received bytes of a trace through comms.
+ * @speed: replay speed, 1 for the original timing, 0 for no waiting
+ * @out: file to capture the replay to, or NULL
+ */
+static int trace_replay(const struct Trace *t, double speed, const char *out)
+{
+    struct Replay r = { 0 };
+    unsigned long chunks = 0, bytes = 0, recorded_frames = 0, recorded_errors = 0;
+    uint64_t first = 0, start;
+    uint8_t version = 0;
+    size_t pos = TRACE_HEADER_LEN;
+    struct TraceRecord rec;
+
+    /* Start in the framing the trace starts in, a negotiation in it moves comms on */
+    while (!version && trace_next(t, &pos, &rec))
+        if (rec.kind == TRACE_RX_FRAME || rec.kind == TRACE_TX_FRAME)
+            version = rec.arg;
+
+    r.master = replay_open_pty();
+    if (r.master < 0)
+        return 1;
+    comms_set_protocol_version(version ? version : PROTOCOL_VERSION_1);
+    if (out && comms_trace_start(out) < 0)
+        return 1;
+
+    start = now_ns();
+    pos = TRACE_HEADER_LEN;
+    while (trace_next(t, &pos, &rec)) {
+        if (rec.kind == TRACE_RX_FRAME && replay_is_delivered(&rec))
+            recorded_frames++;
+        if (rec.kind == TRACE_RX_ERROR)
+            recorded_errors++;
+        if (rec.kind != TRACE_RX_BYTES)
+            continue;
+
+        if (!first)
+            first = rec.time_ns;
+
+        if (speed > 0) {
+            uint64_t due = start + (uint64_t)((rec.time_ns - first) / speed);
+            uint64_t now = now_ns();
+
+            if (due > now) {
+                struct timespec ts = { (due - now) / 1000000000u, (due - now) % 1000000000u };
+                nanosleep(&ts, NULL);
+            }
+            replay_receive(&r);  /* Let a stalled frame time out, as it did at the time */
+        }
+
+        if (replay_write(&r, rec.data, rec.length) < 0)
+            return 1;
+        chunks++;
+        bytes += rec.length;
+    }
+    replay_receive(&r);
+
+    uint64_t duration = now_ns() - start;
+
+    printf("replay speed=%g chunks=%lu bytes=%lu tx_bytes=%lu frames=%lu recorded_frames=%lu "
+           "errors=%lu recorded_errors=%lu duration_s=%.3f ns_per_frame=%.1f\n",
+           speed, chunks, bytes, r.tx_bytes, r.frames, recorded_frames,
+           r.errors, recorded_errors, duration / 1e9,
+           r.frames ? (double)r.receive_ns / r.frames : 0.0);
+
+    comms_trace_stop();
+    comms_close();
+    close(r.master);
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: oac_trace stat TRACE\n"
+                    "       oac_trace replay [-x SPEED] [-o OUT] TRACE\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *out = NULL;
+    double speed = 1.0;
+    struct Trace t;
+    int opt;
+
+    if (argc < 2)
+        usage();
+
+    optind = 2;
+    while ((opt = getopt(argc, argv, "x:o:")) != -1) {
+        switch (opt) {
+        case 'x':
+            speed = strtod(optarg, NULL);
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1)
+        usage();
+    if (trace_load(argv[optind], &t) < 0)
+        return 1;
+
+    if (strcmp(argv[1], "stat") == 0)
+        return trace_stat(&t);
+    if (strcmp(argv[1], "replay") == 0)
+        return trace_replay(&t, speed, out);
+    usage();
+    return 2;
+}
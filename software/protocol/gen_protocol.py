@@ -0,0 +1,955 @@
+#!/usr/bin/env python3
+"""
+gen_protocol.py - Generate the protocol headers from protocol.def
+
+Writes, for userspace (firmware and Linux, via the shared/ symlinks) and for
+the kernel drivers, which are built on their own and cannot reach shared/:
+
+    shared/protocol.h                  constants, error catalog, message types and structs
+    shared/protocol_codec.h            payload encoders and decoders
+    linux/drivers/oac_protocol.h       the same, kernel types and OAC_ names
+    linux/drivers/oac_protocol_codec.h
+
+The codecs are specialized per message type and protocol version: a fixed size
+layout is a straight run of byte stores and loads behind at most one length
+check, and every payload length is a compile time constant checked against
+MAX_PAYLOAD_SIZE.
+
+Usage: gen_protocol.py [--check]
+    --check  write nothing, fail if a generated header is out of date
+"""
+import argparse
+import os
+import re
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SOFTWARE = os.path.dirname(HERE)
+SCHEMA = os.path.join(HERE, 'protocol.def')
+
+WIDTHS = {'u8': 1, 'u16': 2, 'u32': 4, 'u64': 8, 'bool': 1}
+BITS = {'u8': 8, 'u16': 16, 'u32': 32, 'u64': 64, 'bool': 1}
+
+
+class SchemaError(Exception):
+    pass
+
+
+class Const:
+    def __init__(self, name, value, kname, doc, note):
+        self.name, self.value, self.kname = name, value, kname
+        self.doc, self.note = doc, note
+
+
+class Field:
+    def __init__(self, name, ftype, size, v2, note):
+        self.name, self.type, self.size = name, ftype, size
+        self.v2, self.note = v2, note     # v2: None, 'varint' or (shift, width)
+
+
+class Body:
+    def __init__(self, name, member, doc):
+        self.name, self.member, self.doc = name, member, doc
+        self.fields = []
+
+    @property
+    def short(self):
+        return re.sub(r'Body$', '', self.name).lower()
+
+
+class MsgType:
+    def __init__(self, name, ident, body, v2only, note):
+        self.name, self.id, self.body = name, ident, body
+        self.v2only, self.note = v2only, note
+
+
+class ErrorDef:
+    def __init__(self, name, code, origin, limit_ms, message):
+        self.name, self.code, self.origin = name, code, origin
+        self.limit_ms, self.message = limit_ms, message
+
+
+class Schema:
+    def __init__(self):
+        self.items = []         # Const, or None for a blank line, in file order
+        self.header = None
+        self.bodies = []
+        self.types = []
+        self.types_doc = []
+        self.errors = []
+        self.errors_doc = []
+        self.values = {}
+
+    def const(self, name):
+        return next(i for i in self.items if isinstance(i, Const) and i.name == name)
+
+
+def split_note(line):
+    code, _, note = line.partition('#')
+    return code.rstrip(), note.strip() or None
+
+
+def parse(path):
+    schema = Schema()
+    doc = []
+    body = None
+
+    with open(path) as f:
+        lines = f.read().splitlines()
+
+    for lineno, raw in enumerate(lines, 1):
+        where = '%s:%d' % (os.path.basename(path), lineno)
+        if raw.startswith('#'):
+            continue
+        if raw.startswith('>'):
+            doc.append(raw[1:].strip())
+            continue
+        code, note = split_note(raw)
+
+        if not code.strip():
+            body = None
+            if schema.items and schema.items[-1] is not None:
+                schema.items.append(None)
+            continue
+
+        if raw[0].isspace():
+            if body is None:
+                raise SchemaError('%s: field outside a body' % where)
+            tok = code.split()
+            if len(tok) < 2:
+                raise SchemaError('%s: expected FIELD TYPE' % where)
+            name, ftype, size, v2 = tok[0], ' '.join(tok[1:]), None, None
+            m = re.search(r'\s+v2:(\S+)$', ftype)
+            if m:
+                ftype = ftype[:m.start()]
+                enc = m.group(1)
+                bm = re.fullmatch(r'bits\((\d+),(\d+)\)', enc)
+                if enc == 'varint':
+                    v2 = 'varint'
+                elif bm:
+                    v2 = (int(bm.group(1)), int(bm.group(2)))
+                else:
+                    raise SchemaError('%s: unknown v2 encoding %s' % (where, enc))
+            tm = re.fullmatch(r'text\((.+)\)', ftype)
+            if tm:
+                ftype, size = 'text', tm.group(1).strip()
+            elif ftype not in WIDTHS:
+                raise SchemaError('%s: unknown type %s' % (where, ftype))
+            body.fields.append(Field(name, ftype, size, v2, note))
+            continue
+
+        tok = code.split()
+        kind = tok[0]
+        if kind == 'const':
+            rest = code.split(None, 2)[2]
+            kname = None
+            km = re.search(r'\s+k:(\w+)$', rest)
+            if km:
+                kname, rest = km.group(1), rest[:km.start()]
+            schema.items.append(Const(tok[1], rest.strip(), kname, doc, note))
+        elif kind in ('header', 'body'):
+            body = Body(tok[1], tok[2] if kind == 'body' else 'header', doc)
+            if kind == 'header':
+                schema.header = body
+            else:
+                schema.bodies.append(body)
+        elif kind == 'type':
+            if len(tok) not in (4, 5) or (len(tok) == 5 and tok[4] != 'v2only'):
+                raise SchemaError('%s: expected type NAME ID BODY [v2only]' % where)
+            if doc:
+                schema.types_doc = doc
+            schema.types.append(MsgType(tok[1], int(tok[2], 0), tok[3], len(tok) == 5, note))
+        elif kind == 'error':
+            em = re.fullmatch(r'error\s+(\w+)\s+(\S+)\s+(\w+)\s+(\d+)\s+"([^"]*)"', code.strip())
+            if not em:
+                raise SchemaError('%s: expected error NAME CODE ORIGIN LIMIT_MS "MESSAGE"' % where)
+            if doc:
+                schema.errors_doc = doc
+            schema.errors.append(ErrorDef(em.group(1), int(em.group(2), 0), em.group(3),
+                                          int(em.group(4)), em.group(5)))
+        else:
+            raise SchemaError('%s: unknown item %s' % (where, kind))
+        doc = []
+
+    validate(schema)
+    return schema
+
+
+def evaluate(schema, expr):
+    """Value of a constant expression over the schema's constants"""
+    py = re.sub(r'\b[A-Z_][A-Z0-9_]*\b', lambda m: str(schema.values[m.group(0)]), expr)
+    return eval(py, {'__builtins__': {}})
+
+
+def validate(schema):
+    for c in schema.items:
+        if isinstance(c, Const) and not c.value.startswith('{'):
+            schema.values[c.name] = evaluate(schema, c.value)
+
+    codes = set()
+    for e in schema.errors:
+        if not 0 < e.code <= 0xFF or e.code in codes:
+            raise SchemaError('error %s: code must be unique and 1-255' % e.name)
+        if 'ERROR_ORIGIN_' + e.origin not in schema.values:
+            raise SchemaError('error %s: unknown origin %s' % (e.name, e.origin))
+        codes.add(e.code)
+
+    bodies = {b.name: b for b in schema.bodies}
+    for t in schema.types:
+        if t.body not in bodies and t.body not in ('raw', 'batch'):
+            raise SchemaError('type %s: unknown body %s' % (t.name, t.body))
+
+    for b in schema.bodies:
+        for i, f in enumerate(b.fields):
+            if f.type == 'text' and i != len(b.fields) - 1:
+                raise SchemaError('%s.%s: text must be the last field' % (b.name, f.name))
+            if f.type == 'text' and f.v2:
+                raise SchemaError('%s.%s: text has no v2 encoding' % (b.name, f.name))
+        for group in bit_groups(b):
+            if group[0].v2[0] != 0:
+                raise SchemaError('%s.%s: bits must start at 0' % (b.name, group[0].name))
+            shift = 0
+            for f in group:
+                if f.v2[0] != shift or f.v2[1] > BITS[f.type]:
+                    raise SchemaError('%s.%s: bits overlap or leave a gap' % (b.name, f.name))
+                shift += f.v2[1]
+            if shift > 8:
+                raise SchemaError('%s.%s: bits exceed a byte' % (b.name, group[0].name))
+        for v in (1, 2):
+            if max_len(schema, b, v) > schema.values['MAX_PAYLOAD_SIZE']:
+                raise SchemaError('%s does not fit MAX_PAYLOAD_SIZE' % b.name)
+
+
+def bit_groups(body):
+    groups = []
+    for f in body.fields:
+        if isinstance(f.v2, tuple):
+            if f.v2[0] == 0 or not groups or groups[-1][-1] is not prev:
+                groups.append([])
+            groups[-1].append(f)
+        prev = f
+    return groups
+
+
+def layout(body, version):
+    """The fields as encoded, a list of ('fixed', [(field, offset)...], size),
+    ('bits', [field...], 1), ('varint', field) and ('text', field)"""
+    out = []
+    for f in body.fields:
+        if f.type == 'text':
+            out.append(('text', f))
+        elif version == 2 and f.v2 == 'varint':
+            out.append(('varint', f))
+        elif version == 2 and isinstance(f.v2, tuple):
+            if f.v2[0] == 0:
+                out.append(('bits', [f], 1))
+            else:
+                out[-1][1].append(f)
+        else:
+            out.append(('fixed', [f], WIDTHS[f.type]))
+    return out
+
+
+def is_fixed(body, version):
+    return all(e[0] in ('fixed', 'bits') for e in layout(body, version))
+
+
+def same_layout(body):
+    return all(f.v2 is None for f in body.fields)
+
+
+def text_size(schema, f):
+    return evaluate(schema, f.size)
+
+
+def max_len(schema, body, version):
+    n = 0
+    for e in layout(body, version):
+        if e[0] == 'varint':
+            n += (BITS[e[1].type] + 6) // 7
+        elif e[0] == 'text':
+            n += text_size(schema, e[1]) - 1
+        else:
+            n += e[2]
+    return n
+
+
+def describe(body, version):
+    parts = []
+    for e in layout(body, version):
+        if e[0] == 'fixed':
+            parts.append('%s:%d' % (e[1][0].name, e[2]))
+        elif e[0] == 'bits':
+            bits = ' | '.join('%s << %d' % (f.name, f.v2[0]) if f.v2[0] else f.name
+                              for f in reversed(e[1]))
+            parts.append('(%s):1' % bits)
+        elif e[0] == 'varint':
+            parts.append('%s:varint' % e[1].name)
+        else:
+            parts.append('%s:text' % e[1].name)
+    return ' '.join(parts)
+
+
+class Dialect:
+    """How one target spells things"""
+
+    def __init__(self, kernel):
+        self.kernel = kernel
+        self.ind = '\t' if kernel else '    '
+        self.fn = 'oac_proto_' if kernel else 'proto_'
+        self.encode = 'oac_encode_payload' if kernel else 'comms_encode_payload'
+        self.decode = 'oac_decode_payload' if kernel else 'comms_decode_payload'
+        self.ebad = '-EBADMSG' if kernel else '-1'
+        self.etoolong = '-EMSGSIZE' if kernel else '-2'
+        self.eunknown_enc = '-EINVAL' if kernel else '-3'
+        self.eunknown_dec = '-EINVAL' if kernel else '-5'
+        self.static_assert = 'static_assert' if kernel else 'PROTOCOL_STATIC_ASSERT'
+
+    def ctype(self, t):
+        if t == 'bool':
+            return 'bool'
+        return t if self.kernel else 'uint%d_t' % BITS[t]
+
+    def umax(self, t):
+        return ('U%d_MAX' if self.kernel else 'UINT%d_MAX') % BITS[t]
+
+    def name(self, schema, c):
+        if not self.kernel:
+            return c.name
+        return c.kname or 'OAC_' + c.name
+
+    def cname(self, schema, ident):
+        """Spelling of a schema identifier (constant or generated macro)"""
+        for c in schema.items:
+            if isinstance(c, Const) and c.name == ident:
+                return self.name(schema, c)
+        return ('OAC_' + ident) if self.kernel else ident
+
+    def expr(self, schema, text):
+        return re.sub(r'\b[A-Z_][A-Z0-9_]*\b', lambda m: self.cname(schema, m.group(0)), text)
+
+    def type_name(self, t):
+        return ('OAC_MESSAGE_TYPE_' if self.kernel else 'MESSAGE_TYPE_') + t.name
+
+    def len_macro(self, schema, body, version):
+        kind = 'LEN' if is_fixed(body, version) else 'MAX'
+        return self.cname(schema, 'PAYLOAD_%s_%s_V%d' % (kind, body.short.upper(), version))
+
+
+def comment(text, ind=''):
+    return '%s/* %s */' % (ind, text)
+
+
+def block_comment(lines, ind=''):
+    if len(lines) == 1:
+        return [comment(lines[0], ind)]
+    return ['%s/*' % ind] + [('%s * %s' % (ind, l)).rstrip() for l in lines] + ['%s */' % ind]
+
+
+def aligned(rows, ind=''):
+    """rows of (code, value, note) with the values and notes lined up"""
+    if not rows:
+        return []
+    w0 = max(len(r[0]) for r in rows) + 1
+    w1 = max(len(r[1]) for r in rows)
+    out = []
+    for code, value, note in rows:
+        line = code.ljust(w0) + value
+        if note:
+            line = line.ljust(w0 + w1) + '  ' + comment(note)
+        out.append(ind + line.rstrip())
+    return out
+
+
+BANNER = 'Generated by protocol/gen_protocol.py from protocol/protocol.def, do not edit.'
+
+
+def x_macro(d, entries):
+    """Body of an X macro, one entry per line with the continuations aligned"""
+    rows = [d.ind + e for e in entries]
+    tab = 8 if d.kernel else 4
+    width = max(len(r.expandtabs(tab)) for r in rows) + 1
+    return [r + ' ' * (width - len(r.expandtabs(tab))) + '\\' for r in rows[:-1]] + [rows[-1], '']
+
+
+def gen_protocol_h(schema, d):
+    guard = 'OAC_PROTOCOL_H' if d.kernel else 'PROTOCOL_H'
+    out = []
+    if d.kernel:
+        out.append('/* SPDX-License-Identifier: GPL-2.0 */')
+    out += ['/*',
+            ' * %s - Open Action Cam serial protocol, constants and message layouts' %
+            ('oac_protocol.h' if d.kernel else 'protocol.h'),
+            ' *',
+            ' * ' + BANNER,
+            ' */',
+            '#ifndef ' + guard,
+            '#define ' + guard,
+            '']
+    if d.kernel:
+        out.append('#include <linux/types.h>')
+    else:
+        out += ['#include <stdint.h>', '#include <stdbool.h>']
+    out.append('')
+
+    rows = []
+
+    def flush():
+        out.extend(aligned(rows))
+        rows.clear()
+
+    for item in schema.items:
+        if item is None:
+            flush()
+            out.append('')
+            continue
+        if item.doc:
+            flush()
+            out.extend(block_comment(item.doc))
+        rows.append(('#define ' + d.name(schema, item), d.expr(schema, item.value), item.note))
+    flush()
+
+    if schema.errors:
+        out += block_comment(schema.errors_doc or ['Error Catalog'])
+        out += aligned([('#define ' + d.cname(schema, 'ERROR_CODE_' + e.name), str(e.code), e.message)
+                        for e in schema.errors])
+        out += aligned([('#define ' + d.cname(schema, 'ERROR_CODES'),
+                         str(max(e.code for e in schema.errors) + 1), 'One past the highest code')])
+        out += ['', comment('X(code, origin, limit_ms, message) for every error in the catalog'),
+                '#define %s(X) \\' % d.cname(schema, 'ERROR_CATALOG')]
+        out += x_macro(d, ['X(%s, %s, %d, "%s")' % (d.cname(schema, 'ERROR_CODE_' + e.name),
+                                                     d.cname(schema, 'ERROR_ORIGIN_' + e.origin),
+                                                     e.limit_ms, e.message) for e in schema.errors])
+
+    out += block_comment(schema.types_doc or ['Message Type Identifiers'])
+    out.append('enum MessageType {')
+    out += aligned([(d.type_name(t), '= 0x%02X,' % t.id, t.note) for t in schema.types], d.ind)
+    out += ['};', '']
+    out += [comment('X(type, name) for every message type'),
+            '#define %s(X) \\' % d.cname(schema, 'MESSAGE_TYPES')]
+    out += x_macro(d, ['X(%s, "%s")' % (d.type_name(t), t.name) for t in schema.types])
+
+    def struct(body):
+        lines = block_comment(body.doc) if body.doc else []
+        lines.append('struct %s {' % body.name)
+        rows = []
+        for f in body.fields:
+            if f.type == 'text':
+                rows.append(('char', '%s[%s];' % (f.name, d.expr(schema, f.size)), f.note))
+            else:
+                rows.append((d.ctype(f.type), f.name + ';', f.note))
+        lines += aligned(rows, d.ind)
+        lines += ['};', '']
+        return lines
+
+    out += struct(schema.header)
+    for b in schema.bodies:
+        out += struct(b)
+
+    out += ['/* Full Message (Tagged Union) */',
+            'struct Message {',
+            '%sstruct %s %s;' % (d.ind, schema.header.name, schema.header.member),
+            d.ind + 'union {']
+    for b in schema.bodies:
+        out.append('%sstruct %s %s;' % (d.ind * 2, b.name, b.member))
+    out.append('%s%s payload_raw[%s];  /* Raw access (DATA and BATCH) */' %
+               (d.ind * 2, d.ctype('u8'), d.cname(schema, 'MAX_PAYLOAD_SIZE')))
+    out += [d.ind + '} body;', '};', '']
+
+    out += ['/*',
+            ' * Encoded payload lengths, _LEN_ where the layout is fixed and _MAX_ where',
+            ' * it varies, and the length of the frame carrying a payload of n bytes.',
+            ' */']
+    rows = []
+    for b in schema.bodies:
+        for v in (1, 2):
+            rows.append(('#define ' + d.len_macro(schema, b, v), str(max_len(schema, b, v)), None))
+    out += aligned(rows)
+    out.append('')
+    out += aligned([
+        ('#define %s(n)' % d.cname(schema, 'FRAME_LEN_V1'), '((n) + 6)',
+         'START header payload END'),
+        ('#define %s(n)' % d.cname(schema, 'FRAME_LEN_V2'), '((n) + 7)',
+         'COBS(header payload CRC) delimiter'),
+    ])
+    out += ['', '#endif /* %s */' % guard, '']
+    return '\n'.join(out)
+
+
+class Func:
+    """Code generator for one encoder or decoder"""
+
+    def __init__(self, d):
+        self.d = d
+        self.locals = []
+        self.body = []
+
+    def line(self, text='', depth=1):
+        self.body.append((self.d.ind * depth + text) if text else '')
+
+    def emit(self, signature):
+        out = ['static inline ' + signature, '{']
+        for decl in self.locals:
+            out.append(self.d.ind + decl)
+        if self.locals:
+            out.append('')
+        out += self.body
+        out += ['}', '']
+        return out
+
+
+def at(pos, k):
+    """Buffer index pos + k, where pos is None or a variable"""
+    if pos is None:
+        return str(k)
+    return pos if k == 0 else '%s + %d' % (pos, k)
+
+
+def ref(buf, pos, k):
+    return buf if pos is None and k == 0 else '&%s[%s]' % (buf, at(pos, k))
+
+
+def gen_encoder(schema, d, body, version):
+    f = Func(d)
+    ent = layout(body, version)
+    pos, k = None, 0
+
+    for i, e in enumerate(ent):
+        last = i == len(ent) - 1
+        if e[0] == 'fixed':
+            fld = e[1][0]
+            src = 'b->' + fld.name
+            if e[2] == 1:
+                f.line('out[%s] = %s;' % (at(pos, k), src))
+            elif d.kernel:
+                f.line('put_unaligned_le%d(%s, %s);' % (BITS[fld.type], src, ref('out', pos, k)))
+            else:
+                f.line('%sput_le%d(%s, %s);' % (d.fn, BITS[fld.type], ref('out', pos, k), src))
+            k += e[2]
+        elif e[0] == 'bits':
+            terms = []
+            for fld in e[1]:
+                term = 'b->' + fld.name
+                if fld.type != 'bool' and fld.v2[1] < BITS[fld.type]:
+                    term = '(%s & 0x%02X)' % (term, (1 << fld.v2[1]) - 1)
+                if fld.v2[0]:
+                    term = '(%s << %d)' % (term, fld.v2[0])
+                terms.append(term)
+            f.line('out[%s] = %s;' % (at(pos, k), ' | '.join(terms)))
+            k += 1
+        elif e[0] == 'varint':
+            put = '%sput_varint(%s, b->%s)' % (d.fn, ref('out', pos, k), e[1].name)
+            if last:
+                f.line('return %s;' % (put if pos is None and k == 0 else '%s + %s' % (at(pos, k), put)))
+                return f
+            if pos is None:
+                f.locals.append('%s n;' % d.ctype('u8'))
+                f.line('n = %s;' % (put if k == 0 else '%d + %s' % (k, put)))
+                pos = 'n'
+            else:
+                f.line('n += %s;' % (put if k == 0 else '%d + %s' % (k, put)))
+            k = 0
+        else:
+            fld = e[1]
+            f.locals.append('size_t len = strnlen(b->%s, sizeof(b->%s) - 1);' % (fld.name, fld.name))
+            f.line('memcpy(%s, b->%s, len);' % (ref('out', pos, k), fld.name))
+            f.line('return %s + len;' % at(pos, k))
+            return f
+
+    if pos is None:
+        f.line('return %s;' % d.len_macro(schema, body, version))
+    else:
+        f.line('return %s;' % at(pos, k))
+    return f
+
+
+def gen_decoder(schema, d, body, version):
+    f = Func(d)
+    ent = layout(body, version)
+    pos, k = None, 0
+
+    def fail(cond):
+        f.line('if (%s)' % cond)
+        f.line('return %s;' % d.ebad, 2)
+
+    for i, e in enumerate(ent):
+        rest = ent[i:]
+        if e[0] in ('fixed', 'bits') and (i == 0 or ent[i - 1][0] == 'varint'):
+            # Check the run of fixed fields starting here is all there
+            run = 0
+            for r in rest:
+                if r[0] not in ('fixed', 'bits'):
+                    break
+                run += r[2]
+            final = all(r[0] in ('fixed', 'bits') for r in rest)
+            if final and pos is None:
+                fail('length != %s' % d.len_macro(schema, body, version))
+            elif final:
+                fail('%s != length' % at(pos, k + run))
+            else:
+                fail('length < %s' % at(pos, k + run))
+
+        if e[0] == 'fixed':
+            fld = e[1][0]
+            dst = 'b->' + fld.name
+            if fld.type == 'bool':
+                f.line('%s = in[%s] != 0;' % (dst, at(pos, k)))
+            elif e[2] == 1:
+                f.line('%s = in[%s];' % (dst, at(pos, k)))
+            elif d.kernel:
+                f.line('%s = get_unaligned_le%d(%s);' % (dst, BITS[fld.type], ref('in', pos, k)))
+            else:
+                f.line('%s = %sget_le%d(%s);' % (dst, d.fn, BITS[fld.type], ref('in', pos, k)))
+            k += e[2]
+        elif e[0] == 'bits':
+            for fld in e[1]:
+                val = 'in[%s]' % at(pos, k)
+                masked = fld.v2[0] + fld.v2[1] < 8
+                if fld.v2[0]:
+                    val = ('(%s >> %d)' if masked else '%s >> %d') % (val, fld.v2[0])
+                if masked:
+                    val = '%s & 0x%02X' % (val, (1 << fld.v2[1]) - 1)
+                f.line('b->%s = %s;' % (fld.name, val))
+            k += 1
+        elif e[0] == 'varint':
+            fld = e[1]
+            last = i == len(ent) - 1
+            if 'uint64_t v;' not in f.locals and 'u64 v;' not in f.locals:
+                f.locals.insert(0, '%s v;' % d.ctype('u64'))
+            var = 'n' if pos is None else 'r'
+            if 'int %s;' % var not in f.locals:
+                f.locals.append('int %s;' % var)
+            left = 'length - (%s)' % at(pos, k) if pos else ('length - %d' % k if k else 'length')
+            f.line('%s = %sget_varint(%s, %s, &v);' % (var, d.fn, ref('in', pos, k), left))
+            cond = '%s < 0' % var
+            if BITS[fld.type] < 64:
+                cond += ' || v > %s' % d.umax(fld.type)
+            if last:
+                cond += ' || %s != length' % (('%s + %s' % (at(pos, k), var)) if pos or k else var)
+            fail(cond)
+            f.line('b->%s = v;' % fld.name)
+            if last:
+                pass
+            elif pos is None:
+                if k:
+                    f.line('n += %d;' % k)
+            else:
+                f.line('n += %s;' % ('r' if k == 0 else '%d + r' % k))
+            pos, k = 'n', 0
+        else:
+            fld = e[1]
+            # The fields before it were checked to be there
+            f.locals.append('size_t len;')
+            size = 'sizeof(b->%s) - 1' % fld.name
+            if d.kernel:
+                f.line('len = min_t(size_t, length - %s, %s);' % (at(pos, k), size))
+            else:
+                f.line('len = length - %s;' % at(pos, k))
+                f.line('if (len > %s)' % size)
+                f.line('len = %s;' % size, 2)
+            f.line('memcpy(b->%s, %s, len);' % (fld.name, ref('in', pos, k)))
+            f.line("b->%s[len] = '\\0';" % fld.name)
+
+    f.line('return 0;')
+    return f
+
+
+def func_name(d, body, version, verb):
+    if same_layout(body):
+        return '%s%s_%s' % (d.fn, verb, body.short)
+    return '%s%s_%s_v%d' % (d.fn, verb, body.short, version)
+
+
+def gen_codec_h(schema, d):
+    guard = 'OAC_PROTOCOL_CODEC_H' if d.kernel else 'PROTOCOL_CODEC_H'
+    u8, ind = d.ctype('u8'), d.ind
+    out = []
+    if d.kernel:
+        out.append('/* SPDX-License-Identifier: GPL-2.0 */')
+    out += ['/*',
+            ' * %s - Open Action Cam payload encoders and decoders' %
+            ('oac_protocol_codec.h' if d.kernel else 'protocol_codec.h'),
+            ' *',
+            ' * ' + BANNER,
+            ' *',
+            ' * Fields are written one byte at a time, least significant first, so neither',
+            " * the host's byte order nor its struct padding reaches the wire. v1 keeps the",
+            ' * unpadded AVR struct layout older firmware memcpy()s, v2 packs it further:',
+            ' *']
+
+    rows = []
+    by_body = {}
+    for t in schema.types:
+        by_body.setdefault(t.body, []).append(t)
+    seen = set()
+    for t in schema.types:
+        if t.body in seen:
+            continue
+        seen.add(t.body)
+        names = '/'.join(x.name for x in by_body[t.body])
+        if t.body == 'raw':
+            rows.append((names, 'v1, v2', 'raw'))
+        elif t.body == 'batch':
+            rows.append((names, 'v2', '(type:1 len:1 payload:len) per message, at least one'))
+        else:
+            body = next(b for b in schema.bodies if b.name == t.body)
+            if same_layout(body):
+                rows.append((names, 'v1, v2', describe(body, 1)))
+            else:
+                rows.append((names, 'v1', describe(body, 1)))
+                rows.append(('', 'v2', describe(body, 2)))
+    w0 = max(len(r[0]) for r in rows) + 2
+    for r in rows:
+        out.append((' *   ' + r[0].ljust(w0) + r[1].ljust(8) + r[2]).rstrip())
+    out += [' *',
+            ' * A varint is LEB128: 7 bits per byte, least significant group first, the top',
+            ' * bit set on every byte but the last. Text is sent without its terminator, the',
+            ' * payload length gives its exact length. Decoders check the length is exact.',
+            ' */',
+            '#ifndef ' + guard,
+            '#define ' + guard,
+            '']
+
+    if d.kernel:
+        out += ['#include <linux/build_bug.h>',
+                '#include <linux/kernel.h>',
+                '#include <linux/string.h>',
+                '#include <asm/unaligned.h>',
+                '#include "oac_protocol.h"',
+                '']
+    else:
+        out += ['#include <string.h>',
+                '#include "protocol.h"',
+                '',
+                '#ifdef __cplusplus',
+                '#define PROTOCOL_STATIC_ASSERT(cond, msg) static_assert(cond, msg)',
+                '#else',
+                '#define PROTOCOL_STATIC_ASSERT(cond, msg) _Static_assert(cond, msg)',
+                '#endif',
+                '']
+
+    maxp = d.cname(schema, 'MAX_PAYLOAD_SIZE')
+    out.append('/* Every payload fits, and a v2 frame is COBS encoded with a single overhead byte */')
+    for b in schema.bodies:
+        for v in (1, 2):
+            m = d.len_macro(schema, b, v)
+            out.append('%s(%s <= %s, "%s too long");' % (d.static_assert, m, maxp, m))
+    out.append('%s(%s + 5 < 254, "v2 frame needs more than one COBS block");' %
+               (d.static_assert, maxp))
+    out.append('')
+
+    if not d.kernel:
+        for bits in (16, 32, 64):
+            half = bits // 2
+            t = 'uint%d_t' % bits
+            out.append('static inline void proto_put_le%d(uint8_t *out, %s value)' % (bits, t))
+            out.append('{')
+            if bits == 16:
+                out += [ind + 'out[0] = value;', ind + 'out[1] = value >> 8;']
+            else:
+                out += [ind + 'proto_put_le%d(out, value);' % half,
+                        ind + 'proto_put_le%d(&out[%d], value >> %d);' % (half, half // 8, half)]
+            out += ['}', '']
+            out.append('static inline %s proto_get_le%d(const uint8_t *in)' % (t, bits))
+            out.append('{')
+            if bits == 16:
+                out.append(ind + 'return in[0] | (uint16_t)in[1] << 8;')
+            else:
+                out.append(ind + 'return proto_get_le%d(in) | (%s)proto_get_le%d(&in[%d]) << %d;' %
+                           (half, t, half, half // 8, half))
+            out += ['}', '']
+
+    u64 = d.ctype('u64')
+    out += ['static inline %s %sput_varint(%s *out, %s value)' % (u8, d.fn, u8, u64),
+            '{',
+            ind + '%s n = 0;' % u8,
+            '',
+            ind + 'while (value >= 0x80) {',
+            ind * 2 + 'out[n++] = (value & 0x7F) | 0x80;',
+            ind * 2 + 'value >>= 7;',
+            ind + '}',
+            ind + 'out[n++] = value;',
+            ind + 'return n;',
+            '}',
+            '',
+            '/* Returns the bytes consumed, or %s if truncated or wider than 64 bits */' % d.ebad,
+            'static inline int %sget_varint(const %s *in, size_t length, %s *value)' % (d.fn, u8, u64),
+            '{',
+            ind + '%s v = 0;' % u64,
+            ind + 'size_t i;',
+            '',
+            ind + 'for (i = 0; i < length && i < 10; i++) {',
+            ind * 2 + 'v |= (%s)(in[i] & 0x7F) << (7 * i);' % u64,
+            ind * 2 + 'if (!(in[i] & 0x80)) {',
+            ind * 3 + '*value = v;',
+            ind * 3 + 'return i + 1;',
+            ind * 2 + '}',
+            ind + '}',
+            ind + 'return %s;' % d.ebad,
+            '}',
+            '']
+
+    for b in schema.bodies:
+        versions = (1,) if same_layout(b) else (1, 2)
+        for v in versions:
+            name = func_name(d, b, v, 'encode')
+            f = gen_encoder(schema, d, b, v)
+            out += f.emit('%s %s(const struct %s *b, %s *out)' % (u8, name, b.name, u8))
+        for v in versions:
+            name = func_name(d, b, v, 'decode')
+            f = gen_decoder(schema, d, b, v)
+            out += f.emit('int %s(const %s *in, %s length, struct %s *b)' % (name, u8, u8, b.name))
+
+    v2 = d.cname(schema, 'PROTOCOL_VERSION_2')
+
+    # BATCH: validated as a whole, its messages are decoded as they are unpacked
+    out += ['/* Every message in a batch must fit, each is decoded as it is unpacked */',
+            'static inline int %sdecode_batch(const %s *in, %s length, %s *raw)' % (d.fn, u8, u8, u8),
+            '{',
+            ind + 'size_t pos;',
+            '',
+            ind + 'if (length == 0)',
+            ind * 2 + 'return %s;' % d.ebad,
+            ind + 'for (pos = 0; pos < length; pos += 2 + in[pos + 1]) {',
+            ind * 2 + 'if (length - pos < 2 || in[pos] == %s ||' %
+            d.type_name(next(t for t in schema.types if t.body == 'batch')),
+            ind * 2 + '    in[pos + 1] > length - pos - 2)',
+            ind * 3 + 'return %s;' % d.ebad,
+            ind + '}',
+            ind + 'memcpy(raw, in, length);',
+            ind + 'return 0;',
+            '}',
+            '']
+
+    def cases(t_list):
+        return ['%scase %s:' % (ind, d.type_name(t)) for t in t_list]
+
+    groups = []
+    for t in schema.types:
+        if groups and groups[-1][0].body == t.body and groups[-1][-1] is prev:
+            groups[-1].append(t)
+        else:
+            groups.append([t])
+        prev = t
+
+    out += ['/*',
+            ' * %s - Write the payload of msg in the version encoding' % d.encode,
+            ' * @out: at least %s bytes' % maxp,
+            ' *',
+            ' * Returns the payload length, or < 0 for a type that cannot be encoded.',
+            ' */',
+            'static inline int %s(const struct Message *msg, %s version, %s *out)' % (d.encode, u8, u8),
+            '{',
+            ind + 'switch (msg->header.message_type) {']
+    for g in groups:
+        t = g[0]
+        if t.body == 'batch':
+            continue
+        out += cases(g)
+        if t.body == 'raw':
+            out += [ind * 2 + 'if (msg->header.payload_length > %s)' % maxp,
+                    ind * 3 + 'return %s;' % d.etoolong,
+                    ind * 2 + 'memcpy(out, msg->body.payload_raw, msg->header.payload_length);',
+                    ind * 2 + 'return msg->header.payload_length;']
+            continue
+        b = next(x for x in schema.bodies if x.name == t.body)
+        arg = '&msg->body.%s, out' % b.member
+        if same_layout(b):
+            out.append(ind * 2 + 'return %s(%s);' % (func_name(d, b, 1, 'encode'), arg))
+        else:
+            out += [ind * 2 + 'if (version == %s)' % v2,
+                    ind * 3 + 'return %s(%s);' % (func_name(d, b, 2, 'encode'), arg),
+                    ind * 2 + 'return %s(%s);' % (func_name(d, b, 1, 'encode'), arg)]
+    out += [ind + 'default:',
+            ind * 2 + 'return %s;' % d.eunknown_enc,
+            ind + '}',
+            '}',
+            '']
+
+    out += ['/*',
+            ' * %s - Reverse %s into msg, whose type is set' % (d.decode, d.encode),
+            ' *',
+            ' * Returns 0, or < 0 if the payload is malformed or its type unknown.',
+            ' */',
+            'static inline int %s(const %s *in, %s length, %s version, struct Message *msg)' %
+            (d.decode, u8, u8, u8),
+            '{',
+            ind + 'switch (msg->header.message_type) {']
+    for g in groups:
+        t = g[0]
+        out += cases(g)
+        if t.v2only:
+            out += [ind * 2 + 'if (version != %s)' % v2,
+                    ind * 3 + 'return %s;' % d.ebad]
+        if t.body == 'raw':
+            out += [ind * 2 + 'memcpy(msg->body.payload_raw, in, length);',
+                    ind * 2 + 'return 0;']
+            continue
+        if t.body == 'batch':
+            out.append(ind * 2 + 'return %sdecode_batch(in, length, msg->body.payload_raw);' % d.fn)
+            continue
+        b = next(x for x in schema.bodies if x.name == t.body)
+        arg = 'in, length, &msg->body.%s' % b.member
+        if same_layout(b):
+            out.append(ind * 2 + 'return %s(%s);' % (func_name(d, b, 1, 'decode'), arg))
+        else:
+            out += [ind * 2 + 'if (version == %s)' % v2,
+                    ind * 3 + 'return %s(%s);' % (func_name(d, b, 2, 'decode'), arg),
+                    ind * 2 + 'return %s(%s);' % (func_name(d, b, 1, 'decode'), arg)]
+    out += [ind + 'default:',
+            ind * 2 + 'return %s;' % d.eunknown_dec,
+            ind + '}',
+            '}',
+            '',
+            '#endif /* %s */' % guard,
+            '']
+    return '\n'.join(out)
+
+
+def outputs(schema):
+    shared, kernel = Dialect(False), Dialect(True)
+    return {
+        'shared/protocol.h': gen_protocol_h(schema, shared),
+        'shared/protocol_codec.h': gen_codec_h(schema, shared),
+        'linux/drivers/oac_protocol.h': gen_protocol_h(schema, kernel),
+        'linux/drivers/oac_protocol_codec.h': gen_codec_h(schema, kernel),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Generate the protocol headers from protocol.def')
+    parser.add_argument('--check', action='store_true',
+                        help='write nothing, fail if a generated header is out of date')
+    args = parser.parse_args()
+
+    try:
+        schema = parse(SCHEMA)
+    except SchemaError as e:
+        print('gen_protocol: %s' % e, file=sys.stderr)
+        return 1
+
+    stale = []
+    for rel, text in outputs(schema).items():
+        path = os.path.join(SOFTWARE, rel)
+        try:
+            with open(path) as f:
+                current = f.read()
+        except FileNotFoundError:
+            current = None
+        if current == text:
+            continue
+        stale.append(rel)
+        if not args.check:
+            with open(path, 'w') as f:
+                f.write(text)
+            print('[*] wrote %s' % rel)
+
+    if args.check and stale:
+        for rel in stale:
+            print('gen_protocol: %s is out of date' % rel, file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -9,38 +9,340 @@
  */
 
  #include "comms.h"
+ #include "protocol_codec.h"  /* comms_encode_payload(), comms_decode_payload() */
  #include <string.h>
 
+ #if defined(__AVR__)
+ #include <avr/pgmspace.h>
+ #endif
+ #ifndef PROGMEM
+ #define PROGMEM
+ #define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+ #endif
+
  #if IS_MCU
  static const uint8_t comms_recipient = MESSAGE_RECIPIENT_LINUX;
- #define SERIAL_WRITE(byte) serial_write(byte)
+ #define SERIAL_WRITE_BUF(buf, len) serial_write_buf(buf, len)
  #define SERIAL_AVAILABLE() serial_available()
- #define SERIAL_READ() serial_read()
+ #define RX_RING_SIZE 64     /* Serial already buffers 64 bytes in its ISR, keep RAM use low */
+ #define TX_BATCH_SIZE 48    /* Status, a command and a short error */
+ #define TX_QUEUE_SIZE 160   /* Bytes waiting for the Serial TX buffer, the largest frame and some */
+ #define TX_QUEUE_FRAMES 8   /* Frames and log texts waiting */
+ #define TX_LOG_CHUNK 24     /* Log text queued as one entry at most, an urgent frame may wait for it */
+ #define ERROR_SLOTS 4       /* Error codes rate limited at a time, the firmware raises few */
 
  #else /* IS_LINUX */
 
+ #include <sys/uio.h>
+ #include "comms_trace.h"
+
  #define SERIAL_DEVICE "/dev/ttyS0"  /* Raspberry Pi UART */
  static const uint8_t comms_recipient = MESSAGE_RECIPIENT_FIRMWARE;
  static int serial_fd = -1;  /* Ensure serial_fd is properly declared */
- static int linux_serial_read(void); 
- static int linux_serial_available(void);
- #define SERIAL_WRITE(byte) write(serial_fd, &byte, 1)
- #define SERIAL_AVAILABLE() linux_serial_available()
- #define SERIAL_READ() linux_serial_read()
+ #define RX_RING_SIZE 512    /* Large enough to drain several frames per read() */
+ #define TX_RING_SIZE 1024   /* Bytes queued for the UART, power of two */
+ #define TX_MAX_FRAMES 32    /* Frames queued for the UART, power of two */
+ #define TX_BATCH_SIZE MAX_PAYLOAD_SIZE
+ #define ERROR_SLOTS 16
+ #define TRACE_MAX_BYTES (64UL << 20)  /* A trace stops here rather than fill the disk */
+ #define TRACE_FLUSH_MS 1000           /* Longest a record stays in the stdio buffer */
 
  #endif
  
- #define BUFFER_SIZE (MAX_PAYLOAD_SIZE + 6)
+ #define BUFFER_SIZE FRAME_LEN_V2(MAX_PAYLOAD_SIZE)  /* Largest frame, v2 COBS encoded and delimited */
 
+ /*
+  * RX ring buffer - raw bytes drained from the serial port in bulk.
+  * head and tail are free running; RX_RING_SIZE must be a power of two.
+  */
+ #define RX_RING_MASK (RX_RING_SIZE - 1)
+ static uint8_t rx_ring[RX_RING_SIZE];
+ static uint16_t rx_ring_head = 0;  /* Next byte to be written by comms_rx_fill() */
+ static uint16_t rx_ring_tail = 0;  /* Next byte to be consumed by comms_parse_next() */
+
+ /* Frame parser state, retained across calls */
  static uint8_t rx_buffer[BUFFER_SIZE];
  static uint8_t rx_index = 0;
  static bool receiving = false;
+ static uint8_t rx_framing = PROTOCOL_VERSION_1;  /* Framing of the frame being received */
  static uint32_t last_byte_time = 0;
 
- static int comms_send_message(const struct Message *msg);
+ /*
+  * Negotiated protocol version. This selects the framing we transmit with; in v2 the
+  * parser additionally accepts v1 frames so a restarted peer can always renegotiate.
+  */
+ static uint8_t protocol_version = PROTOCOL_VERSION_1;
+ #if IS_LINUX
+ static bool proto_negotiating = false;  /* v2 requested, no ack received yet */
+ static uint32_t proto_req_time = 0;     /* Time of the last v2 request */
+ #endif
+
+ /*
+  * Protocol v2 reliable delivery. Every v2 frame carries the sender's sequence number.
+  * Command and event frames are kept until the peer acknowledges them, and resent on a
+  * NAK or after RETRANSMIT_TIMEOUT_MS. Status and error frames are superseded by the
+  * next one, so they are never resent.
+  */
+ struct UnackedFrame {
+     uint32_t sent_time;
+     struct EventBody event;             /* A command only uses event.command */
+     uint8_t type;                       /* MESSAGE_TYPE_COMMAND or MESSAGE_TYPE_EVENT */
+     uint8_t seq;
+     uint8_t retries;
+     bool used;
+ };
+ static struct UnackedFrame unacked[MAX_UNACKED];
+ static uint16_t tx_failures = 0;        /* Command frames given up on */
+ static uint8_t tx_seq = 0;              /* Sequence number of the next frame sent */
+ static uint8_t rx_expected_seq = 0;     /* Sequence number expected from the peer next */
+ static uint16_t event_trace = 0;        /* Trace ID of the last event sent, never 0 */
+ static bool rx_seq_valid = false;       /* Nothing received since the last (re)negotiation */
+ static uint64_t rx_seen = 0;            /* Bit n set: frame rx_expected_seq - 1 - n was received */
+
+ /*
+  * Protocol v2 batching. Messages sent within BATCH_WINDOW_MS of each other share one
+  * MESSAGE_TYPE_BATCH frame, whose payload is TYPE LEN PAYLOAD for each of them. The
+  * frame carries the sequence number of its first message and the others follow on
+  * consecutively, so they are acknowledged exactly as if they had been sent separately.
+  * The batch is built in place behind room for the frame header, and a received batch
+  * is unpacked in place from rx_buffer.
+  */
+ static uint8_t tx_batch[TX_BATCH_SIZE + 7];
+ static uint8_t tx_batch_len = 0;        /* Payload bytes at tx_batch + 5 */
+ static uint8_t tx_batch_count = 0;      /* Messages in the batch */
+ static uint8_t tx_batch_seq = 0;        /* Sequence number of the first message */
+ static uint8_t tx_batch_class = 0;      /* Highest TxClass of the messages */
+ static uint32_t tx_batch_time = 0;      /* Time the first message was added */
+ static uint8_t rx_batch_pos = 0;        /* Next message in rx_buffer */
+ static uint8_t rx_batch_end = 0;        /* End of the batch payload in rx_buffer */
+ static uint8_t rx_batch_seq = 0;        /* Sequence number of the next message */
+
+ /*
+  * Error rate limiting. A code is sent at most once per limit_ms of the error catalog,
+  * the occurrences in between are counted and the next ERROR_CODE message carries the
+  * count. When every slot is in use, the code sent least recently gives up its slot.
+  */
+ #define ERROR_DEFAULT_LIMIT_MS 10000    /* Codes missing from the catalog */
+ struct ErrorSlot {
+     uint32_t sent_time;
+     uint16_t count;                     /* Occurrences not sent yet */
+     uint8_t code;                       /* 0 if unused */
+ };
+ static struct ErrorSlot error_slots[ERROR_SLOTS];
+
+ /*
+  * Bulk transfer, one object sent and one received at a time. The sender keeps no copy
+  * of the object, data the receiver missed is read again from the source. Chunks are
+  * only produced once the UART has (almost) drained, so any other frame waits behind
+  * at most one of them.
+  */
+ enum BulkState {
+     BULK_IDLE,
+     BULK_OPENING,       /* Sender: OPEN sent, waiting for the first credit */
+     BULK_SENDING,       /* Sender: credit received / receiver: object open */
+     BULK_DONE,          /* Receiver: complete, the final credit is repeated on request */
+ };
+ static comms_bulk_read_t bulk_tx_read = NULL;
+ static int8_t bulk_tx_state = BULK_IDLE;     /* Or the negated BULK_E_* the last transfer failed with */
+ static uint8_t bulk_tx_object = 0;
+ static uint8_t bulk_tx_xfer = 0;             /* Transfer ID, 0 until the first transfer */
+ static uint8_t bulk_tx_retries = 0;          /* Resends since the last progress */
+ static uint32_t bulk_tx_size = 0;
+ static uint32_t bulk_tx_acked = 0;           /* Everything below arrived */
+ static uint32_t bulk_tx_next = 0;            /* Next byte to send */
+ static uint32_t bulk_tx_limit = 0;           /* Credit, bytes below may be sent */
+ static uint32_t bulk_tx_time = 0;            /* Time of the last progress or resend */
+ static const struct BulkSink *bulk_sink = NULL;
+ static uint8_t bulk_rx_state = BULK_IDLE;
+ static uint8_t bulk_rx_xfer = 0;
+ static bool bulk_rx_resent = false;          /* RESEND sent since the last progress */
+ static uint32_t bulk_rx_resend_time = 0;     /* Time of the last RESEND */
+ static uint32_t bulk_rx_size = 0;
+ static uint32_t bulk_rx_offset = 0;          /* Everything below was written to the sink */
+ static uint32_t bulk_rx_credited = 0;        /* Offset of the last credit sent */
+
+ /*
+  * Baud rate ladder. Linux climbs it one rung at a time: BAUD_REQ at the current rate,
+  * the firmware answers BAUD_ACK and switches, Linux switches and sends BAUD_PROBE,
+  * which the firmware echoes. Either side falls back to baud_rung if the echo does not
+  * arrive, and to rung 0 after a burst of frame errors.
+  */
+ enum BaudState {
+     BAUD_IDLE,
+     BAUD_WAIT_ACK,      /* Linux: request sent at the current rate */
+     BAUD_WAIT_PROBE,    /* Switched to baud_target, waiting for the probe (echo) */
+ };
+ static const uint32_t baud_ladder[] = BAUD_LADDER;
+ #define BAUD_RUNGS (sizeof(baud_ladder) / sizeof(baud_ladder[0]))
+ static uint8_t baud_rung = 0;           /* Confirmed rung */
+ static uint8_t baud_target = 0;         /* Rung being negotiated */
+ static uint8_t baud_state = BAUD_IDLE;
+ static uint32_t baud_timer = 0;         /* Time baud_state was entered */
+ static uint8_t baud_errors = 0;         /* Frame errors in the current window */
+ static uint32_t baud_error_time = 0;    /* Start of the current error window */
+
+ /*
+  * Clock synchronisation. Linux pings the firmware, which answers with its clock, and
+  * fits a line through the answers. Each answer is taken to be the firmware clock at the
+  * midpoint of the round trip, once the time both frames spent on the line is taken out,
+  * as the firmware reads its clock between the two. Only pings that came back within
+  * twice the quickest delay are used, the others waited in a queue on the way.
+  */
+ #if IS_MCU
+ static uint32_t clock_last_us = 0;      /* micros() at the last comms_clock_us() */
+ static uint32_t clock_high = 0;         /* Times micros() wrapped */
+ #else /* IS_LINUX */
+ struct ClockSample {
+     uint64_t fw_us;
+     int64_t mono_ns;                    /* Linux time at fw_us */
+     int64_t delay_ns;                   /* Round trip less the time on the line */
+ };
+ static struct ClockSample clock_samples[CLOCK_SAMPLES];
+ static uint8_t clock_count = 0;         /* Samples in clock_samples */
+ static uint8_t clock_next = 0;          /* Slot of the next sample */
+ static uint8_t clock_ping_id = 0;
+ static bool clock_ping_pending = false;
+ static uint8_t clock_missed = 0;        /* Pings given up on since the last answer */
+ static int64_t clock_ping_ns = 0;       /* Time the pending ping was sent */
+ static int64_t clock_ping_line_ns = 0;  /* Its time on the line */
+ static uint32_t clock_ping_time = 0;    /* GET_TIME_MS() of the last ping */
+ static uint64_t clock_fw_us = 0;        /* The estimate: firmware time clock_fw_us is */
+ static int64_t clock_mono_ns = 0;       /* Linux time clock_mono_ns, and Linux time passes */
+ static int32_t clock_drift_ppb = 0;     /* this much faster than the firmware's */
+ static int32_t clock_error_ns = -1;     /* Half the quickest delay, < 0 until synchronised */
+ #endif
+
+ /* CRC-8, polynomial 0x07 (x^8 + x^2 + x + 1), initial value 0. Kept in flash on the MCU */
+ static const uint8_t crc8_table[256] PROGMEM = {
+     0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15,
+     0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D,
+     0x70, 0x77, 0x7E, 0x79, 0x6C, 0x6B, 0x62, 0x65,
+     0x48, 0x4F, 0x46, 0x41, 0x54, 0x53, 0x5A, 0x5D,
+     0xE0, 0xE7, 0xEE, 0xE9, 0xFC, 0xFB, 0xF2, 0xF5,
+     0xD8, 0xDF, 0xD6, 0xD1, 0xC4, 0xC3, 0xCA, 0xCD,
+     0x90, 0x97, 0x9E, 0x99, 0x8C, 0x8B, 0x82, 0x85,
+     0xA8, 0xAF, 0xA6, 0xA1, 0xB4, 0xB3, 0xBA, 0xBD,
+     0xC7, 0xC0, 0xC9, 0xCE, 0xDB, 0xDC, 0xD5, 0xD2,
+     0xFF, 0xF8, 0xF1, 0xF6, 0xE3, 0xE4, 0xED, 0xEA,
+     0xB7, 0xB0, 0xB9, 0xBE, 0xAB, 0xAC, 0xA5, 0xA2,
+     0x8F, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9D, 0x9A,
+     0x27, 0x20, 0x29, 0x2E, 0x3B, 0x3C, 0x35, 0x32,
+     0x1F, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0D, 0x0A,
+     0x57, 0x50, 0x59, 0x5E, 0x4B, 0x4C, 0x45, 0x42,
+     0x6F, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7D, 0x7A,
+     0x89, 0x8E, 0x87, 0x80, 0x95, 0x92, 0x9B, 0x9C,
+     0xB1, 0xB6, 0xBF, 0xB8, 0xAD, 0xAA, 0xA3, 0xA4,
+     0xF9, 0xFE, 0xF7, 0xF0, 0xE5, 0xE2, 0xEB, 0xEC,
+     0xC1, 0xC6, 0xCF, 0xC8, 0xDD, 0xDA, 0xD3, 0xD4,
+     0x69, 0x6E, 0x67, 0x60, 0x75, 0x72, 0x7B, 0x7C,
+     0x51, 0x56, 0x5F, 0x58, 0x4D, 0x4A, 0x43, 0x44,
+     0x19, 0x1E, 0x17, 0x10, 0x05, 0x02, 0x0B, 0x0C,
+     0x21, 0x26, 0x2F, 0x28, 0x3D, 0x3A, 0x33, 0x34,
+     0x4E, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5C, 0x5B,
+     0x76, 0x71, 0x78, 0x7F, 0x6A, 0x6D, 0x64, 0x63,
+     0x3E, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2C, 0x2B,
+     0x06, 0x01, 0x08, 0x0F, 0x1A, 0x1D, 0x14, 0x13,
+     0xAE, 0xA9, 0xA0, 0xA7, 0xB2, 0xB5, 0xBC, 0xBB,
+     0x96, 0x91, 0x98, 0x9F, 0x8A, 0x8D, 0x84, 0x83,
+     0xDE, 0xD9, 0xD0, 0xD7, 0xC2, 0xC5, 0xCC, 0xCB,
+     0xE6, 0xE1, 0xE8, 0xEF, 0xFA, 0xFD, 0xF4, 0xF3,
+ };
+
+ /*
+  * TX priority classes, highest first. Link control, commands and ACK/NAK are urgent, bulk
+  * data, error text and log text go last.
+  */
+ enum TxClass {
+     TX_URGENT,
+     TX_EVENT,       /* Events, replies, responses and error codes */
+     TX_STATUS,      /* Periodic, a queued status is superseded by the next */
+     TX_BULK,
+ };
+
+ #if IS_MCU
+ /*
+  * TX scheduler - frames wait here instead of blocking in Serial.write(), and are moved to
+  * the Serial TX buffer, which the UART ISR drains, as far as it has room. The highest class
+  * goes first, oldest first within a class. A frame once started is finished, and below
+  * TX_URGENT a frame only starts on an empty Serial TX buffer, so an urgent frame never waits
+  * for more than the rest of one other frame. Log text is queued in entries of at most
+  * TX_LOG_CHUNK bytes, so it never holds one up for longer than a frame would. Frames are
+  * kept in order in tx_queue, the one chosen next is rotated to the front.
+  */
+ #if BUFFER_SIZE > TX_QUEUE_SIZE
+ #error "TX_QUEUE_SIZE must hold the largest frame"
+ #endif
+ struct TxEntry {
+     uint8_t len;
+     uint8_t cls;                    /* TxClass */
+     uint8_t seq;                    /* Sequence number of the first message */
+     uint8_t count;                  /* Messages in the frame, 0 for log text */
+ };
+ static uint8_t tx_queue[TX_QUEUE_SIZE];
+ static uint16_t tx_queue_len = 0;
+ static struct TxEntry tx_entries[TX_QUEUE_FRAMES];
+ static uint8_t tx_entry_count = 0;
+ static uint8_t tx_started = 0;      /* Bytes of the first entry already in the Serial TX buffer */
+
+ #else /* IS_LINUX */
+ /*
+  * TX ring buffer - serialized frames waiting for the UART.
+  * tx_frame_len tracks frame boundaries so callers can see how many frames are still queued.
+  */
+ #define TX_RING_MASK (TX_RING_SIZE - 1)
+ #define TX_FRAME_MASK (TX_MAX_FRAMES - 1)
+ static uint8_t tx_ring[TX_RING_SIZE];
+ static uint16_t tx_ring_head = 0;   /* Next byte to be queued */
+ static uint16_t tx_ring_tail = 0;   /* Next byte to be written to the fd */
+ static uint8_t tx_frame_len[TX_MAX_FRAMES];
+ static uint8_t tx_frame_head = 0;   /* Next free frame slot */
+ static uint8_t tx_frame_tail = 0;   /* Oldest frame not fully written */
+ static uint16_t tx_frame_sent = 0;  /* Bytes of the oldest frame already written */
+
+ /* Link capture, see comms_trace.h */
+ static FILE *trace_file = NULL;
+ static unsigned long trace_bytes = 0;  /* Written to trace_file so far */
+ static uint32_t trace_flush_time = 0;  /* Time trace_file was last flushed */
+ #endif
+
+ static int comms_send_message(struct Message *msg);
+ static int comms_transmit(const struct Message *msg);
+ static int comms_write_frame(const uint8_t *frame, uint8_t len, uint8_t cls, uint8_t seq, uint8_t count);
+ static int comms_batch_add(const struct Message *msg);
+ static uint8_t comms_tx_class(const struct Message *msg);
+ static int comms_batch_flush(void);
+ static void comms_batch_poll(void);
+ static void comms_bulk_poll(void);
+ static bool comms_handle_bulk_message(const struct Message *msg);
  static int comms_serialize_message(const struct Message *msg, uint8_t *out_buf);
+ static int comms_frame_payload(uint8_t *out_buf, uint8_t recipient, uint8_t type, uint8_t seq, uint8_t payload_len);
  static int comms_deserialize_message(const uint8_t *in_buf, size_t length, struct Message *msg);
+ static int comms_decode_frame(const uint8_t *frame, size_t length, uint8_t version, struct Message *msg);
+ static void comms_reset_sequence(void);
+ static size_t comms_cobs_encode(const uint8_t *in, size_t length, uint8_t *out);
+ static int comms_cobs_decode(const uint8_t *in, size_t length, uint8_t *out);
  static uint8_t comms_calculate_checksum(const uint8_t *data, uint8_t length);
+ static uint8_t comms_crc8(const uint8_t *data, size_t length);
+ static int comms_apply_baud(uint8_t rung);
+ static void comms_clock_poll(void);
+ #if IS_LINUX
+ static void comms_clock_handle_pong(const struct Message *msg);
+ static void comms_baud_reset_peer(void);
+ static int comms_tx_enqueue(const uint8_t *frame, uint8_t len);
+ static void comms_trace(uint8_t kind, uint8_t arg, const uint8_t *data, uint16_t length,
+                         const uint8_t *more, uint16_t more_length);
+ static void comms_trace_message(uint8_t kind, uint8_t version, const struct Message *msg);
+ /* Frames leave through comms_tx_flush(), which the program calls */
+ #define comms_tx_push() do { } while (0)
+ #define comms_tx_queued(seq) false
+ #else
+ static void comms_tx_schedule(const uint8_t *frame, uint8_t len, uint8_t cls, uint8_t seq, uint8_t count);
+ static void comms_tx_push(void);
+ static bool comms_tx_queued(uint8_t seq);
+ /* Nothing is captured on the MCU */
+ #define comms_trace(...) do { } while (0)
+ #define comms_trace_message(...) do { } while (0)
+ #endif
 
 /*
  * comms_send_command - Send a command message to the recipient
@@ -85,6 +387,98 @@ int comms_send_error(uint8_t error_code, const char *error_message)
     return comms_send_message(&msg);
 }
 
+/*
+ * comms_error_limit_ms - Shortest time between two ERROR_CODE messages with a code.
+ */
+static uint32_t comms_error_limit_ms(uint8_t code)
+{
+    switch (code) {
+#define ERROR_LIMIT(code, origin, limit_ms, message) case code: return limit_ms;
+    ERROR_CATALOG(ERROR_LIMIT)
+#undef ERROR_LIMIT
+    default:
+        return ERROR_DEFAULT_LIMIT_MS;
+    }
+}
+
+/*
+ * comms_raise_error - Send an error from the error catalog, rate limited per code.
+ * @param code: ERROR_CODE_*
+ * @param context: Error specific value, 0 if there is none
+ * @note Raised again within its limit, an error is only counted. The count goes out with
+ *       the next one sent, so a condition that persists costs one small frame per limit.
+ * @return 0 if sent, 1 if only counted, negative value on error
+ */
+int comms_raise_error(uint8_t code, uint32_t context)
+{
+    struct ErrorSlot *slot = NULL;
+    uint32_t now = GET_TIME_MS();
+    struct Message msg;
+
+    for (uint8_t i = 0; i < ERROR_SLOTS; i++) {
+        struct ErrorSlot *s = &error_slots[i];
+
+        if (s->code == code) {
+            slot = s;
+            break;
+        }
+        if (!slot || (slot->code && (!s->code || (int32_t)(s->sent_time - slot->sent_time) < 0)))
+            slot = s;  /* Unused, or sent before the best so far */
+    }
+    if (slot->code != code) {
+        slot->code = code;
+        slot->count = 0;
+        slot->sent_time = now - comms_error_limit_ms(code);
+    }
+
+    if (slot->count < UINT16_MAX)
+        slot->count++;
+    if (now - slot->sent_time < comms_error_limit_ms(code))
+        return 1;
+
+    msg.header.recipient = comms_recipient;
+    msg.header.message_type = MESSAGE_TYPE_ERROR_CODE;
+    msg.header.payload_length = sizeof(struct ErrorCodeBody);
+    msg.body.payload_error_code.code = code;
+    msg.body.payload_error_code.count = slot->count;
+    msg.body.payload_error_code.context = context;
+
+    slot->sent_time = now;
+    slot->count = 0;
+
+    return comms_send_message(&msg);
+}
+
+#if IS_LINUX
+/*
+ * comms_error_message - The message of an error in the error catalog.
+ */
+const char *comms_error_message(uint8_t code)
+{
+    switch (code) {
+#define ERROR_MESSAGE(code, origin, limit_ms, message) case code: return message;
+    ERROR_CATALOG(ERROR_MESSAGE)
+#undef ERROR_MESSAGE
+    default:
+        return "Unknown error";
+    }
+}
+
+/*
+ * comms_error_origin - The ERROR_ORIGIN_* side raising an error, 0 if it is not in the catalog.
+ */
+uint8_t comms_error_origin(uint8_t code)
+{
+    switch (code) {
+#define ERROR_ORIGIN(code, origin, limit_ms, message) case code: return origin;
+    ERROR_CATALOG(ERROR_ORIGIN)
+#undef ERROR_ORIGIN
+    default:
+        return 0;
+    }
+}
+#endif
+
 /* 
  * comms_send_status - Send a status message to the recipient
  * @param status: The status to send
@@ -103,19 +497,66 @@ int comms_send_status(const struct StatusBody *status)
     return comms_send_message(&msg);
 }
 
+/*
+ * comms_send_reply - Answer a request
+ * @param tid: Transaction ID of the request
+ * @param result: REPLY_OK or REPLY_E_*
+ * @param val: Value returned to the requester
+ * @return 0 on success, negative value on error
+ */
+int comms_send_reply(uint8_t tid, uint8_t result, uint64_t val)
+{
+    struct Message msg;
+    msg.header.recipient = comms_recipient;
+    msg.header.message_type = MESSAGE_TYPE_REPLY;
+    msg.header.payload_length = sizeof(struct ReplyBody);
+    msg.body.payload_reply.tid = tid;
+    msg.body.payload_reply.result = result;
+    msg.body.payload_reply.val = val;
+
+    return comms_send_message(&msg);
+}
+
+/*
+ * comms_send_event - Send a command that is traced from when it happened
+ * @param command: The command to send
+ * @param time_us: comms_clock_us() when it happened, e.g. the button was released
+ * @return The event's trace ID, or a negative value on error
+ * @note Sent straight away, together with any batch waiting for BATCH_WINDOW_MS.
+ */
+int32_t comms_send_event(uint16_t command, uint64_t time_us)
+{
+    struct Message msg;
+    msg.header.recipient = comms_recipient;
+    msg.header.message_type = MESSAGE_TYPE_EVENT;
+    msg.header.payload_length = sizeof(struct EventBody);
+    msg.body.payload_event.command = command;
+    msg.body.payload_event.trace = ++event_trace ? event_trace : ++event_trace;
+    msg.body.payload_event.time_us = time_us;
+    msg.body.payload_event.queued_us = (uint32_t)(comms_clock_us() - time_us);
+
+    int ret = comms_send_message(&msg);
+    if (ret == 0)
+        ret = comms_batch_flush();
+    return ret < 0 ? ret : msg.body.payload_event.trace;
+}
+
  /* 
   * @name comms_init
   * @brief Initializes the serial communication for both ATmega and Linux System
   * @note This function sets up the serial port for communication.
   *       For ATmega firmware, it initializes the serial port at 9600 baud rate.
   *       For Linux, it opens the serial device and configures it for 9600 baud rate,
-  *       8n1, raw mode, with no flow control.
+  *       8n1, raw mode, with no flow control. Faster rates are negotiated afterwards,
+  *       see comms_negotiate_baud().
   *     
   * @return 0 on success, -1 on error
   */
  int comms_init(void) {
+     baud_rung = 0;
+     baud_state = BAUD_IDLE;
  #if IS_MCU
-     serial_begin(9600);
+     serial_begin(ARDUINO_BAUDRATE);
  #else /* IS_LINUX */
      struct termios options;
      serial_fd = open(SERIAL_DEVICE, O_RDWR | O_NOCTTY | O_NDELAY);
@@ -128,8 +569,8 @@ int comms_send_status(const struct StatusBody *status)
      tcgetattr(serial_fd, &options);
  
      /* Set Baud Rate */
-     cfsetispeed(&options, B9600);
-     cfsetospeed(&options, B9600);
+     cfsetispeed(&options, LINUX_BAUDRATE);
+     cfsetospeed(&options, LINUX_BAUDRATE);
  
      /* Set 8N1 (8-bit, No parity, 1 stop bit) */
      options.c_cflag &= ~PARENB;  /* No parity */
@@ -150,309 +591,2267 @@ int comms_send_status(const struct StatusBody *status)
  
      /* Set non-blocking mode */
      fcntl(serial_fd, F_SETFL, FNDELAY);
+
+     /* The firmware may still be on a faster rate negotiated by a previous session */
+     comms_baud_reset_peer();
+
+     /* Ask the firmware for v2 framing, older firmware simply ignores the request.
+      * Once acknowledged, the link speed is negotiated as well. */
+     comms_negotiate_protocol();
  #endif
     return 0;
  }
 
 /*
- * comms_receive_message - Read and deserialize one complete message from serial.
- * @param msg: Pointer to target Message structure.
- * @returns:
- *   > 0 = message successfully received and deserialized
- *     0 = no message available
- *   < 0 = error occurred
+ * comms_negotiate_protocol - Request protocol v2 framing from the firmware.
+ * @note Linux only. Until COMMAND_PROTO_ACK_V2 arrives we keep transmitting v1
+ *       frames, and the request is repeated (rate limited) whenever a frame
+ *       fails to parse.
+ * @return 0 on success, negative value on error
  */
-int comms_receive_message(struct Message *msg)
+int comms_negotiate_protocol(void)
 {
-    if (!msg)
-        return -1;  /* Invalid argument */
+#if IS_LINUX
+    proto_negotiating = true;
+    proto_req_time = GET_TIME_MS();
+
+    /* A restarted session may follow a v2 one, the request itself is always v1 */
+    protocol_version = PROTOCOL_VERSION_1;
+    comms_reset_sequence();
+    return comms_send_command(COMMAND_PROTO_REQ_V2);
+#else
+    return -1; /* The firmware only ever answers requests */
+#endif
+}
 
-    uint32_t now = GET_TIME_MS();
+/*
+ * comms_set_protocol_version - Force the framing used for transmission.
+ * @note The firmware drops back to v1 whenever Linux is powered off, as the
+ *       next boot has to renegotiate.
+ */
+void comms_set_protocol_version(uint8_t version)
+{
+    protocol_version = (version == PROTOCOL_VERSION_2) ? PROTOCOL_VERSION_2 : PROTOCOL_VERSION_1;
+#if IS_LINUX
+    proto_negotiating = false;
+#endif
+    comms_reset_sequence();
+}
 
-    if (receiving && (now - last_byte_time > MAX_MESSAGE_TIMEOUT_MS)) {
-        receiving = false;
-        rx_index = 0;
-        memset(msg, 0, sizeof(struct Message));
-        return -2;  /* Timeout */
+/*
+ * comms_get_protocol_version - Framing currently used for transmission.
+ */
+uint8_t comms_get_protocol_version(void)
+{
+    return protocol_version;
+}
+
+#if IS_LINUX
+/*
+ * comms_baud_speed - termios speed for a ladder rate
+ * @return B0 if termios has no constant for the rate (e.g. 250000), such rungs are skipped
+ */
+static speed_t comms_baud_speed(uint32_t baud)
+{
+    switch (baud) {
+    case 9600: return B9600;
+    case 115200: return B115200;
+    case 500000: return B500000;
+    case 1000000: return B1000000;
+    default: return B0;
     }
+}
 
-    while (SERIAL_AVAILABLE() > 0) {
-        int byte = SERIAL_READ();
-        if (byte < 0) {
-            memset(msg, 0, sizeof(struct Message));
-            return -3;  /* Read error */
+/*
+ * comms_baud_reset_peer - Send the firmware back to rung 0 from wherever it is.
+ * @note A BAUD_REQ for rung 0 takes effect without a probe, so it is sent (v1 framed,
+ *       which the firmware always accepts) once at every rung above 0. The bytes sent
+ *       at the other rungs arrive as garbage, so each request, and the first frame
+ *       at rung 0, is preceded by delimiters that end whatever partial frame the
+ *       firmware made of them.
+ */
+static void comms_baud_reset_peer(void)
+{
+    static const uint8_t idle[4] = { MESSAGE_DELIMITER, MESSAGE_DELIMITER,
+                                     MESSAGE_DELIMITER, MESSAGE_DELIMITER };
+
+    for (uint8_t rung = BAUD_RUNGS - 1; rung > 0; rung--) {
+        if (comms_apply_baud(rung) == 0) {
+            comms_tx_enqueue(idle, sizeof(idle));
+            comms_send_command(COMMAND_BAUD_REQ | 0);
+            comms_tx_flush();
+            tcdrain(serial_fd);
+            usleep(BAUD_SETTLE_MS * 1000);  /* Let the firmware act on it before the next rung */
         }
+    }
+    comms_set_baud(0);
+    comms_tx_enqueue(idle, sizeof(idle));
+}
+#endif
 
-        last_byte_time = now;
-        uint8_t b = (uint8_t)byte;
+/*
+ * comms_apply_baud - Switch the local UART to a ladder rung.
+ * @note Frames already queued were meant for the old rate, so they are sent first.
+ * @return 0 on success, < 0 if the rung cannot be used on this platform
+ */
+static int comms_apply_baud(uint8_t rung)
+{
+    if (rung >= BAUD_RUNGS)
+        return -1;
 
-        if (!receiving) {
-            if (b == MESSAGE_START) {
-                rx_index = 0;
-                rx_buffer[rx_index++] = b;
-                memset(msg, 0, sizeof(struct Message));
-                receiving = true;
-            } else {
-                rx_index = 0;
-                memset(msg, 0, sizeof(struct Message));
-                return -4;  /* Unexpected start byte */
-            }
-        } else {
-            if (rx_index >= BUFFER_SIZE) {
-                receiving = false;
-                rx_index = 0;
-                memset(msg, 0, sizeof(struct Message));
-                return -5;  /* Buffer overflow */
-            }
+#if IS_MCU
+    while (comms_tx_flush() > 0)
+        ;
+    serial_flush();
+    serial_begin(baud_ladder[rung]);
+#else /* IS_LINUX */
+    struct termios options;
+    speed_t speed = comms_baud_speed(baud_ladder[rung]);
 
-            rx_buffer[rx_index++] = b;
+    if (serial_fd == -1 || speed == B0)
+        return -1;
 
-            if (rx_index >= 6) {
-                uint8_t payload_len = rx_buffer[3];
-                uint8_t expected_len = 6 + payload_len;
+    while (comms_tx_flush() > 0)
+        tcdrain(serial_fd);
+    tcdrain(serial_fd);
 
-                if (rx_index == expected_len) {
-                    if (rx_buffer[expected_len - 1] != MESSAGE_END) {
-                        receiving = false;
-                        rx_index = 0;
-                        memset(msg, 0, sizeof(struct Message));
-                        return -6;  /* Invalid end byte */
-                    }
+    tcgetattr(serial_fd, &options);
+    cfsetispeed(&options, speed);
+    cfsetospeed(&options, speed);
+    if (tcsetattr(serial_fd, TCSANOW, &options) < 0)
+        return -1;
 
-                    int result = comms_deserialize_message(rx_buffer, expected_len, msg);
-                    receiving = false;
-                    rx_index = 0;
-                    return (result == 0) ? 1 : -8;  /* Success or deserialization error */
-                }
-            }
-        }
-    }
+    uint8_t baud[4];
+    proto_put_le32(baud, baud_ladder[rung]);
+    comms_trace(TRACE_BAUD, 0, baud, sizeof(baud), NULL, 0);
+#endif
 
-    return 0;  /* No message yet */
+    return 0;
 }
 
 /*
- * comms_send_message - Serializes and transmits a full Message to the other platform.
- * @msg: Pointer to a fully populated Message struct.
- *
- * Returns: 0 on success, negative error code on failure.
+ * comms_negotiate_baud - Step the link up to the next rung of BAUD_LADDER.
+ * @note Linux only. Runs in the background from the receive path: each confirmed
+ *       rung requests the next one, until the top or until a step fails.
+ * @return 0 if a step was requested or the top was already reached, < 0 on error
  */
-static int comms_send_message(const struct Message *msg)
+int comms_negotiate_baud(void)
 {
-    if (!msg) {
-        return -1;
-    }
+#if IS_LINUX
+    uint8_t rung = baud_rung + 1;
 
-    /* Construct serialized message buffer */
-    uint8_t payload[MAX_PAYLOAD_SIZE + 6];
-    int len = comms_serialize_message(msg, payload);
-    if (len < 0) {
-        return -2; /* Serialization failed */
-    }
+    /* Skip rates this platform cannot set */
+    while (rung < BAUD_RUNGS && comms_baud_speed(baud_ladder[rung]) == B0)
+        rung++;
 
-    for (int i = 0; i < len; ++i) {
-        SERIAL_WRITE(payload[i]);
+    if (rung >= BAUD_RUNGS) {
+        baud_state = BAUD_IDLE;
+        return 0;
     }
 
-    return 0;
+    baud_target = rung;
+    baud_state = BAUD_WAIT_ACK;
+    baud_timer = GET_TIME_MS();
+    return comms_send_command(COMMAND_BAUD_REQ | rung);
+#else
+    return -1; /* The firmware only ever answers requests */
+#endif
 }
 
- /* 
-  * comms_calculate_checksum
-  * @param data Pointer to the data array
-  * @param length Length of the data array
-  * @return Calculated checksum
-  */
- static uint8_t comms_calculate_checksum(const uint8_t *data, uint8_t length)
- {
-     uint8_t checksum = 0;
-     for (uint8_t i = 0; i < length; i++) {
-         checksum ^= data[i];  /* Simple XOR checksum */
-     }
-     return checksum;
- }
-
- /* 
- * comms_validate_checksum
- *
- * Validates by performing XOR checksum on the message, excluding start and end chars,
- * but including the checksum field, such that an XOR on the aforementioned chars will yield 0
- * when the message is intact. 
- * @param data: the raw data of the entire message, including the start and end chars.
- * @param len:  the length of the message
- * @returns false if the message is corrupt.
- *          true if the message is valid.		
+/*
+ * comms_set_baud - Switch to a ladder rung immediately, without negotiation.
+ * @note Used to return to rung 0 when the other side is known to have reset.
+ * @return 0 on success, < 0 if the rung cannot be used
  */
-static bool comms_validate_checksum(const uint8_t *data, size_t len)
+int comms_set_baud(uint8_t rung)
 {
-    uint8_t result = 0;
-    for (size_t i = 1; i < len - 1; i++)
-        result ^= data[i];
+    baud_state = BAUD_IDLE;
+    baud_errors = 0;
 
-    return result == 0;
- }
- 
- /* 
-  * comms_serialize_message
-  * @param msg Pointer to the message structure
-  * @param out_buf Pointer to the output buffer
-  * @return < 0 on error, total length of serialized message on success(inluding framing and header bytes)
-  */
- static int comms_serialize_message(const struct Message *msg, uint8_t *out_buf)
-{
-    if (!msg || !out_buf)
+    if (comms_apply_baud(rung) < 0)
         return -1;
 
-    const uint8_t *payload = NULL;
-    size_t payload_len = msg->header.payload_length;
+    baud_rung = rung;
+    return 0;
+}
+
+/*
+ * comms_get_baud - Current link speed.
+ */
+uint32_t comms_get_baud(void)
+{
+    return baud_ladder[baud_rung];
+}
 
-    /* Start of frame */ 
-    out_buf[0] = MESSAGE_START;
+/*
+ * comms_handle_baud_message - Run the baud rate negotiation.
+ * @return true if the command was a baud negotiation command
+ */
+static bool comms_handle_baud_message(uint16_t command)
+{
+    uint8_t rung = command & COMMAND_BAUD_RUNG_MASK;
 
-    /* Header fields */
-    out_buf[1] = msg->header.recipient;
-    out_buf[2] = msg->header.message_type;
-    out_buf[3] = msg->header.payload_length;
-    out_buf[4] = 0;
-    /* Payload */
-    switch (msg->header.message_type) {
-    case MESSAGE_TYPE_COMMAND:
-        out_buf[5] = msg->body.payload_command.command & 0xFF;
-        out_buf[6] = (msg->body.payload_command.command >> 8) & 0xFF;
-        break;
+    switch (command & ~COMMAND_BAUD_RUNG_MASK) {
+#if IS_MCU
+    case COMMAND_BAUD_REQ:
+        if (rung >= BAUD_RUNGS)
+            return true;  /* Unknown rate, the request times out on the Linux side */
 
-    case MESSAGE_TYPE_RESPONSE:
-        if (payload_len != sizeof(struct ResponseBody)) return -2;
-        out_buf[5] = msg->body.payload_response.param & 0xFF;
-        out_buf[6] = (msg->body.payload_response.param >> 8) & 0xFF;
-        memcpy(&out_buf[7], &msg->body.payload_response.val, sizeof(uint64_t));
-        break;
+        comms_send_command(COMMAND_BAUD_ACK | rung);
 
-    case MESSAGE_TYPE_STATUS:
-        if (payload_len != sizeof(struct StatusBody)) return -2;
-        memcpy(&out_buf[5], &msg->body.payload_status, payload_len);
-        break;
+        if (rung == 0) {
+            comms_set_baud(0);  /* Rung 0 always works, no probe needed */
+            return true;
+        }
 
-    case MESSAGE_TYPE_ERROR:
-        out_buf[5] = msg->body.payload_error.error_code;
-        strncpy((char *)&out_buf[6], msg->body.payload_error.error_message, payload_len - 1);
-        break;
+        comms_apply_baud(rung);
+        baud_target = rung;
+        baud_state = BAUD_WAIT_PROBE;
+        baud_timer = GET_TIME_MS();
+        return true;
+
+    case COMMAND_BAUD_PROBE:
+        if (baud_state == BAUD_WAIT_PROBE && rung == baud_target) {
+            comms_send_command(COMMAND_BAUD_PROBE | rung);
+            baud_rung = rung;
+            baud_state = BAUD_IDLE;
+        }
+        return true;
+
+    case COMMAND_BAUD_ACK:
+        return true;
+#else /* IS_LINUX */
+    case COMMAND_BAUD_ACK:
+        if (baud_state == BAUD_WAIT_ACK && rung == baud_target) {
+            if (comms_apply_baud(rung) < 0) {
+                comms_set_baud(baud_rung);
+                return true;
+            }
+            baud_state = BAUD_WAIT_PROBE;
+            baud_timer = GET_TIME_MS();
+            comms_send_command(COMMAND_BAUD_PROBE | rung);
+        }
+        return true;
 
-    case MESSAGE_TYPE_DATA:
-        memcpy(&out_buf[5], msg->body.payload_raw, payload_len);
-        break;
+    case COMMAND_BAUD_PROBE:
+        if (baud_state == BAUD_WAIT_PROBE && rung == baud_target) {
+            baud_rung = rung;
+            baud_errors = 0;
+            comms_negotiate_baud();  /* On to the next rung */
+        }
+        return true;
 
+    case COMMAND_BAUD_REQ:
+        return true;
+#endif
     default:
-        return -3;
+        return false;
     }
+}
 
-    /* Calculate checksum for header + payload */
-    out_buf[4] = comms_calculate_checksum(&out_buf[1], 4 + payload_len);
-
-    out_buf[5 + payload_len] = MESSAGE_END;
+/*
+ * comms_baud_poll - Fall back when a baud step is not confirmed in time.
+ */
+static void comms_baud_poll(void)
+{
+    if (baud_state == BAUD_IDLE || GET_TIME_MS() - baud_timer <= BAUD_PROBE_TIMEOUT_MS)
+        return;
 
-    return 6 + payload_len;  /* Return total length of the message */
+    if (baud_state == BAUD_WAIT_PROBE)
+        comms_set_baud(baud_rung);  /* The new rate does not work, back to the last good one */
+    else
+        baud_state = BAUD_IDLE;     /* No answer, the firmware cannot change rates */
 }
 
+/*
+ * comms_tx_failures - Command frames dropped after MAX_RETRANSMITS resends without an ACK.
+ * @note Protocol v2 only, v1 frames are never acknowledged.
+ */
+uint16_t comms_tx_failures(void)
+{
+    return tx_failures;
+}
 
- /* 
-  * comms_deserialize_message
-  * @param in_buf Pointer to the input buffer
-  * @param length Length of the input buffer
-  * @param msg Pointer to the message structure to fill
-  * @return < 0 on error, 0 on success
-  */
- static int comms_deserialize_message(const uint8_t *in_buf, size_t length, struct Message *msg)
+/*
+ * comms_rx_fill - Drain all available serial bytes into the RX ring.
+ * @note On Linux this is a single readv() per call, covering both halves of the
+ *       ring when the free space wraps. On the MCU the bytes are copied out of the
+ *       Serial buffer in one block rather than one serial_read() per byte.
+ * @return number of bytes added to the ring, 0 if none, < 0 on read error
+ */
+static int comms_rx_fill(void)
 {
-    if (!in_buf || !msg || length < 6)
+    uint16_t space = RX_RING_SIZE - (uint16_t)(rx_ring_head - rx_ring_tail);
+    uint16_t start = rx_ring_head & RX_RING_MASK;
+    uint16_t first = RX_RING_SIZE - start;
+    int n;
+
+    if (space == 0)
+        return 0;  /* Ring full, parse before reading more */
+
+    if (first > space)
+        first = space;
+
+#if IS_MCU
+    int available = SERIAL_AVAILABLE();
+    if (available <= 0)
+        return 0;
+
+    if ((uint16_t)available < first)
+        first = available;
+
+    n = serial_read_bytes(&rx_ring[start], first);
+#else /* IS_LINUX */
+    struct iovec iov[2];
+
+    if (serial_fd == -1)
+        return 0;  /* Prevent reading from an invalid file descriptor */
+
+    iov[0].iov_base = &rx_ring[start];
+    iov[0].iov_len = first;
+    iov[1].iov_base = rx_ring;
+    iov[1].iov_len = space - first;
+
+    n = readv(serial_fd, iov, (space > first) ? 2 : 1);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        perror("Error reading from serial");
         return -1;
+    }
+#endif
 
-    if (in_buf[0] != MESSAGE_START || in_buf[length - 1] != MESSAGE_END)
-        return -2;
+    if (n > 0) {
+        comms_trace(TRACE_RX_BYTES, 0, &rx_ring[start], (n > first) ? first : n,
+                    rx_ring, (n > first) ? n - first : 0);
+        rx_ring_head += n;
+        last_byte_time = GET_TIME_MS();
+    }
 
-    msg->header.recipient = in_buf[1];
-    msg->header.message_type = in_buf[2];
-    msg->header.payload_length = in_buf[3];
-    msg->header.checksum = in_buf[4];
+    return n;
+}
 
-    if (length != 6 + msg->header.payload_length)
-        return -3; /* Message length does not match expected length */
+/*
+ * comms_parse_v1_byte - Feed one byte of a START/END framed message to the parser.
+ * @return > 0 when a message was decoded into msg, 0 if more bytes are needed, < 0 on error
+ */
+static int comms_parse_v1_byte(uint8_t b, struct Message *msg)
+{
+    rx_buffer[rx_index++] = b;
 
-    if (!comms_validate_checksum(in_buf,length))
-        return -4; /* Invalid checksum - corrupted message? */
+    if (rx_index == 4 && rx_buffer[3] > MAX_PAYLOAD_SIZE) {
+        receiving = false;
+        rx_index = 0;
+        return -5;  /* Buffer overflow */
+    }
 
-    const uint8_t *payload = &in_buf[5];
+    if (rx_index >= 6 && rx_index == 6 + rx_buffer[3]) {
+        uint8_t len = rx_index;
+
+        receiving = false;
+        rx_index = 0;
+
+        if (rx_buffer[len - 1] != MESSAGE_END)
+            return -6;  /* Invalid end byte */
+
+        /* Success or deserialization error */
+        return (comms_deserialize_message(rx_buffer, len, msg) == 0) ? 1 : -8;
+    }
+
+    return 0;
+}
+
+/*
+ * comms_is_log_text - Whether a run of bytes between v2 delimiters is log text.
+ * @note The second byte of a frame is its recipient, which is never printable, so a
+ *       frame is never mistaken for text.
+ */
+static bool comms_is_log_text(const uint8_t *data, uint8_t length)
+{
+    for (uint8_t i = 0; i < length; i++) {
+        if ((data[i] < 0x20 || data[i] > 0x7E) && data[i] != '\t' && data[i] != '\r' && data[i] != '\n')
+            return false;
+    }
+    return true;
+}
+
+/*
+ * comms_parse_cobs_byte - Feed one byte of a COBS encoded (v2) message to the parser.
+ * @note The delimiter always ends the frame, so a corrupt or truncated frame costs at
+ *       most the frame itself; the next frame is decoded normally.
+ * @return > 0 when a message was decoded into msg, 0 if more bytes are needed, < 0 on error
+ */
+static int comms_parse_cobs_byte(uint8_t b, struct Message *msg)
+{
+    if (b != MESSAGE_DELIMITER) {
+        if (rx_index >= BUFFER_SIZE) {
+            receiving = false;
+            rx_index = 0;
+            return -5;  /* Buffer overflow */
+        }
+        rx_buffer[rx_index++] = b;
+        return 0;
+    }
+
+    uint8_t len = rx_index;
+    receiving = false;
+    rx_index = 0;
+
+    /* Log text between frames, see comms_log_write(), is no error */
+    if (comms_is_log_text(rx_buffer, len))
+        return 0;
+
+    /* Decoding never grows the data, so it is done in place */
+    int decoded = comms_cobs_decode(rx_buffer, len, rx_buffer);
+    if (decoded < 0)
+        return -7;  /* Invalid encoding */
+
+    return (comms_decode_frame(rx_buffer, decoded, PROTOCOL_VERSION_2, msg) == 0) ? 1 : -8;
+}
+
+/*
+ * comms_handle_link_message - Consume protocol negotiation messages.
+ * @return true if the message was handled here and must not reach the application
+ */
+static bool comms_handle_link_message(const struct Message *msg)
+{
+    if (!MESSAGE_IS_LINK(msg))
+        return false;
+
+    if (msg->header.message_type == MESSAGE_TYPE_RESPONSE) {
+#if IS_LINUX
+        comms_clock_handle_pong(msg);
+#endif
+        return true;
+    }
+
+    uint16_t command = msg->body.payload_command.command;
+
+    if ((command & ~COMMAND_TIME_ID_MASK) == COMMAND_TIME_PING) {
+#if IS_MCU
+        struct Message pong;
+        pong.header.recipient = comms_recipient;
+        pong.header.message_type = MESSAGE_TYPE_RESPONSE;
+        pong.header.payload_length = sizeof(struct ResponseBody);
+        pong.body.payload_response.param = command;
+        pong.body.payload_response.val = comms_clock_us();
+        comms_send_message(&pong);
+#endif
+        return true;
+    }
+
+    switch (command) {
+#if IS_MCU
+    case COMMAND_PROTO_REQ_V2:
+        /* The requester may not speak v2 yet, so acknowledge with v1 framing */
+        protocol_version = PROTOCOL_VERSION_1;
+        comms_send_command(COMMAND_PROTO_ACK_V2);
+        protocol_version = PROTOCOL_VERSION_2;
+        comms_reset_sequence();
+        return true;
+#else /* IS_LINUX */
+    case COMMAND_PROTO_ACK_V2:
+        protocol_version = PROTOCOL_VERSION_2;
+        proto_negotiating = false;
+        comms_reset_sequence();
+        comms_negotiate_baud();
+        return true;
+#endif
+    default:
+        return comms_handle_baud_message(command);
+    }
+}
+
+/*
+ * comms_reset_sequence - Forget sequence state, the peer starts over after a (re)negotiation.
+ */
+static void comms_reset_sequence(void)
+{
+    rx_seq_valid = false;
+    rx_seen = 0;
+    for (uint8_t i = 0; i < MAX_UNACKED; i++)
+        unacked[i].used = false;
+    tx_batch_len = 0;
+    tx_batch_count = 0;
+}
+
+/*
+ * comms_send_ack - Acknowledge a command frame, or ask for a missing frame to be resent.
+ * @param type: MESSAGE_TYPE_ACK or MESSAGE_TYPE_NAK
+ * @param seq: Sequence number of the frame concerned
+ */
+static void comms_send_ack(uint8_t type, uint8_t seq)
+{
+    struct Message msg;
+    msg.header.recipient = comms_recipient;
+    msg.header.message_type = type;
+    msg.header.payload_length = sizeof(struct AckBody);
+    msg.body.payload_ack.seq = seq;
+
+    comms_send_message(&msg);
+}
+
+/*
+ * comms_track_unacked - Keep a command or event frame until the peer acknowledges it.
+ * @note When every slot is taken the oldest frame is given up on.
+ */
+static void comms_track_unacked(const struct Message *msg)
+{
+    struct UnackedFrame *slot = &unacked[0];
+
+    for (uint8_t i = 0; i < MAX_UNACKED; i++) {
+        if (!unacked[i].used) {
+            slot = &unacked[i];
+            break;
+        }
+        if ((uint32_t)(unacked[i].sent_time - slot->sent_time) > 0x7FFFFFFFUL)
+            slot = &unacked[i];
+    }
+
+    if (slot->used)
+        tx_failures++;
+
+    slot->sent_time = GET_TIME_MS();
+    slot->type = msg->header.message_type;
+    if (slot->type == MESSAGE_TYPE_EVENT)
+        slot->event = msg->body.payload_event;
+    else
+        slot->event.command = msg->body.payload_command.command;
+    slot->seq = msg->header.seq;
+    slot->retries = 0;
+    slot->used = true;
+}
+
+/*
+ * comms_resend - Transmit a tracked frame again, with its original sequence number.
+ */
+static void comms_resend(struct UnackedFrame *frame)
+{
+    struct Message msg;
+
+    if (comms_tx_queued(frame->seq)) {
+        frame->sent_time = GET_TIME_MS();  /* Overtaken by urgent frames, not lost */
+        return;
+    }
+
+    msg.header.recipient = comms_recipient;
+    msg.header.message_type = frame->type;
+    msg.header.seq = frame->seq;
+    if (frame->type == MESSAGE_TYPE_EVENT) {
+        msg.header.payload_length = sizeof(struct EventBody);
+        msg.body.payload_event = frame->event;
+    } else {
+        msg.header.payload_length = sizeof(struct CommandBody);
+        msg.body.payload_command.command = frame->event.command;
+    }
+
+    frame->sent_time = GET_TIME_MS();
+    frame->retries++;
+    comms_transmit(&msg);
+}
+
+/*
+ * comms_retransmit_poll - Resend command frames whose acknowledgement is overdue.
+ */
+static void comms_retransmit_poll(void)
+{
+    uint32_t now = GET_TIME_MS();
+
+    for (uint8_t i = 0; i < MAX_UNACKED; i++) {
+        if (!unacked[i].used || now - unacked[i].sent_time <= RETRANSMIT_TIMEOUT_MS)
+            continue;
+
+        if (unacked[i].retries >= MAX_RETRANSMITS) {
+            unacked[i].used = false;
+            tx_failures++;
+            continue;
+        }
+        comms_resend(&unacked[i]);
+    }
+}
+
+/*
+ * comms_handle_sequence - Sequence tracking and ACK/NAK handling for received v2 frames.
+ * @note A jump in the peer's sequence numbers means frames were lost in between, and
+ *       the most recent of those are NAKed straight away. The peer only keeps command
+ *       and event frames, so NAKs for anything else are ignored there. Frames older than
+ *       expected are resends, checked against a 64 frame window of what was already
+ *       received: a command or event we already delivered (our ACK was lost) is
+ *       acknowledged again and dropped.
+ * @return true if the message was handled here and must not reach the application
+ */
+static bool comms_handle_sequence(const struct Message *msg)
+{
+    uint8_t seq = msg->header.seq;
+    int8_t gap = rx_seq_valid ? (int8_t)(seq - rx_expected_seq) : 0;
+    bool duplicate = false;
+
+    if (gap >= 0) {
+        for (int8_t i = 1; i <= gap && i <= MAX_UNACKED; i++)
+            comms_send_ack(MESSAGE_TYPE_NAK, seq - i);
+
+        rx_seen = (gap >= 63) ? 1 : (rx_seen << (gap + 1)) | 1;
+        rx_expected_seq = seq + 1;
+        rx_seq_valid = true;
+    } else {
+        uint8_t age = -gap - 1;  /* Bit index of this frame in rx_seen */
+
+        duplicate = (age >= 64) || (rx_seen & ((uint64_t)1 << age));
+        if (!duplicate)
+            rx_seen |= (uint64_t)1 << age;
+    }
 
     switch (msg->header.message_type) {
+    case MESSAGE_TYPE_ACK:
+        for (uint8_t i = 0; i < MAX_UNACKED; i++) {
+            if (unacked[i].used && unacked[i].seq == msg->body.payload_ack.seq)
+                unacked[i].used = false;
+        }
+        return true;
+
+    case MESSAGE_TYPE_NAK:
+        for (uint8_t i = 0; i < MAX_UNACKED; i++) {
+            if (unacked[i].used && unacked[i].seq == msg->body.payload_ack.seq &&
+                unacked[i].retries < MAX_RETRANSMITS)
+                comms_resend(&unacked[i]);
+        }
+        return true;
+
     case MESSAGE_TYPE_COMMAND:
-        memcpy(&msg->body.payload_command, payload, sizeof(struct CommandBody));
-        break;
+        if (!COMMAND_IS_LINK(msg->body.payload_command.command))
+            comms_send_ack(MESSAGE_TYPE_ACK, seq);
+        return duplicate;
+
+    case MESSAGE_TYPE_EVENT:
+        comms_send_ack(MESSAGE_TYPE_ACK, seq);
+        return duplicate;
+
+    default:
+        return duplicate;
+    }
+}
+
+/*
+ * comms_rx_error - Called for every discarded frame.
+ * @param err: The parser's error code.
+ * @note While a v2 request is outstanding, errors usually mean the firmware is still
+ *       transmitting v2 frames from a previous session, so ask again (rate limited).
+ *       Both sides drop to rung 0 independently on an error burst; once one side has,
+ *       the other sees nothing but errors and follows.
+ */
+static void comms_rx_error(int err)
+{
+    uint32_t now = GET_TIME_MS();
+
+    comms_trace(TRACE_RX_ERROR, (uint8_t)-err, NULL, 0, NULL, 0);
+
+#if IS_LINUX
+    if (proto_negotiating && now - proto_req_time > PROTOCOL_RETRY_MS)
+        comms_negotiate_protocol();
+#endif
+
+    /* A burst of errors above rung 0 means the faster rate is not reliable here */
+    if (baud_rung != 0) {
+        if (now - baud_error_time > BAUD_ERROR_WINDOW_MS) {
+            baud_error_time = now;
+            baud_errors = 0;
+        }
+        if (++baud_errors >= BAUD_ERROR_LIMIT)
+            comms_set_baud(0);
+    }
+}
+
+/*
+ * comms_batch_next - Unpack the next message of a received batch.
+ * @note The batch was checked when its frame was decoded, each message in it is
+ *       still decoded, and sequenced, as if it had arrived in a frame of its own.
+ * @return > 0 when a message was decoded into msg, < 0 if it was malformed
+ */
+static int comms_batch_next(struct Message *msg)
+{
+    const uint8_t *sub = &rx_buffer[rx_batch_pos];
+
+    msg->header.recipient = rx_buffer[0];
+    msg->header.message_type = sub[0];
+    msg->header.payload_length = sub[1];
+    msg->header.seq = rx_batch_seq++;
+    msg->header.checksum = 0;
+    rx_batch_pos += 2 + sub[1];
+
+    return (comms_decode_payload(&sub[2], sub[1], PROTOCOL_VERSION_2, msg) == 0) ? 1 : -8;
+}
+
+/*
+ * comms_parse_next - Run the frame parser over buffered bytes until one frame completes.
+ * @param msg: Pointer to target Message structure.
+ * @note Parser state is kept between calls, so a frame may span several fills.
+ *       A run of bytes outside of a frame is reported once, not once per byte.
+ *       The first byte of a frame selects its framing: MESSAGE_START is always v1,
+ *       a COBS frame can never begin with it as its first byte is at most BUFFER_SIZE.
+ *       A batch is unpacked completely before the next byte is parsed.
+ * @returns:
+ *   > 0 = message successfully received and deserialized
+ *     0 = ring drained without completing a frame
+ *   < 0 = frame discarded, parser is ready for the next frame
+ */
+static int comms_parse_next(struct Message *msg)
+{
+    bool discarded = false;
+    int ret;
+
+    while (rx_batch_pos < rx_batch_end || rx_ring_tail != rx_ring_head) {
+        if (rx_batch_pos < rx_batch_end) {
+            ret = comms_batch_next(msg);
+        } else {
+            uint8_t b = rx_ring[rx_ring_tail++ & RX_RING_MASK];
+
+            if (!receiving) {
+                if (b == MESSAGE_START) {
+                    rx_framing = PROTOCOL_VERSION_1;
+                } else if (protocol_version == PROTOCOL_VERSION_2 && b != MESSAGE_DELIMITER) {
+                    rx_framing = PROTOCOL_VERSION_2;
+                } else {
+                    /* Idle delimiters between v2 frames are expected, anything else is not */
+                    if (protocol_version == PROTOCOL_VERSION_1 || b != MESSAGE_DELIMITER)
+                        discarded = true;
+                    continue;
+                }
+
+                rx_index = 0;
+                rx_buffer[rx_index++] = b;
+                receiving = true;
+
+                if (discarded) {
+                    comms_rx_error(-4);
+                    return -4;  /* Unexpected start byte */
+                }
+                continue;
+            }
+
+            if (rx_framing == PROTOCOL_VERSION_2)
+                ret = comms_parse_cobs_byte(b, msg);
+            else
+                ret = comms_parse_v1_byte(b, msg);
+
+            if (ret == 0)
+                continue;
+        }
+
+        if (ret > 0 && msg->header.message_type == MESSAGE_TYPE_BATCH) {
+            /* rx_buffer holds RECIPIENT TYPE LEN SEQ PAYLOAD, unpack it from there */
+            rx_batch_pos = 4;
+            rx_batch_end = 4 + msg->header.payload_length;
+            rx_batch_seq = msg->header.seq;
+            continue;
+        }
+
+        if (ret > 0)
+            comms_trace_message(TRACE_RX_FRAME, rx_framing, msg);
+
+        if (ret > 0 && ((rx_framing == PROTOCOL_VERSION_2 && comms_handle_sequence(msg)) ||
+                        comms_handle_link_message(msg) || comms_handle_bulk_message(msg)))
+            continue;
+
+        if (ret < 0)
+            comms_rx_error(ret);
+        return ret;
+    }
+
+    if (discarded) {
+        comms_rx_error(-4);
+        return -4;
+    }
+    return 0;
+}
+
+/*
+ * comms_rx_timed_out - Drop a partially received frame once the sender has gone quiet.
+ * @return true if a partial frame was discarded
+ */
+static bool comms_rx_timed_out(void)
+{
+    if (receiving && (GET_TIME_MS() - last_byte_time > MAX_MESSAGE_TIMEOUT_MS)) {
+        receiving = false;
+        rx_index = 0;
+        comms_trace(TRACE_RX_ERROR, 2, NULL, 0, NULL, 0);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * comms_receive_message - Read and deserialize one complete message from serial.
+ * @param msg: Pointer to target Message structure.
+ * @note Bytes beyond the returned frame stay buffered for the next call.
+ * @returns:
+ *   > 0 = message successfully received and deserialized
+ *     0 = no message available
+ *   < 0 = error occurred
+ */
+int comms_receive_message(struct Message *msg)
+{
+    if (!msg)
+        return -1;  /* Invalid argument */
+
+    comms_retransmit_poll();
+    comms_baud_poll();
+    comms_batch_poll();
+    comms_bulk_poll();
+    comms_clock_poll();
+    comms_tx_push();
+
+    int filled = comms_rx_fill();
+
+    if (rx_ring_tail == rx_ring_head && rx_batch_pos >= rx_batch_end) {
+        if (filled < 0)
+            return -3;  /* Read error */
+        if (comms_rx_timed_out())
+            return -2;  /* Timeout */
+        return 0;
+    }
+
+    return comms_parse_next(msg);
+}
+
+/*
+ * comms_receive_messages - Read and deserialize every complete message available.
+ * @param msgs: Array of Message structures to fill.
+ * @param max: Number of entries in msgs.
+ * @note Corrupt frames are skipped. Anything beyond max frames stays buffered.
+ * @returns:
+ *   >= 0 = number of messages written to msgs
+ *   < 0  = error occurred before any message was received
+ */
+int comms_receive_messages(struct Message *msgs, int max)
+{
+    int count = 0;
+
+    if (!msgs || max <= 0)
+        return -1;  /* Invalid argument */
+
+    comms_retransmit_poll();
+    comms_baud_poll();
+    comms_batch_poll();
+    comms_bulk_poll();
+    comms_clock_poll();
+    comms_tx_push();
+
+    int filled = comms_rx_fill();
+
+    while (count < max && (rx_ring_tail != rx_ring_head || rx_batch_pos < rx_batch_end)) {
+        if (comms_parse_next(&msgs[count]) > 0)
+            count++;
+    }
+
+    if (count == 0) {
+        if (filled < 0)
+            return -3;  /* Read error */
+        if (comms_rx_timed_out())
+            return -2;  /* Timeout */
+    }
+
+    return count;
+}
+
+#if IS_LINUX
+/*
+ * comms_tx_enqueue - Copy a serialized frame into the TX ring.
+ * @param frame: The serialized frame.
+ * @param len: Length of the frame in bytes.
+ * @return 0 on success, -1 if the ring cannot hold the frame
+ */
+static int comms_tx_enqueue(const uint8_t *frame, uint8_t len)
+{
+    uint16_t space = TX_RING_SIZE - (uint16_t)(tx_ring_head - tx_ring_tail);
+    uint16_t start = tx_ring_head & TX_RING_MASK;
+    uint16_t first = TX_RING_SIZE - start;
+
+    if (space < len || (uint8_t)(tx_frame_head - tx_frame_tail) >= TX_MAX_FRAMES)
+        return -1;
+
+    if (first > len)
+        first = len;
+
+    memcpy(&tx_ring[start], frame, first);
+    memcpy(tx_ring, frame + first, len - first);
+
+    tx_ring_head += len;
+    tx_frame_len[tx_frame_head++ & TX_FRAME_MASK] = len;
+
+    return 0;
+}
+
+/*
+ * comms_tx_consume - Release bytes the UART has accepted, retiring completed frames.
+ * @param count: Number of bytes written.
+ */
+static void comms_tx_consume(size_t count)
+{
+    tx_ring_tail += count;
+    tx_frame_sent += count;
+
+    while (tx_frame_tail != tx_frame_head &&
+           tx_frame_sent >= tx_frame_len[tx_frame_tail & TX_FRAME_MASK]) {
+        tx_frame_sent -= tx_frame_len[tx_frame_tail & TX_FRAME_MASK];
+        tx_frame_tail++;
+    }
+}
+#else /* IS_MCU */
+/* Reverse tx_queue[from, to) in place */
+static void comms_tx_reverse(uint16_t from, uint16_t to)
+{
+    while (from + 1 < to) {
+        uint8_t b = tx_queue[from];
+        tx_queue[from++] = tx_queue[--to];
+        tx_queue[to] = b;
+    }
+}
+
+/*
+ * comms_tx_remove - Take an entry out of the queue, closing the gap.
+ * @param index: Entry to remove
+ * @param offset: Its first byte in tx_queue
+ */
+static void comms_tx_remove(uint8_t index, uint16_t offset)
+{
+    uint8_t len = tx_entries[index].len;
+
+    memmove(&tx_queue[offset], &tx_queue[offset + len], tx_queue_len - offset - len);
+    tx_queue_len -= len;
+    memmove(&tx_entries[index], &tx_entries[index + 1],
+            (tx_entry_count - index - 1) * sizeof(tx_entries[0]));
+    tx_entry_count--;
+}
+
+/*
+ * comms_tx_drop - Drop the newest entry not yet started that matches.
+ * @param cls: The class to drop
+ * @param log: Drop log text rather than frames
+ * @return true if an entry was dropped
+ */
+static bool comms_tx_drop(uint8_t cls, bool log)
+{
+    uint16_t offset = tx_queue_len;
+
+    for (uint8_t i = tx_entry_count; i-- > 0;) {
+        offset -= tx_entries[i].len;
+        if (i == 0 && tx_started)
+            break;
+        if (tx_entries[i].cls == cls && (tx_entries[i].count == 0) == log) {
+            comms_tx_remove(i, offset);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * comms_tx_push - Move queued bytes to the Serial TX buffer without blocking.
+ * @note Called from every send and every comms_receive_message(s) in loop().
+ */
+static void comms_tx_push(void)
+{
+    while (tx_entry_count) {
+        if (tx_started == 0) {
+            uint8_t next = 0;
+            uint16_t offset = 0, next_offset = 0;
+
+            for (uint8_t i = 0; i < tx_entry_count; offset += tx_entries[i++].len) {
+                if (tx_entries[i].cls < tx_entries[next].cls) {
+                    next = i;
+                    next_offset = offset;
+                }
+            }
+            if (tx_entries[next].cls != TX_URGENT && serial_tx_pending() > 0)
+                return;  /* Keep the Serial TX buffer free for urgent frames */
+
+            if (next > 0) {
+                /* Rotate the frame in front of the ones it overtakes */
+                struct TxEntry entry = tx_entries[next];
+                uint16_t end = next_offset + entry.len;
+
+                comms_tx_reverse(0, next_offset);
+                comms_tx_reverse(next_offset, end);
+                comms_tx_reverse(0, end);
+                memmove(&tx_entries[1], &tx_entries[0], next * sizeof(tx_entries[0]));
+                tx_entries[0] = entry;
+            }
+        }
+
+        size_t room = serial_tx_room();
+        uint8_t left = tx_entries[0].len - tx_started;
+
+        if (room == 0)
+            return;
+        if (room > left)
+            room = left;
+
+        SERIAL_WRITE_BUF(&tx_queue[tx_started], room);
+        tx_started += room;
+
+        if (tx_started < tx_entries[0].len)
+            return;
+
+        tx_started = 0;
+        comms_tx_remove(0, 0);
+    }
+}
+
+/*
+ * comms_tx_schedule - Queue a frame for comms_tx_push().
+ * @note A status supersedes the one still queued. Without room log text is dropped first,
+ *       then a status to make room for a higher class. Otherwise this waits for the UART.
+ */
+static void comms_tx_schedule(const uint8_t *frame, uint8_t len, uint8_t cls, uint8_t seq, uint8_t count)
+{
+    if (cls == TX_STATUS)
+        comms_tx_drop(TX_STATUS, false);
+
+    while (tx_entry_count >= TX_QUEUE_FRAMES || tx_queue_len + len > TX_QUEUE_SIZE) {
+        if (comms_tx_drop(TX_BULK, true))
+            continue;
+        if (cls < TX_STATUS && comms_tx_drop(TX_STATUS, false))
+            continue;
+        comms_tx_push();
+    }
+
+    memcpy(&tx_queue[tx_queue_len], frame, len);
+    tx_queue_len += len;
+    tx_entries[tx_entry_count++] = (struct TxEntry){ len, cls, seq, count };
+
+    comms_tx_push();
+}
+
+/*
+ * comms_tx_queued - Whether the message with a sequence number is still in the queue.
+ */
+static bool comms_tx_queued(uint8_t seq)
+{
+    for (uint8_t i = 0; i < tx_entry_count; i++) {
+        if ((uint8_t)(seq - tx_entries[i].seq) < tx_entries[i].count)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * comms_log_write - Queue log text, sent between frames at the lowest priority.
+ * @note Never waits, text that does not fit in the queue is dropped.
+ *       In v2 each entry ends with a delimiter, else Linux would take the text and the
+ *       frame after it for one frame. It skips the text, see comms_is_log_text().
+ */
+void comms_log_write(const uint8_t *data, size_t len)
+{
+    uint8_t end = (protocol_version == PROTOCOL_VERSION_2) ? 1 : 0;
+
+    while (len > 0) {
+        struct TxEntry *last = tx_entry_count ? &tx_entries[tx_entry_count - 1] : NULL;
+        size_t n;
+
+        /* Appended to the log text still waiting, if there is any */
+        if (!last || last->count != 0 || last->len + end >= TX_LOG_CHUNK || (tx_entry_count == 1 && tx_started)) {
+            if (tx_entry_count >= TX_QUEUE_FRAMES || tx_queue_len + end >= TX_QUEUE_SIZE)
+                break;
+            last = &tx_entries[tx_entry_count++];
+            *last = (struct TxEntry){ 0, TX_BULK, 0, 0 };
+        } else if (tx_queue[tx_queue_len - 1] == MESSAGE_DELIMITER) {
+            /* The delimiter moves behind the new text */
+            tx_queue_len--;
+            last->len--;
+        }
+        if (tx_queue_len + end > TX_QUEUE_SIZE)
+            break;
+
+        n = TX_QUEUE_SIZE - tx_queue_len - end;
+        if (n > (size_t)(TX_LOG_CHUNK - end - last->len))
+            n = TX_LOG_CHUNK - end - last->len;
+        if (n > len)
+            n = len;
+
+        memcpy(&tx_queue[tx_queue_len], data, n);
+        tx_queue_len += n;
+        last->len += n;
+        data += n;
+        len -= n;
+
+        if (end) {
+            tx_queue[tx_queue_len++] = MESSAGE_DELIMITER;
+            last->len++;
+        }
+        if (n == 0)
+            break;  /* The queue is full */
+    }
+
+    comms_tx_push();
+}
+#endif
+
+/*
+ * comms_tx_flush - Write as much of the TX queue as the UART will take without blocking.
+ * @note On Linux every queued frame is handed to a single writev(), covering both halves
+ *       of the ring when it wraps. Partial writes and EAGAIN leave the remainder queued
+ *       for the next call. On the MCU the TX scheduler moves what the Serial TX buffer
+ *       has room for, see comms_tx_push().
+ *       A pending batch is sent first, without waiting for the end of its window.
+ * @return bytes still queued, or < 0 on write error
+ */
+int comms_tx_flush(void)
+{
+    if (comms_batch_flush() < 0)
+        return -1;
+
+#if IS_LINUX
+    while (tx_ring_tail != tx_ring_head) {
+        uint16_t used = tx_ring_head - tx_ring_tail;
+        uint16_t start = tx_ring_tail & TX_RING_MASK;
+        uint16_t first = TX_RING_SIZE - start;
+        struct iovec iov[2];
+        ssize_t n;
+
+        if (serial_fd == -1)
+            return -1;
+
+        if (first > used)
+            first = used;
+
+        iov[0].iov_base = &tx_ring[start];
+        iov[0].iov_len = first;
+        iov[1].iov_base = tx_ring;
+        iov[1].iov_len = used - first;
+
+        n = writev(serial_fd, iov, (used > first) ? 2 : 1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;  /* UART is full, retry on the next flush */
+            perror("Error writing to serial");
+            return -1;
+        }
+        if (n == 0)
+            break;
+
+        comms_trace(TRACE_TX_BYTES, 0, &tx_ring[start], (n > first) ? first : n,
+                    tx_ring, (n > first) ? n - first : 0);
+        comms_tx_consume(n);
+    }
+#else /* IS_MCU */
+    comms_tx_push();
+#endif
+
+    return (int)comms_tx_pending();
+}
+
+/*
+ * comms_tx_pending - Bytes queued for transmission but not yet accepted by the UART.
+ */
+size_t comms_tx_pending(void)
+{
+#if IS_LINUX
+    return (uint16_t)(tx_ring_head - tx_ring_tail);
+#else
+    return tx_queue_len - tx_started + serial_tx_pending();
+#endif
+}
+
+/*
+ * comms_tx_queue_depth - Frames queued for transmission, including a partially written one.
+ * @note Callers can use this for backpressure, e.g. skipping a periodic message while
+ *       the link is still busy with the previous one.
+ */
+unsigned int comms_tx_queue_depth(void)
+{
+#if IS_LINUX
+    return (uint8_t)(tx_frame_head - tx_frame_tail);
+#else
+    if (tx_entry_count)
+        return tx_entry_count;
+    return serial_tx_pending() ? 1 : 0;
+#endif
+}
+
+/*
+ * comms_send_message - Serializes and queues a full Message for the other platform.
+ * @msg: Pointer to a fully populated Message struct, the sequence number is assigned here.
+ * @note In protocol v2 command frames are kept for retransmission until acknowledged.
+ *
+ * Returns: 0 on success, negative error code on failure.
+ */
+static int comms_send_message(struct Message *msg)
+{
+    if (!msg) {
+        return -1;
+    }
+
+    msg->header.seq = tx_seq++;
+
+    if (protocol_version == PROTOCOL_VERSION_2 &&
+        ((msg->header.message_type == MESSAGE_TYPE_COMMAND &&
+          !COMMAND_IS_LINK(msg->body.payload_command.command)) ||
+         msg->header.message_type == MESSAGE_TYPE_EVENT))
+        comms_track_unacked(msg);
+
+    return comms_transmit(msg);
+}
+
+/*
+ * comms_transmit - Serialize a Message and hand it to the UART.
+ * @msg: Pointer to a fully populated Message struct, including its sequence number.
+ * @note In protocol v2 the message joins the pending batch, except link messages which
+ *       must go out at the current rate straight away, and bulk transfer messages: chunks
+ *       fill a frame of their own and credits must not wait. Anything sent on its own goes
+ *       after what is already batched.
+ *
+ * Returns: 0 on success, negative error code on failure.
+ */
+static int comms_transmit(const struct Message *msg)
+{
+    comms_trace_message(TRACE_TX_FRAME, protocol_version, msg);
+
+    if (protocol_version == PROTOCOL_VERSION_2 && msg->header.message_type != MESSAGE_TYPE_DATA &&
+        !MESSAGE_IS_LINK(msg)) {
+        int ret = comms_batch_add(msg);
+        if (ret != -5)
+            return ret;
+    }
+
+    if (comms_batch_flush() < 0)
+        return -4; /* Write error */
+
+    /* Construct serialized message buffer */
+    uint8_t payload[BUFFER_SIZE];
+    int len = comms_serialize_message(msg, payload);
+    if (len < 0) {
+        return -2; /* Serialization failed */
+    }
+
+    return comms_write_frame(payload, len, comms_tx_class(msg), msg->header.seq, 1);
+}
+
+/*
+ * comms_tx_class - The TxClass a message is sent with.
+ */
+static uint8_t comms_tx_class(const struct Message *msg)
+{
+    switch (msg->header.message_type) {
+    case MESSAGE_TYPE_COMMAND:
+    case MESSAGE_TYPE_ACK:
+    case MESSAGE_TYPE_NAK:
+        return TX_URGENT;
+    case MESSAGE_TYPE_RESPONSE:
+        return MESSAGE_IS_LINK(msg) ? TX_URGENT : TX_EVENT;
+    case MESSAGE_TYPE_EVENT:
+    case MESSAGE_TYPE_REPLY:
+    case MESSAGE_TYPE_ERROR_CODE:
+        return TX_EVENT;
+    case MESSAGE_TYPE_STATUS:
+        return TX_STATUS;
+    default:
+        return TX_BULK;
+    }
+}
+
+/*
+ * comms_write_frame - Hand a serialized frame to the UART.
+ * @param cls: TxClass of the frame, the highest of its messages
+ * @param seq: Sequence number of its first message
+ * @param count: Messages in the frame
+ * @note The frame is written immediately if the UART can take it, otherwise it
+ *       stays queued and goes out with the next comms_tx_flush(). On the MCU it goes
+ *       through the TX scheduler, which picks the order by class.
+ *
+ * Returns: 0 on success, negative error code on failure.
+ */
+static int comms_write_frame(const uint8_t *frame, uint8_t len, uint8_t cls, uint8_t seq, uint8_t count)
+{
+#if IS_MCU
+    comms_tx_schedule(frame, len, cls, seq, count);
+#else /* IS_LINUX */
+    (void)cls;
+    (void)seq;
+    (void)count;
+
+    if (comms_tx_enqueue(frame, len) < 0) {
+        /* Make room by pushing out what the UART will take, then try once more */
+        if (comms_tx_flush() < 0 || comms_tx_enqueue(frame, len) < 0)
+            return -3; /* TX queue full */
+    }
+
+    if (comms_tx_flush() < 0)
+        return -4; /* Write error */
+#endif
+
+    return 0;
+}
+
+/*
+ * comms_batch_add - Add a v2 message to the pending batch.
+ * @msg: Pointer to a fully populated Message struct, including its sequence number.
+ * @note Only consecutive sequence numbers can share a frame, and a full batch is sent
+ *       to make room, so either ends the current batch early.
+ *
+ * Returns: 0 on success, -5 if the message is too large to ever be batched,
+ *          other negative error codes on failure.
+ */
+static int comms_batch_add(const struct Message *msg)
+{
+    uint8_t payload[MAX_PAYLOAD_SIZE];
+    int len = comms_encode_payload(msg, PROTOCOL_VERSION_2, payload);
+    if (len < 0)
+        return -2; /* Serialization failed */
+
+    if (tx_batch_count && (tx_batch_len + 2 + len > TX_BATCH_SIZE ||
+                           (uint8_t)(tx_batch_seq + tx_batch_count) != msg->header.seq)) {
+        if (comms_batch_flush() < 0)
+            return -4; /* Write error */
+    }
+
+    if (2 + len > TX_BATCH_SIZE)
+        return -5;
+
+    if (tx_batch_count == 0) {
+        tx_batch_seq = msg->header.seq;
+        tx_batch_time = GET_TIME_MS();
+        tx_batch_class = TX_BULK;
+    }
+    if (comms_tx_class(msg) < tx_batch_class)
+        tx_batch_class = comms_tx_class(msg);
+
+    uint8_t *sub = &tx_batch[5 + tx_batch_len];
+    sub[0] = msg->header.message_type;
+    sub[1] = len;
+    memcpy(&sub[2], payload, len);
+
+    tx_batch_len += 2 + len;
+    tx_batch_count++;
+    return 0;
+}
+
+/*
+ * comms_batch_flush - Send the pending batch now.
+ * @note A lone message goes out in a frame of its own, without the batch overhead.
+ *       Batches are v2 only, one left over from before a renegotiation is dropped.
+ *
+ * Returns: 0 on success, negative error code on failure.
+ */
+static int comms_batch_flush(void)
+{
+    uint8_t count = tx_batch_count;
+    int len;
+
+    if (count == 0)
+        return 0;
+
+    tx_batch_count = 0;
+    if (protocol_version != PROTOCOL_VERSION_2)
+        return 0;
+
+    if (count == 1) {
+        uint8_t type = tx_batch[5];
+        uint8_t payload_len = tx_batch[6];
+
+        memmove(&tx_batch[5], &tx_batch[7], payload_len);
+        len = comms_frame_payload(tx_batch, comms_recipient, type, tx_batch_seq, payload_len);
+    } else {
+        len = comms_frame_payload(tx_batch, comms_recipient, MESSAGE_TYPE_BATCH, tx_batch_seq, tx_batch_len);
+    }
+    tx_batch_len = 0;
+
+    return comms_write_frame(tx_batch, len, tx_batch_class, tx_batch_seq, count);
+}
+
+/*
+ * comms_batch_poll - Send the pending batch once its window has passed.
+ */
+static void comms_batch_poll(void)
+{
+    if (tx_batch_count && GET_TIME_MS() - tx_batch_time >= BATCH_WINDOW_MS)
+        comms_batch_flush();
+}
+
+/*
+ * comms_bulk_send_op - Send a bulk transfer message.
+ * @param payload: OP XFER and the fields of the operation.
+ */
+static int comms_bulk_send_op(const uint8_t *payload, uint8_t len)
+{
+    struct Message msg;
+    msg.header.recipient = comms_recipient;
+    msg.header.message_type = MESSAGE_TYPE_DATA;
+    msg.header.payload_length = len;
+    memcpy(msg.body.payload_raw, payload, len);
+
+    return comms_send_message(&msg);
+}
+
+/*
+ * comms_bulk_tx_idle - Whether the UART has room for another chunk.
+ * @note On Linux the kernel's tty buffer counts as well, a chunk is queued while the
+ *       previous one goes out so the line never idles between them.
+ */
+static bool comms_bulk_tx_idle(void)
+{
+#if IS_MCU
+    return comms_tx_pending() == 0;
+#else /* IS_LINUX */
+    int queued = 0;
+
+    if (comms_tx_queue_depth() != 0)
+        return false;
+    return ioctl(serial_fd, TIOCOUTQ, &queued) < 0 || queued < FRAME_LEN_V2(MAX_PAYLOAD_SIZE);
+#endif
+}
+
+/*
+ * comms_bulk_tx_end - End the transfer being sent.
+ * @param result: 0 if the receiver has the whole object, otherwise a BULK_E_*.
+ * @param notify: Tell the receiver the sender gave up.
+ */
+static void comms_bulk_tx_end(uint8_t result, bool notify)
+{
+    if (notify) {
+        uint8_t payload[3] = { BULK_OP_CANCEL, bulk_tx_xfer, result };
+        comms_bulk_send_op(payload, sizeof(payload));
+    }
+    bulk_tx_state = result ? -(int8_t)result : BULK_IDLE;
+}
+
+/*
+ * comms_bulk_send - Start sending an object, it goes out from the receive path.
+ * @param object: BULK_OBJECT_*
+ * @param size: Size of the object in bytes.
+ * @param read: Source of the object's data, called until the transfer ends.
+ * @return 0 on success, -1 if a transfer is already in progress
+ */
+int comms_bulk_send(uint8_t object, uint32_t size, comms_bulk_read_t read)
+{
+    if (bulk_tx_state > BULK_IDLE || !read)
+        return -1;
+
+    /* Start from the clock, a restarted sender must not reuse the ID it last used */
+    bulk_tx_xfer = bulk_tx_xfer ? bulk_tx_xfer + 1 : (uint8_t)GET_TIME_MS();
+    if (bulk_tx_xfer == 0)
+        bulk_tx_xfer = 1;
+
+    bulk_tx_read = read;
+    bulk_tx_object = object;
+    bulk_tx_size = size;
+    bulk_tx_acked = bulk_tx_next = bulk_tx_limit = 0;
+    bulk_tx_retries = 0;
+    bulk_tx_time = GET_TIME_MS();
+    bulk_tx_state = BULK_OPENING;
+
+    uint8_t payload[7] = { BULK_OP_OPEN, bulk_tx_xfer, object };
+    proto_put_le32(&payload[3], size);
+    return (comms_bulk_send_op(payload, sizeof(payload)) < 0) ? -1 : 0;
+}
+
+/*
+ * comms_bulk_send_status - Progress of the object being sent.
+ * @param offset: Set to the bytes the receiver has, if not NULL.
+ * @return > 0 while sending, 0 once the receiver has the object or before the first
+ *         transfer, otherwise the negated BULK_E_* the transfer failed with
+ */
+int comms_bulk_send_status(uint32_t *offset)
+{
+    if (offset)
+        *offset = bulk_tx_acked;
+    return bulk_tx_state;
+}
+
+/*
+ * comms_bulk_cancel - Give up on the object being sent.
+ */
+void comms_bulk_cancel(void)
+{
+    if (bulk_tx_state > BULK_IDLE)
+        comms_bulk_tx_end(BULK_E_CANCELLED, true);
+}
+
+/*
+ * comms_bulk_set_sink - Receive objects with sink, NULL refuses every object.
+ * @note The sink must stay valid until it is replaced.
+ */
+void comms_bulk_set_sink(const struct BulkSink *sink)
+{
+    if (bulk_rx_state == BULK_SENDING && bulk_sink)
+        bulk_sink->close(BULK_E_CANCELLED);
+    bulk_rx_state = BULK_IDLE;
+    bulk_sink = sink;
+}
+
+/*
+ * comms_bulk_poll - Send chunks within the credit while the UART has room, and go back
+ * to the last credit when the receiver has gone quiet.
+ */
+static void comms_bulk_poll(void)
+{
+    uint8_t payload[MAX_PAYLOAD_SIZE];
+
+    if (bulk_tx_state <= BULK_IDLE)
+        return;
+
+    if (GET_TIME_MS() - bulk_tx_time > BULK_RETRY_MS) {
+        if (++bulk_tx_retries > BULK_MAX_RETRIES) {
+            comms_bulk_tx_end(BULK_E_TIMEOUT, true);
+            return;
+        }
+        bulk_tx_time = GET_TIME_MS();
+
+        if (bulk_tx_state == BULK_OPENING) {
+            payload[0] = BULK_OP_OPEN;
+            payload[1] = bulk_tx_xfer;
+            payload[2] = bulk_tx_object;
+            proto_put_le32(&payload[3], bulk_tx_size);
+            comms_bulk_send_op(payload, 7);
+            return;
+        }
+        bulk_tx_next = bulk_tx_acked;
+    }
+
+    while (bulk_tx_state == BULK_SENDING && bulk_tx_next < bulk_tx_limit && comms_bulk_tx_idle()) {
+        uint32_t left = bulk_tx_limit - bulk_tx_next;
+        uint8_t len = (left < BULK_CHUNK_MAX) ? left : BULK_CHUNK_MAX;
+
+        payload[0] = BULK_OP_CHUNK;
+        payload[1] = bulk_tx_xfer;
+        proto_put_le32(&payload[2], bulk_tx_next);
+        if (bulk_tx_read(bulk_tx_next, &payload[BULK_CHUNK_HEADER_LEN], len) < 0) {
+            comms_bulk_tx_end(BULK_E_IO, true);
+            return;
+        }
+        if (comms_bulk_send_op(payload, BULK_CHUNK_HEADER_LEN + len) < 0)
+            return;  /* UART full after all, try again on the next poll */
+        bulk_tx_next += len;
+    }
+}
+
+/*
+ * comms_bulk_credit - Tell the sender what has arrived and how much more may follow.
+ * @param op: BULK_OP_CREDIT, or BULK_OP_RESEND to have the sender go back to the offset.
+ */
+static void comms_bulk_credit(uint8_t op)
+{
+    uint16_t window = (bulk_rx_state == BULK_DONE) ? 0 : bulk_sink->window;
+    uint8_t payload[8] = { op, bulk_rx_xfer };
+
+    proto_put_le32(&payload[2], bulk_rx_offset);
+    proto_put_le16(&payload[6], window);
+    bulk_rx_credited = bulk_rx_offset;
+    comms_bulk_send_op(payload, sizeof(payload));
+}
+
+/*
+ * comms_bulk_rx_end - End the transfer being received.
+ * @param result: 0 if the object is complete, otherwise a BULK_E_*.
+ * @param notify: Tell the sender the receiver gave up.
+ */
+static void comms_bulk_rx_end(uint8_t result, bool notify)
+{
+    if (notify) {
+        uint8_t payload[3] = { BULK_OP_ABORT, bulk_rx_xfer, result };
+        comms_bulk_send_op(payload, sizeof(payload));
+    }
+    bulk_rx_state = result ? BULK_IDLE : BULK_DONE;
+    bulk_sink->close(result);
+}
+
+/*
+ * comms_bulk_receive_open - Handle an offered object.
+ * @note An OPEN for the transfer already open or done was resent because the credit
+ *       answering it was lost. Any other OPEN replaces the transfer being received,
+ *       the sink decides whether the new one resumes it.
+ */
+static void comms_bulk_receive_open(const uint8_t *payload, uint8_t len)
+{
+    uint8_t xfer = payload[1];
+
+    if (len < 7)
+        return;
+
+    if (bulk_rx_state != BULK_IDLE && xfer == bulk_rx_xfer) {
+        comms_bulk_credit(BULK_OP_CREDIT);
+        return;
+    }
+
+    if (bulk_rx_state == BULK_SENDING)
+        bulk_sink->close(BULK_E_CANCELLED);
+    bulk_rx_state = BULK_IDLE;
+    bulk_rx_xfer = xfer;
+
+    if (!bulk_sink) {
+        uint8_t refuse[3] = { BULK_OP_ABORT, xfer, BULK_E_NO_SINK };
+        comms_bulk_send_op(refuse, sizeof(refuse));
+        return;
+    }
+
+    int32_t offset = bulk_sink->open(payload[2], proto_get_le32(&payload[3]));
+    if (offset < 0) {
+        uint8_t refuse[3] = { BULK_OP_ABORT, xfer, (uint8_t)-offset };
+        comms_bulk_send_op(refuse, sizeof(refuse));
+        return;
+    }
+
+    bulk_rx_size = proto_get_le32(&payload[3]);
+    bulk_rx_offset = ((uint32_t)offset < bulk_rx_size) ? (uint32_t)offset : bulk_rx_size;
+    bulk_rx_resent = false;
+    bulk_rx_state = BULK_SENDING;
+
+    if (bulk_rx_offset == bulk_rx_size)
+        comms_bulk_rx_end(0, false);
+    comms_bulk_credit(BULK_OP_CREDIT);
+}
+
+/*
+ * comms_bulk_receive_chunk - Write a chunk that follows on from what has arrived.
+ * @note Anything else means a chunk was lost, or the sender went back further than it
+ *       had to, and the sender is asked to resume from what has arrived. Once, as the
+ *       rest of its window is on the way, and again only if it keeps going after
+ *       half a retry interval. After the last chunk the final credit is repeated instead.
+ */
+static void comms_bulk_receive_chunk(const uint8_t *payload, uint8_t len)
+{
+    if (len < BULK_CHUNK_HEADER_LEN || payload[1] != bulk_rx_xfer || bulk_rx_state == BULK_IDLE)
+        return;
+
+    uint32_t offset = proto_get_le32(&payload[2]);
+    uint8_t count = len - BULK_CHUNK_HEADER_LEN;
+
+    if (bulk_rx_state == BULK_DONE || offset != bulk_rx_offset ||
+        count > bulk_rx_size - bulk_rx_offset) {
+        if (!bulk_rx_resent || GET_TIME_MS() - bulk_rx_resend_time >= BULK_RETRY_MS / 2) {
+            bulk_rx_resent = true;
+            bulk_rx_resend_time = GET_TIME_MS();
+            comms_bulk_credit((bulk_rx_state == BULK_DONE) ? BULK_OP_CREDIT : BULK_OP_RESEND);
+        }
+        return;
+    }
 
-    case MESSAGE_TYPE_RESPONSE:
-        memcpy(&msg->body.payload_response, payload, sizeof(struct ResponseBody));
-        break;    
+    if (bulk_sink->write(offset, &payload[BULK_CHUNK_HEADER_LEN], count) < 0) {
+        comms_bulk_rx_end(BULK_E_IO, true);
+        return;
+    }
+    bulk_rx_offset += count;
+    bulk_rx_resent = false;
+
+    if (bulk_rx_offset == bulk_rx_size) {
+        comms_bulk_rx_end(0, false);
+        comms_bulk_credit(BULK_OP_CREDIT);
+    } else if (bulk_rx_offset - bulk_rx_credited >= bulk_sink->window / 2) {
+        comms_bulk_credit(BULK_OP_CREDIT);
+    }
+}
 
-    case MESSAGE_TYPE_STATUS:
-        memcpy(&msg->body.payload_status, payload, sizeof(struct StatusBody));
-        break;
+/*
+ * comms_bulk_receive_credit - Move the sender's window on.
+ * @param resend: The receiver missed a chunk, go back to the offset.
+ */
+static void comms_bulk_receive_credit(const uint8_t *payload, uint8_t len, bool resend)
+{
+    if (len < 8 || payload[1] != bulk_tx_xfer || bulk_tx_state <= BULK_IDLE)
+        return;
 
-    case MESSAGE_TYPE_ERROR:
-        msg->body.payload_error.error_code = payload[0];
-        strncpy(msg->body.payload_error.error_message, (char *)&payload[1], msg->header.payload_length - 1);
-        msg->body.payload_error.error_message[msg->header.payload_length - 1] = '\0';
-        break;
+    uint32_t offset = proto_get_le32(&payload[2]);
+    uint32_t limit = offset + proto_get_le16(&payload[6]);
+
+    if (offset > bulk_tx_size)
+        return;
 
-    case MESSAGE_TYPE_DATA:
-        memcpy(msg->body.payload_raw, payload, msg->header.payload_length);
+    if (offset > bulk_tx_acked || bulk_tx_state == BULK_OPENING) {
+        bulk_tx_acked = offset;
+        bulk_tx_retries = 0;
+        bulk_tx_time = GET_TIME_MS();
+        bulk_tx_state = BULK_SENDING;
+    }
+
+    if (bulk_tx_next < bulk_tx_acked || (resend && offset == bulk_tx_acked))
+        bulk_tx_next = bulk_tx_acked;
+    bulk_tx_limit = (limit < bulk_tx_size) ? limit : bulk_tx_size;
+
+    if (bulk_tx_acked == bulk_tx_size)
+        comms_bulk_tx_end(0, false);
+}
+
+/*
+ * comms_handle_bulk_message - Run the bulk transfer protocol.
+ * @return true if the message was a bulk transfer message, they never reach the application
+ */
+static bool comms_handle_bulk_message(const struct Message *msg)
+{
+    const uint8_t *payload = msg->body.payload_raw;
+    uint8_t len = msg->header.payload_length;
+
+    if (msg->header.message_type != MESSAGE_TYPE_DATA)
+        return false;
+    if (len < 3)
+        return true;
+
+    switch (payload[0]) {
+    case BULK_OP_OPEN:
+        comms_bulk_receive_open(payload, len);
+        break;
+    case BULK_OP_CHUNK:
+        comms_bulk_receive_chunk(payload, len);
+        break;
+    case BULK_OP_CANCEL:
+        if (payload[1] == bulk_rx_xfer && bulk_rx_state == BULK_SENDING)
+            comms_bulk_rx_end(payload[2] ? payload[2] : BULK_E_CANCELLED, false);
         break;
+    case BULK_OP_CREDIT:
+    case BULK_OP_RESEND:
+        comms_bulk_receive_credit(payload, len, payload[0] == BULK_OP_RESEND);
+        break;
+    case BULK_OP_ABORT:
+        if (payload[1] == bulk_tx_xfer && bulk_tx_state > BULK_IDLE)
+            comms_bulk_tx_end(payload[2] ? payload[2] : BULK_E_CANCELLED, false);
+        break;
+    }
+    return true;
+}
 
-    default:
-        return -5;
+/*
+ * comms_clock_us - This side's clock in microseconds. The firmware's is the one its
+ * COMMAND_TIME_PING answers carry, and the one to timestamp events with.
+ * @note On the MCU micros() wraps every 71 minutes and is extended here, so this must run
+ *       at least that often, which comms_receive_message() sees to. Not from interrupts.
+ */
+uint64_t comms_clock_us(void)
+{
+#if IS_MCU
+    uint32_t now = GET_TIME_US();
+
+    if (now < clock_last_us)
+        clock_high++;
+    clock_last_us = now;
+    return ((uint64_t)clock_high << 32) | now;
+#else /* IS_LINUX */
+    return GET_TIME_NS() / 1000;
+#endif
+}
+
+#if IS_LINUX
+/*
+ * comms_line_ns - Time a message takes on the line at the current rate, 10 bits a byte.
+ */
+static int64_t comms_line_ns(const struct Message *msg)
+{
+    uint8_t frame[BUFFER_SIZE];
+    int len = comms_serialize_message(msg, frame);
+
+    return len > 0 ? (int64_t)len * 10 * 1000000000 / comms_get_baud() : 0;
+}
+
+/*
+ * comms_clock_fit - Fit the firmware clock against CLOCK_MONOTONIC by least squares.
+ * @note Uses the samples taken within CLOCK_WINDOW_S of the newest, with at most twice
+ *       the smallest delay among them. x is in us and y in ns beyond x * 1000, both
+ *       relative to the newest sample, which keeps the sums well inside 64 bits.
+ */
+static void comms_clock_fit(void)
+{
+    const struct ClockSample *last = &clock_samples[(clock_next + CLOCK_SAMPLES - 1) % CLOCK_SAMPLES];
+    int64_t xs[CLOCK_SAMPLES], ys[CLOCK_SAMPLES];
+    int64_t min_delay = INT64_MAX, sum_x = 0, sum_y = 0, sxx = 0, sxy = 0, mean_x, mean_y, drift;
+    uint8_t i, n = 0;
+
+    for (i = 0; i < clock_count; i++) {
+        if (last->fw_us - clock_samples[i].fw_us <= CLOCK_WINDOW_S * 1000000ULL &&
+            clock_samples[i].delay_ns < min_delay)
+            min_delay = clock_samples[i].delay_ns;
     }
 
-    return 0;
+    for (i = 0; i < clock_count; i++) {
+        const struct ClockSample *sample = &clock_samples[i];
+
+        if (last->fw_us - sample->fw_us > CLOCK_WINDOW_S * 1000000ULL ||
+            sample->delay_ns > 2 * min_delay)
+            continue;
+
+        xs[n] = -(int64_t)(last->fw_us - sample->fw_us);
+        ys[n] = sample->mono_ns - last->mono_ns - xs[n] * 1000;
+        sum_x += xs[n];
+        sum_y += ys[n];
+        n++;
+    }
+
+    mean_x = sum_x / n;
+    mean_y = sum_y / n;
+    for (i = 0; i < n; i++) {
+        sxx += (xs[i] - mean_x) * (xs[i] - mean_x);
+        sxy += (xs[i] - mean_x) * (ys[i] - mean_y);
+    }
+
+    /* The line goes through the mean, a second of samples at least gives it a slope */
+    drift = sxx >= 1000000 ? sxy / (sxx / 1000000) : 0;
+    if (drift > CLOCK_MAX_DRIFT_PPB)
+        drift = CLOCK_MAX_DRIFT_PPB;
+    if (drift < -CLOCK_MAX_DRIFT_PPB)
+        drift = -CLOCK_MAX_DRIFT_PPB;
+
+    clock_fw_us = last->fw_us + mean_x;
+    clock_mono_ns = last->mono_ns + mean_x * 1000 + mean_y;
+    clock_drift_ppb = drift;
+    if (clock_count >= CLOCK_MIN_SAMPLES)
+        clock_error_ns = min_delay / 2 < INT32_MAX ? min_delay / 2 : INT32_MAX;
 }
 
- 
- /* Internal Linux serial functions */
- #if IS_LINUX
- static int linux_serial_available(void) {
-     int bytes_available;
- 
-     if (serial_fd == -1) {
-         return 0;  /* Prevent reading from an invalid file descriptor */ 
-     }
- 
-     if (ioctl(serial_fd, FIONREAD, &bytes_available) == -1) {
-         perror("Error checking available bytes");
-         return 0;
+/*
+ * comms_clock_handle_pong - Add the firmware's answer to a ping to the estimate.
+ */
+static void comms_clock_handle_pong(const struct Message *msg)
+{
+    int64_t now = GET_TIME_NS();
+    uint64_t fw_us = msg->body.payload_response.val;
+    struct ClockSample *sample;
+    int64_t delay_ns;
+
+    if (!clock_ping_pending ||
+        (msg->body.payload_response.param & COMMAND_TIME_ID_MASK) != clock_ping_id)
+        return;  /* Answer to an earlier ping, given up on */
+    clock_ping_pending = false;
+    clock_missed = 0;
+
+    /* The firmware restarted, and its clock with it */
+    if (clock_count && fw_us < clock_samples[(clock_next + CLOCK_SAMPLES - 1) % CLOCK_SAMPLES].fw_us) {
+        clock_count = 0;
+        clock_error_ns = -1;
+    }
+
+    delay_ns = now - clock_ping_ns - clock_ping_line_ns - comms_line_ns(msg);
+    if (delay_ns < 0)
+        delay_ns = 0;
+
+    sample = &clock_samples[clock_next];
+    sample->fw_us = fw_us;
+    sample->mono_ns = clock_ping_ns + clock_ping_line_ns + delay_ns / 2;
+    sample->delay_ns = delay_ns;
+    clock_next = (clock_next + 1) % CLOCK_SAMPLES;
+    if (clock_count < CLOCK_SAMPLES)
+        clock_count++;
+
+    comms_clock_fit();
+}
+
+/*
+ * comms_clock_to_mono_ns - Convert a firmware timestamp to CLOCK_MONOTONIC.
+ * @param fw_us: Firmware clock, see comms_clock_us()
+ * @param mono_ns: Set to the same moment on CLOCK_MONOTONIC, in nanoseconds
+ * @return The error bound in nanoseconds, or < 0 until CLOCK_MIN_SAMPLES pings were answered
+ */
+int32_t comms_clock_to_mono_ns(uint64_t fw_us, int64_t *mono_ns)
+{
+    int64_t d = (int64_t)(fw_us - clock_fw_us);
+
+    if (clock_error_ns < 0)
+        return -1;
+
+    /* Split so d * drift cannot overflow, however far fw_us is from the estimate */
+    *mono_ns = clock_mono_ns + d * 1000 + (d / 1000000) * clock_drift_ppb +
+               (d % 1000000) * clock_drift_ppb / 1000000;
+    return clock_error_ns;
+}
+
+/*
+ * comms_clock_drift_ppb - How much faster CLOCK_MONOTONIC runs than the firmware clock.
+ */
+int32_t comms_clock_drift_ppb(void)
+{
+    return clock_drift_ppb;
+}
+#endif
+
+/*
+ * comms_clock_poll - Keep the firmware clock extended (MCU), ping the firmware when due (Linux).
+ * @note A ping not answered by the time the next is due is given up on. After
+ *       CLOCK_FAST_TRIES of those in a row, firmware that never answers, pings go out
+ *       every CLOCK_SYNC_MS until one is answered.
+ */
+static void comms_clock_poll(void)
+{
+#if IS_MCU
+    comms_clock_us();
+#else /* IS_LINUX */
+    uint32_t interval = clock_count < CLOCK_MIN_SAMPLES && clock_missed < CLOCK_FAST_TRIES ?
+                        CLOCK_FAST_MS : CLOCK_SYNC_MS;
+    struct Message ping;
+
+    if (serial_fd == -1 || baud_state != BAUD_IDLE || GET_TIME_MS() - clock_ping_time < interval)
+        return;
+
+    if (clock_ping_pending && clock_missed < UINT8_MAX)
+        clock_missed++;
+
+    clock_ping_id = (clock_ping_id + 1) & COMMAND_TIME_ID_MASK;
+    ping.header.recipient = comms_recipient;
+    ping.header.message_type = MESSAGE_TYPE_COMMAND;
+    ping.header.payload_length = sizeof(struct CommandBody);
+    ping.header.seq = tx_seq;
+    ping.body.payload_command.command = COMMAND_TIME_PING | clock_ping_id;
+
+    clock_ping_time = GET_TIME_MS();
+    clock_ping_line_ns = comms_line_ns(&ping);
+    clock_ping_ns = GET_TIME_NS();
+    clock_ping_pending = comms_send_message(&ping) == 0;
+#endif
+}
+
+ /* 
+  * comms_calculate_checksum
+  * @param data Pointer to the data array
+  * @param length Length of the data array
+  * @return Calculated checksum
+  */
+ static uint8_t comms_calculate_checksum(const uint8_t *data, uint8_t length)
+ {
+     uint8_t checksum = 0;
+     for (uint8_t i = 0; i < length; i++) {
+         checksum ^= data[i];  /* Simple XOR checksum */
      }
- 
-     return bytes_available;
+     return checksum;
  }
- 
- /* Read a single byte */
- static int linux_serial_read(void) {
-     uint8_t byte;
- 
-     if (serial_fd == -1) {
-         return -1;  /* Prevent reading from an invalid file descriptor */ 
-     }
- 
-     int result = read(serial_fd, &byte, 1);
-     if (result == -1) {
-         perror("Error reading from serial");
-     }
-     /* If the result's length is 1, return the value, otherwise -1 for error */
-     return (result == 1) ? byte : -1;
+
+ /* 
+ * comms_validate_checksum
+ *
+ * Validates by performing XOR checksum on the header and payload, including the
+ * checksum field, such that an XOR on the aforementioned chars will yield 0
+ * when the message is intact. 
+ * @param data: the header and payload of the message, without any framing bytes.
+ * @param len:  the length of the header and payload
+ * @returns false if the message is corrupt.
+ *          true if the message is valid.		
+ */
+static bool comms_validate_checksum(const uint8_t *data, size_t len)
+{
+    uint8_t result = 0;
+    for (size_t i = 0; i < len; i++)
+        result ^= data[i];
+
+    return result == 0;
+ }
+
+ /*
+  * comms_crc8 - Table driven CRC-8 (polynomial 0x07) used by protocol v2
+  * @param data Pointer to the data array
+  * @param length Length of the data array
+  * @return CRC of data. Run over data followed by its CRC, the result is 0.
+  */
+ static uint8_t comms_crc8(const uint8_t *data, size_t length)
+ {
+     uint8_t crc = 0;
+     for (size_t i = 0; i < length; i++)
+         crc = pgm_read_byte(&crc8_table[crc ^ data[i]]);
+     return crc;
  }
  
+ /* 
+  * comms_serialize_message
+  * @param msg Pointer to the message structure
+  * @param out_buf Pointer to the output buffer, at least BUFFER_SIZE bytes
+  * @return < 0 on error, total length of serialized message on success(inluding framing and header bytes)
+  */
+ static int comms_serialize_message(const struct Message *msg, uint8_t *out_buf)
+{
+    if (!msg || !out_buf)
+        return -1;
+
+    /* Payload */
+    int payload_len = comms_encode_payload(msg, protocol_version, &out_buf[5]);
+    if (payload_len < 0)
+        return payload_len;
+
+    return comms_frame_payload(out_buf, msg->header.recipient, msg->header.message_type,
+                               msg->header.seq, payload_len);
+}
+
+ /*
+  * comms_frame_payload - Frame an encoded payload in the current protocol version.
+  * @param out_buf Output buffer, at least 7 bytes longer than the payload, with the
+  *        payload already in place at out_buf + 5
+  * @return total length of the frame
+  */
+ static int comms_frame_payload(uint8_t *out_buf, uint8_t recipient, uint8_t type, uint8_t seq, uint8_t payload_len)
+{
+    /* Start of frame */ 
+    out_buf[0] = MESSAGE_START;
+
+    /* Header fields */
+    out_buf[1] = recipient;
+    out_buf[2] = type;
+    out_buf[3] = payload_len;
+    out_buf[4] = 0;
+
+    if (protocol_version == PROTOCOL_VERSION_2) {
+        /* The v2 header carries the sequence number where v1 has its checksum,
+         * and a CRC-8 over header + payload follows the payload */
+        out_buf[4] = seq;
+        out_buf[5 + payload_len] = comms_crc8(&out_buf[1], 4 + payload_len);
+
+        /* Re-frame as COBS: encoded header + payload + CRC, then the delimiter.
+         * Encoding in place is safe, the output trails the input by one byte. */
+        size_t len = comms_cobs_encode(&out_buf[1], 5 + payload_len, out_buf);
+        out_buf[len] = MESSAGE_DELIMITER;
+        return len + 1;
+    }
+
+    /* Calculate checksum for header + payload */
+    out_buf[4] = comms_calculate_checksum(&out_buf[1], 4 + payload_len);
+
+    out_buf[5 + payload_len] = MESSAGE_END;
+
+    return 6 + payload_len;  /* Return total length of the message */
+}
+
+ /*
+  * comms_cobs_encode - Consistent Overhead Byte Stuffing
+  * @param in Data to encode, may contain 0x00
+  * @param length Length of the data
+  * @param out Output buffer, length + 1 bytes for frames shorter than 254 bytes.
+  *            May alias in - 1, as every output byte is written at or behind the input.
+  * @return length of the encoded data, which contains no 0x00 bytes
+  */
+ static size_t comms_cobs_encode(const uint8_t *in, size_t length, uint8_t *out)
+{
+    size_t code_idx = 0;
+    size_t out_idx = 1;
+    uint8_t code = 1;
+
+    for (size_t i = 0; i < length; i++) {
+        if (in[i] == 0) {
+            out[code_idx] = code;
+            code_idx = out_idx++;
+            code = 1;
+            continue;
+        }
+
+        out[out_idx++] = in[i];
+        if (++code == 0xFF) {
+            out[code_idx] = code;
+            code_idx = out_idx++;
+            code = 1;
+        }
+    }
+    out[code_idx] = code;
+
+    return out_idx;
+}
+
+ /*
+  * comms_cobs_decode - Reverse comms_cobs_encode
+  * @param in Encoded data, without the delimiter
+  * @param length Length of the encoded data
+  * @param out Output buffer, may alias in since the output never overtakes the input
+  * @return length of the decoded data, < 0 if the encoding is invalid
+  */
+ static int comms_cobs_decode(const uint8_t *in, size_t length, uint8_t *out)
+{
+    size_t in_idx = 0;
+    size_t out_idx = 0;
+
+    while (in_idx < length) {
+        uint8_t code = in[in_idx++];
+
+        if (code == 0 || in_idx + code - 1 > length)
+            return -1;
+
+        for (uint8_t i = 1; i < code; i++)
+            out[out_idx++] = in[in_idx++];
+
+        if (code != 0xFF && in_idx < length)
+            out[out_idx++] = 0;
+    }
+
+    return out_idx;
+}
+
+
+ /* 
+  * comms_deserialize_message
+  * @param in_buf Pointer to the input buffer
+  * @param length Length of the input buffer
+  * @param msg Pointer to the message structure to fill
+  * @return < 0 on error, 0 on success
+  */
+ static int comms_deserialize_message(const uint8_t *in_buf, size_t length, struct Message *msg)
+{
+    if (!in_buf || !msg || length < 6)
+        return -1;
+
+    if (in_buf[0] != MESSAGE_START || in_buf[length - 1] != MESSAGE_END)
+        return -2;
+
+    return comms_decode_frame(&in_buf[1], length - 2, PROTOCOL_VERSION_1, msg);
+}
+
+ /* 
+  * comms_decode_frame - Decode the header and payload of a message, common to all framings
+  * @param frame Pointer to the header, immediately followed by the payload
+  *              v1: RECIPIENT TYPE LEN XOR PAYLOAD
+  *              v2: RECIPIENT TYPE LEN SEQ PAYLOAD CRC8
+  * @param length Length of the header and payload (and CRC)
+  * @param version Protocol version the frame was received with
+  * @param msg Pointer to the message structure to fill
+  * @return < 0 on error, 0 on success
+  */
+ static int comms_decode_frame(const uint8_t *frame, size_t length, uint8_t version, struct Message *msg)
+{
+    size_t overhead = (version == PROTOCOL_VERSION_2) ? 5 : 4;
+
+    if (length < overhead)
+        return -1;
+
+    msg->header.recipient = frame[0];
+    msg->header.message_type = frame[1];
+    msg->header.payload_length = frame[2];
+
+    if (length != overhead + (size_t)msg->header.payload_length)
+        return -3; /* Message length does not match expected length */
+
+    if (version == PROTOCOL_VERSION_2) {
+        msg->header.seq = frame[3];
+        msg->header.checksum = frame[length - 1];
+        if (comms_crc8(frame, length) != 0)
+            return -4; /* Invalid CRC - corrupted message? */
+    } else {
+        msg->header.seq = 0;
+        msg->header.checksum = frame[3];
+        if (!comms_validate_checksum(frame, length))
+            return -4; /* Invalid checksum - corrupted message? */
+    }
+
+    if (comms_decode_payload(&frame[4], msg->header.payload_length, version, msg) < 0)
+        return -5; /* Malformed payload */
+
+    return 0;
+}
+
+ 
+ #if IS_LINUX
+/*
+ * comms_trace_start - Capture the link to a file, see comms_trace.h.
+ * @param path: File to write, replaced if it exists.
+ * @note Capture runs until comms_trace_stop() or until the trace reaches TRACE_MAX_BYTES.
+ *       Records are buffered, at most TRACE_FLUSH_MS worth is lost if the program dies.
+ * @return 0 on success, -1 on error
+ */
+int comms_trace_start(const char *path)
+{
+    struct timespec ts;
+
+    comms_trace_stop();
+
+    trace_file = fopen(path, "wb");
+    if (!trace_file) {
+        perror("Error opening trace");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    if (trace_put_header(trace_file, comms_get_baud(), (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec) < 0) {
+        comms_trace_stop();
+        return -1;
+    }
+
+    trace_bytes = TRACE_HEADER_LEN;
+    trace_flush_time = GET_TIME_MS();
+    return 0;
+}
+
+/*
+ * comms_trace_stop - Stop capturing the link, the trace is flushed and closed.
+ */
+void comms_trace_stop(void)
+{
+    if (trace_file) {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+}
+
+/*
+ * comms_trace - Append a record to the trace, if one is being captured.
+ * @note DATA may be given in two parts, see trace_put_record().
+ */
+static void comms_trace(uint8_t kind, uint8_t arg, const uint8_t *data, uint16_t length,
+                        const uint8_t *more, uint16_t more_length)
+{
+    struct timespec ts;
+    int n;
+
+    if (!trace_file)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    n = trace_put_record(trace_file, (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec,
+                         kind, arg, data, length, more, more_length);
+    if (n < 0) {
+        perror("Error writing trace");
+        comms_trace_stop();
+        return;
+    }
+
+    trace_bytes += n;
+    if (trace_bytes >= TRACE_MAX_BYTES) {
+        fprintf(stderr, "Trace reached %lu bytes, stopped\n", trace_bytes);
+        comms_trace_stop();
+        return;
+    }
+
+    if (GET_TIME_MS() - trace_flush_time >= TRACE_FLUSH_MS) {
+        fflush(trace_file);
+        trace_flush_time = GET_TIME_MS();
+    }
+}
+
+/*
+ * comms_trace_message - Record a message as RECIPIENT TYPE LEN SEQ PAYLOAD.
+ * @param version: Encoding of the payload, the framing the message arrived in or leaves with.
+ */
+static void comms_trace_message(uint8_t kind, uint8_t version, const struct Message *msg)
+{
+    uint8_t buf[TRACE_FRAME_HEADER_LEN + MAX_PAYLOAD_SIZE];
+    int len;
+
+    if (!trace_file)
+        return;
+
+    len = comms_encode_payload(msg, version, &buf[TRACE_FRAME_HEADER_LEN]);
+    if (len < 0)
+        return;
+
+    buf[0] = msg->header.recipient;
+    buf[1] = msg->header.message_type;
+    buf[2] = (uint8_t)len;
+    buf[3] = msg->header.seq;
+    comms_trace(kind, version, buf, TRACE_FRAME_HEADER_LEN + len, NULL, 0);
+}
+
  /* Close serial port */
  void comms_close(void) {
+     /* Best effort, anything the UART won't take now is dropped */
+     comms_tx_flush();
+
      if (serial_fd != -1) {
          close(serial_fd);
          serial_fd = -1;
      }
+
+     /* Discard anything buffered for the old descriptor */
+     rx_ring_head = rx_ring_tail = 0;
+     receiving = false;
+     rx_index = 0;
+     rx_batch_pos = rx_batch_end = 0;
+     comms_reset_sequence();
+     tx_ring_head = tx_ring_tail = 0;
+     tx_frame_head = tx_frame_tail = 0;
+     tx_frame_sent = 0;
+
+     /* Transfers end with the descriptor, a receiver can resume them once reopened */
+     if (bulk_tx_state > BULK_IDLE)
+         bulk_tx_state = -BULK_E_CANCELLED;
+     if (bulk_rx_state == BULK_SENDING)
+         bulk_sink->close(BULK_E_CANCELLED);
+     bulk_rx_state = BULK_IDLE;
  }
 
  #else
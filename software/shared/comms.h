@@ -23,6 +23,7 @@ extern "C" {
     #include "serial_wrapper.h" 
     #define ARDUINO_BAUDRATE 9600
     #define GET_TIME_MS() millis()
+    #define GET_TIME_US() micros()
 
 #else /* IS_LINUX */
     #include <time.h>
@@ -39,87 +40,77 @@ extern "C" {
         clock_gettime(CLOCK_MONOTONIC, &ts);
         return (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
     }
+    static inline int64_t GET_TIME_NS(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
 #endif
 
-/* Message Framing */
-#define MESSAGE_START 0xAA
-#define MESSAGE_END   0x55
-
-/* Payload Constraints */
-#define MAX_PAYLOAD_SIZE 128  /* Adjust based on RAM availability */
-/* Timeout for message reception (milliseconds) */
-#define MAX_MESSAGE_TIMEOUT_MS 100
+/* Protocol constants, message types and payload structs, generated from protocol/protocol.def */
+#include "protocol.h"
 
-/* Command Definitions */
-#define COMMAND_RECORD_REQ_START  0xF000
-#define COMMAND_RECORD_STARTED    0xF001
-#define COMMAND_RECORD_REQ_END    0xE000
-#define COMMAND_RECORD_ENDED      0xE001
-#define COMMAND_SHUTDOWN_REQ      0xD000
-#define COMMAND_SHUTDOWN_STARTED  0xD001
-
-#define OAC_COMMAND_WD_START          0xB000
-#define OAC_COMMAND_WD_STOP           0xB001
-#define OAC_COMMAND_WD_KICK           0xB002
-#define OAC_COMMAND_WD_SET_TO         0xB003
-
-/* Message Recipient Definitions */
-#define MESSAGE_RECIPIENT_LINUX 0x01
-#define MESSAGE_RECIPIENT_FIRMWARE 0x02
-
-/* Message Type Identifiers */
-enum MessageType {
-    MESSAGE_TYPE_COMMAND    = 0x01,
-    MESSAGE_TYPE_STATUS     = 0x02,
-    MESSAGE_TYPE_ERROR      = 0x03,
-    MESSAGE_TYPE_DATA       = 0x04,
-	MESSAGE_TYPE_RESPONSE   = 0x06,
-};
+/* Minimum time between v2 negotiation retries (milliseconds) */
+#define PROTOCOL_RETRY_MS 1000
 
-/* Message Header */
-struct MessageHeader {
-    uint8_t recipient;
-    uint8_t message_type;
-    uint8_t payload_length;
-    uint8_t checksum;
-};
+#define BAUD_PROBE_TIMEOUT_MS 250   /* Probe echo must arrive within this time of switching */
+#define BAUD_SETTLE_MS 20           /* Time the firmware gets to act on a BAUD_REQ for rung 0 */
+#define BAUD_ERROR_LIMIT 8          /* Frame errors within BAUD_ERROR_WINDOW_MS ... */
+#define BAUD_ERROR_WINDOW_MS 1000   /* ... above rung 0 drop the link back to rung 0 */
 
-struct ResponseBody {
-	uint16_t param;
-	uint64_t val;
-};
+/* Protocol v2 reliable delivery: command frames are acknowledged by sequence number */
+#define RETRANSMIT_TIMEOUT_MS 100   /* Resend a command frame not acknowledged within this time */
+#define MAX_RETRANSMITS 3           /* Give up on a command frame after this many resends */
+#define MAX_UNACKED 4               /* Command and event frames awaiting acknowledgement */
+#define BATCH_WINDOW_MS 5           /* Messages sent within this time share one frame */
 
-/* Command Payload */
-struct CommandBody {
-    uint16_t command;
-};
+/* Bulk transfer over DATA messages, see BULK_OP_* in protocol.h */
+#define BULK_RETRY_MS 250           /* Resend from the last credit when no credit arrives within this time */
+#define BULK_MAX_RETRIES 4          /* Give up after this many resends without progress */
 
-/* Status Payload */
-struct StatusBody {
-    uint32_t bat_volt_uv;
-    uint8_t bat_lvl;
-    uint8_t state;
-    bool charging;
-    uint8_t error_code;
-};
+/* Clock synchronisation, see comms_clock_to_mono_ns() */
+#define CLOCK_SYNC_MS 2000          /* Interval between pings once synchronised */
+#define CLOCK_FAST_MS 100           /* ... and until CLOCK_MIN_SAMPLES pings were answered */
+#define CLOCK_FAST_TRIES 10         /* ... unless this many in a row went unanswered */
+#define CLOCK_MIN_SAMPLES 4
+#define CLOCK_SAMPLES 32            /* Pings the estimate is made from */
+#define CLOCK_WINDOW_S 120          /* Older pings are not used */
+#define CLOCK_MAX_DRIFT_PPB 20000000  /* 2%, far beyond any ceramic resonator */
 
-/* Error Payload */
-struct ErrorBody {
-    uint8_t error_code;
-    char error_message[MAX_PAYLOAD_SIZE - 1];
-};
-
-/* Full Message (Tagged Union) */
-struct Message {
-    struct MessageHeader header;
-    union {
-        struct CommandBody payload_command;
-        struct ResponseBody payload_response;
-        struct StatusBody payload_status;
-        struct ErrorBody payload_error;
-        uint8_t payload_raw[MAX_PAYLOAD_SIZE]; /* Raw access (used for MESSAGE_TYPE_DATA) */
-    } body;
+/* Timeout for message reception (milliseconds) */
+#define MAX_MESSAGE_TIMEOUT_MS 100
 
+/* Link control commands (0x9xxx) are consumed by the comms layer and never acknowledged */
+#define COMMAND_IS_LINK(cmd)      (((cmd) & 0xF000) == 0x9000)
+
+/* Link control messages: link commands, and the RESPONSE to a COMMAND_TIME_PING */
+#define MESSAGE_IS_LINK(msg) \
+    (((msg)->header.message_type == MESSAGE_TYPE_COMMAND && \
+      COMMAND_IS_LINK((msg)->body.payload_command.command)) || \
+     ((msg)->header.message_type == MESSAGE_TYPE_RESPONSE && \
+      COMMAND_IS_LINK((msg)->body.payload_response.param)))
+
+/*
+ * Bulk transfer data source, reads len bytes of the object being sent at offset.
+ * Called again for data the receiver missed, so it must return the same bytes.
+ * Returns 0, or < 0 if the data cannot be read.
+ */
+typedef int (*comms_bulk_read_t)(uint32_t offset, uint8_t *buf, uint8_t len);
+
+/*
+ * Bulk transfer receiver, one per program, see comms_bulk_set_sink().
+ * open: an object of size bytes is offered. Returns the offset to resume from,
+ *       0 for a new object, or a negated BULK_E_* to refuse it.
+ * write: store len bytes at offset, always the next bytes after the last write.
+ *        Returns 0, or < 0 to abort the transfer.
+ * close: the transfer ended, 0 if the object is complete, otherwise a BULK_E_*.
+ * window: bytes the sink takes ahead of the last credit, at least BULK_CHUNK_MAX.
+ */
+struct BulkSink {
+    int32_t (*open)(uint8_t object, uint32_t size);
+    int (*write)(uint32_t offset, const uint8_t *data, uint8_t len);
+    void (*close)(uint8_t result);
+    uint16_t window;
 };
 
 /* Public API */
@@ -128,14 +119,74 @@ int comms_init(void);
 
 int comms_receive_message(struct Message *msg);
 
+int comms_receive_messages(struct Message *msgs, int max);
+
 int comms_send_command(uint16_t command);
 
 int comms_send_error(uint8_t code, const char *message);
 
+int comms_raise_error(uint8_t code, uint32_t context);
+
+#if IS_LINUX
+const char *comms_error_message(uint8_t code);
+
+uint8_t comms_error_origin(uint8_t code);
+#endif
+
 int comms_send_status(const struct StatusBody *status);
 
+int comms_send_reply(uint8_t tid, uint8_t result, uint64_t val);
+
+int32_t comms_send_event(uint16_t command, uint64_t time_us);
+
+int comms_tx_flush(void);
+
+size_t comms_tx_pending(void);
+
+unsigned int comms_tx_queue_depth(void);
+
+#if IS_MCU
+void comms_log_write(const uint8_t *data, size_t len);
+#endif
+
+int comms_negotiate_protocol(void);
+
+void comms_set_protocol_version(uint8_t version);
+
+uint8_t comms_get_protocol_version(void);
+
+uint16_t comms_tx_failures(void);
+
+int comms_negotiate_baud(void);
+
+int comms_set_baud(uint8_t rung);
+
+uint32_t comms_get_baud(void);
+
+int comms_bulk_send(uint8_t object, uint32_t size, comms_bulk_read_t read);
+
+int comms_bulk_send_status(uint32_t *offset);
+
+void comms_bulk_cancel(void);
+
+void comms_bulk_set_sink(const struct BulkSink *sink);
+
+uint64_t comms_clock_us(void);
+
+#if IS_LINUX
+int32_t comms_clock_to_mono_ns(uint64_t fw_us, int64_t *mono_ns);
+
+int32_t comms_clock_drift_ppb(void);
+#endif
+
 void comms_close(void);
 
+#if IS_LINUX
+int comms_trace_start(const char *path);
+
+void comms_trace_stop(void);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,131 @@
+/*
+ * comms_trace.h - Capture format for the UART link, written by comms.c on Linux
+ *
+ * A trace is a file header followed by records, all fields little endian:
+ *
+ *   header : "OACT" FORMAT(2) BAUD(4) START_NS(8)
+ *   record : TIME_NS(8) KIND(1) ARG(1) LEN(2) DATA(LEN)
+ *
+ * Times are CLOCK_MONOTONIC in nanoseconds. BAUD is the link rate when the trace
+ * was started, later changes are recorded as they happen. Record kinds:
+ *   TRACE_RX_BYTES : DATA as read from the UART
+ *   TRACE_TX_BYTES : DATA as accepted by the UART
+ *   TRACE_RX_FRAME : a message the parser accepted, ARG its framing version.
+ *                    DATA is RECIPIENT TYPE LEN SEQ PAYLOAD, the payload in that
+ *                    version's encoding. Messages of a batch are recorded one by one
+ *   TRACE_TX_FRAME : a message handed to the link layer, as TRACE_RX_FRAME
+ *   TRACE_RX_ERROR : a discarded frame, ARG the parser's error code negated
+ *   TRACE_BAUD     : the link changed rate, DATA the new rate as BAUD(4)
+ *
+ * The raw bytes are enough to replay a trace, the frames and errors are what the
+ * parser made of them at the time.
+ */
+#ifndef COMMS_TRACE_H
+#define COMMS_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "protocol_codec.h"  /* proto_put_le*(), proto_get_le*() */
+
+#define TRACE_MAGIC "OACT"
+#define TRACE_FORMAT 1
+#define TRACE_HEADER_LEN 18
+#define TRACE_RECORD_LEN 12         /* Record header, DATA follows */
+#define TRACE_FRAME_HEADER_LEN 4    /* RECIPIENT TYPE LEN SEQ */
+
+enum TraceKind {
+    TRACE_RX_BYTES = 1,
+    TRACE_TX_BYTES = 2,
+    TRACE_RX_FRAME = 3,
+    TRACE_TX_FRAME = 4,
+    TRACE_RX_ERROR = 5,
+    TRACE_BAUD     = 6,
+};
+
+struct TraceRecord {
+    uint64_t time_ns;
+    uint8_t kind;
+    uint8_t arg;
+    uint16_t length;
+    const uint8_t *data;
+};
+
+/*
+ * trace_put_header - Write the file header.
+ * @return 0 on success, -1 on write error
+ */
+static inline int trace_put_header(FILE *f, uint32_t baud, uint64_t start_ns)
+{
+    uint8_t buf[TRACE_HEADER_LEN];
+
+    memcpy(buf, TRACE_MAGIC, 4);
+    proto_put_le16(&buf[4], TRACE_FORMAT);
+    proto_put_le32(&buf[6], baud);
+    proto_put_le64(&buf[10], start_ns);
+
+    return (fwrite(buf, sizeof(buf), 1, f) == 1) ? 0 : -1;
+}
+
+/*
+ * trace_put_record - Write one record, its DATA given in up to two parts.
+ * @note Two parts let ring buffer contents that wrap be recorded without a copy.
+ * @return bytes written, or -1 on write error
+ */
+static inline int trace_put_record(FILE *f, uint64_t time_ns, uint8_t kind, uint8_t arg,
+                                   const uint8_t *data, uint16_t length,
+                                   const uint8_t *more, uint16_t more_length)
+{
+    uint8_t buf[TRACE_RECORD_LEN];
+
+    proto_put_le64(&buf[0], time_ns);
+    buf[8] = kind;
+    buf[9] = arg;
+    proto_put_le16(&buf[10], length + more_length);
+
+    if (fwrite(buf, sizeof(buf), 1, f) != 1 ||
+        (length && fwrite(data, length, 1, f) != 1) ||
+        (more_length && fwrite(more, more_length, 1, f) != 1))
+        return -1;
+
+    return TRACE_RECORD_LEN + length + more_length;
+}
+
+/*
+ * trace_get_header - Check the file header of a trace held in memory.
+ * @return 0 on success, -1 if buf does not hold a trace this code understands
+ */
+static inline int trace_get_header(const uint8_t *buf, size_t length, uint32_t *baud, uint64_t *start_ns)
+{
+    if (length < TRACE_HEADER_LEN || memcmp(buf, TRACE_MAGIC, 4) != 0 ||
+        proto_get_le16(&buf[4]) != TRACE_FORMAT)
+        return -1;
+
+    *baud = proto_get_le32(&buf[6]);
+    *start_ns = proto_get_le64(&buf[10]);
+    return 0;
+}
+
+/*
+ * trace_get_record - Parse the record at buf, rec->data points into buf.
+ * @return bytes used, 0 at the end of the trace, -1 if the record is truncated
+ */
+static inline int trace_get_record(const uint8_t *buf, size_t length, struct TraceRecord *rec)
+{
+    if (length == 0)
+        return 0;
+    if (length < TRACE_RECORD_LEN)
+        return -1;
+
+    rec->time_ns = proto_get_le64(&buf[0]);
+    rec->kind = buf[8];
+    rec->arg = buf[9];
+    rec->length = proto_get_le16(&buf[10]);
+    rec->data = &buf[TRACE_RECORD_LEN];
+
+    if (length < (size_t)TRACE_RECORD_LEN + rec->length)
+        return -1;
+    return TRACE_RECORD_LEN + rec->length;
+}
+
+#endif /* COMMS_TRACE_H */
@@ -19,7 +19,7 @@ void init_error_system(Led* l, PowerManagement* pm) {
     blinkAnim = BlinkLedAnimation(led, 0); 
 }
 
-void throw_error(uint8_t code, const char* message) {
+void throw_error(uint8_t code) {
     if (!led) {
         Serial.println("ERROR: LED not initialized!");
         return;
@@ -33,9 +33,7 @@ void throw_error(uint8_t code, const char* message) {
     if (lastErrorCode == code) return;  /* Prevent redundant updates */
 
     Serial.print("[ERROR] ");
-    Serial.print(code);
-    Serial.print(": ");
-    Serial.println(message);
+    Serial.println(code);
     
     lastErrorCode = code;
 
@@ -15,30 +15,24 @@
 #endif
 
 /* Error Origins */
-#define ORIGIN_MCU   1
-#define ORIGIN_LINUX 2
-
-/* Error definition struct */
-typedef struct {
-    uint8_t code;
-    const char* message;
-    uint8_t origin;
-} error_def_t;
-
-/* === Error Definitions === */
-#define ERR_LOW_BATTERY               ((error_def_t){  2, "Low Battery",                            ORIGIN_MCU })  
-#define ERR_INSUFFICIENT_SPACE        ((error_def_t){  3, "Insufficient storage space!",            ORIGIN_LINUX })
-#define ERR_BATTERY_OV                ((error_def_t){  6, "Battery over-voltage detected",          ORIGIN_MCU })  
-#define ERR_NO_COMM_RPI               ((error_def_t){  7, "No contact with RPI!",                   ORIGIN_MCU })
-#define ERR_RPI_SHUTDOWN_REQ_TIMEOUT  ((error_def_t){  8, "RPI did not acknowledge shutdown!",      ORIGIN_MCU })
-#define ERR_RPI_SHUTDOWN_TIMEOUT      ((error_def_t){  9, "Could not kill RPI - no serial hangup!", ORIGIN_MCU })
-#define ERR_STORAGE_CHECK_FAILED      ((error_def_t){ 10, "Failed to check available storage.",     ORIGIN_LINUX })
-#define ERR_INVALID_RESOLUTION        ((error_def_t){ 12, "Invalid resolution format.",             ORIGIN_LINUX })
-#define ERR_PIPE_CREATION_FAILED      ((error_def_t){ 13, "Failed to create pipe.",                 ORIGIN_LINUX })
-#define ERR_MONITOR_THREAD_FAILED     ((error_def_t){ 14, "Failed to create monitor thread.",       ORIGIN_LINUX })
-#define ERR_CAMERA_NOT_FOUND          ((error_def_t){ 15, "No camera detected.",                    ORIGIN_LINUX })
-#define ERR_RECORD_START_FAILED       ((error_def_t){ 16, "Recording failed to start.",             ORIGIN_LINUX })
-#define ERR_TRANSCODE_FAILED          ((error_def_t){ 17, "Transcoding process failed.",            ORIGIN_LINUX })
+#define ORIGIN_MCU   ERROR_ORIGIN_MCU
+#define ORIGIN_LINUX ERROR_ORIGIN_LINUX
+
+/* === Error Definitions, codes of the error catalog in protocol.def === */
+#define ERR_LOW_BATTERY               ERROR_CODE_LOW_BATTERY
+#define ERR_INSUFFICIENT_SPACE        ERROR_CODE_INSUFFICIENT_SPACE
+#define ERR_CHARGER_FAULT             ERROR_CODE_CHARGER_FAULT
+#define ERR_BATTERY_OV                ERROR_CODE_BATTERY_OV
+#define ERR_NO_COMM_RPI               ERROR_CODE_NO_COMM_RPI
+#define ERR_RPI_SHUTDOWN_REQ_TIMEOUT  ERROR_CODE_RPI_SHUTDOWN_REQ_TIMEOUT
+#define ERR_RPI_SHUTDOWN_TIMEOUT      ERROR_CODE_RPI_SHUTDOWN_TIMEOUT
+#define ERR_STORAGE_CHECK_FAILED      ERROR_CODE_STORAGE_CHECK_FAILED
+#define ERR_INVALID_RESOLUTION        ERROR_CODE_INVALID_RESOLUTION
+#define ERR_PIPE_CREATION_FAILED      ERROR_CODE_PIPE_CREATION_FAILED
+#define ERR_MONITOR_THREAD_FAILED     ERROR_CODE_MONITOR_THREAD_FAILED
+#define ERR_CAMERA_NOT_FOUND          ERROR_CODE_CAMERA_NOT_FOUND
+#define ERR_RECORD_START_FAILED       ERROR_CODE_RECORD_START_FAILED
+#define ERR_TRANSCODE_FAILED          ERROR_CODE_TRANSCODE_FAILED
 
 #if IS_MCU
 
@@ -53,15 +47,16 @@ class PowerManagement;
 class Led;
 
 void init_error_system(Led* led, PowerManagement* pm);
-void throw_error(uint8_t code, const char* message);
+void throw_error(uint8_t code);
 void reset_error();
 uint8_t get_current_error();
 
-#define ERROR(e) do { \
-    if ((e).origin == CURRENT_PLATFORM) { \
-        comms_send_error((e).code, (e).message); \
-    } \
-    throw_error((e).code, (e).message); \
+/* Errors go to Linux as their code, which looks the message up */
+#define ERROR(e) ERROR_CONTEXT(e, 0)
+
+#define ERROR_CONTEXT(e, context) do { \
+    comms_raise_error((e), (context)); \
+    throw_error(e); \
 } while (0)
 
 #define WARN(message, ...) do { \
@@ -102,11 +97,13 @@ uint8_t get_current_error(void);
 }
 #endif
 
-#define ERROR(e) do { \
-    if ((e).origin == CURRENT_PLATFORM) { \
-        comms_send_error((e).code, (e).message); \
+#define ERROR(e) ERROR_CONTEXT(e, 0)
+
+#define ERROR_CONTEXT(e, context) do { \
+    if (comms_error_origin(e) == CURRENT_PLATFORM) { \
+        comms_raise_error((e), (context)); \
     } \
-    throw_error((e).code, (e).message); \
+    throw_error((e), comms_error_message(e)); \
 } while (0)
 
 #define WARN(message, ...) do { \
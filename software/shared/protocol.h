@@ -0,0 +1,342 @@
+/*
+ * protocol.h - Open Action Cam serial protocol, constants and message layouts
+ *
+ * Generated by protocol/gen_protocol.py from protocol/protocol.def, do not edit.
+ */
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Message Framing */
+#define MESSAGE_START     0xAA
+#define MESSAGE_END       0x55
+#define MESSAGE_DELIMITER 0x00  /* Protocol v2: terminates every COBS encoded frame */
+
+/* Protocol Versions */
+#define PROTOCOL_VERSION_1 1  /* START/END framing, length delimited */
+#define PROTOCOL_VERSION_2 2  /* COBS framing, 0x00 delimited */
+
+/* Payload Constraints */
+#define MAX_PAYLOAD_SIZE 128
+
+/* Message Recipient Definitions */
+#define MESSAGE_RECIPIENT_LINUX    0x01
+#define MESSAGE_RECIPIENT_FIRMWARE 0x02
+
+/*
+ * Baud rate ladder. Rung 0 is the rate both sides start at, Linux steps up from
+ * there. Every rate divides 16 MHz exactly with U2X except 115200 (2.1% error).
+ */
+#define BAUD_LADDER { 9600, 115200, 250000, 500000, 1000000 }
+
+/* Command Definitions */
+#define COMMAND_RECORD_REQ_START 0xF000
+#define COMMAND_RECORD_STARTED   0xF001
+#define COMMAND_RECORD_REQ_END   0xE000
+#define COMMAND_RECORD_ENDED     0xE001
+#define COMMAND_SHUTDOWN_REQ     0xD000
+#define COMMAND_SHUTDOWN_STARTED 0xD001
+#define COMMAND_HB               0xC000  /* Redundant, use COMMAND_WD_KICK */
+
+/*
+ * Protocol negotiation. Requests and acks are always sent with v1 framing.
+ * Link control commands (0x9xxx) are consumed by the comms layer and never acknowledged.
+ */
+#define COMMAND_PROTO_REQ_V2 0x9002
+#define COMMAND_PROTO_ACK_V2 0x9102
+
+/* Baud rate negotiation, the low nibble is the BAUD_LADDER rung */
+#define COMMAND_BAUD_REQ       0x9200  /* Linux: please switch to rung n. Rung 0 needs no probe */
+#define COMMAND_BAUD_ACK       0x9300  /* Firmware: switching now */
+#define COMMAND_BAUD_PROBE     0x9400  /* Linux, at the new rate. The firmware echoes it to confirm */
+#define COMMAND_BAUD_RUNG_MASK 0x000F
+
+/*
+ * Clock synchronisation, the low nibble is a ping ID. Linux sends COMMAND_TIME_PING | id,
+ * the firmware answers straight away with a RESPONSE: param = COMMAND_TIME_PING | id,
+ * val = comms_clock_us(), its clock in microseconds since it started. Neither is batched.
+ */
+#define COMMAND_TIME_PING    0x9500
+#define COMMAND_TIME_ID_MASK 0x000F
+
+/*
+ * Status reporting. The firmware sends a status when a value changes by at least its
+ * threshold, no more often than the minimum interval, and otherwise every keepalive.
+ * Linux sets a threshold with a REQUEST: command = COMMAND_STATUS_SET_*, val, or without
+ * a reply with a RESPONSE message: param = COMMAND_STATUS_SET_*, val.
+ * A threshold of 0 disables that trigger.
+ */
+#define COMMAND_STATUS_REQ              0x8000  /* Linux: send a status now */
+#define COMMAND_STATUS_SET_VOLT_DELTA   0x8100  /* Battery voltage change, uV */
+#define COMMAND_STATUS_SET_LVL_DELTA    0x8101  /* Battery level change, percent */
+#define COMMAND_STATUS_SET_EVENTS       0x8102  /* STATUS_EVENT_* changes reported */
+#define COMMAND_STATUS_SET_KEEPALIVE    0x8103  /* Longest time between statuses, ms */
+#define COMMAND_STATUS_SET_MIN_INTERVAL 0x8104  /* Shortest time between statuses, ms */
+
+#define STATUS_EVENT_CHARGING 0x01
+#define STATUS_EVENT_STATE    0x02
+#define STATUS_EVENT_ERROR    0x04
+
+#define STATUS_DEFAULT_VOLT_DELTA_UV   50000
+#define STATUS_DEFAULT_LVL_DELTA       1
+#define STATUS_DEFAULT_EVENTS          (STATUS_EVENT_CHARGING | STATUS_EVENT_STATE | STATUS_EVENT_ERROR)
+#define STATUS_DEFAULT_KEEPALIVE_MS    5000
+#define STATUS_DEFAULT_MIN_INTERVAL_MS 100
+
+/* LED, set like the status thresholds */
+#define COMMAND_LED_SET_BRIGHTNESS 0x8200  /* 0-255 */
+#define LED_DEFAULT_BRIGHTNESS     8
+
+/* Button Definitions */
+#define COMMAND_BTN_SHORT 0xA001
+#define COMMAND_BTN_LONG  0xA002
+
+/* Watchdog Definitions */
+#define COMMAND_WD_START   0xB000
+#define COMMAND_WD_STOP    0xB001
+#define COMMAND_WD_KICK    0xB002
+#define COMMAND_WD_SET_TO  0xB003
+#define WD_MIN_TIMEOUT     1       /* seconds */
+#define WD_MAX_TIMEOUT     60
+#define WD_DEFAULT_TIMEOUT 10
+
+/*
+ * Firmware update. Linux sends a REQUEST: command = COMMAND_FW_UPDATE, val = FW_UPDATE_KEY.
+ * The firmware replies, then hands the UART to its bootloader (Optiboot 6.2 or later,
+ * STK500v1 at FW_UPDATE_BAUD), which Linux programs page by page. Refused with
+ * REPLY_E_BUSY while the firmware is shutting Linux down.
+ */
+#define COMMAND_FW_UPDATE 0x8300
+#define FW_UPDATE_KEY     0x4F414355  /* "OACU", a stray request never starts an update */
+#define FW_UPDATE_BAUD    115200
+#define FW_PAGE_SIZE      128         /* ATmega328 flash page */
+#define FW_APP_SIZE       0x7E00      /* Flash below Optiboot's 512 byte boot section */
+
+/* Reply Results */
+#define REPLY_OK        0x00
+#define REPLY_E_UNKNOWN 0x01  /* Command not supported by this firmware */
+#define REPLY_E_INVALID 0x02  /* Value out of range */
+#define REPLY_E_BUSY    0x03  /* Cannot be done in the current state */
+
+/*
+ * Bulk transfer, carried in DATA payloads: OP XFER, then by operation
+ * OPEN    object:1 size:4         sender: offer an object of size bytes
+ * CHUNK   offset:4 data           sender: bytes of the object from offset on
+ * CANCEL  reason:1                sender: giving up on the transfer
+ * CREDIT  offset:4 window:2       receiver: everything below offset arrived,
+ * send up to offset + window
+ * RESEND  offset:4 window:2       receiver: as CREDIT, and send everything from
+ * offset again, a chunk went missing
+ * ABORT   reason:1                receiver: refusing or giving up on the transfer
+ * XFER is chosen by the sender, anything for another transfer is ignored. The
+ * CREDIT answering OPEN gives the offset the receiver resumes from, one with
+ * offset = size completes the transfer. Operations sent by the receiver have the
+ * top bit set.
+ */
+#define BULK_OP_OPEN          0x01
+#define BULK_OP_CHUNK         0x02
+#define BULK_OP_CANCEL        0x03
+#define BULK_OP_CREDIT        0x81
+#define BULK_OP_ABORT         0x82
+#define BULK_OP_RESEND        0x83
+#define BULK_CHUNK_HEADER_LEN 6
+#define BULK_CHUNK_MAX        (MAX_PAYLOAD_SIZE - BULK_CHUNK_HEADER_LEN)
+
+#define BULK_E_CANCELLED 0x01  /* Sender or receiver gave up */
+#define BULK_E_NO_SINK   0x02  /* Receiver takes no objects of this kind */
+#define BULK_E_TOO_LARGE 0x03  /* Receiver cannot hold the object */
+#define BULK_E_IO        0x04  /* Data could not be read or stored */
+#define BULK_E_TIMEOUT   0x05  /* No credit from the receiver */
+
+/* Bulk objects */
+#define BULK_OBJECT_EVENT_LOG   0x01  /* Firmware: events logged since boot */
+#define BULK_OBJECT_CALIBRATION 0x02  /* Linux: calibration table for the firmware */
+
+/* Side raising an error */
+#define ERROR_ORIGIN_MCU   1
+#define ERROR_ORIGIN_LINUX 2
+
+/*
+ * Error catalog. An error travels as an ERROR_CODE message, its code and a context value,
+ * and the receiver looks the message up here. The sender sends a code at most once per
+ * LIMIT_MS and counts the occurrences in between, the next message carries the count.
+ */
+#define ERROR_CODE_LOW_BATTERY              2   /* Low Battery */
+#define ERROR_CODE_INSUFFICIENT_SPACE       3   /* Insufficient storage space! */
+#define ERROR_CODE_CHARGER_FAULT            4   /* Charger error */
+#define ERROR_CODE_BATTERY_OV               6   /* Battery over-voltage detected */
+#define ERROR_CODE_NO_COMM_RPI              7   /* No contact with RPI! */
+#define ERROR_CODE_RPI_SHUTDOWN_REQ_TIMEOUT 8   /* RPI did not acknowledge shutdown! */
+#define ERROR_CODE_RPI_SHUTDOWN_TIMEOUT     9   /* Could not kill RPI - no serial hangup! */
+#define ERROR_CODE_STORAGE_CHECK_FAILED     10  /* Failed to check available storage. */
+#define ERROR_CODE_INVALID_RESOLUTION       12  /* Invalid resolution format. */
+#define ERROR_CODE_PIPE_CREATION_FAILED     13  /* Failed to create pipe. */
+#define ERROR_CODE_MONITOR_THREAD_FAILED    14  /* Failed to create monitor thread. */
+#define ERROR_CODE_CAMERA_NOT_FOUND         15  /* No camera detected. */
+#define ERROR_CODE_RECORD_START_FAILED      16  /* Recording failed to start. */
+#define ERROR_CODE_TRANSCODE_FAILED         17  /* Transcoding process failed. */
+#define ERROR_CODES 18  /* One past the highest code */
+
+/* X(code, origin, limit_ms, message) for every error in the catalog */
+#define ERROR_CATALOG(X) \
+    X(ERROR_CODE_LOW_BATTERY, ERROR_ORIGIN_MCU, 60000, "Low Battery")                                     \
+    X(ERROR_CODE_INSUFFICIENT_SPACE, ERROR_ORIGIN_LINUX, 10000, "Insufficient storage space!")            \
+    X(ERROR_CODE_CHARGER_FAULT, ERROR_ORIGIN_MCU, 60000, "Charger error")                                 \
+    X(ERROR_CODE_BATTERY_OV, ERROR_ORIGIN_MCU, 60000, "Battery over-voltage detected")                    \
+    X(ERROR_CODE_NO_COMM_RPI, ERROR_ORIGIN_MCU, 10000, "No contact with RPI!")                            \
+    X(ERROR_CODE_RPI_SHUTDOWN_REQ_TIMEOUT, ERROR_ORIGIN_MCU, 10000, "RPI did not acknowledge shutdown!")  \
+    X(ERROR_CODE_RPI_SHUTDOWN_TIMEOUT, ERROR_ORIGIN_MCU, 10000, "Could not kill RPI - no serial hangup!") \
+    X(ERROR_CODE_STORAGE_CHECK_FAILED, ERROR_ORIGIN_LINUX, 10000, "Failed to check available storage.")   \
+    X(ERROR_CODE_INVALID_RESOLUTION, ERROR_ORIGIN_LINUX, 10000, "Invalid resolution format.")             \
+    X(ERROR_CODE_PIPE_CREATION_FAILED, ERROR_ORIGIN_LINUX, 10000, "Failed to create pipe.")               \
+    X(ERROR_CODE_MONITOR_THREAD_FAILED, ERROR_ORIGIN_LINUX, 10000, "Failed to create monitor thread.")    \
+    X(ERROR_CODE_CAMERA_NOT_FOUND, ERROR_ORIGIN_LINUX, 10000, "No camera detected.")                      \
+    X(ERROR_CODE_RECORD_START_FAILED, ERROR_ORIGIN_LINUX, 10000, "Recording failed to start.")            \
+    X(ERROR_CODE_TRANSCODE_FAILED, ERROR_ORIGIN_LINUX, 10000, "Transcoding process failed.")
+
+/* Message Type Identifiers */
+enum MessageType {
+    MESSAGE_TYPE_COMMAND    = 0x01,
+    MESSAGE_TYPE_STATUS     = 0x02,
+    MESSAGE_TYPE_ERROR      = 0x03,
+    MESSAGE_TYPE_DATA       = 0x04,  /* Bulk transfer, see BULK_OP_* */
+    MESSAGE_TYPE_RESPONSE   = 0x06,
+    MESSAGE_TYPE_ACK        = 0x07,  /* Protocol v2: command frame received */
+    MESSAGE_TYPE_NAK        = 0x08,  /* Protocol v2: frame missing, please resend */
+    MESSAGE_TYPE_BATCH      = 0x09,  /* Protocol v2: several messages in one frame */
+    MESSAGE_TYPE_REQUEST    = 0x0A,  /* Linux: carry out a command, answered by a REPLY */
+    MESSAGE_TYPE_REPLY      = 0x0B,  /* Firmware: outcome of the REQUEST with the same tid */
+    MESSAGE_TYPE_EVENT      = 0x0C,  /* Firmware: a COMMAND traced from when it happened, acknowledged alike */
+    MESSAGE_TYPE_ERROR_CODE = 0x0D,  /* An error from the error catalog, rate limited by the sender */
+};
+
+/* X(type, name) for every message type */
+#define MESSAGE_TYPES(X) \
+    X(MESSAGE_TYPE_COMMAND, "COMMAND")       \
+    X(MESSAGE_TYPE_STATUS, "STATUS")         \
+    X(MESSAGE_TYPE_ERROR, "ERROR")           \
+    X(MESSAGE_TYPE_DATA, "DATA")             \
+    X(MESSAGE_TYPE_RESPONSE, "RESPONSE")     \
+    X(MESSAGE_TYPE_ACK, "ACK")               \
+    X(MESSAGE_TYPE_NAK, "NAK")               \
+    X(MESSAGE_TYPE_BATCH, "BATCH")           \
+    X(MESSAGE_TYPE_REQUEST, "REQUEST")       \
+    X(MESSAGE_TYPE_REPLY, "REPLY")           \
+    X(MESSAGE_TYPE_EVENT, "EVENT")           \
+    X(MESSAGE_TYPE_ERROR_CODE, "ERROR_CODE")
+
+/* Message Header */
+struct MessageHeader {
+    uint8_t recipient;
+    uint8_t message_type;
+    uint8_t payload_length;
+    uint8_t checksum;        /* v1: XOR, v2: CRC-8 */
+    uint8_t seq;             /* v2 only: per sender sequence number */
+};
+
+/* Command Payload */
+struct CommandBody {
+    uint16_t command;
+};
+
+/* Response Payload */
+struct ResponseBody {
+    uint16_t param;
+    uint64_t val;
+};
+
+/* Status Payload */
+struct StatusBody {
+    uint32_t bat_volt_uv;
+    uint8_t  bat_lvl;
+    uint8_t  state;
+    bool     charging;
+    uint8_t  error_code;
+};
+
+/* Error Payload, the text is sent without its terminator */
+struct ErrorBody {
+    uint8_t error_code;
+    char    error_message[MAX_PAYLOAD_SIZE - 1];
+};
+
+/* Error Code Payload, the message is in the error catalog */
+struct ErrorCodeBody {
+    uint8_t  code;
+    uint16_t count;    /* Occurrences since the last one sent, this one included */
+    uint32_t context;  /* Error specific, e.g. the battery voltage in mV */
+};
+
+/* Acknowledgement Payload (ACK and NAK) */
+struct AckBody {
+    uint8_t seq;
+};
+
+/* Request Payload */
+struct RequestBody {
+    uint8_t  tid;      /* Transaction ID, echoed in the reply */
+    uint16_t command;
+    uint64_t val;
+};
+
+/* Reply Payload */
+struct ReplyBody {
+    uint8_t  tid;
+    uint8_t  result;  /* REPLY_OK or REPLY_E_* */
+    uint64_t val;
+};
+
+/* Event Payload, a command with the time it happened, so the receiver can time what it sets off */
+struct EventBody {
+    uint16_t command;
+    uint16_t trace;      /* Trace ID, counts up from 1 with every event since the firmware started */
+    uint64_t time_us;    /* comms_clock_us() when it happened */
+    uint32_t queued_us;  /* From then until the frame was sent */
+};
+
+/* Full Message (Tagged Union) */
+struct Message {
+    struct MessageHeader header;
+    union {
+        struct CommandBody payload_command;
+        struct ResponseBody payload_response;
+        struct StatusBody payload_status;
+        struct ErrorBody payload_error;
+        struct ErrorCodeBody payload_error_code;
+        struct AckBody payload_ack;
+        struct RequestBody payload_request;
+        struct ReplyBody payload_reply;
+        struct EventBody payload_event;
+        uint8_t payload_raw[MAX_PAYLOAD_SIZE];  /* Raw access (DATA and BATCH) */
+    } body;
+};
+
+/*
+ * Encoded payload lengths, _LEN_ where the layout is fixed and _MAX_ where
+ * it varies, and the length of the frame carrying a payload of n bytes.
+ */
+#define PAYLOAD_LEN_COMMAND_V1   2
+#define PAYLOAD_LEN_COMMAND_V2   2
+#define PAYLOAD_LEN_RESPONSE_V1  10
+#define PAYLOAD_MAX_RESPONSE_V2  12
+#define PAYLOAD_LEN_STATUS_V1    8
+#define PAYLOAD_MAX_STATUS_V2    8
+#define PAYLOAD_MAX_ERROR_V1     127
+#define PAYLOAD_MAX_ERROR_V2     127
+#define PAYLOAD_LEN_ERRORCODE_V1 7
+#define PAYLOAD_MAX_ERRORCODE_V2 9
+#define PAYLOAD_LEN_ACK_V1       1
+#define PAYLOAD_LEN_ACK_V2       1
+#define PAYLOAD_LEN_REQUEST_V1   11
+#define PAYLOAD_MAX_REQUEST_V2   13
+#define PAYLOAD_LEN_REPLY_V1     10
+#define PAYLOAD_MAX_REPLY_V2     12
+#define PAYLOAD_LEN_EVENT_V1     16
+#define PAYLOAD_MAX_EVENT_V2     20
+
+#define FRAME_LEN_V1(n) ((n) + 6)  /* START header payload END */
+#define FRAME_LEN_V2(n) ((n) + 7)  /* COBS(header payload CRC) delimiter */
+
+#endif /* PROTOCOL_H */
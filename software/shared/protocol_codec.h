@@ -0,0 +1,569 @@
+/*
+ * protocol_codec.h - Open Action Cam payload encoders and decoders
+ *
+ * Generated by protocol/gen_protocol.py from protocol/protocol.def, do not edit.
+ *
+ * Fields are written one byte at a time, least significant first, so neither
+ * the host's byte order nor its struct padding reaches the wire. v1 keeps the
+ * unpadded AVR struct layout older firmware memcpy()s, v2 packs it further:
+ *
+ *   COMMAND     v1, v2  command:2
+ *   STATUS      v1      bat_volt_uv:4 bat_lvl:1 state:1 charging:1 error_code:1
+ *               v2      bat_volt_uv:varint bat_lvl:1 (charging << 7 | state):1 error_code:1
+ *   ERROR       v1, v2  error_code:1 error_message:text
+ *   DATA        v1, v2  raw
+ *   RESPONSE    v1      param:2 val:8
+ *               v2      param:2 val:varint
+ *   ACK/NAK     v1, v2  seq:1
+ *   BATCH       v2      (type:1 len:1 payload:len) per message, at least one
+ *   REQUEST     v1      tid:1 command:2 val:8
+ *               v2      tid:1 command:2 val:varint
+ *   REPLY       v1      tid:1 result:1 val:8
+ *               v2      tid:1 result:1 val:varint
+ *   EVENT       v1      command:2 trace:2 time_us:8 queued_us:4
+ *               v2      command:2 trace:varint time_us:varint queued_us:varint
+ *   ERROR_CODE  v1      code:1 count:2 context:4
+ *               v2      code:1 count:varint context:varint
+ *
+ * A varint is LEB128: 7 bits per byte, least significant group first, the top
+ * bit set on every byte but the last. Text is sent without its terminator, the
+ * payload length gives its exact length. Decoders check the length is exact.
+ */
+#ifndef PROTOCOL_CODEC_H
+#define PROTOCOL_CODEC_H
+
+#include <string.h>
+#include "protocol.h"
+
+#ifdef __cplusplus
+#define PROTOCOL_STATIC_ASSERT(cond, msg) static_assert(cond, msg)
+#else
+#define PROTOCOL_STATIC_ASSERT(cond, msg) _Static_assert(cond, msg)
+#endif
+
+/* Every payload fits, and a v2 frame is COBS encoded with a single overhead byte */
+PROTOCOL_STATIC_ASSERT(PAYLOAD_LEN_COMMAND_V1 <= MAX_PAYLOAD_SIZE, "PAYLOAD_LEN_COMMAND_V1 too long");
+PROTOCOL_STATIC_ASSERT(PAYLOAD_LEN_COMMAND_V2 <= MAX_PAYLOAD_SIZE, "PAYLOAD_LEN_COMMAND_V2 too long");
+PROTOCOL_STATIC_ASSERT(PAYLOAD_LEN_RESPONSE_V1 <= MAX_PAYLOAD_SIZE, "PAYLOAD_LEN_RESPONSE_V1 too long");
+PROTOCOL_STATIC_ASSERT(PAYLOAD_MAX_RESPONSE_V2 <= MAX_PAYLOAD_SIZE, "PAYLOAD_MAX_RESPONSE_V2 too long");
+PROTOCOL_STATIC_ASSERT(PAYLOAD_LEN_STATUS_V1 <= MAX_PAYLOAD_SIZE, "PAYLOAD_LEN_STATUS_V1 too long");
+PROTOCOL_STATIC_ASSERT(PAYLOAD_MAX_STATUS_V2 <= MAX_PAYLOAD_SIZE, "PAYLOAD_MAX_STATUS_V2 too long");
+PROTOCOL_STATIC_ASSERT(PAYLOAD_MAX_ERROR_V1 <= MAX_PAYLOAD_SIZE, "PAYLOAD_MAX_ERROR_V1 too long");
+PROTOCOL_STATIC_ASSERT(PAYLOAD_MAX_ERROR_V2 <= MAX_PAYLOAD_SIZE, "PAYLOAD_MAX_ERROR_V2 too long");
+PROTOCOL_STATIC_ASSERT(PAYLOAD_LEN_ERRORCODE_V1 <= MAX_PAYLOAD_SIZE, "PAYLOAD_LEN_ERRORCODE_V1 too long");
+PROTOCOL_STATIC_ASSERT(PAYLOAD_MAX_ERRORCODE_V2 <= MAX_PAYLOAD_SIZE, "PAYLOAD_MAX_ERRORCODE_V2 too long");
+PROTOCOL_STATIC_ASSERT(PAYLOAD_LEN_ACK_V1 <= MAX_PAYLOAD_SIZE, "PAYLOAD_LEN_ACK_V1 too long");
+PROTOCOL_STATIC_ASSERT(PAYLOAD_LEN_ACK_V2 <= MAX_PAYLOAD_SIZE, "PAYLOAD_LEN_ACK_V2 too long");
+PROTOCOL_STATIC_ASSERT(PAYLOAD_LEN_REQUEST_V1 <= MAX_PAYLOAD_SIZE, "PAYLOAD_LEN_REQUEST_V1 too long");
+PROTOCOL_STATIC_ASSERT(PAYLOAD_MAX_REQUEST_V2 <= MAX_PAYLOAD_SIZE, "PAYLOAD_MAX_REQUEST_V2 too long");
+PROTOCOL_STATIC_ASSERT(PAYLOAD_LEN_REPLY_V1 <= MAX_PAYLOAD_SIZE, "PAYLOAD_LEN_REPLY_V1 too long");
+PROTOCOL_STATIC_ASSERT(PAYLOAD_MAX_REPLY_V2 <= MAX_PAYLOAD_SIZE, "PAYLOAD_MAX_REPLY_V2 too long");
+PROTOCOL_STATIC_ASSERT(PAYLOAD_LEN_EVENT_V1 <= MAX_PAYLOAD_SIZE, "PAYLOAD_LEN_EVENT_V1 too long");
+PROTOCOL_STATIC_ASSERT(PAYLOAD_MAX_EVENT_V2 <= MAX_PAYLOAD_SIZE, "PAYLOAD_MAX_EVENT_V2 too long");
+PROTOCOL_STATIC_ASSERT(MAX_PAYLOAD_SIZE + 5 < 254, "v2 frame needs more than one COBS block");
+
+static inline void proto_put_le16(uint8_t *out, uint16_t value)
+{
+    out[0] = value;
+    out[1] = value >> 8;
+}
+
+static inline uint16_t proto_get_le16(const uint8_t *in)
+{
+    return in[0] | (uint16_t)in[1] << 8;
+}
+
+static inline void proto_put_le32(uint8_t *out, uint32_t value)
+{
+    proto_put_le16(out, value);
+    proto_put_le16(&out[2], value >> 16);
+}
+
+static inline uint32_t proto_get_le32(const uint8_t *in)
+{
+    return proto_get_le16(in) | (uint32_t)proto_get_le16(&in[2]) << 16;
+}
+
+static inline void proto_put_le64(uint8_t *out, uint64_t value)
+{
+    proto_put_le32(out, value);
+    proto_put_le32(&out[4], value >> 32);
+}
+
+static inline uint64_t proto_get_le64(const uint8_t *in)
+{
+    return proto_get_le32(in) | (uint64_t)proto_get_le32(&in[4]) << 32;
+}
+
+static inline uint8_t proto_put_varint(uint8_t *out, uint64_t value)
+{
+    uint8_t n = 0;
+
+    while (value >= 0x80) {
+        out[n++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    out[n++] = value;
+    return n;
+}
+
+/* Returns the bytes consumed, or -1 if truncated or wider than 64 bits */
+static inline int proto_get_varint(const uint8_t *in, size_t length, uint64_t *value)
+{
+    uint64_t v = 0;
+    size_t i;
+
+    for (i = 0; i < length && i < 10; i++) {
+        v |= (uint64_t)(in[i] & 0x7F) << (7 * i);
+        if (!(in[i] & 0x80)) {
+            *value = v;
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+static inline uint8_t proto_encode_command(const struct CommandBody *b, uint8_t *out)
+{
+    proto_put_le16(out, b->command);
+    return PAYLOAD_LEN_COMMAND_V1;
+}
+
+static inline int proto_decode_command(const uint8_t *in, uint8_t length, struct CommandBody *b)
+{
+    if (length != PAYLOAD_LEN_COMMAND_V1)
+        return -1;
+    b->command = proto_get_le16(in);
+    return 0;
+}
+
+static inline uint8_t proto_encode_response_v1(const struct ResponseBody *b, uint8_t *out)
+{
+    proto_put_le16(out, b->param);
+    proto_put_le64(&out[2], b->val);
+    return PAYLOAD_LEN_RESPONSE_V1;
+}
+
+static inline uint8_t proto_encode_response_v2(const struct ResponseBody *b, uint8_t *out)
+{
+    proto_put_le16(out, b->param);
+    return 2 + proto_put_varint(&out[2], b->val);
+}
+
+static inline int proto_decode_response_v1(const uint8_t *in, uint8_t length, struct ResponseBody *b)
+{
+    if (length != PAYLOAD_LEN_RESPONSE_V1)
+        return -1;
+    b->param = proto_get_le16(in);
+    b->val = proto_get_le64(&in[2]);
+    return 0;
+}
+
+static inline int proto_decode_response_v2(const uint8_t *in, uint8_t length, struct ResponseBody *b)
+{
+    uint64_t v;
+    int n;
+
+    if (length < 2)
+        return -1;
+    b->param = proto_get_le16(in);
+    n = proto_get_varint(&in[2], length - 2, &v);
+    if (n < 0 || 2 + n != length)
+        return -1;
+    b->val = v;
+    return 0;
+}
+
+static inline uint8_t proto_encode_status_v1(const struct StatusBody *b, uint8_t *out)
+{
+    proto_put_le32(out, b->bat_volt_uv);
+    out[4] = b->bat_lvl;
+    out[5] = b->state;
+    out[6] = b->charging;
+    out[7] = b->error_code;
+    return PAYLOAD_LEN_STATUS_V1;
+}
+
+static inline uint8_t proto_encode_status_v2(const struct StatusBody *b, uint8_t *out)
+{
+    uint8_t n;
+
+    n = proto_put_varint(out, b->bat_volt_uv);
+    out[n] = b->bat_lvl;
+    out[n + 1] = (b->state & 0x7F) | (b->charging << 7);
+    out[n + 2] = b->error_code;
+    return n + 3;
+}
+
+static inline int proto_decode_status_v1(const uint8_t *in, uint8_t length, struct StatusBody *b)
+{
+    if (length != PAYLOAD_LEN_STATUS_V1)
+        return -1;
+    b->bat_volt_uv = proto_get_le32(in);
+    b->bat_lvl = in[4];
+    b->state = in[5];
+    b->charging = in[6] != 0;
+    b->error_code = in[7];
+    return 0;
+}
+
+static inline int proto_decode_status_v2(const uint8_t *in, uint8_t length, struct StatusBody *b)
+{
+    uint64_t v;
+    int n;
+
+    n = proto_get_varint(in, length, &v);
+    if (n < 0 || v > UINT32_MAX)
+        return -1;
+    b->bat_volt_uv = v;
+    if (n + 3 != length)
+        return -1;
+    b->bat_lvl = in[n];
+    b->state = in[n + 1] & 0x7F;
+    b->charging = in[n + 1] >> 7;
+    b->error_code = in[n + 2];
+    return 0;
+}
+
+static inline uint8_t proto_encode_error(const struct ErrorBody *b, uint8_t *out)
+{
+    size_t len = strnlen(b->error_message, sizeof(b->error_message) - 1);
+
+    out[0] = b->error_code;
+    memcpy(&out[1], b->error_message, len);
+    return 1 + len;
+}
+
+static inline int proto_decode_error(const uint8_t *in, uint8_t length, struct ErrorBody *b)
+{
+    size_t len;
+
+    if (length < 1)
+        return -1;
+    b->error_code = in[0];
+    len = length - 1;
+    if (len > sizeof(b->error_message) - 1)
+        len = sizeof(b->error_message) - 1;
+    memcpy(b->error_message, &in[1], len);
+    b->error_message[len] = '\0';
+    return 0;
+}
+
+static inline uint8_t proto_encode_errorcode_v1(const struct ErrorCodeBody *b, uint8_t *out)
+{
+    out[0] = b->code;
+    proto_put_le16(&out[1], b->count);
+    proto_put_le32(&out[3], b->context);
+    return PAYLOAD_LEN_ERRORCODE_V1;
+}
+
+static inline uint8_t proto_encode_errorcode_v2(const struct ErrorCodeBody *b, uint8_t *out)
+{
+    uint8_t n;
+
+    out[0] = b->code;
+    n = 1 + proto_put_varint(&out[1], b->count);
+    return n + proto_put_varint(&out[n], b->context);
+}
+
+static inline int proto_decode_errorcode_v1(const uint8_t *in, uint8_t length, struct ErrorCodeBody *b)
+{
+    if (length != PAYLOAD_LEN_ERRORCODE_V1)
+        return -1;
+    b->code = in[0];
+    b->count = proto_get_le16(&in[1]);
+    b->context = proto_get_le32(&in[3]);
+    return 0;
+}
+
+static inline int proto_decode_errorcode_v2(const uint8_t *in, uint8_t length, struct ErrorCodeBody *b)
+{
+    uint64_t v;
+    int n;
+    int r;
+
+    if (length < 1)
+        return -1;
+    b->code = in[0];
+    n = proto_get_varint(&in[1], length - 1, &v);
+    if (n < 0 || v > UINT16_MAX)
+        return -1;
+    b->count = v;
+    n += 1;
+    r = proto_get_varint(&in[n], length - (n), &v);
+    if (r < 0 || v > UINT32_MAX || n + r != length)
+        return -1;
+    b->context = v;
+    return 0;
+}
+
+static inline uint8_t proto_encode_ack(const struct AckBody *b, uint8_t *out)
+{
+    out[0] = b->seq;
+    return PAYLOAD_LEN_ACK_V1;
+}
+
+static inline int proto_decode_ack(const uint8_t *in, uint8_t length, struct AckBody *b)
+{
+    if (length != PAYLOAD_LEN_ACK_V1)
+        return -1;
+    b->seq = in[0];
+    return 0;
+}
+
+static inline uint8_t proto_encode_request_v1(const struct RequestBody *b, uint8_t *out)
+{
+    out[0] = b->tid;
+    proto_put_le16(&out[1], b->command);
+    proto_put_le64(&out[3], b->val);
+    return PAYLOAD_LEN_REQUEST_V1;
+}
+
+static inline uint8_t proto_encode_request_v2(const struct RequestBody *b, uint8_t *out)
+{
+    out[0] = b->tid;
+    proto_put_le16(&out[1], b->command);
+    return 3 + proto_put_varint(&out[3], b->val);
+}
+
+static inline int proto_decode_request_v1(const uint8_t *in, uint8_t length, struct RequestBody *b)
+{
+    if (length != PAYLOAD_LEN_REQUEST_V1)
+        return -1;
+    b->tid = in[0];
+    b->command = proto_get_le16(&in[1]);
+    b->val = proto_get_le64(&in[3]);
+    return 0;
+}
+
+static inline int proto_decode_request_v2(const uint8_t *in, uint8_t length, struct RequestBody *b)
+{
+    uint64_t v;
+    int n;
+
+    if (length < 3)
+        return -1;
+    b->tid = in[0];
+    b->command = proto_get_le16(&in[1]);
+    n = proto_get_varint(&in[3], length - 3, &v);
+    if (n < 0 || 3 + n != length)
+        return -1;
+    b->val = v;
+    return 0;
+}
+
+static inline uint8_t proto_encode_reply_v1(const struct ReplyBody *b, uint8_t *out)
+{
+    out[0] = b->tid;
+    out[1] = b->result;
+    proto_put_le64(&out[2], b->val);
+    return PAYLOAD_LEN_REPLY_V1;
+}
+
+static inline uint8_t proto_encode_reply_v2(const struct ReplyBody *b, uint8_t *out)
+{
+    out[0] = b->tid;
+    out[1] = b->result;
+    return 2 + proto_put_varint(&out[2], b->val);
+}
+
+static inline int proto_decode_reply_v1(const uint8_t *in, uint8_t length, struct ReplyBody *b)
+{
+    if (length != PAYLOAD_LEN_REPLY_V1)
+        return -1;
+    b->tid = in[0];
+    b->result = in[1];
+    b->val = proto_get_le64(&in[2]);
+    return 0;
+}
+
+static inline int proto_decode_reply_v2(const uint8_t *in, uint8_t length, struct ReplyBody *b)
+{
+    uint64_t v;
+    int n;
+
+    if (length < 2)
+        return -1;
+    b->tid = in[0];
+    b->result = in[1];
+    n = proto_get_varint(&in[2], length - 2, &v);
+    if (n < 0 || 2 + n != length)
+        return -1;
+    b->val = v;
+    return 0;
+}
+
+static inline uint8_t proto_encode_event_v1(const struct EventBody *b, uint8_t *out)
+{
+    proto_put_le16(out, b->command);
+    proto_put_le16(&out[2], b->trace);
+    proto_put_le64(&out[4], b->time_us);
+    proto_put_le32(&out[12], b->queued_us);
+    return PAYLOAD_LEN_EVENT_V1;
+}
+
+static inline uint8_t proto_encode_event_v2(const struct EventBody *b, uint8_t *out)
+{
+    uint8_t n;
+
+    proto_put_le16(out, b->command);
+    n = 2 + proto_put_varint(&out[2], b->trace);
+    n += proto_put_varint(&out[n], b->time_us);
+    return n + proto_put_varint(&out[n], b->queued_us);
+}
+
+static inline int proto_decode_event_v1(const uint8_t *in, uint8_t length, struct EventBody *b)
+{
+    if (length != PAYLOAD_LEN_EVENT_V1)
+        return -1;
+    b->command = proto_get_le16(in);
+    b->trace = proto_get_le16(&in[2]);
+    b->time_us = proto_get_le64(&in[4]);
+    b->queued_us = proto_get_le32(&in[12]);
+    return 0;
+}
+
+static inline int proto_decode_event_v2(const uint8_t *in, uint8_t length, struct EventBody *b)
+{
+    uint64_t v;
+    int n;
+    int r;
+
+    if (length < 2)
+        return -1;
+    b->command = proto_get_le16(in);
+    n = proto_get_varint(&in[2], length - 2, &v);
+    if (n < 0 || v > UINT16_MAX)
+        return -1;
+    b->trace = v;
+    n += 2;
+    r = proto_get_varint(&in[n], length - (n), &v);
+    if (r < 0)
+        return -1;
+    b->time_us = v;
+    n += r;
+    r = proto_get_varint(&in[n], length - (n), &v);
+    if (r < 0 || v > UINT32_MAX || n + r != length)
+        return -1;
+    b->queued_us = v;
+    return 0;
+}
+
+/* Every message in a batch must fit, each is decoded as it is unpacked */
+static inline int proto_decode_batch(const uint8_t *in, uint8_t length, uint8_t *raw)
+{
+    size_t pos;
+
+    if (length == 0)
+        return -1;
+    for (pos = 0; pos < length; pos += 2 + in[pos + 1]) {
+        if (length - pos < 2 || in[pos] == MESSAGE_TYPE_BATCH ||
+            in[pos + 1] > length - pos - 2)
+            return -1;
+    }
+    memcpy(raw, in, length);
+    return 0;
+}
+
+/*
+ * comms_encode_payload - Write the payload of msg in the version encoding
+ * @out: at least MAX_PAYLOAD_SIZE bytes
+ *
+ * Returns the payload length, or < 0 for a type that cannot be encoded.
+ */
+static inline int comms_encode_payload(const struct Message *msg, uint8_t version, uint8_t *out)
+{
+    switch (msg->header.message_type) {
+    case MESSAGE_TYPE_COMMAND:
+        return proto_encode_command(&msg->body.payload_command, out);
+    case MESSAGE_TYPE_STATUS:
+        if (version == PROTOCOL_VERSION_2)
+            return proto_encode_status_v2(&msg->body.payload_status, out);
+        return proto_encode_status_v1(&msg->body.payload_status, out);
+    case MESSAGE_TYPE_ERROR:
+        return proto_encode_error(&msg->body.payload_error, out);
+    case MESSAGE_TYPE_DATA:
+        if (msg->header.payload_length > MAX_PAYLOAD_SIZE)
+            return -2;
+        memcpy(out, msg->body.payload_raw, msg->header.payload_length);
+        return msg->header.payload_length;
+    case MESSAGE_TYPE_RESPONSE:
+        if (version == PROTOCOL_VERSION_2)
+            return proto_encode_response_v2(&msg->body.payload_response, out);
+        return proto_encode_response_v1(&msg->body.payload_response, out);
+    case MESSAGE_TYPE_ACK:
+    case MESSAGE_TYPE_NAK:
+        return proto_encode_ack(&msg->body.payload_ack, out);
+    case MESSAGE_TYPE_REQUEST:
+        if (version == PROTOCOL_VERSION_2)
+            return proto_encode_request_v2(&msg->body.payload_request, out);
+        return proto_encode_request_v1(&msg->body.payload_request, out);
+    case MESSAGE_TYPE_REPLY:
+        if (version == PROTOCOL_VERSION_2)
+            return proto_encode_reply_v2(&msg->body.payload_reply, out);
+        return proto_encode_reply_v1(&msg->body.payload_reply, out);
+    case MESSAGE_TYPE_EVENT:
+        if (version == PROTOCOL_VERSION_2)
+            return proto_encode_event_v2(&msg->body.payload_event, out);
+        return proto_encode_event_v1(&msg->body.payload_event, out);
+    case MESSAGE_TYPE_ERROR_CODE:
+        if (version == PROTOCOL_VERSION_2)
+            return proto_encode_errorcode_v2(&msg->body.payload_error_code, out);
+        return proto_encode_errorcode_v1(&msg->body.payload_error_code, out);
+    default:
+        return -3;
+    }
+}
+
+/*
+ * comms_decode_payload - Reverse comms_encode_payload into msg, whose type is set
+ *
+ * Returns 0, or < 0 if the payload is malformed or its type unknown.
+ */
+static inline int comms_decode_payload(const uint8_t *in, uint8_t length, uint8_t version, struct Message *msg)
+{
+    switch (msg->header.message_type) {
+    case MESSAGE_TYPE_COMMAND:
+        return proto_decode_command(in, length, &msg->body.payload_command);
+    case MESSAGE_TYPE_STATUS:
+        if (version == PROTOCOL_VERSION_2)
+            return proto_decode_status_v2(in, length, &msg->body.payload_status);
+        return proto_decode_status_v1(in, length, &msg->body.payload_status);
+    case MESSAGE_TYPE_ERROR:
+        return proto_decode_error(in, length, &msg->body.payload_error);
+    case MESSAGE_TYPE_DATA:
+        memcpy(msg->body.payload_raw, in, length);
+        return 0;
+    case MESSAGE_TYPE_RESPONSE:
+        if (version == PROTOCOL_VERSION_2)
+            return proto_decode_response_v2(in, length, &msg->body.payload_response);
+        return proto_decode_response_v1(in, length, &msg->body.payload_response);
+    case MESSAGE_TYPE_ACK:
+    case MESSAGE_TYPE_NAK:
+        return proto_decode_ack(in, length, &msg->body.payload_ack);
+    case MESSAGE_TYPE_BATCH:
+        if (version != PROTOCOL_VERSION_2)
+            return -1;
+        return proto_decode_batch(in, length, msg->body.payload_raw);
+    case MESSAGE_TYPE_REQUEST:
+        if (version == PROTOCOL_VERSION_2)
+            return proto_decode_request_v2(in, length, &msg->body.payload_request);
+        return proto_decode_request_v1(in, length, &msg->body.payload_request);
+    case MESSAGE_TYPE_REPLY:
+        if (version == PROTOCOL_VERSION_2)
+            return proto_decode_reply_v2(in, length, &msg->body.payload_reply);
+        return proto_decode_reply_v1(in, length, &msg->body.payload_reply);
+    case MESSAGE_TYPE_EVENT:
+        if (version == PROTOCOL_VERSION_2)
+            return proto_decode_event_v2(in, length, &msg->body.payload_event);
+        return proto_decode_event_v1(in, length, &msg->body.payload_event);
+    case MESSAGE_TYPE_ERROR_CODE:
+        if (version == PROTOCOL_VERSION_2)
+            return proto_decode_errorcode_v2(in, length, &msg->body.payload_error_code);
+        return proto_decode_errorcode_v1(in, length, &msg->body.payload_error_code);
+    default:
+        return -5;
+    }
+}
+
+#endif /* PROTOCOL_CODEC_H */
@@ -1,4 +1,5 @@
 #include <Arduino.h>
+#include "comms.h"
 
 extern "C" {
     void serial_begin(unsigned long baudrate) {
@@ -9,6 +10,28 @@ extern "C" {
         Serial.write(byte);
     }
 
+    /* Write a block of bytes to the serial port
+     * @note only blocks if the Serial TX buffer fills, the UART ISR drains it
+     */
+    void serial_write_buf(const uint8_t *buf, size_t len) {
+        Serial.write(buf, len);
+    }
+
+    /* Bytes waiting in the Serial TX buffer */
+    size_t serial_tx_pending() {
+        return SERIAL_TX_BUFFER_SIZE - 1 - Serial.availableForWrite();
+    }
+
+    /* Bytes the Serial TX buffer takes without blocking */
+    size_t serial_tx_room() {
+        return Serial.availableForWrite();
+    }
+
+    /* Block until the Serial TX buffer has been transmitted */
+    void serial_flush() {
+        Serial.flush();
+    }
+
     int serial_available() {
         return Serial.available();
     }
@@ -25,4 +48,30 @@ extern "C" {
         return -1;  /* No byte available */ 
     }
 
+    /* Read a block of bytes from the serial port
+     * @note callers must not request more than serial_available(), otherwise
+     *       Serial.readBytes() blocks until its timeout expires
+     * @return (size_t) the number of bytes read
+     */
+    size_t serial_read_bytes(uint8_t *buf, size_t len) {
+        return Serial.readBytes(buf, len);
+    }
+
 }
+
+/* Log text goes through the TX scheduler, so it never holds up a frame */
+class SerialLog : public Print {
+public:
+    size_t write(uint8_t byte) override {
+        comms_log_write(&byte, 1);
+        return 1;
+    }
+
+    size_t write(const uint8_t *buf, size_t len) override {
+        comms_log_write(buf, len);
+        return len;
+    }
+};
+
+static SerialLog serial_log_print;
+Print &serial_log = serial_log_print;
@@ -7,11 +7,19 @@ extern "C" {
 
 void serial_begin(unsigned long baudrate);
 void serial_write(uint8_t byte);
+void serial_write_buf(const uint8_t *buf, size_t len);
+size_t serial_tx_pending(void);
+size_t serial_tx_room(void);
+void serial_flush(void);
 int serial_available(void);
 int serial_read(void);
+size_t serial_read_bytes(uint8_t *buf, size_t len);
 
 #ifdef __cplusplus
 }
+
+/* Print to the TX scheduler as log text, in place of Serial */
+extern Print &serial_log;
 #endif
 
 #endif /* SERIAL_WRAPPER_H */
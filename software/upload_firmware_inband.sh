@@ -0,0 +1,48 @@
+#!/bin/bash
+
+# Parameters
+RPI_HOST="$1"         # IP or hostname
+RPI_USER="$2"         # SSH username
+RPI_PASS="$3"         # SSH password
+
+# Resolve script directory and relative paths
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+LOCAL_HEX="$SCRIPT_DIR/firmware/build/firmware.ino.hex"
+LOCAL_BIN="$SCRIPT_DIR/firmware/build/firmware.bin"
+
+# request_firmware() looks under /lib/firmware, the attribute takes the name below it
+FW_NAME="oac/firmware.bin"
+REMOTE_BIN="/tmp/firmware.bin"
+REMOTE_ATTR="/sys/bus/serial/drivers/oac_dev/*/firmware_update"
+
+
+
+if [[ -z "$RPI_HOST" || -z "$RPI_USER" || -z "$RPI_PASS" ]]; then
+    echo "Usage: $0 <rpi_host> <rpi_user> <rpi_pass>"
+    echo "Uploads the firmware to the rpi at the specified IP, then has oac_dev write it to"
+    echo "the atmega328 over the running serial link. Needs Optiboot 6.2 or later on the MCU,"
+    echo "use upload_and_flash_remote.sh for the first flash"
+    echo "  -rpi_host: IP or hostname of RPi"
+    echo "  -rpi_user: SSH username for RPi"
+    echo "  -rpi_pass: SSH password for RPi"
+    exit 1
+fi
+
+if [[ ! -f "$LOCAL_HEX" ]]; then
+    echo "[!] Firmware hex not found at $LOCAL_HEX"
+    exit 2
+fi
+
+echo "[*] Converting firmware to a flash image..."
+if ! objcopy -I ihex -O binary "$LOCAL_HEX" "$LOCAL_BIN"; then
+    echo "[!] objcopy failed"
+    exit 3
+fi
+
+echo "[*] Copying firmware to RPi..."
+sshpass -p "$RPI_PASS" scp "$LOCAL_BIN" "$RPI_USER@$RPI_HOST:$REMOTE_BIN"
+sshpass -p "$RPI_PASS" ssh "$RPI_USER@$RPI_HOST" "sudo install -D -m 644 $REMOTE_BIN /lib/firmware/$FW_NAME"
+
+echo "[*] Updating firmware over the serial link..."
+sshpass -p "$RPI_PASS" ssh "$RPI_USER@$RPI_HOST" "echo $FW_NAME | sudo tee $REMOTE_ATTR > /dev/null"
+sshpass -p "$RPI_PASS" ssh "$RPI_USER@$RPI_HOST" "cat $REMOTE_ATTR"